@@ -17,12 +17,14 @@
  */
 
 #include "acct.h"
+#include "cdefs.h"
 #include "decode.h"
 #include "conv.h"
-#include "daylog.h"
 #include "err.h"
+#include "graph_db.h"
 #include "hosts_db.h"
 #include "localip.h"
+#include "lpm.h"
 #include "now.h"
 #include "opt.h"
 
@@ -37,10 +39,37 @@
 
 uint64_t acct_total_packets = 0, acct_total_bytes = 0;
 
-static int using_localnet4 = 0, using_localnet6 = 0;
-static struct addr localnet4, localmask4, localnet6, localmask6;
+/* Networks given with -l, or NULL if there were none. */
+static struct lpm *localnets = NULL;
 
-/* Parse the net/mask specification into two IPs or die trying. */
+/* The prefix length of a netmask, or -1 if its bits aren't contiguous. */
+static int mask_to_pfxlen(const struct addr * const mask) {
+   const uint8_t *p = (mask->family == IPv6) ? mask->ip.v6.s6_addr
+                                             : (const uint8_t *)&(mask->ip.v4);
+   const int len = (mask->family == IPv6) ? 16 : 4;
+   int i, pfxlen = 0;
+
+   for (i = 0; i < len && p[i] == 0xff; i++)
+      pfxlen += 8;
+   if (i < len) {
+      uint8_t b = p[i];
+
+      while (b & 0x80) {
+         pfxlen++;
+         b = (uint8_t)(b << 1);
+      }
+      if (b != 0)
+         return -1;
+      for (i++; i < len; i++)
+         if (p[i] != 0)
+            return -1;
+   }
+   return pfxlen;
+}
+
+/* Parse the net/mask specification into two IPs or die trying, and add it
+ * to the local networks.
+ */
 void
 acct_init_localnet(const char *spec)
 {
@@ -78,6 +107,8 @@ acct_init_localnet(const char *spec)
          errx(1, "couldn't parse \"%s\": %s", tokens[1], gai_strerror(ret));
       if (localmask.family != localnet.family)
          errx(1, "family mismatch between net and mask");
+      if ((pfxlen = mask_to_pfxlen(&localmask)) < 0)
+         errx(1, "netmask \"%s\" isn't contiguous", tokens[1]);
    } else {
       uint8_t frac, *p;
       char *endptr;
@@ -119,15 +150,9 @@ acct_init_localnet(const char *spec)
 
    /* Register the correct netmask and calculate the correct net.  */
    addr_mask(&localnet, &localmask);
-   if (localnet.family == IPv6) {
-      using_localnet6 = 1;
-      localnet6 = localnet;
-      localmask6 = localmask;
-   } else {
-      using_localnet4 = 1;
-      localnet4 = localnet;
-      localmask4 = localmask;
-   }
+   if (localnets == NULL)
+      localnets = lpm_make();
+   lpm_insert(localnets, &localnet, (unsigned int)pfxlen);
 
    verbosef("local network address: %s", addr_to_str(&localnet));
    verbosef("   local network mask: %s", addr_to_str(&localmask));
@@ -137,94 +162,94 @@ static int addr_is_local(const struct addr * const a,
                          const struct local_ips *local_ips) {
    if (is_localip(a, local_ips))
       return 1;
-   if (a->family == IPv4 && using_localnet4) {
-      if (addr_inside(a, &localnet4, &localmask4))
-         return 1;
-   } else if (a->family == IPv6 && using_localnet6) {
-      if (addr_inside(a, &localnet6, &localmask6))
-         return 1;
-   }
+   if (localnets != NULL && lpm_match(localnets, a))
+      return 1;
    return 0;
 }
 
-/* Account for the given packet summary. */
-void acct_for(const struct pktsummary * const sm,
-              const struct local_ips * const local_ips) {
-   struct bucket *hs = NULL;  // Source host.
-   struct bucket *hd = NULL;  // Dest host.
-   int dir_in, dir_out;
-
-#if 0 /* WANT_CHATTY? */
-   printf("%15s > ", addr_to_str(&sm->src));
-   printf("%15s ", addr_to_str(&sm->dst));
-   printf("len %4d proto %2d", sm->len, sm->proto);
-
-   if (sm->proto == IPPROTO_TCP || sm->proto == IPPROTO_UDP)
-      printf(" port %5d : %5d", sm->src_port, sm->dst_port);
-   if (sm->proto == IPPROTO_TCP)
-      printf(" %s%s%s%s%s%s",
-         (sm->tcp_flags & TH_FIN)?"F":"",
-         (sm->tcp_flags & TH_SYN)?"S":"",
-         (sm->tcp_flags & TH_RST)?"R":"",
-         (sm->tcp_flags & TH_PUSH)?"P":"",
-         (sm->tcp_flags & TH_ACK)?"A":"",
-         (sm->tcp_flags & TH_URG)?"U":""
-      );
-   printf("\n");
-#endif
-
-   /* Totals. */
-   acct_total_packets += sm->packets;
-   acct_total_bytes += sm->len;
+void acct_free_localnet(void) {
+   if (localnets != NULL)
+      lpm_free(localnets);
+   localnets = NULL;
+}
 
-   /* Graphs. */
-   dir_out = addr_is_local(&sm->src, local_ips);
-   dir_in  = addr_is_local(&sm->dst, local_ips);
+/* Look up a host in the shard, or in hosts_db if there is no shard.  The
+ * shards take every host, and hosts_shard_merge() decides which are let into
+ * hosts_db, but here a new host can be turned away, returning NULL.
+ */
+static struct bucket *acct_host_get(struct acct_shard * const shard,
+                                    const struct addr * const a,
+                                    const uint64_t len) {
+   if (shard != NULL)
+      return hosts_shard_get(shard->hosts, a);
+   return host_admit(a, len);
+}
 
-   /* Traffic staying within the network isn't counted. */
-   if (dir_out && !dir_in) {
-      daylog_acct((uint64_t)sm->len, GRAPH_OUT);
-      graph_acct((uint64_t)sm->len, GRAPH_OUT);
-   }
-   if (dir_in && !dir_out) {
-      daylog_acct((uint64_t)sm->len, GRAPH_IN);
-      graph_acct((uint64_t)sm->len, GRAPH_IN);
-   }
+static void acct_host_prefetch(struct acct_shard * const shard,
+                               const struct addr * const *a,
+                               const size_t n) {
+   if (shard != NULL)
+      hosts_shard_prefetch(shard->hosts, a, n);
+   else
+      host_prefetch(a, n);
+}
 
-   if (opt_hosts_max == 0) return; /* skip per-host accounting */
+/* Account for the hosts, protocols and ports of a summary, which stands for
+ * the given number of SYNs.
+ */
+static void acct_hosts(const struct pktsummary * const sm,
+                       const uint64_t syns,
+                       const int dir_in, const int dir_out,
+                       struct acct_shard * const shard) {
+   struct bucket *hs = NULL;  // Source host.
+   struct bucket *hd = NULL;  // Dest host.
+   uint32_t src_hash = 0, dst_hash = 0;
 
    /* Hosts. */
-   hosts_db_reduce();
-   if (!opt_want_local_only || dir_out) {
-      hs = host_get(&(sm->src));
-      hs->out   += sm->len;
-      hs->total += sm->len;
+   if (shard == NULL)
+      hosts_db_reduce();
+   if ((!opt_want_local_only || dir_out) &&
+       (hs = acct_host_get(shard, &(sm->src), sm->len)) != NULL) {
+      hs->out += sm->len;
       memcpy(hs->u.host.mac_addr, sm->src_mac, sizeof(sm->src_mac));
       hs->u.host.last_seen_mono = now_mono();
+      if (shard == NULL) {
+         hs->u.host.changed = graph_generation();
+         hosts_top_update(hs);
+      }
    }
 
-   if (!opt_want_local_only || dir_in) {
-      hd = host_get(&(sm->dst));
-      hd->in    += sm->len;
-      hd->total += sm->len;
+   if ((!opt_want_local_only || dir_in) &&
+       (hd = acct_host_get(shard, &(sm->dst), sm->len)) != NULL) {
+      hd->in += sm->len;
       memcpy(hd->u.host.mac_addr, sm->dst_mac, sizeof(sm->dst_mac));
+      if (shard == NULL) {
+         hd->u.host.changed = graph_generation();
+         hosts_top_update(hd);
+      }
       /*
        * Don't update recipient's last seen time, we don't know that
        * they received successfully.
        */
    }
 
+   /* Peers. */
+   if (opt_want_peers && (hs || hd)) {
+      src_hash = host_hash(&(sm->src));
+      dst_hash = host_hash(&(sm->dst));
+      if (hs) host_add_peer(hs, dst_hash);
+      if (hd) host_add_peer(hd, src_hash);
+   }
+
    /* Protocols. */
    if (sm->proto != IPPROTO_INVALID) {
       if (hs) {
          struct bucket *ps = host_get_ip_proto(hs, sm->proto);
-         ps->out   += sm->len;
-         ps->total += sm->len;
+         ps->out += sm->len;
       }
       if (hd) {
          struct bucket *pd = host_get_ip_proto(hd, sm->proto);
-         pd->in    += sm->len;
-         pd->total += sm->len;
+         pd->in += sm->len;
       }
    }
 
@@ -236,29 +261,25 @@ void acct_for(const struct pktsummary * const sm,
       // Local ports on host.
       if ((sm->src_port <= opt_highest_port) && hs) {
          struct bucket *ps = host_get_port_tcp(hs, sm->src_port);
-         ps->out   += sm->len;
-         ps->total += sm->len;
+         ps->out += sm->len;
+         if (opt_want_peers) port_tcp_add_peer(ps, dst_hash);
       }
       if ((sm->dst_port <= opt_highest_port) && hd) {
          struct bucket *pd = host_get_port_tcp(hd, sm->dst_port);
-         pd->in    += sm->len;
-         pd->total += sm->len;
-         if (sm->tcp_flags == TH_SYN)
-            pd->u.port_tcp.syn++;
+         pd->in += sm->len;
+         pd->u.port_tcp.syn += syns;
+         if (opt_want_peers) port_tcp_add_peer(pd, src_hash);
       }
 
       // Remote ports.
       if ((sm->src_port <= opt_highest_port) && hd) {
          struct bucket *pdr = host_get_port_tcp_remote(hd, sm->src_port);
-         pdr->out   += sm->len;
-         pdr->total += sm->len;
+         pdr->out += sm->len;
       }
       if ((sm->dst_port <= opt_highest_port) && hs) {
          struct bucket *psr = host_get_port_tcp_remote(hs, sm->dst_port);
-         psr->in    += sm->len;
-         psr->total += sm->len;
-         if (sm->tcp_flags == TH_SYN)
-            psr->u.port_tcp.syn++;
+         psr->in += sm->len;
+         psr->u.port_tcp.syn += syns;
       }
       break;
 
@@ -266,25 +287,23 @@ void acct_for(const struct pktsummary * const sm,
       // Local ports on host.
       if ((sm->src_port <= opt_highest_port) && hs) {
          struct bucket *ps = host_get_port_udp(hs, sm->src_port);
-         ps->out   += sm->len;
-         ps->total += sm->len;
+         ps->out += sm->len;
+         if (opt_want_peers) port_udp_add_peer(ps, dst_hash);
       }
       if ((sm->dst_port <= opt_highest_port) && hd) {
          struct bucket *pd = host_get_port_udp(hd, sm->dst_port);
-         pd->in    += sm->len;
-         pd->total += sm->len;
+         pd->in += sm->len;
+         if (opt_want_peers) port_udp_add_peer(pd, src_hash);
       }
 
       // Remote ports.
       if ((sm->src_port <= opt_highest_port) && hd) {
          struct bucket *pdr = host_get_port_udp_remote(hd, sm->src_port);
-         pdr->out   += sm->len;
-         pdr->total += sm->len;
+         pdr->out += sm->len;
       }
       if ((sm->dst_port <= opt_highest_port) && hs) {
          struct bucket *psr = host_get_port_udp_remote(hs, sm->dst_port);
-         psr->in    += sm->len;
-         psr->total += sm->len;
+         psr->in += sm->len;
       }
       break;
 
@@ -294,4 +313,265 @@ void acct_for(const struct pktsummary * const sm,
    }
 }
 
+/* ---------------------------------------------------------------------------
+ * The flow cache sits between the per-packet totals and the hosts tables.
+ * Most packets belong to a few busy flows, so it adds them up in a small
+ * direct-mapped table and only touches the hosts tables when an entry is
+ * evicted, or on acct_flush().
+ */
+#define ACCT_FLOW_BITS 10
+#define ACCT_FLOWS (1U << ACCT_FLOW_BITS)
+
+struct acct_flow {
+   struct pktsummary sm;
+   uint64_t syns;
+   uint8_t used, dir_in, dir_out;
+};
+
+struct acct_flows {
+   struct acct_flow flow[ACCT_FLOWS];
+};
+
+/* The flow cache for accounting straight into hosts_db. */
+static struct acct_flows global_flows;
+
+/* Whether two summaries are for the same hosts, MACs, protocol and ports. */
+static int acct_same_flow(const struct pktsummary * const a,
+                          const struct pktsummary * const b) {
+   return (a->proto == b->proto &&
+           a->src_port == b->src_port &&
+           a->dst_port == b->dst_port &&
+           addr_equal(&a->src, &b->src) &&
+           addr_equal(&a->dst, &b->dst) &&
+           memcmp(a->src_mac, b->src_mac, sizeof(a->src_mac)) == 0 &&
+           memcmp(a->dst_mac, b->dst_mac, sizeof(a->dst_mac)) == 0);
+}
+
+static uint32_t acct_addr_hash(const struct addr * const a) {
+   if (a->family == IPv4)
+      return (uint32_t)a->ip.v4;
+   else {
+      uint32_t w[4];
+
+      memcpy(w, &(a->ip.v6), sizeof(w));
+      return w[0] ^ w[1] ^ w[2] ^ w[3];
+   }
+}
+
+static uint32_t acct_flow_hash(const struct pktsummary * const sm) {
+   uint32_t h;
+
+   h = acct_addr_hash(&sm->src) * 0x9E3779B1U;
+   h = (h ^ acct_addr_hash(&sm->dst)) * 0x85EBCA77U;
+   h = (h ^ ((uint32_t)sm->src_port << 16 | sm->dst_port)) * 0xC2B2AE3DU;
+   h ^= sm->proto;
+   return (h * 0x9E3779B1U) >> (32 - ACCT_FLOW_BITS);
+}
+
+static struct acct_flows *acct_flows_of(struct acct_shard * const shard) {
+   return (shard != NULL) ? shard->flows : &global_flows;
+}
+
+static void acct_flow_flush(struct acct_flow * const f,
+                            struct acct_shard * const shard) {
+   acct_hosts(&f->sm, f->syns, f->dir_in, f->dir_out, shard);
+   f->used = 0;
+}
+
+static void acct_flow_add(struct acct_shard * const shard,
+                          const struct pktsummary * const sm,
+                          const int dir_in, const int dir_out) {
+   struct acct_flow *f = &(acct_flows_of(shard)->flow[acct_flow_hash(sm)]);
+
+   if (f->used && !acct_same_flow(&f->sm, sm))
+      acct_flow_flush(f, shard); /* evict */
+   if (!f->used) {
+      f->sm = *sm;
+      f->syns = 0;
+      f->used = 1;
+      f->dir_in = (uint8_t)dir_in;
+      f->dir_out = (uint8_t)dir_out;
+   } else {
+      f->sm.packets += sm->packets;
+      f->sm.len += sm->len;
+   }
+   if (sm->tcp_flags == TH_SYN)
+      f->syns++;
+}
+
+/* Entries are flushed a group at a time, after prefetching all their hosts
+ * together.
+ */
+#define ACCT_FLUSH_GROUP (HOSTS_PREFETCH_MAX / 2)
+
+static void acct_flows_flush(struct acct_flows * const flows,
+                             struct acct_shard * const shard) {
+   unsigned int i, j;
+
+   for (i = 0; i < ACCT_FLOWS; i += ACCT_FLUSH_GROUP) {
+      const struct addr *a[HOSTS_PREFETCH_MAX];
+      size_t n = 0;
+
+      for (j = i; j < i + ACCT_FLUSH_GROUP; j++)
+         if (flows->flow[j].used) {
+            a[n++] = &(flows->flow[j].sm.src);
+            a[n++] = &(flows->flow[j].sm.dst);
+         }
+      if (n == 0)
+         continue;
+      acct_host_prefetch(shard, a, n);
+      for (j = i; j < i + ACCT_FLUSH_GROUP; j++)
+         if (flows->flow[j].used)
+            acct_flow_flush(&(flows->flow[j]), shard);
+   }
+}
+
+/* Account for everything in the global flow cache. */
+void acct_flush(void) {
+   acct_flows_flush(&global_flows, NULL);
+}
+
+/* Account for the given packet summary, into the shard if given.  Totals and
+ * graphs are updated right away, hosts go through the flow cache.
+ */
+static void acct_for_shard_or_global(const struct pktsummary * const sm,
+                                     const struct local_ips * const local_ips,
+                                     struct acct_shard * const shard) {
+   int dir_in, dir_out;
+
+#if 0 /* WANT_CHATTY? */
+   printf("%15s > ", addr_to_str(&sm->src));
+   printf("%15s ", addr_to_str(&sm->dst));
+   printf("len %4d proto %2d", sm->len, sm->proto);
+
+   if (sm->proto == IPPROTO_TCP || sm->proto == IPPROTO_UDP)
+      printf(" port %5d : %5d", sm->src_port, sm->dst_port);
+   if (sm->proto == IPPROTO_TCP)
+      printf(" %s%s%s%s%s%s",
+         (sm->tcp_flags & TH_FIN)?"F":"",
+         (sm->tcp_flags & TH_SYN)?"S":"",
+         (sm->tcp_flags & TH_RST)?"R":"",
+         (sm->tcp_flags & TH_PUSH)?"P":"",
+         (sm->tcp_flags & TH_ACK)?"A":"",
+         (sm->tcp_flags & TH_URG)?"U":""
+      );
+   printf("\n");
+#endif
+
+   /* Graphs. */
+   dir_out = addr_is_local(&sm->src, local_ips);
+   dir_in  = addr_is_local(&sm->dst, local_ips);
+
+   if (shard != NULL) {
+      /* Totals and graphs are applied in acct_shard_merge(). */
+      shard->total_packets += sm->packets;
+      shard->total_bytes += sm->len;
+      if (dir_out && !dir_in) {
+         shard->graph_out += sm->len;
+         shard->graph_pkts_out += sm->packets;
+      }
+      if (dir_in && !dir_out) {
+         shard->graph_in += sm->len;
+         shard->graph_pkts_in += sm->packets;
+      }
+   } else {
+      /* Totals. */
+      acct_total_packets += sm->packets;
+      acct_total_bytes += sm->len;
+
+      /* Traffic staying within the network isn't counted. */
+      if (dir_out && !dir_in)
+         graph_acct((uint64_t)sm->len, sm->packets, GRAPH_OUT);
+      if (dir_in && !dir_out)
+         graph_acct((uint64_t)sm->len, sm->packets, GRAPH_IN);
+   }
+
+   if (opt_hosts_max == 0) return; /* skip per-host accounting */
+   acct_flow_add(shard, sm, dir_in, dir_out);
+}
+
+/* Account for the given packet summary. */
+void acct_for(const struct pktsummary * const sm,
+              const struct local_ips * const local_ips) {
+   acct_for_shard_or_global(sm, local_ips, NULL);
+}
+
+/* Fold sm into an earlier summary of the same traffic, if possible.  Returns
+ * non-zero if it did, and sm needn't be accounted for separately.  SYNs are
+ * counted per summary, so they're never folded.
+ */
+int acct_coalesce(struct pktsummary * const into,
+                  const struct pktsummary * const sm) {
+   if (into->tcp_flags == TH_SYN || sm->tcp_flags == TH_SYN ||
+       !acct_same_flow(into, sm))
+      return 0;
+   into->packets += sm->packets;
+   into->len += sm->len;
+   return 1;
+}
+
+/* How many summaries ahead of the one being accounted for to prefetch. */
+#define ACCT_PREFETCH_AHEAD 4
+
+/* Account for n packet summaries, into the shard if given.  Looking ahead
+ * lets the flow cache entries be loaded while earlier summaries are
+ * accounted for.
+ */
+void acct_for_batch(const struct pktsummary * const sms, const size_t n,
+                    const struct local_ips * const local_ips,
+                    struct acct_shard * const shard) {
+   struct acct_flows *flows = acct_flows_of(shard);
+   size_t i;
+
+   for (i = 0; i < n; i++) {
+      if (opt_hosts_max != 0 && i + ACCT_PREFETCH_AHEAD < n)
+         PREFETCH(&(flows->flow[
+            acct_flow_hash(&(sms[i + ACCT_PREFETCH_AHEAD]))]));
+      acct_for_shard_or_global(&(sms[i]), local_ips, shard);
+   }
+}
+
+/* ---------------------------------------------------------------------------
+ * Shards let a capture thread do its accounting without touching any global
+ * state.  The main thread drains them with acct_shard_merge().
+ */
+void acct_shard_init(struct acct_shard *shard) {
+   shard->hosts = hosts_shard_make();
+   shard->flows = xcalloc(1, sizeof(*shard->flows));
+   shard->total_packets = shard->total_bytes = 0;
+   shard->graph_in = shard->graph_out = 0;
+   shard->graph_pkts_in = shard->graph_pkts_out = 0;
+}
+
+void acct_shard_free(struct acct_shard *shard) {
+   hosts_shard_free(shard->hosts);
+   shard->hosts = NULL;
+   free(shard->flows);
+   shard->flows = NULL;
+}
+
+/* Whether the shard should be merged before any more is accounted into it.
+ * It's only checked between batches, so a shard can go a batch past full.
+ */
+int acct_shard_full(const struct acct_shard *shard) {
+   return (opt_hosts_max != 0 && hosts_shard_full(shard->hosts));
+}
+
+/* Fold the shard into the global totals, graphs and hosts_db, and empty it.
+ * Must be called from the main thread.
+ */
+void acct_shard_merge(struct acct_shard *shard) {
+   acct_total_packets += shard->total_packets;
+   acct_total_bytes += shard->total_bytes;
+   graph_acct(shard->graph_out, shard->graph_pkts_out, GRAPH_OUT);
+   graph_acct(shard->graph_in, shard->graph_pkts_in, GRAPH_IN);
+   shard->total_packets = shard->total_bytes = 0;
+   shard->graph_in = shard->graph_out = 0;
+   shard->graph_pkts_in = shard->graph_pkts_out = 0;
+   if (opt_hosts_max != 0) {
+      acct_flows_flush(shard->flows, shard);
+      hosts_shard_merge(shard->hosts);
+   }
+}
+
 /* vim:set ts=3 sw=3 tw=78 expandtab: */
@@ -3,16 +3,45 @@
  *
  * acct.h: traffic accounting
  */
+#ifndef __DARKSTAT_ACCT_H
+#define __DARKSTAT_ACCT_H
 
+#include <stddef.h> /* for size_t */
 #include <stdint.h>
 
 struct pktsummary;
 struct local_ips;
+struct hashtable;
+struct acct_flows;
+
+/* Accounting state private to one capture thread. */
+struct acct_shard {
+   struct hashtable *hosts;
+   struct acct_flows *flows;
+   uint64_t total_packets, total_bytes;
+   uint64_t graph_in, graph_out;
+   uint64_t graph_pkts_in, graph_pkts_out;
+};
 
 extern uint64_t acct_total_packets, acct_total_bytes;
 
 void acct_init_localnet(const char *spec);
+void acct_free_localnet(void);
 void acct_for(const struct pktsummary * const sm,
               const struct local_ips * const local_ips);
 
+void acct_flush(void);
+
+int acct_coalesce(struct pktsummary * const into,
+                  const struct pktsummary * const sm);
+void acct_for_batch(const struct pktsummary * const sms, const size_t n,
+                    const struct local_ips * const local_ips,
+                    struct acct_shard * const shard);
+
+void acct_shard_init(struct acct_shard *shard);
+void acct_shard_free(struct acct_shard *shard);
+int acct_shard_full(const struct acct_shard *shard);
+void acct_shard_merge(struct acct_shard *shard);
+
+#endif /* __DARKSTAT_ACCT_H */
 /* vim:set ts=3 sw=3 tw=80 expandtab: */
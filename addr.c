@@ -11,6 +11,7 @@
 
 #include <arpa/inet.h> /* for inet_ntop */
 #include <assert.h>
+#include <stdint.h>
 #include <string.h> /* for memcmp */
 #include <netdb.h> /* for getaddrinfo */
 
@@ -26,20 +27,42 @@ int addr_equal(const struct addr * const a, const struct addr * const b)
    }
 }
 
-static char _addrstrbuf[INET6_ADDRSTRLEN];
-const char *addr_to_str(const struct addr * const a)
+/* IPv4 is common enough, and simple enough, to do by hand.  inet_ntop()
+ * is left with IPv6, and its rules for where the :: goes.
+ */
+size_t addr_format(const struct addr * const a, char buf[INET6_ADDRSTRLEN])
 {
    if (a->family == IPv4) {
-      struct in_addr in;
-      in.s_addr = a->ip.v4;
-      return (inet_ntoa(in));
+      const uint8_t *b = (const uint8_t *)&(a->ip.v4);
+      size_t len = 0;
+      int i;
+
+      for (i=0; i<4; i++) {
+         const unsigned int o = b[i];
+
+         if (o >= 100)
+            buf[len++] = (char)('0' + o / 100);
+         if (o >= 10)
+            buf[len++] = (char)('0' + (o / 10) % 10);
+         buf[len++] = (char)('0' + o % 10);
+         buf[len++] = '.';
+      }
+      buf[len-1] = '\0'; /* instead of the last dot */
+      return len-1;
    } else {
       assert(a->family == IPv6);
-      inet_ntop(AF_INET6, &(a->ip.v6), _addrstrbuf, sizeof(_addrstrbuf));
-      return (_addrstrbuf);
+      inet_ntop(AF_INET6, &(a->ip.v6), buf, INET6_ADDRSTRLEN);
+      return strlen(buf);
    }
 }
 
+static char _addrstrbuf[INET6_ADDRSTRLEN];
+const char *addr_to_str(const struct addr * const a)
+{
+   addr_format(a, _addrstrbuf);
+   return (_addrstrbuf);
+}
+
 int str_to_addr(const char *s, struct addr *a)
 {
    struct addrinfo hints, *ai;
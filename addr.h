@@ -24,6 +24,9 @@ struct addr {
 
 int addr_equal(const struct addr * const a, const struct addr * const b);
 const char *addr_to_str(const struct addr * const a);
+
+/* Like addr_to_str(), into the caller's buf.  Returns the length. */
+size_t addr_format(const struct addr * const a, char buf[INET6_ADDRSTRLEN]);
 void addr_mask(struct addr *a, const struct addr * const mask);
 int addr_inside(const struct addr * const a,
    const struct addr * const net, const struct addr * const mask);
@@ -84,6 +84,8 @@ void test_inside(const char *a, const char *net, const char *mask, int expect)
 int main() {
   test("0.0.0.0", "0.0.0.0", 0);
   test("192.168.1.2", "192.168.1.2", 0);
+  test("10.0.100.255", "10.0.100.255", 0);
+  test("1.20.99.100", "1.20.99.100", 0);
 
   test("::", "::", 0);
   test("::0", "::", 0);
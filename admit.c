@@ -0,0 +1,142 @@
+/* darkstat 3
+ * copyright (c) 2026 darkstat contributors.
+ *
+ * admit.c: letting only heavy hitters into a full hosts table
+ *
+ * You may use, modify and redistribute this file under the terms of the
+ * GNU General Public License version 2. (see COPYING.GPL)
+ */
+
+/* A flood from spoofed or scanning sources brings more new hosts than
+ * --hosts-max, and each of them only sends a packet or two.  Letting them
+ * all in means reducing the hosts table over and over, only to throw them
+ * away again.
+ *
+ * So once the table holds --hosts-keep hosts, a new host has to earn its
+ * place: its bytes go into a Count-Min sketch, and it's only let in once
+ * the sketch says it has had --admit bytes.  The sketch is a few rows of
+ * counters, each row indexed by a different hash of the host, and a host's
+ * estimate is its smallest counter, which can be too high but never too
+ * low.  Only the smallest counters are raised (the "conservative update"),
+ * which keeps the estimates of small hosts closer to the truth.  Every
+ * counter is halved once a minute, so it takes recent traffic to get in.
+ *
+ * Memory and time per packet are the same however many hosts there are.
+ * A HyperLogLog sketch counts how many different hosts were seen,
+ * including the ones that never made it in.
+ */
+
+#include "admit.h"
+#include "conv.h"
+#include "err.h"
+#include "hll.h"
+#include "metrics.h"
+#include "now.h"
+#include "opt.h"
+#include "str.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define ADMIT_ROWS 4
+#define ADMIT_COLS_BITS 16
+#define ADMIT_COLS (1U << ADMIT_COLS_BITS)
+#define ADMIT_DECAY_SECS 60
+#define ADMIT_HLL_BITS 12
+
+static uint32_t *counters = NULL; /* ADMIT_ROWS rows of ADMIT_COLS */
+static time_t next_decay;
+static uint8_t seen[1U << ADMIT_HLL_BITS];
+static uint64_t admitted, turned_away, turned_away_bytes;
+
+void admit_init(void) {
+   if (opt_admit_bytes == 0)
+      return;
+   counters = xcalloc((size_t)ADMIT_ROWS * ADMIT_COLS, sizeof(*counters));
+   next_decay = now_mono() + ADMIT_DECAY_SECS;
+   verbosef("hosts past --hosts-keep need %u bytes to be admitted",
+      opt_admit_bytes);
+}
+
+void admit_free(void) {
+   free(counters);
+   counters = NULL;
+}
+
+void admit_reset(void) {
+   if (counters != NULL)
+      memset(counters, 0,
+         (size_t)ADMIT_ROWS * ADMIT_COLS * sizeof(*counters));
+   memset(seen, 0, sizeof(seen));
+}
+
+void admit_seen(const uint32_t hash) {
+   hll_add(seen, ADMIT_HLL_BITS, hash);
+}
+
+/* Halve every counter, once for each minute that has gone by. */
+static void decay(void) {
+   const time_t now = now_mono();
+   uint32_t i;
+
+   while (now >= next_decay) {
+      for (i=0; i<ADMIT_ROWS * ADMIT_COLS; i++)
+         counters[i] >>= 1;
+      next_decay += ADMIT_DECAY_SECS;
+   }
+}
+
+int admit_host(const uint32_t hash, const uint64_t bytes) {
+   uint32_t *c[ADMIT_ROWS], est = UINT32_MAX, add;
+   unsigned int r;
+
+   decay();
+   /* Each row takes its column from a different multiple of the hash.
+    * The multipliers are odd, so the top bits of every product depend on
+    * all of the hash.
+    */
+   for (r=0; r<ADMIT_ROWS; r++) {
+      static const uint32_t mult[ADMIT_ROWS] = {
+         0x9E3779B1U, 0x85EBCA77U, 0xC2B2AE3DU, 0x27D4EB2FU
+      };
+      c[r] = &counters[r * ADMIT_COLS +
+         ((hash * mult[r]) >> (32 - ADMIT_COLS_BITS))];
+      if (*c[r] < est)
+         est = *c[r];
+   }
+   add = (bytes > UINT32_MAX - est) ? UINT32_MAX - est : (uint32_t)bytes;
+   est += add;
+   for (r=0; r<ADMIT_ROWS; r++)
+      if (*c[r] < est)
+         *c[r] = est;
+
+   if (est >= opt_admit_bytes) {
+      admitted++;
+      return 1;
+   }
+   turned_away++;
+   turned_away_bytes += bytes;
+   return 0;
+}
+
+void admit_metrics(struct str *buf) {
+   if (counters == NULL)
+      return;
+   metrics_header(buf, "darkstat_distinct_hosts", "gauge",
+      "Estimated number of different hosts seen, admitted or not.");
+   str_appendf(buf, "darkstat_distinct_hosts %qu\n",
+      (qu)hll_count(seen, ADMIT_HLL_BITS));
+   metrics_header(buf, "darkstat_admit_admitted_total", "counter",
+      "New hosts let into a full hosts table, having had --admit bytes.");
+   str_appendf(buf, "darkstat_admit_admitted_total %qu\n", (qu)admitted);
+   metrics_header(buf, "darkstat_admit_turned_away_total", "counter",
+      "Times traffic for a new host was counted without admitting it.");
+   str_appendf(buf, "darkstat_admit_turned_away_total %qu\n",
+      (qu)turned_away);
+   metrics_header(buf, "darkstat_admit_turned_away_bytes_total", "counter",
+      "Bytes of traffic for hosts that weren't admitted.");
+   str_appendf(buf, "darkstat_admit_turned_away_bytes_total %qu\n",
+      (qu)turned_away_bytes);
+}
+
+/* vim:set ts=3 sw=3 tw=78 expandtab: */
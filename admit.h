@@ -0,0 +1,31 @@
+/* darkstat 3
+ * copyright (c) 2026 darkstat contributors.
+ *
+ * admit.h: letting only heavy hitters into a full hosts table
+ *
+ * You may use, modify and redistribute this file under the terms of the
+ * GNU General Public License version 2. (see COPYING.GPL)
+ */
+#ifndef __DARKSTAT_ADMIT_H
+#define __DARKSTAT_ADMIT_H
+
+#include <stdint.h>
+
+struct str;
+
+void admit_init(void);  /* if opt_admit_bytes is set */
+void admit_free(void);
+void admit_reset(void); /* forget every host */
+
+/* Count a host, by its hash, towards the distinct hosts seen. */
+void admit_seen(const uint32_t hash);
+
+/* Count bytes towards a host that isn't in the table, and return non-zero
+ * if it has now had --admit bytes, recently enough to be let in.
+ */
+int admit_host(const uint32_t hash, const uint64_t bytes);
+
+void admit_metrics(struct str *buf); /* for /metrics */
+
+#endif /* __DARKSTAT_ADMIT_H */
+/* vim:set ts=3 sw=3 tw=78 expandtab: */
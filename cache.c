@@ -34,60 +34,94 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
 #include <assert.h>
 
 #include "cache.h"
+#include "conv.h"
 
-/* prototypes */
-void update_state(struct sc_ent *, struct pfsync_state *);
-struct sc_ent *cache_state(struct pfsync_state *);
-static __inline int sc_cmp(struct sc_ent *s1, struct sc_ent *s2);
+/*
+ * The cache is an open addressing hash table of states, keyed on
+ * (id, creatorid), with linear probing.  It starts small and doubles as
+ * the state table grows, up to cache_max entries.
+ *
+ * Every state seen in a poll is stamped with that poll's generation, and
+ * cache_endupdate() removes the ones that weren't, in one sweep.
+ * After the first poll, a state that isn't in the cache is new, so all of
+ * its traffic is counted, not just what it gets from then on.
+ * Removal shifts the rest of the cluster back, so there are no
+ * tombstones to slow down lookups.
+ */
 
-/* initialize the tree and queue */
-RB_HEAD(sc_tree, sc_ent) sctree;
-TAILQ_HEAD(sc_queue, sc_ent) scq1, scq2, scq_free;
-RB_GENERATE(sc_tree, sc_ent, tlink, sc_cmp)
+#define CACHE_MIN_SLOTS 1024
 
-struct sc_queue *scq_act = NULL;
-struct sc_queue *scq_exp = NULL;
+struct sc_ent *sc_store = NULL;
+static u_int32_t sc_mask = 0;		/* slots - 1 */
+static u_int32_t sc_gen = 1;		/* 0 marks an empty slot */
+static int sc_primed = 0;		/* after the first poll */
 
 int cache_max = 0;
-int cache_size = 0;
+int cache_size = 0;			/* states in the cache */
+struct cache_stats cache_stats;
 
-struct sc_ent *sc_store = NULL;
+static __inline u_int32_t
+sc_hash(u_int64_t id, u_int32_t creatorid)
+{
+	u_int64_t h = (id ^ ((u_int64_t)creatorid << 32)) *
+	    0x9e3779b97f4a7c15ULL;
+
+	return ((u_int32_t)(h >> 32));
+}
+
+static __inline u_int32_t
+sc_home(const struct sc_ent *ent)
+{
+	return (sc_hash(ent->id, ent->creatorid) & sc_mask);
+}
 
-/* preallocate the cache and insert into the 'free' queue */
+/* The slot holding (id, creatorid), or the empty slot where it would go. */
+static struct sc_ent *
+sc_find(u_int64_t id, u_int32_t creatorid)
+{
+	u_int32_t i = sc_hash(id, creatorid) & sc_mask;
+
+	while (sc_store[i].gen != 0 &&
+	    (sc_store[i].id != id || sc_store[i].creatorid != creatorid))
+		i = (i + 1) & sc_mask;
+	return (&sc_store[i]);
+}
+
+static void
+sc_resize(u_int32_t slots)
+{
+	struct sc_ent *old = sc_store;
+	u_int32_t i, old_slots = old ? sc_mask + 1 : 0;
+
+	sc_store = xcalloc(slots, sizeof(*sc_store));
+	sc_mask = slots - 1;
+	for (i = 0; i < old_slots; i++)
+		if (old[i].gen != 0)
+			*sc_find(old[i].id, old[i].creatorid) = old[i];
+	free(old);
+	cache_stats.resizes++;
+}
+
+/* the cache can hold up to max states, and 0 turns it off */
 int
 cache_init(int max)
 {
-	int n;
 	static int initialized = 0;
 
 	if (max < 0 || initialized)
 		return (1);
 
-	if (max == 0) {
-		sc_store = NULL;
-	} else {
-		sc_store = reallocarray(NULL, max, sizeof(struct sc_ent));
-		if (sc_store == NULL)
-			return (1);
-	}
-
-	RB_INIT(&sctree);
-	TAILQ_INIT(&scq1);
-	TAILQ_INIT(&scq2);
-	TAILQ_INIT(&scq_free);
-
-	scq_act = &scq1;
-	scq_exp = &scq2;
-
-	for (n = 0; n < max; n++)
-		TAILQ_INSERT_HEAD(&scq_free, sc_store + n, qlink);
-
-	cache_size = cache_max = max;
+	cache_max = max;
+	cache_size = 0;
+	memset(&cache_stats, 0, sizeof(cache_stats));
+	if (max > 0)
+		sc_resize(CACHE_MIN_SLOTS);
 	initialized++;
 
 	return (0);
@@ -112,95 +146,105 @@ update_state(struct sc_ent *prev, struct pfsync_state *new)
 }
 
 void
-add_state(struct pfsync_state *st)
+add_state(struct sc_ent *ent, struct pfsync_state *st)
 {
-	struct sc_ent *ent;
 	assert(st != NULL);
 
-	if (cache_max == 0)
-		return;
-
-	if (TAILQ_EMPTY(&scq_free))
-		return;
-
-	ent = TAILQ_FIRST(&scq_free);
-	TAILQ_REMOVE(&scq_free, ent, qlink);
-
-	cache_size--;
-
 	ent->id = st->id;
 	ent->creatorid = st->creatorid;
+	ent->gen = sc_gen;
 	ent->bytes[0] = COUNTER(st->bytes[0]);
 	ent->bytes[1] = COUNTER(st->bytes[1]);
 	ent->packets[0] = COUNTER(st->packets[0]);
 	ent->packets[1] = COUNTER(st->packets[1]);
-
-	RB_INSERT(sc_tree, &sctree, ent);
-	TAILQ_INSERT_HEAD(scq_act, ent, qlink);
+	cache_size++;
 }
 
 /* must be called only once for each state before cache_endupdate */
 struct sc_ent *
 cache_state(struct pfsync_state *st)
 {
-	struct sc_ent ent, *old;
+	struct sc_ent *ent;
 
 	if (cache_max == 0)
 		return (NULL);
 
-	ent.id = st->id;
-	ent.creatorid = st->creatorid;
-	old = RB_FIND(sc_tree, &sctree, &ent);
-
-	if (old == NULL) {
-		add_state(st);
-		return (NULL);
+	cache_stats.lookups++;
+	ent = sc_find(st->id, st->creatorid);
+	if (ent->gen == 0) {
+		cache_stats.misses++;
+		if (cache_size >= cache_max) {
+			cache_stats.full++;
+			return (NULL);
+		}
+		/* Keep the load under 3/4, if cache_max allows. */
+		if ((u_int64_t)(cache_size + 1) * 4 > (u_int64_t)sc_mask * 3 &&
+		    (u_int64_t)(sc_mask + 1) < (u_int64_t)cache_max * 2) {
+			sc_resize((sc_mask + 1) * 2);
+			ent = sc_find(st->id, st->creatorid);
+		}
+		add_state(ent, st);
+		if (!sc_primed)
+			return (NULL);	/* it was there before we started */
+		memset(ent->bytes, 0, sizeof(ent->bytes));
+		memset(ent->packets, 0, sizeof(ent->packets));
+	} else if (COUNTER(st->bytes[0]) < ent->bytes[0] ||
+	    COUNTER(st->bytes[1]) < ent->bytes[1]) {
+		/* a new state with an old id */
+		memset(ent->bytes, 0, sizeof(ent->bytes));
+		memset(ent->packets, 0, sizeof(ent->packets));
 	}
 
-	if (COUNTER(st->bytes[0]) < old->bytes[0] || COUNTER(st->bytes[1]) < old->bytes[1])
-		return (NULL);
-
-	update_state(old, st);
-
-	/* move to active queue */
-	TAILQ_REMOVE(scq_exp, old, qlink);
-	TAILQ_INSERT_HEAD(scq_act, old, qlink);
+	ent->gen = sc_gen;
+	update_state(ent, st);
+	return (ent);
+}
 
-	return (old);
+/* Empty slot i, moving later entries of its cluster back to fill it. */
+static void
+sc_remove(u_int32_t i)
+{
+	u_int32_t j = i;
+
+	for (;;) {
+		u_int32_t k;
+
+		j = (j + 1) & sc_mask;
+		if (sc_store[j].gen == 0)
+			break;
+		k = sc_home(&sc_store[j]);
+		/* Entry j can move to i if its home isn't in (i, j]. */
+		if ((i <= j) ? (i < k && k <= j) : (i < k || k <= j))
+			continue;
+		sc_store[i] = sc_store[j];
+		i = j;
+	}
+	sc_store[i].gen = 0;
+	cache_size--;
 }
 
 /* remove the states that are not updated in this cycle */
 void
 cache_endupdate(void)
 {
-	struct sc_queue *tmp;
-	struct sc_ent *ent;
+	u_int32_t start, n, i;
 
-	while (! TAILQ_EMPTY(scq_exp)) {
-		ent = TAILQ_FIRST(scq_exp);
-		TAILQ_REMOVE(scq_exp, ent, qlink);
-		RB_REMOVE(sc_tree, &sctree, ent);
-		TAILQ_INSERT_HEAD(&scq_free, ent, qlink);
-		cache_size++;
-	}
-
-	tmp = scq_act;
-	scq_act = scq_exp;
-	scq_exp = tmp;
-}
+	if (cache_max == 0)
+		return;
 
-static __inline int
-sc_cmp(struct sc_ent *a, struct sc_ent *b)
-{
-	if (a->id > b->id)
-		return (1);
-	if (a->id < b->id)
-		return (-1);
-	if (a->creatorid > b->creatorid)
-		return (1);
-	if (a->creatorid < b->creatorid)
-		return (-1);
-	return (0);
+	/* Start after an empty slot, so that no cluster wraps around. */
+	for (start = 0; sc_store[start].gen != 0; start++)
+		;
+	for (n = 1; n <= sc_mask; n++) {
+		i = (start + n) & sc_mask;
+		while (sc_store[i].gen != 0 && sc_store[i].gen != sc_gen) {
+			sc_remove(i);
+			cache_stats.expired++;
+		}
+	}
+	if (++sc_gen == 0)
+		sc_gen = 1;
+	sc_primed = 1;
 }
 
 #endif
@@ -24,25 +24,31 @@
 #include <netinet/tcp_fsm.h>
 #include <arpa/inet.h>
 #include <sys/types.h>
-#include <sys/queue.h>
-#include <sys/tree.h>
 #include <net/pfvar.h>
 
 struct sc_ent {
-	RB_ENTRY(sc_ent)    tlink;
-	TAILQ_ENTRY(sc_ent) qlink;
 	u_int64_t	    id;
 	u_int32_t	    creatorid;
+	u_int32_t	    gen;	/* of the last poll it was in, 0 if free */
 	u_int64_t	    bytes[2];
 	u_int64_t	    bytes_delta[2];
 	u_int64_t	    packets[2];
 	u_int64_t	    packets_delta[2];
 };
 
+struct cache_stats {
+	u_int64_t	    lookups;
+	u_int64_t	    misses;	/* new states */
+	u_int64_t	    full;	/* new states that didn't fit */
+	u_int64_t	    expired;
+	u_int64_t	    resizes;
+};
+
 int cache_init(int);
 void cache_endupdate(void);
 struct sc_ent *cache_state(struct pfsync_state *);
 extern int cache_max, cache_size;
+extern struct cache_stats cache_stats;
 
 #define COUNTER(c) ((((u_int64_t) ntohl(c[0]))<<32) + ntohl(c[1]))
 
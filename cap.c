@@ -8,29 +8,53 @@
  */
 
 #include "acct.h"
+#include "bsd.h" /* for strlcpy */
 #include "cdefs.h"
 #include "cap.h"
 #include "config.h"
 #include "conv.h"
 #include "decode.h"
 #include "err.h"
+#include "event.h"
 #include "hosts_db.h"
 #include "linktypes.h"
 #include "localip.h"
+#include "metrics.h"
 #include "now.h"
+#include "numa.h"
 #include "opt.h"
+#include "pktq.h"
 #include "queue.h"
+#include "snapshot.h"
 #include "str.h"
+#include "xdp.h"
 
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
 #ifdef HAVE_SYS_FILIO_H
 # include <sys/filio.h> /* Solaris' FIONBIO hides here */
 #endif
+#ifdef linux
+# include <arpa/inet.h> /* for htons */
+# include <linux/filter.h>
+# include <linux/if_packet.h>
+# include <net/ethernet.h> /* for ETH_P_ALL */
+# include <net/if.h>
+# include <net/if_arp.h>
+# ifndef ETHERTYPE_PPPOE
+#  define ETHERTYPE_PPPOE 0x8864
+# endif
+#endif
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <pcap.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -42,9 +66,12 @@ char *title_interfaces = NULL; /* for html.c */
  *  - cap_add_ifname() one or more times
  *  - cap_add_filter() zero or more times
  *  - cap_start() once to start listening
+ *  - cap_start_threads() once, after hosts_db_init()
+ *  - cap_event_init() once, to register with the event loop
  * Once per main loop:
- *  - cap_fd_set() to update the select() set
- *  - cap_poll() to read from ready pcap fds
+ *  - cap_poll() to read from ready pcap fds, or with --threads,
+ *    to merge what the capture threads have accounted so far, or with
+ *    --queue-size, to account for what they've queued
  * Shutdown:
  *  - cap_stop()
  */
@@ -54,15 +81,59 @@ struct strnode {
    const char *str;
 };
 
+struct cap_ring;
+
+/* Packets are decoded into a batch, and the batch is accounted for in one
+ * go at the end of each read, or when it fills up.  A packet that repeats
+ * one of the last few in the batch is folded into it.
+ */
+#define CAP_BATCH 64
+#define CAP_COALESCE 4
+
 struct cap_iface {
    STAILQ_ENTRY(cap_iface) entries;
 
    const char *name;
    const char *filter;
    pcap_t *pcap;
+   struct cap_ring *ring; /* instead of pcap, with --ring-size */
+   struct xdp_queue *xdp; /* instead of pcap, with --xdp-queues */
+   struct bpf_program xdp_filter; /* the user's, run on each packet */
    int fd;
    const struct linkhdr *linkhdr;
    struct local_ips local_ips;
+   struct pktsummary batch[CAP_BATCH];
+   size_t batch_len;
+   unsigned int rewrite; /* with -r --replay, the pass over the file */
+
+   /* With --threads, each interface has its own thread, which
+    * accounts into *active under lock.  The main thread swaps active with
+    * the other shard and merges the old one outside the lock.  A thread
+    * whose shard fills up before then wakes the main thread, and waits.
+    */
+   pthread_t thread;
+   pthread_mutex_t lock;
+   struct acct_shard shards[2];
+   struct acct_shard *active;
+   int failed;
+   volatile uint64_t shard_waits;
+
+   /* With -r --threads, a worker merges its own shard, under this. */
+   pthread_mutex_t *merge_lock;
+
+   /* With --queue-size, the thread only decodes, and queues its batches
+    * for the main thread to account for.  It counts how often it found
+    * the queue full and had to wait, and asks for a wakeup once it's half
+    * full, rather than waiting for the next poll.
+    */
+   struct pktq *queue;
+   volatile uint64_t queue_waits;
+   volatile int queue_woke;
+
+   /* How long each cap_dispatch() that got packets took, and how many it
+    * got, for /metrics.  Under lock with --threads.
+    */
+   struct histogram dispatch_nsec, dispatch_pkts;
 };
 
 static STAILQ_HEAD(cli_ifnames_head, strnode) cli_ifnames =
@@ -77,6 +148,17 @@ static STAILQ_HEAD(cap_ifs_head, cap_iface) cap_ifs =
 /* The read timeout passed to pcap_open_live() */
 #define CAP_TIMEOUT_MSEC 500
 
+static volatile int cap_threads_running = 0;
+
+/* Capture threads write a byte here to wake the main thread up, with
+ * --queue-size.
+ */
+static int cap_wake[2] = { -1, -1 };
+
+static void callback(u_char *user,
+                     const struct pcap_pkthdr *pheader,
+                     const u_char *pdata);
+
 void cap_add_ifname(const char *ifname) {
    struct strnode *n = xmalloc(sizeof(*n));
    n->str = ifname;
@@ -113,11 +195,410 @@ static void cap_set_filter(pcap_t *pcap, const char *filter) {
    free(tmp_filter);
 }
 
-/* Start capturing on just one interface. Called from cap_start(). */
-static void cap_start_one(struct cap_iface *iface, const int promisc) {
-   char errbuf[PCAP_ERRBUF_SIZE], *tmp_device;
+/* What the decoder for each linktype can account for, as a filter expression,
+ * so that the kernel can drop everything else before it's copied out to us.
+ * NULL when there's nothing to drop, or we can't say.
+ */
+static const char *cap_prune_expr(const int linktype) {
+   switch (linktype) {
+   case DLT_EN10MB:
+      return opt_want_pppoe ? "pppoes and ip" : "ip or ip6";
+#ifdef DLT_LINUX_SLL
+   case DLT_LINUX_SLL:
+#endif
+   case DLT_NULL:
+   case DLT_LOOP:
+      return "ip or ip6";
+   case DLT_PPP:
+      return "ip";
+   default:
+      return NULL;
+   }
+}
+
+/* Returns the user's filter combined with cap_prune_expr(), as a new string,
+ * or NULL for no filter at all.  Some keywords move pcap's idea of where the
+ * network header starts, which would change what the pruning expression
+ * looks at, so filters using them are left alone.
+ */
+static char *cap_make_filter(const char *filter, const int linktype) {
+   static const char *const moves_offsets[] =
+      { "vlan", "mpls", "pppoe", "geneve", NULL };
+   const char *prune = cap_prune_expr(linktype);
+   size_t len, i;
+   char *out;
+
+   if (prune == NULL)
+      return (filter == NULL) ? NULL : xstrdup(filter);
+   if (filter == NULL) {
+      out = xstrdup(prune);
+   } else {
+      for (i = 0; moves_offsets[i] != NULL; i++)
+         if (strstr(filter, moves_offsets[i]) != NULL)
+            return xstrdup(filter);
+      len = strlen(filter) + strlen(prune) + sizeof("() and ()");
+      out = xmalloc(len);
+      snprintf(out, len, "(%s) and (%s)", filter, prune);
+   }
+   verbosef("kernel filter is '%s'", out);
+   return out;
+}
+
+/* Set up the decoder for the interface's linktype, and return the snaplen
+ * we need to capture with.
+ */
+static int cap_set_linktype(struct cap_iface *iface, const int linktype) {
+   int snaplen;
+
+   verbosef("linktype is %d (%s)", linktype, get_linktype_name(linktype));
+   if ((linktype == DLT_EN10MB) && opt_want_macs)
+      hosts_db_show_macs = 1;
+   iface->linkhdr = getlinkhdr(linktype);
+   if (iface->linkhdr == NULL)
+      errx(1, "unknown linktype %d", linktype);
+   snaplen = getsnaplen(iface->linkhdr);
+   if (opt_want_pppoe) {
+      snaplen += PPPOE_HDR_LEN;
+      if (linktype != DLT_EN10MB)
+         errx(1, "can't do PPPoE decoding on a non-Ethernet linktype");
+   }
+   verbosef("calculated snaplen minimum %d", snaplen);
+   if (opt_want_snaplen > -1)
+      snaplen = opt_want_snaplen;
+   return snaplen;
+}
+
+#ifdef linux
+/* ---------------------------------------------------------------------------
+ * Native capture on Linux: an AF_PACKET socket with a TPACKET_V3 ring mapped
+ * into our address space, used instead of libpcap when --ring-size is given.
+ * The kernel fills whole blocks of packets and hands them over when they're
+ * full or when CAP_RING_TIMEOUT_MSEC has passed, which is when the socket
+ * becomes readable.  We walk the packets in place, without copying.
+ */
+#define CAP_RING_BLOCK_SIZE (1 << 20)
+#define CAP_RING_FRAME_SIZE 2048
+#define CAP_RING_TIMEOUT_MSEC 100
+
+struct cap_ring {
+   uint8_t *map;
+   size_t map_len;
+   unsigned int block_nr, cur;
+   unsigned int recv, drop;   /* the kernel resets its counters on read */
+};
+
+/* Work out the DLT for the interface from its ARPHRD type. */
+static int cap_ring_linktype(const int fd, const char *ifname) {
+   struct ifreq ifr;
+
+   memset(&ifr, 0, sizeof(ifr));
+   strlcpy(ifr.ifr_name, ifname, sizeof(ifr.ifr_name));
+   if (ioctl(fd, SIOCGIFHWADDR, &ifr) == -1)
+      err(1, "ioctl(SIOCGIFHWADDR, '%s')", ifname);
+   switch (ifr.ifr_hwaddr.sa_family) {
+   case ARPHRD_ETHER:
+   case ARPHRD_LOOPBACK:
+      return DLT_EN10MB;
+   case ARPHRD_NONE:
+      return DLT_RAW;
+   default:
+      errx(1, "--ring-size can't capture on '%s' (ARPHRD type %d), "
+         "try without it", ifname, ifr.ifr_hwaddr.sa_family);
+   }
+}
+
+/* Attach the user's filter, or failing that one which accepts what the
+ * decoder can account for, truncated to snaplen.  The latter is written out
+ * by hand, so it's as short as it can be and doesn't need pcap_compile().
+ */
+static void cap_ring_set_filter(const int fd, const char *filter,
+                                const int linktype, const int snaplen) {
+   struct bpf_insn accept[] = { BPF_STMT(BPF_RET+BPF_K, (u_int)snaplen) };
+   struct bpf_insn ether_ip[] = {
+      BPF_STMT(BPF_LD+BPF_H+BPF_ABS, 12),
+      BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, ETHERTYPE_IP, 1, 0),
+      BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, ETHERTYPE_IPV6, 0, 1),
+      BPF_STMT(BPF_RET+BPF_K, (u_int)snaplen),
+      BPF_STMT(BPF_RET+BPF_K, 0),
+   };
+   struct bpf_insn ether_pppoe_ip[] = {
+      BPF_STMT(BPF_LD+BPF_H+BPF_ABS, 12),
+      BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, ETHERTYPE_PPPOE, 0, 3),
+      BPF_STMT(BPF_LD+BPF_H+BPF_ABS, ETHER_HDR_LEN + 6), /* PPP protocol */
+      BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 0x0021, 0, 1),
+      BPF_STMT(BPF_RET+BPF_K, (u_int)snaplen),
+      BPF_STMT(BPF_RET+BPF_K, 0),
+   };
+   struct bpf_program prog;
+   struct sock_fprog fprog;
+   pcap_t *dead = NULL;
+
+   if (filter == NULL && linktype == DLT_EN10MB && opt_want_pppoe) {
+      prog.bf_len = sizeof(ether_pppoe_ip) / sizeof(*ether_pppoe_ip);
+      prog.bf_insns = ether_pppoe_ip;
+   } else if (filter == NULL && linktype == DLT_EN10MB) {
+      prog.bf_len = sizeof(ether_ip) / sizeof(*ether_ip);
+      prog.bf_insns = ether_ip;
+   } else if (filter == NULL) {
+      prog.bf_len = 1;
+      prog.bf_insns = accept;
+   } else {
+      char *tmp_filter = xstrdup(filter);
+
+      dead = pcap_open_dead(linktype, snaplen);
+      if (dead == NULL)
+         errx(1, "pcap_open_dead() failed");
+      if (pcap_compile(dead, &prog, tmp_filter, 1, 0) == -1)
+         errx(1, "pcap_compile(): %s", pcap_geterr(dead));
+      free(tmp_filter);
+   }
+
+   fprog.len = prog.bf_len;
+   fprog.filter = (struct sock_filter *)prog.bf_insns;
+   if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER,
+                  &fprog, sizeof(fprog)) == -1)
+      err(1, "setsockopt(SO_ATTACH_FILTER)");
+
+   if (dead != NULL) {
+      pcap_freecode(&prog);
+      pcap_close(dead);
+   }
+}
+
+static void cap_ring_start(struct cap_iface *iface, const int promisc) {
+   struct cap_ring *ring = xmalloc(sizeof(*ring));
+   struct tpacket_req3 req;
+   struct sockaddr_ll sll;
+   int fd, linktype, snaplen, ver = TPACKET_V3;
+   char *filter;
+
+   verbosef("capturing on interface '%s' with a %u MB ring",
+      iface->name, opt_ring_size);
+   /* Protocol 0 receives nothing until the bind() below gives it one, along
+    * with the interface.  Otherwise packets from every interface would land
+    * in the ring in the meantime, and be counted against this one.
+    */
+   if ((fd = socket(AF_PACKET, SOCK_RAW, 0)) == -1)
+      err(1, "socket(AF_PACKET)");
+
+   linktype = cap_ring_linktype(fd, iface->name);
+   snaplen = cap_set_linktype(iface, linktype);
+   verbosef("using snaplen %d", snaplen);
+   filter = (iface->filter == NULL) ? NULL :
+      cap_make_filter(iface->filter, linktype);
+   cap_ring_set_filter(fd, filter, linktype, snaplen);
+   free(filter);
+
+   if (setsockopt(fd, SOL_PACKET, PACKET_VERSION, &ver, sizeof(ver)) == -1)
+      err(1, "setsockopt(PACKET_VERSION, TPACKET_V3)");
+
+   memset(&req, 0, sizeof(req));
+   req.tp_block_size = CAP_RING_BLOCK_SIZE;
+   req.tp_block_nr = opt_ring_size;
+   req.tp_frame_size = CAP_RING_FRAME_SIZE;
+   req.tp_frame_nr = req.tp_block_nr *
+      (CAP_RING_BLOCK_SIZE / CAP_RING_FRAME_SIZE);
+   req.tp_retire_blk_tov = CAP_RING_TIMEOUT_MSEC;
+   if (setsockopt(fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) == -1)
+      err(1, "setsockopt(PACKET_RX_RING)");
+
+   ring->block_nr = req.tp_block_nr;
+   ring->map_len = (size_t)req.tp_block_nr * req.tp_block_size;
+   ring->map = mmap(NULL, ring->map_len, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_LOCKED, fd, 0);
+   if (ring->map == MAP_FAILED) {
+      /* MAP_LOCKED can fail on RLIMIT_MEMLOCK, retry without it. */
+      ring->map = mmap(NULL, ring->map_len, PROT_READ | PROT_WRITE,
+         MAP_SHARED, fd, 0);
+      if (ring->map == MAP_FAILED)
+         err(1, "mmap(%zu bytes of ring)", ring->map_len);
+   }
+   ring->cur = 0;
+   ring->recv = ring->drop = 0;
+
+   memset(&sll, 0, sizeof(sll));
+   sll.sll_family = AF_PACKET;
+   sll.sll_protocol = htons(ETH_P_ALL);
+   if ((sll.sll_ifindex = (int)if_nametoindex(iface->name)) == 0)
+      err(1, "if_nametoindex('%s')", iface->name);
+   if (bind(fd, (struct sockaddr *)&sll, sizeof(sll)) == -1)
+      err(1, "bind(AF_PACKET, '%s')", iface->name);
+
+   if (promisc) {
+      struct packet_mreq mr;
+
+      memset(&mr, 0, sizeof(mr));
+      mr.mr_ifindex = sll.sll_ifindex;
+      mr.mr_type = PACKET_MR_PROMISC;
+      if (setsockopt(fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP,
+                     &mr, sizeof(mr)) == -1)
+         err(1, "setsockopt(PACKET_ADD_MEMBERSHIP)");
+      verbosef("capturing in promiscuous mode");
+   } else
+      verbosef("capturing in non-promiscuous mode");
+
+   iface->fd = fd;
+   iface->ring = ring;
+}
+
+/* Account for every packet in the retired blocks of the ring.  Returns the
+ * number of packets handled.
+ */
+static int cap_ring_dispatch(struct cap_iface *iface) {
+   struct cap_ring *ring = iface->ring;
+   int count = 0;
+
+   for (;;) {
+      struct tpacket_block_desc *bd = (struct tpacket_block_desc *)
+         (ring->map + (size_t)ring->cur * CAP_RING_BLOCK_SIZE);
+      const uint8_t *p;
+      uint32_t i;
+
+      if ((bd->hdr.bh1.block_status & TP_STATUS_USER) == 0)
+         break;
+      __sync_synchronize();
+
+      p = (const uint8_t *)bd + bd->hdr.bh1.offset_to_first_pkt;
+      for (i=0; i<bd->hdr.bh1.num_pkts; i++) {
+         const struct tpacket3_hdr *h = (const struct tpacket3_hdr *)p;
+         struct pcap_pkthdr ph;
+
+         ph.ts.tv_sec = h->tp_sec;
+         ph.ts.tv_usec = h->tp_nsec / 1000;
+         ph.caplen = h->tp_snaplen;
+         ph.len = h->tp_len;
+         callback((u_char *)iface, &ph, p + h->tp_mac);
+         p += h->tp_next_offset;
+      }
+      count += (int)bd->hdr.bh1.num_pkts;
+
+      __sync_synchronize();
+      bd->hdr.bh1.block_status = TP_STATUS_KERNEL;
+      ring->cur = (ring->cur + 1) % ring->block_nr;
+   }
+   return count;
+}
+
+static int cap_ring_stats(struct cap_iface *iface, struct pcap_stat *ps) {
+   struct tpacket_stats_v3 st;
+   socklen_t len = sizeof(st);
+
+   if (getsockopt(iface->fd, SOL_PACKET, PACKET_STATISTICS, &st, &len) == -1)
+      return -1;
+   iface->ring->recv += st.tp_packets;
+   iface->ring->drop += st.tp_drops;
+   ps->ps_recv = iface->ring->recv;
+   ps->ps_drop = iface->ring->drop;
+   return 0;
+}
+
+/* Add the interface's socket to a PACKET_FANOUT group.  The kernel spreads
+ * packets across the members of the group, by flow hash or by the CPU that
+ * received them.
+ */
+static void cap_join_fanout(const struct cap_iface *iface, const int group) {
+   int arg, type;
+
+   if (opt_fanout_cpu)
+      type = PACKET_FANOUT_CPU;
+   else
+      type = PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_DEFRAG;
+   arg = (group & 0xffff) | (type << 16);
+   if (setsockopt(iface->fd, SOL_PACKET, PACKET_FANOUT,
+                  &arg, sizeof(arg)) == -1)
+      err(1, "setsockopt(PACKET_FANOUT, '%s')", iface->name);
+}
+
+static void cap_ring_stop(struct cap_iface *iface) {
+   munmap(iface->ring->map, iface->ring->map_len);
+   close(iface->fd);
+   free(iface->ring);
+   iface->ring = NULL;
+}
+#endif /* linux */
+
+#ifdef HAVE_AF_XDP
+/* ---------------------------------------------------------------------------
+ * AF_XDP capture with --xdp-queues, one receive queue per member of the
+ * interface.  See xdp.c.  The XDP program only keeps IP traffic, and the
+ * user's filter, if any, is run here on each packet.
+ */
+static void cap_xdp_start(struct cap_iface *iface, const unsigned int queue,
+                          const int promisc) {
+   int snaplen = cap_set_linktype(iface, DLT_EN10MB);
+
+   verbosef("using snaplen %d", snaplen);
+   if (iface->filter != NULL) {
+      char *tmp_filter = xstrdup(iface->filter);
+      pcap_t *dead = pcap_open_dead(DLT_EN10MB, snaplen);
+
+      if (dead == NULL)
+         errx(1, "pcap_open_dead() failed");
+      if (pcap_compile(dead, &iface->xdp_filter, tmp_filter, 1, 0) == -1)
+         errx(1, "pcap_compile(): %s", pcap_geterr(dead));
+      pcap_close(dead);
+      free(tmp_filter);
+   }
+   iface->xdp = xdp_open(iface->name, queue, opt_xdp_queues, snaplen,
+      promisc);
+   iface->fd = xdp_fd(iface->xdp);
+}
+
+static void cap_xdp_packet(void *user, const struct timeval *ts,
+                           const uint8_t *pkt, uint32_t caplen, uint32_t len) {
+   struct cap_iface *iface = user;
+   struct pcap_pkthdr ph;
+
+   ph.ts = *ts;
+   ph.caplen = caplen;
+   ph.len = len;
+   if (iface->xdp_filter.bf_insns != NULL &&
+       !pcap_offline_filter(&iface->xdp_filter, &ph, pkt))
+      return;
+   callback((u_char *)iface, &ph, pkt);
+}
+
+static int cap_xdp_stats(struct cap_iface *iface, struct pcap_stat *ps) {
+   unsigned int recv, drop;
+
+   if (xdp_stats(iface->xdp, &recv, &drop) == -1)
+      return -1;
+   ps->ps_recv = recv;
+   ps->ps_drop = drop;
+   return 0;
+}
+
+static void cap_xdp_stop(struct cap_iface *iface) {
+   xdp_close(iface->xdp);
+   iface->xdp = NULL;
+   if (iface->xdp_filter.bf_insns != NULL)
+      pcap_freecode(&iface->xdp_filter);
+}
+#endif /* HAVE_AF_XDP */
+
+/* Start capturing on just one interface, as the given member of its
+ * --fanout group or --xdp-queues.  Called from cap_start().
+ */
+static void cap_start_one(struct cap_iface *iface, const unsigned int member,
+                          const int promisc) {
+   char errbuf[PCAP_ERRBUF_SIZE], *tmp_device, *filter;
    int linktype, snaplen, waited;
 
+#ifdef HAVE_AF_XDP
+   if (opt_xdp_queues) {
+      cap_xdp_start(iface, member, promisc);
+      return;
+   }
+#else
+   (void)member;
+#endif
+#ifdef linux
+   if (opt_ring_size) {
+      cap_ring_start(iface, promisc);
+      return;
+   }
+#endif
+
    /* pcap wants a non-const interface name string */
    tmp_device = xstrdup(iface->name);
    if (iface->filter)
@@ -153,34 +634,17 @@ static void cap_start_one(struct cap_iface *iface, const int promisc) {
 
    /* Work out the linktype and what snaplen we need. */
    linktype = pcap_datalink(iface->pcap);
-   verbosef("linktype is %d (%s)", linktype, get_linktype_name(linktype));
-   if ((linktype == DLT_EN10MB) && opt_want_macs)
-      hosts_db_show_macs = 1;
-   iface->linkhdr = getlinkhdr(linktype);
-   if (iface->linkhdr == NULL)
-      errx(1, "unknown linktype %d", linktype);
-   snaplen = getsnaplen(iface->linkhdr);
-   if (opt_want_pppoe) {
-      snaplen += PPPOE_HDR_LEN;
-      if (linktype != DLT_EN10MB)
-         errx(1, "can't do PPPoE decoding on a non-Ethernet linktype");
-   }
-   verbosef("calculated snaplen minimum %d", snaplen);
+   snaplen = cap_set_linktype(iface, linktype);
 #ifdef linux
-   /* FIXME: actually due to libpcap moving to mmap (!!!)
-    * work out which version and fix the way we do capture
-    * on linux:
-    */
-
    /* Ubuntu 9.04 has a problem where requesting snaplen <= 60 will
     * give us 42 bytes, and we need at least 54 for TCP headers.
     *
-    * Hack to set minimum snaplen to tcpdump's default:
+    * Hack to set minimum snaplen to tcpdump's default.  The ring, which
+    * doesn't go through libpcap, gets exactly what it asks for.
     */
-   snaplen = MAX(snaplen, 96);
+   if (opt_want_snaplen == -1)
+      snaplen = MAX(snaplen, 96);
 #endif
-   if (opt_want_snaplen > -1)
-      snaplen = opt_want_snaplen;
    verbosef("using snaplen %d", snaplen);
 
    /* Close and re-open pcap to use the new snaplen. */
@@ -206,7 +670,9 @@ static void cap_start_one(struct cap_iface *iface, const int promisc) {
    else
       verbosef("capturing in non-promiscuous mode");
 
-   cap_set_filter(iface->pcap, iface->filter);
+   filter = cap_make_filter(iface->filter, linktype);
+   cap_set_filter(iface->pcap, filter);
+   free(filter);
    iface->fd = pcap_fileno(iface->pcap);
 
    /* set non-blocking */
@@ -247,15 +713,38 @@ static void cap_start_one(struct cap_iface *iface, const int promisc) {
 
 void cap_start(const int promisc) {
    struct str *ifs = str_make();
+#ifdef linux
+   /* Fanout group ids are global, so don't collide with other processes. */
+   int fanout_group = (int)(getpid() & 0xffff);
+#endif
+   const unsigned int members = opt_xdp_queues ? opt_xdp_queues : opt_fanout;
 
    assert(STAILQ_EMPTY(&cap_ifs));
    if (STAILQ_EMPTY(&cli_ifnames))
       errx(1, "no interfaces specified");
+#ifndef linux
+   if (opt_ring_size)
+      errx(1, "--ring-size is only supported on Linux");
+   if (opt_fanout > 1)
+      errx(1, "--fanout is only supported on Linux");
+#endif
+#ifndef HAVE_AF_XDP
+   if (opt_xdp_queues)
+      errx(1, "--xdp-queues needs AF_XDP, from Linux 5.9 or later");
+#endif
+   if (opt_xdp_queues && (opt_ring_size || opt_fanout > 1))
+      errx(1, "--xdp-queues can't be combined with --ring-size or --fanout");
+
+   /* Before the rings are allocated, so they land on the node too.  With
+    * more than one interface, the first one decides.
+    */
+   if (opt_want_numa)
+      numa_bind_iface(STAILQ_FIRST(&cli_ifnames)->str);
 
    /* For each ifname */
    while (!STAILQ_EMPTY(&cli_ifnames)) {
       struct strnode *ifname, *filter = NULL;
-      struct cap_iface *iface = xmalloc(sizeof(*iface));
+      unsigned int i;
 
       ifname = STAILQ_FIRST(&cli_ifnames);
       STAILQ_REMOVE_HEAD(&cli_ifnames, entries);
@@ -265,22 +754,55 @@ void cap_start(const int promisc) {
          STAILQ_REMOVE_HEAD(&cli_filters, entries);
       }
 
-      iface->name = ifname->str;
-      iface->filter = (filter == NULL) ? NULL : filter->str;
-      iface->pcap = NULL;
-      iface->fd = -1;
-      iface->linkhdr = NULL;
-      localip_init(&iface->local_ips);
-      STAILQ_INSERT_TAIL(&cap_ifs, iface, entries);
-      cap_start_one(iface, promisc);
-
-      free(ifname);
-      if (filter) free(filter);
+      /* With --fanout or --xdp-queues, open the interface once per
+       * member.
+       */
+      for (i = 0; i < members; i++) {
+         struct cap_iface *iface = xmalloc(sizeof(*iface));
+
+         iface->name = ifname->str;
+         iface->filter = (filter == NULL) ? NULL : filter->str;
+         iface->pcap = NULL;
+         iface->ring = NULL;
+         iface->xdp = NULL;
+         iface->xdp_filter.bf_len = 0;
+         iface->xdp_filter.bf_insns = NULL;
+         iface->fd = -1;
+         iface->linkhdr = NULL;
+         localip_init(&iface->local_ips);
+         iface->batch_len = 0;
+         iface->active = NULL;
+         iface->failed = 0;
+         iface->shard_waits = 0;
+         iface->merge_lock = NULL;
+         iface->queue = NULL;
+         iface->queue_waits = 0;
+         iface->queue_woke = 0;
+         histogram_init(&iface->dispatch_nsec, HISTOGRAM_NSEC);
+         histogram_init(&iface->dispatch_pkts, HISTOGRAM_COUNT);
+         STAILQ_INSERT_TAIL(&cap_ifs, iface, entries);
+         cap_start_one(iface, i, promisc);
+         if (iface->fd != -1)
+            snapshot_fd_add(iface->fd);
+#ifdef linux
+         if (opt_fanout > 1)
+            cap_join_fanout(iface, fanout_group);
+#endif
+      }
+#ifdef linux
+      if (opt_fanout > 1)
+         verbosef("interface '%s' is spread across %u sockets "
+            "in fanout group %d", ifname->str, opt_fanout, fanout_group);
+      fanout_group++;
+#endif
 
       if (str_len(ifs) == 0)
-         str_append(ifs, iface->name);
+         str_append(ifs, ifname->str);
       else
-         str_appendf(ifs, ", %s", iface->name);
+         str_appendf(ifs, ", %s", ifname->str);
+
+      free(ifname);
+      if (filter) free(filter);
    }
    verbosef("all capture interfaces prepared");
 
@@ -300,41 +822,37 @@ void cap_start(const int promisc) {
    }
 }
 
-#ifdef linux
-# define _unused_on_linux_ _unused_
-# define _unused_otherwise_
-#else
-# define _unused_on_linux_
-# define _unused_otherwise_ _unused_
-#endif
-
-/*
- * Set pcap_fd in the given fd_set.
+/* Register the capture fds with the event loop, where they can be waited on.
+ * Returns how often to poll instead, in msec, or -1 if there's no need.
  */
-void cap_fd_set(fd_set *read_set _unused_on_linux_,
-                int *max_fd _unused_on_linux_,
-                struct timeval *timeout _unused_otherwise_,
-                int *need_timeout) {
-   assert(*need_timeout == 0); /* we're first to get a shot at the fd_set */
+int cap_event_init(void) {
+   struct cap_iface *iface;
+
+   if (cap_threads_running) {
+      if (cap_wake[0] != -1 &&
+          event_set(cap_wake[0], EVENT_READ, NULL, NULL) == -1)
+         errx(1, "can't wait on capture threads' pipe");
+      return CAP_TIMEOUT_MSEC; /* the threads read, we only wake to merge */
+   }
 
 #ifdef linux
-   /*
-    * Linux's BPF is immediate, so don't select() as it will lead to horrible
-    * performance.  Instead, use a timeout for buffering.
-    */
-   *need_timeout = 1;
-   timeout->tv_sec = 0;
-   timeout->tv_usec = CAP_TIMEOUT_MSEC * 1000;
-#else
-   {
-      struct cap_iface *iface;
-      STAILQ_FOREACH(iface, &cap_ifs, entries) {
-         /* We have a BSD-like BPF, we can select() on it. */
-         FD_SET(iface->fd, read_set);
-         *max_fd = MAX(*max_fd, iface->fd);
-      }
+   if (!opt_ring_size && !opt_xdp_queues) {
+      /*
+       * Linux's BPF is immediate, so don't wait on it as it will lead to
+       * horrible performance.  Instead, use a timeout for buffering.
+       */
+      return CAP_TIMEOUT_MSEC;
    }
+   /* The ring's socket is only readable once a block has been retired,
+    * and an AF_XDP socket once there's a packet on its RX ring.
+    */
 #endif
+   STAILQ_FOREACH(iface, &cap_ifs, entries) {
+      /* We have a BSD-like BPF, we can wait on it. */
+      if (event_set(iface->fd, EVENT_READ, NULL, NULL) == -1)
+         errx(1, "can't wait on capture fd %d", iface->fd);
+   }
+   return -1;
 }
 
 unsigned int cap_pkts_recv = 0, cap_pkts_drop = 0;
@@ -346,8 +864,26 @@ static void cap_stats_update(void) {
    cap_pkts_drop = 0;
    STAILQ_FOREACH(iface, &cap_ifs, entries) {
       struct pcap_stat ps;
-      if (pcap_stats(iface->pcap, &ps) != 0) {
-         warnx("pcap_stats('%s'): %s", iface->name, pcap_geterr(iface->pcap));
+      int ret;
+
+      if (cap_threads_running)
+         pthread_mutex_lock(&iface->lock);
+#ifdef HAVE_AF_XDP
+      if (iface->xdp != NULL)
+         ret = cap_xdp_stats(iface, &ps);
+      else
+#endif
+#ifdef linux
+      if (iface->ring != NULL)
+         ret = cap_ring_stats(iface, &ps);
+      else
+#endif
+         ret = pcap_stats(iface->pcap, &ps);
+      if (cap_threads_running)
+         pthread_mutex_unlock(&iface->lock);
+      if (ret != 0) {
+         warnx("pcap_stats('%s'): %s", iface->name,
+            iface->pcap ? pcap_geterr(iface->pcap) : strerror(errno));
          return;
       }
       cap_pkts_recv += ps.ps_recv;
@@ -379,54 +915,332 @@ static void hexdump(const u_char *buf,
    printf("\n");
 }
 
+/* Queue the batch, waiting for room if the main thread is behind.  This
+ * runs in the capture thread, inside cap_dispatch() and so under
+ * iface->lock.  The main thread takes that lock too, for /metrics, stats
+ * and around fork(), and it's the one that makes room, so the lock is let
+ * go while waiting.
+ */
+static void cap_queue_batch(struct cap_iface *iface) {
+   size_t done = 0;
+
+   for (;;) {
+      done += pktq_put(iface->queue, iface->batch + done,
+         iface->batch_len - done);
+      if (!iface->queue_woke &&
+          pktq_len(iface->queue) >= pktq_size(iface->queue) / 2) {
+         iface->queue_woke = 1;
+         /* The pipe is non-blocking, and full means a wakeup is due. */
+         if (write(cap_wake[1], "", 1) == -1 && errno != EAGAIN)
+            warn("write(wakeup pipe)");
+      }
+      if (done == iface->batch_len || !cap_threads_running)
+         break;
+      iface->queue_waits++;
+      pthread_mutex_unlock(&iface->lock);
+      (void)poll(NULL, 0, 1);
+      pthread_mutex_lock(&iface->lock);
+   }
+}
+
+/* The active shard is full, have it merged into hosts_db now rather than
+ * reduce it, which would lose traffic that's already been counted.  A file
+ * worker does that itself.  A capture thread wakes the main thread, which
+ * swaps in the other, empty, shard; iface->lock is let go meanwhile, as in
+ * cap_queue_batch().
+ */
+static void cap_shard_full(struct cap_iface *iface) {
+   const struct acct_shard *full = iface->active;
+
+   if (iface->merge_lock != NULL) {
+      pthread_mutex_lock(iface->merge_lock);
+      acct_shard_merge(iface->active);
+      pthread_mutex_unlock(iface->merge_lock);
+      return;
+   }
+   iface->shard_waits++;
+   if (write(cap_wake[1], "", 1) == -1 && errno != EAGAIN)
+      warn("write(wakeup pipe)");
+   while (iface->active == full && cap_threads_running) {
+      pthread_mutex_unlock(&iface->lock);
+      (void)poll(NULL, 0, 1);
+      pthread_mutex_lock(&iface->lock);
+   }
+}
+
+/* Account for the batch of decoded packets. */
+static void cap_flush(struct cap_iface *iface) {
+   if (iface->queue != NULL)
+      cap_queue_batch(iface);
+   else {
+      if (iface->active != NULL && acct_shard_full(iface->active))
+         cap_shard_full(iface);
+      acct_for_batch(iface->batch, iface->batch_len,
+         &iface->local_ips, iface->active);
+   }
+   iface->batch_len = 0;
+}
+
+/* With --replay, each pass over the file moves its hosts somewhere new, so
+ * that a short capture can stand in for a network with many more hosts.
+ * Pass zero leaves the addresses alone.
+ */
+static void cap_rewrite_addr(struct addr *a, const unsigned int pass) {
+   uint8_t *b;
+
+   if (a->family == IPv4)
+      b = (uint8_t *)&(a->ip.v4) + 1;
+   else
+      b = a->ip.v6.s6_addr + 6;
+   b[0] ^= (uint8_t)(pass >> 8);
+   b[1] ^= (uint8_t)pass;
+}
+
+/* Decode one packet into batch[*len], folding it into one of the last few
+ * packets if it's from the same flow.
+ */
+static void cap_decode(const struct cap_iface * const iface,
+                       const struct pcap_pkthdr *pheader,
+                       const u_char *pdata,
+                       struct pktsummary *batch,
+                       size_t *len) {
+   struct pktsummary *sm = &(batch[*len]);
+   size_t i;
+
+   if (opt_want_hexdump)
+      hexdump(pdata, pheader->caplen, iface->linkhdr);
+   if (iface->linkhdr->linktype != DLT_EN10MB ||
+       !decode_ether_fast(pheader, pdata, sm)) {
+      memset(sm, 0, sizeof(*sm));
+      if (!iface->linkhdr->decoder(pheader, pdata, sm))
+         return;
+   }
+   sm->packets = 1;
+   if (iface->rewrite != 0) {
+      cap_rewrite_addr(&(sm->src), iface->rewrite);
+      cap_rewrite_addr(&(sm->dst), iface->rewrite);
+   }
+   for (i = *len; i > 0 && *len - i < CAP_COALESCE; i--)
+      if (acct_coalesce(&(batch[i - 1]), sm))
+         return;
+   (*len)++;
+}
+
 /* Callback function for pcap_dispatch() which chains to the decoder specified
  * in the linkhdr struct.
  */
 static void callback(u_char *user,
                      const struct pcap_pkthdr *pheader,
                      const u_char *pdata) {
-   const struct cap_iface * const iface = (struct cap_iface *)user;
-   struct pktsummary sm;
+   struct cap_iface * const iface = (struct cap_iface *)user;
 
-   if (opt_want_hexdump)
-      hexdump(pdata, pheader->caplen, iface->linkhdr);
-   memset(&sm, 0, sizeof(sm));
-   sm.packets = 1;
-   if (iface->linkhdr->decoder(pheader, pdata, &sm))
-      acct_for(&sm, &iface->local_ips);
+   if (iface->batch_len == CAP_BATCH)
+      cap_flush(iface);
+   cap_decode(iface, pheader, pdata, iface->batch, &(iface->batch_len));
+}
+
+/* Read whatever is waiting on the interface.
+ * Returns the number of packets handled, or -1 on error.
+ */
+static int cap_dispatch(struct cap_iface *iface) {
+   int ret;
+
+#ifdef HAVE_AF_XDP
+   if (iface->xdp != NULL)
+      ret = xdp_dispatch(iface->xdp, cap_xdp_packet, iface);
+   else
+#endif
+#ifdef linux
+   if (iface->ring != NULL)
+      ret = cap_ring_dispatch(iface);
+   else
+#endif
+   ret = pcap_dispatch(
+         iface->pcap,
+         -1, /* count = entire buffer */
+         callback,
+         (u_char*)iface); /* user = struct to pass to callback */
+   cap_flush(iface);
+   return ret;
+}
+
+static void cap_check_addrs(const struct cap_iface *iface) {
+   static int told = 0;
+
+   if (!told && iface->local_ips.num_addrs == 0) {
+      verbosef("interface '%s' has no addresses, "
+               "your graphs will be blank",
+               iface->name);
+      verbosef("please read the darkstat manpage, "
+               "and consider using the -l option");
+      told = 1;
+   }
+}
+
+/* cap_dispatch(), recording how it went for /metrics. */
+static int cap_dispatch_timed(struct cap_iface *iface) {
+   struct timespec t;
+   int ret;
+
+   timer_start(&t);
+   ret = cap_dispatch(iface);
+   if (ret > 0) {
+      histogram_add(&iface->dispatch_nsec, (uint64_t)timer_nsec(&t));
+      histogram_add(&iface->dispatch_pkts, (uint64_t)ret);
+   }
+   return ret;
+}
+
+/* Body of a capture thread: read and account for packets into the
+ * interface's active shard until cap_stop().
+ */
+static void *cap_thread(void *arg) {
+   struct cap_iface *iface = arg;
+   struct pollfd pfd;
+
+   pfd.fd = iface->fd;
+   pfd.events = POLLIN;
+   while (cap_threads_running) {
+      int ret;
+
+      if (iface->queue == NULL) {
+         /* Otherwise, they're the main thread's, for accounting. */
+         localip_update(iface->name, &iface->local_ips);
+         cap_check_addrs(iface);
+      }
+
+      pthread_mutex_lock(&iface->lock);
+      ret = cap_dispatch_timed(iface);
+      pthread_mutex_unlock(&iface->lock);
+
+      if (ret < 0) {
+         warnx("pcap_dispatch('%s'): %s",
+            iface->name, pcap_geterr(iface->pcap));
+         iface->failed = 1;
+         break;
+      }
+      if (ret == 0 && poll(&pfd, 1, CAP_TIMEOUT_MSEC) == -1 &&
+          errno != EINTR) {
+         warn("poll('%s')", iface->name);
+         iface->failed = 1;
+         break;
+      }
+   }
+   return NULL;
+}
+
+/* Hold every interface's lock across fork(), so a snapshot child doesn't
+ * start with one held by a capture thread it doesn't have.
+ */
+static void cap_fork_lock(void) {
+   struct cap_iface *iface;
+
+   if (cap_threads_running)
+      STAILQ_FOREACH(iface, &cap_ifs, entries)
+         pthread_mutex_lock(&iface->lock);
+}
+
+static void cap_fork_unlock(void) {
+   struct cap_iface *iface;
+
+   if (cap_threads_running)
+      STAILQ_FOREACH(iface, &cap_ifs, entries)
+         pthread_mutex_unlock(&iface->lock);
+}
+
+/* Start one capture thread per interface, if --threads was given. */
+void cap_start_threads(void) {
+   struct cap_iface *iface;
+   int ret;
+
+   if (!opt_capture_threads)
+      return;
+   cap_threads_running = 1;
+   if (pipe(cap_wake) == -1)
+      err(1, "pipe");
+   fd_set_nonblock(cap_wake[0]);
+   fd_set_nonblock(cap_wake[1]);
+   STAILQ_FOREACH(iface, &cap_ifs, entries) {
+      acct_shard_init(&iface->shards[0]);
+      acct_shard_init(&iface->shards[1]);
+      iface->active = &iface->shards[0];
+      if (opt_queue_size)
+         iface->queue = pktq_make(opt_queue_size);
+      if ((ret = pthread_mutex_init(&iface->lock, NULL)) != 0)
+         errx(1, "pthread_mutex_init(): %s", strerror(ret));
+      if ((ret = pthread_create(&iface->thread, NULL, cap_thread, iface)) != 0)
+         errx(1, "pthread_create(): %s", strerror(ret));
+      verbosef("started capture thread for interface '%s'", iface->name);
+   }
+   if ((ret = pthread_atfork(cap_fork_lock, cap_fork_unlock,
+                             cap_fork_unlock)) != 0)
+      errx(1, "pthread_atfork(): %s", strerror(ret));
+}
+
+/* Account for everything in the interface's queue. */
+static void cap_drain_queue(struct cap_iface *iface) {
+   struct pktsummary sms[CAP_BATCH];
+   size_t n;
+
+   while ((n = pktq_get(iface->queue, sms, CAP_BATCH)) > 0)
+      acct_for_batch(sms, n, &iface->local_ips, NULL);
+   iface->queue_woke = 0;
+}
+
+/* Swap the interface's active shard, and merge the previous one. */
+static void cap_merge_one(struct cap_iface *iface) {
+   struct acct_shard *full;
+
+   pthread_mutex_lock(&iface->lock);
+   full = iface->active;
+   iface->active = (full == &iface->shards[0]) ? &iface->shards[1]
+                                               : &iface->shards[0];
+   pthread_mutex_unlock(&iface->lock);
+   acct_shard_merge(full);
 }
 
 /* Process any packets currently in the capture buffer.
  * Returns 0 on error (usually means the interface went down).
  */
-int cap_poll(fd_set *read_set _unused_on_linux_) {
+int cap_poll(void) {
    struct cap_iface *iface;
-   static int told = 0;
+
+   if (cap_threads_running) {
+      int ok = 1;
+
+      if (cap_wake[0] != -1) {
+         char buf[64];
+
+         while (read(cap_wake[0], buf, sizeof(buf)) > 0)
+            ;
+      }
+      STAILQ_FOREACH(iface, &cap_ifs, entries) {
+         if (iface->queue != NULL) {
+            localip_update(iface->name, &iface->local_ips);
+            cap_check_addrs(iface);
+            cap_drain_queue(iface);
+         } else
+            cap_merge_one(iface);
+         if (iface->failed)
+            ok = 0;
+      }
+      cap_stats_update();
+      return ok;
+   }
 
    STAILQ_FOREACH(iface, &cap_ifs, entries) {
       /* Once per capture poll, check our IP address.  It's used in accounting
        * for traffic graphs.
        */
       localip_update(iface->name, &iface->local_ips);
-      if (!told && iface->local_ips.num_addrs == 0) {
-         verbosef("interface '%s' has no addresses, "
-                  "your graphs will be blank",
-                  iface->name);
-         verbosef("please read the darkstat manpage, "
-                  "and consider using the -l option");
-         told = 1;
-      }
+      cap_check_addrs(iface);
 
       for (;;) {
          struct timespec t;
          int ret;
 
          timer_start(&t);
-         ret = pcap_dispatch(
-               iface->pcap,
-               -1, /* count = entire buffer */
-               callback,
-               (u_char*)iface); /* user = struct to pass to callback */
+         ret = cap_dispatch_timed(iface);
          timer_stop(&t,
                     2 * CAP_TIMEOUT_MSEC * 1000000,
                     "pcap_dispatch took too long");
@@ -455,15 +1269,111 @@ int cap_poll(fd_set *read_set _unused_on_linux_) {
    return 1;
 }
 
+void cap_metrics(struct str *buf) {
+   struct histogram nsec = HISTOGRAM_INIT(HISTOGRAM_NSEC);
+   struct histogram pkts = HISTOGRAM_INIT(HISTOGRAM_COUNT);
+   struct cap_iface *iface;
+
+   STAILQ_FOREACH(iface, &cap_ifs, entries) {
+      if (cap_threads_running)
+         pthread_mutex_lock(&iface->lock);
+      histogram_merge(&nsec, &iface->dispatch_nsec);
+      histogram_merge(&pkts, &iface->dispatch_pkts);
+      if (cap_threads_running)
+         pthread_mutex_unlock(&iface->lock);
+   }
+   metrics_header(buf, "darkstat_capture_dispatch_seconds", "histogram",
+      "Time taken to account for each batch of captured packets.");
+   metrics_histogram(buf, "darkstat_capture_dispatch_seconds", NULL, &nsec);
+   metrics_header(buf, "darkstat_capture_dispatch_packets", "histogram",
+      "Packets in each batch of captured packets.");
+   metrics_histogram(buf, "darkstat_capture_dispatch_packets", NULL, &pkts);
+   metrics_header(buf, "darkstat_capture_packets_received_total", "counter",
+      "Packets received by the capture interfaces, according to the OS.");
+   str_appendf(buf, "darkstat_capture_packets_received_total %u\n",
+      cap_pkts_recv);
+   metrics_header(buf, "darkstat_capture_packets_dropped_total", "counter",
+      "Packets dropped before darkstat could read them.");
+   str_appendf(buf, "darkstat_capture_packets_dropped_total %u\n",
+      cap_pkts_drop);
+
+   if (cap_threads_running && !opt_queue_size) {
+      uint64_t waits = 0;
+
+      STAILQ_FOREACH(iface, &cap_ifs, entries)
+         waits += iface->shard_waits;
+      metrics_header(buf, "darkstat_capture_shard_waits_total", "counter",
+         "Times a capture thread filled its hosts shard, and had to wait.");
+      str_appendf(buf, "darkstat_capture_shard_waits_total %qu\n",
+         (qu)waits);
+   }
+   if (opt_queue_size && cap_wake[0] != -1) {
+      uint64_t queued = 0, waits = 0;
+
+      STAILQ_FOREACH(iface, &cap_ifs, entries)
+         if (iface->queue != NULL) {
+            queued += pktq_len(iface->queue);
+            waits += iface->queue_waits;
+         }
+      metrics_header(buf, "darkstat_capture_queue_packets", "gauge",
+         "Packets decoded by capture threads and waiting to be accounted.");
+      str_appendf(buf, "darkstat_capture_queue_packets %qu\n", (qu)queued);
+      metrics_header(buf, "darkstat_capture_queue_waits_total", "counter",
+         "Times a capture thread found its queue full, and had to wait.");
+      str_appendf(buf, "darkstat_capture_queue_waits_total %qu\n",
+         (qu)waits);
+   }
+}
+
 void cap_stop(void) {
+   if (cap_threads_running) {
+      struct cap_iface *iface;
+
+      cap_threads_running = 0;
+      STAILQ_FOREACH(iface, &cap_ifs, entries) {
+         pthread_join(iface->thread, NULL);
+         pthread_mutex_destroy(&iface->lock);
+         if (iface->queue != NULL) {
+            cap_drain_queue(iface);
+            pktq_free(iface->queue);
+            iface->queue = NULL;
+         }
+         acct_shard_merge(&iface->shards[0]);
+         acct_shard_merge(&iface->shards[1]);
+         acct_shard_free(&iface->shards[0]);
+         acct_shard_free(&iface->shards[1]);
+         iface->active = NULL;
+      }
+   }
+
    while (!STAILQ_EMPTY(&cap_ifs)) {
       struct cap_iface *iface = STAILQ_FIRST(&cap_ifs);
 
       STAILQ_REMOVE_HEAD(&cap_ifs, entries);
-      pcap_close(iface->pcap);
+      if (iface->fd != -1) {
+         event_set(iface->fd, 0, NULL, NULL);
+         snapshot_fd_remove(iface->fd);
+      }
+#ifdef HAVE_AF_XDP
+      if (iface->xdp != NULL)
+         cap_xdp_stop(iface);
+      else
+#endif
+#ifdef linux
+      if (iface->ring != NULL)
+         cap_ring_stop(iface);
+      else
+#endif
+         pcap_close(iface->pcap);
       localip_free(&iface->local_ips);
       free(iface);
    }
+   if (cap_wake[0] != -1) {
+      event_set(cap_wake[0], 0, NULL, NULL);
+      close(cap_wake[0]);
+      close(cap_wake[1]);
+      cap_wake[0] = cap_wake[1] = -1;
+   }
    free(title_interfaces);
    title_interfaces = NULL;
 }
@@ -486,57 +1396,348 @@ void cap_free_args(void) {
 }
 
 /* Run through entire capfile. */
-void cap_from_file(const char *capfile) {
+static void cap_open_file(struct cap_iface *iface, const char *capfile) {
    char errbuf[PCAP_ERRBUF_SIZE];
-   int linktype, ret;
-   struct cap_iface iface;
-
-   iface.name = NULL;
-   iface.filter = NULL;
-   iface.pcap = NULL;
-   iface.fd = -1;
-   iface.linkhdr = NULL;
-   localip_init(&iface.local_ips);
-
-   /* Process cmdline filters. */
-   if (!STAILQ_EMPTY(&cli_filters))
-      iface.filter = STAILQ_FIRST(&cli_filters)->str;
-   while (!STAILQ_EMPTY(&cli_filters)) {
-      struct strnode *n = STAILQ_FIRST(&cli_filters);
-      STAILQ_REMOVE_HEAD(&cli_filters, entries);
-      free(n);
-   }
+   int linktype;
 
    /* Open packet capture descriptor. */
    errbuf[0] = '\0'; /* zero length string */
-   iface.pcap = pcap_open_offline(capfile, errbuf);
+   iface->pcap = pcap_open_offline(capfile, errbuf);
 
-   if (iface.pcap == NULL)
+   if (iface->pcap == NULL)
       errx(1, "pcap_open_offline(): %s", errbuf);
 
    if (errbuf[0] != '\0') /* not zero length anymore -> warning */
       warnx("pcap_open_offline() warning: %s", errbuf);
 
    /* Work out the linktype. */
-   linktype = pcap_datalink(iface.pcap);
-   iface.linkhdr = getlinkhdr(linktype);
-   if (iface.linkhdr == NULL)
+   linktype = pcap_datalink(iface->pcap);
+   iface->linkhdr = getlinkhdr(linktype);
+   if (iface->linkhdr == NULL)
       errx(1, "unknown linktype %d", linktype);
 
-   cap_set_filter(iface.pcap, iface.filter);
+   cap_set_filter(iface->pcap, iface->filter);
+}
 
-   /* Process file. */
-   ret = pcap_dispatch(
-         iface.pcap,
+static void cap_file_dispatch(struct cap_iface *iface) {
+   int ret = pcap_dispatch(
+         iface->pcap,
          -1,               /* count, -1 = entire buffer */
          callback,
-         (u_char*)&iface); /* user */
+         (u_char*)iface);  /* user */
+   cap_flush(iface);
 
    if (ret < 0)
-      errx(1, "pcap_dispatch(): %s", pcap_geterr(iface.pcap));
+      errx(1, "pcap_dispatch(): %s", pcap_geterr(iface->pcap));
+}
+
+/* With --timing, the file is read in chunks, and each chunk is read in,
+ * decoded, and accounted for in turn, so that each phase can be timed on its
+ * own without reading the clock for every packet.
+ */
+#define CAP_TIMING_CHUNK 4096
+
+static void cap_file_timed(struct cap_iface *iface,
+                           struct cap_timing *timing) {
+   struct pcap_pkthdr *hdrs = xmalloc(CAP_TIMING_CHUNK * sizeof(*hdrs));
+   size_t *offs = xmalloc(CAP_TIMING_CHUNK * sizeof(*offs));
+   struct pktsummary *sms = xmalloc(CAP_TIMING_CHUNK * sizeof(*sms));
+   u_char *data = NULL;
+   size_t data_size = 0;
+   int done = 0;
+
+   while (!done) {
+      struct timespec t;
+      size_t n = 0, used = 0, nsm = 0, i;
+
+      timer_start(&t);
+      while (n < CAP_TIMING_CHUNK) {
+         struct pcap_pkthdr *h;
+         const u_char *d;
+         int ret = pcap_next_ex(iface->pcap, &h, &d);
+
+         if (ret == -2) {
+            done = 1; /* end of file */
+            break;
+         }
+         if (ret < 0)
+            errx(1, "pcap_next_ex(): %s", pcap_geterr(iface->pcap));
+         if (ret == 0)
+            continue;
+         if (used + h->caplen > data_size) {
+            data_size = (used + h->caplen) * 2;
+            data = xrealloc(data, data_size);
+         }
+         memcpy(data + used, d, h->caplen);
+         hdrs[n] = *h;
+         offs[n] = used;
+         used += h->caplen;
+         n++;
+      }
+      timing->capture_nsec += timer_nsec(&t);
+      timing->packets += n;
+
+      timer_start(&t);
+      for (i = 0; i < n; i++)
+         cap_decode(iface, &(hdrs[i]), data + offs[i], sms, &nsm);
+      timing->decode_nsec += timer_nsec(&t);
+
+      timer_start(&t);
+      for (i = 0; i < nsm; i += CAP_BATCH)
+         acct_for_batch(sms + i, (nsm - i < CAP_BATCH) ? nsm - i : CAP_BATCH,
+                        &iface->local_ips, NULL);
+      timing->acct_nsec += timer_nsec(&t);
+   }
+   free(data);
+   free(sms);
+   free(offs);
+   free(hdrs);
+}
+
+/* ---------------------------------------------------------------------------
+ * Reading a capture file with --threads.  The file is mapped into memory, and
+ * workers take turns claiming the next few megabytes of whole records from
+ * it.  Each worker decodes and accounts for its chunk into a private shard,
+ * then folds the shard into hosts_db, one worker at a time.
+ */
+#define CAP_FILE_CHUNK (4 * 1024 * 1024)
+#define CAP_FILE_MAX_WORKERS 64
+
+#define PCAP_MAGIC 0xa1b2c3d4
+#define PCAP_MAGIC_NSEC 0xa1b23c4d
+#define PCAP_FILE_HDRLEN 24
+#define PCAP_REC_HDRLEN 16
+
+struct cap_file {
+   const char *name;
+   const uint8_t *map;
+   size_t size;
+   int swapped, nsec;
+   const struct bpf_program *filter; /* NULL for none */
+
+   pthread_mutex_t claim_lock; /* guards pos */
+   size_t pos; /* start of the first record not yet claimed */
+
+   pthread_mutex_t merge_lock; /* guards hosts_db and the graphs */
+};
+
+struct cap_worker {
+   pthread_t thread;
+   struct cap_file *file;
+   struct cap_iface iface; /* a private batch, accounting into shard */
+   struct acct_shard shard;
+   uint64_t packets;
+};
+
+static uint32_t cap_file_u32(const struct cap_file *f, const uint8_t *p) {
+   uint32_t v;
 
+   memcpy(&v, p, sizeof(v));
+   if (f->swapped)
+      v = (v >> 24) | ((v >> 8) & 0xff00) | ((v << 8) & 0xff0000) | (v << 24);
+   return v;
+}
+
+/* Claim the next chunk of whole records, as [*start, *end).
+ * Returns 0 once the file is used up.
+ */
+static int cap_file_claim(struct cap_file *f, size_t *start, size_t *end) {
+   size_t pos;
+
+   pthread_mutex_lock(&f->claim_lock);
+   *start = pos = f->pos;
+   while (f->size - pos >= PCAP_REC_HDRLEN && pos - *start < CAP_FILE_CHUNK) {
+      const uint32_t caplen = cap_file_u32(f, f->map + pos + 8);
+
+      if (caplen > f->size - pos - PCAP_REC_HDRLEN) {
+         warnx("%s: last packet is truncated, ignoring it", f->name);
+         f->size = pos;
+         break;
+      }
+      pos += PCAP_REC_HDRLEN + caplen;
+   }
+   f->pos = *end = pos;
+   pthread_mutex_unlock(&f->claim_lock);
+   return (*end > *start);
+}
+
+static void *cap_file_worker(void *arg) {
+   struct cap_worker *w = arg;
+   struct cap_file *f = w->file;
+   size_t pos, end;
+
+   while (cap_file_claim(f, &pos, &end)) {
+      while (pos < end) {
+         const uint8_t *rec = f->map + pos;
+         struct pcap_pkthdr ph;
+
+         ph.ts.tv_sec = cap_file_u32(f, rec);
+         ph.ts.tv_usec = cap_file_u32(f, rec + 4);
+         if (f->nsec)
+            ph.ts.tv_usec /= 1000;
+         ph.caplen = cap_file_u32(f, rec + 8);
+         ph.len = cap_file_u32(f, rec + 12);
+         pos += PCAP_REC_HDRLEN + ph.caplen;
+         if (f->filter != NULL &&
+             !pcap_offline_filter(f->filter, &ph, rec + PCAP_REC_HDRLEN))
+            continue;
+         w->packets++;
+         callback((u_char *)&w->iface, &ph, rec + PCAP_REC_HDRLEN);
+      }
+      cap_flush(&w->iface);
+      pthread_mutex_lock(&f->merge_lock);
+      acct_shard_merge(&w->shard);
+      pthread_mutex_unlock(&f->merge_lock);
+   }
+   return NULL;
+}
+
+/* Read the already opened file with a worker per CPU.  Returns 0 if there's
+ * only one CPU, or it isn't a file we can map, e.g. pcapng, to read it through
+ * libpcap instead.
+ */
+static int cap_file_threaded(struct cap_iface *iface, const char *capfile,
+                             struct cap_timing *timing) {
+   struct cap_file f;
+   struct cap_worker *workers;
+   struct bpf_program prog;
+   struct stat st;
+   uint32_t magic;
+   long nworkers;
+   void *map;
+   int fd, i, ret;
+
+   nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+   if (nworkers < 2)
+      return 0; /* no faster than reading it here */
+   if (nworkers > CAP_FILE_MAX_WORKERS)
+      nworkers = CAP_FILE_MAX_WORKERS;
+
+   if ((fd = open(capfile, O_RDONLY)) == -1)
+      return 0;
+   if (fstat(fd, &st) == -1 || st.st_size < PCAP_FILE_HDRLEN ||
+       (map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE,
+                   fd, 0)) == MAP_FAILED) {
+      close(fd);
+      return 0;
+   }
+   close(fd);
+
+   f.name = capfile;
+   f.map = map;
+   f.size = (size_t)st.st_size;
+   memcpy(&magic, f.map, sizeof(magic));
+   f.swapped = (magic != PCAP_MAGIC && magic != PCAP_MAGIC_NSEC);
+   f.nsec = 0;
+   magic = cap_file_u32(&f, f.map);
+   if (magic != PCAP_MAGIC && magic != PCAP_MAGIC_NSEC) {
+      verbosef("%s isn't a classic pcap file, reading it in one thread",
+               capfile);
+      munmap(map, f.size);
+      return 0;
+   }
+   f.nsec = (magic == PCAP_MAGIC_NSEC);
+#ifdef MADV_SEQUENTIAL
+   madvise(map, f.size, MADV_SEQUENTIAL);
+#endif
+
+   f.filter = NULL;
+   if (iface->filter != NULL) {
+      char *tmp_filter = xstrdup(iface->filter);
+
+      if (pcap_compile(iface->pcap, &prog, tmp_filter, 1, 0) == -1)
+         errx(1, "pcap_compile(): %s", pcap_geterr(iface->pcap));
+      free(tmp_filter);
+      f.filter = &prog;
+   }
+   f.pos = PCAP_FILE_HDRLEN;
+   if ((ret = pthread_mutex_init(&f.claim_lock, NULL)) != 0 ||
+       (ret = pthread_mutex_init(&f.merge_lock, NULL)) != 0)
+      errx(1, "pthread_mutex_init(): %s", strerror(ret));
+
+   verbosef("reading %s with %ld threads", capfile, nworkers);
+
+   workers = xcalloc((size_t)nworkers, sizeof(*workers));
+   for (i = 0; i < nworkers; i++) {
+      struct cap_worker *w = &workers[i];
+
+      w->file = &f;
+      w->iface = *iface;
+      w->iface.batch_len = 0;
+      acct_shard_init(&w->shard);
+      w->iface.active = &w->shard;
+      w->iface.merge_lock = &f.merge_lock;
+      if ((ret = pthread_create(&w->thread, NULL, cap_file_worker, w)) != 0)
+         errx(1, "pthread_create(): %s", strerror(ret));
+   }
+   for (i = 0; i < nworkers; i++) {
+      struct cap_worker *w = &workers[i];
+
+      pthread_join(w->thread, NULL);
+      acct_shard_free(&w->shard);
+      if (timing != NULL)
+         timing->packets += w->packets;
+   }
+   if (timing != NULL)
+      timing->threads = (unsigned int)nworkers;
+   free(workers);
+
+   pthread_mutex_destroy(&f.claim_lock);
+   pthread_mutex_destroy(&f.merge_lock);
+   if (f.filter != NULL)
+      pcap_freecode(&prog);
+   munmap(map, (size_t)st.st_size);
+   return 1;
+}
+
+void cap_from_file(const char *capfile, const unsigned int replay,
+                   struct cap_timing *timing) {
+   struct cap_iface iface;
+   unsigned int pass;
+
+   iface.name = NULL;
+   iface.filter = NULL;
+   iface.pcap = NULL;
+   iface.ring = NULL;
+   iface.xdp = NULL;
+   iface.xdp_filter.bf_len = 0;
+   iface.xdp_filter.bf_insns = NULL;
+   iface.fd = -1;
+   iface.linkhdr = NULL;
+   localip_init(&iface.local_ips);
+   iface.batch_len = 0;
+   iface.rewrite = 0;
+   iface.active = NULL;
+   iface.failed = 0;
+   iface.shard_waits = 0;
+   iface.merge_lock = NULL;
+   iface.queue = NULL;
+
+   /* Process cmdline filters. */
+   if (!STAILQ_EMPTY(&cli_filters))
+      iface.filter = STAILQ_FIRST(&cli_filters)->str;
+   while (!STAILQ_EMPTY(&cli_filters)) {
+      struct strnode *n = STAILQ_FIRST(&cli_filters);
+      STAILQ_REMOVE_HEAD(&cli_filters, entries);
+      free(n);
+   }
+
+   for (pass = 0; pass < replay; pass++) {
+      cap_open_file(&iface, capfile);
+      iface.rewrite = pass;
+
+      /* Process file. */
+      if (!opt_capture_threads ||
+          !cap_file_threaded(&iface, capfile, timing)) {
+         if (timing != NULL)
+            cap_file_timed(&iface, timing);
+         else
+            cap_file_dispatch(&iface);
+      }
+      pcap_close(iface.pcap);
+      iface.pcap = NULL;
+   }
    localip_free(&iface.local_ips);
-   pcap_close(iface.pcap);
 }
 
 /* vim:set ts=3 sw=3 tw=78 expandtab: */
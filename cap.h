@@ -3,22 +3,38 @@
  *
  * cap.h: interface to libpcap.
  */
+#ifndef __DARKSTAT_CAP_H
+#define __DARKSTAT_CAP_H
 
-#include <sys/types.h> /* OpenBSD needs this before select */
+#include <sys/types.h>
 #include <sys/time.h> /* FreeBSD 4 needs this for struct timeval */
-#include <sys/select.h>
+#include <stdint.h>
 
 extern unsigned int cap_pkts_recv, cap_pkts_drop;
 
 void cap_add_ifname(const char *ifname); /* call one or more times */
 void cap_add_filter(const char *filter); /* call zero or more times */
 void cap_start(const int promisc);
-void cap_fd_set(fd_set *read_set, int *max_fd,
-   struct timeval *timeout, int *need_timeout);
-int cap_poll(fd_set *read_set);
+void cap_start_threads(void);
+int cap_event_init(void);
+int cap_poll(void);
 void cap_stop(void);
+struct str;
+void cap_metrics(struct str *buf); /* for /metrics */
 void cap_free_args(void);
 
-void cap_from_file(const char *capfile);
+/* Where the time went while reading a file, with -r --timing. */
+struct cap_timing {
+   uint64_t packets;
+   int64_t capture_nsec, decode_nsec, acct_nsec;
+   unsigned int threads; /* with --threads, phases aren't timed */
+};
 
+/* Account for the packets in capfile, reading it replay times.  If timing
+ * isn't NULL, each phase is timed into it.
+ */
+void cap_from_file(const char *capfile, const unsigned int replay,
+                   struct cap_timing *timing);
+
+#endif /* __DARKSTAT_CAP_H */
 /* vim:set ts=3 sw=3 tw=78 expandtab: */
@@ -11,10 +11,12 @@
 # define _noreturn_ __attribute__((__noreturn__))
 # define _printflike_(fmtarg, firstvararg) \
    __attribute__((__format__ (__printf__, fmtarg, firstvararg) ))
+# define PREFETCH(addr) __builtin_prefetch(addr)
 #else
 # define _unused_
 # define _noreturn_
 # define _printflike_(fmtarg, firstvararg)
+# define PREFETCH(addr) ((void)(addr))
 #endif
 
 #ifndef MAX
@@ -16,25 +16,34 @@
 #include "db.h"
 #include "dns.h"
 #include "err.h"
+#include "event.h"
+#include "flow.h"
 #include "hosts_db.h"
 #include "http.h"
 #include "localip.h"
+#include "names.h"
 #include "ncache.h"
 #include "now.h"
+#include "opt.h"
 #include "pidfile.h"
+#include "sensor.h"
+#include "snapshot.h"
 #include "str.h"
 #ifdef __OpenBSD__
 #include "pf.h"
 #endif
 
+#include <sys/resource.h> /* for getrusage() */
 #include <assert.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <time.h>
 #include <unistd.h>
 #include <pcap.h>
 
@@ -76,6 +85,16 @@ static int opt_pf_seen = 0;
 static void cb_pf(const char *arg) {
    opt_pf_seen = 1;
 }
+
+static void cb_pf_states(const char *arg)
+{ opt_pf_cache_max = (unsigned int)parsenum(arg, INT_MAX / 2); }
+
+static void cb_pf_interval(const char *arg)
+{
+   opt_pf_interval = (unsigned int)parsenum(arg, 60000);
+   if (opt_pf_interval == 0)
+      errx(1, "--pf-interval must be at least 1 msec");
+}
 #endif
 
 static int opt_iface_seen = 0;
@@ -89,17 +108,26 @@ static void cb_filter(const char *arg) { cap_add_filter(arg); }
 static const char *opt_capfile = NULL;
 static void cb_capfile(const char *arg) { opt_capfile = arg; }
 
-int opt_want_snaplen = -1;
+static const char *opt_flow = NULL;
+static void cb_flow(const char *arg) { opt_flow = arg; }
+
+static int opt_want_timing = 0;
+static void cb_timing(const char *arg _unused_) { opt_want_timing = 1; }
+
+static unsigned int opt_replay = 1;
+static void cb_replay(const char *arg)
+{
+   if ((opt_replay = parsenum(arg, 65536)) == 0)
+      errx(1, "--replay must be at least 1");
+}
+
 static void cb_snaplen(const char *arg)
 { opt_want_snaplen = (int)parsenum(arg, 0); }
 
-int opt_want_pppoe = 0;
 static void cb_pppoe(const char *arg _unused_) { opt_want_pppoe = 1; }
 
-int opt_want_syslog = 0;
 static void cb_syslog(const char *arg _unused_) { opt_want_syslog = 1; }
 
-int opt_want_verbose = 0;
 static void cb_verbose(const char *arg _unused_) { opt_want_verbose = 1; }
 
 static int opt_want_daemonize = 1;
@@ -111,12 +139,25 @@ static void cb_no_promisc(const char *arg _unused_) { opt_want_promisc = 0; }
 static int opt_want_dns = 1;
 static void cb_no_dns(const char *arg _unused_) { opt_want_dns = 0; }
 
-int opt_want_macs = 1;
+static void cb_dns_workers(const char *arg)
+{
+   opt_dns_workers = (unsigned int)parsenum(arg, 64);
+   if (opt_dns_workers == 0)
+      errx(1, "--dns-workers must be at least 1");
+}
+
+static void cb_dns_timeout(const char *arg)
+{ opt_dns_timeout = (unsigned int)parsenum(arg, 30); }
+
+static void cb_dns_cache(const char *arg)
+{ opt_dns_cache = (unsigned int)parsenum(arg, 0); }
+
 static void cb_no_macs(const char *arg _unused_) { opt_want_macs = 0; }
 
-int opt_want_lastseen = 1;
 static void cb_no_lastseen(const char *arg _unused_) { opt_want_lastseen = 0; }
 
+static void cb_no_peers(const char *arg _unused_) { opt_want_peers = 0; }
+
 static unsigned short opt_bindport = 667;
 static void cb_port(const char *arg)
 { opt_bindport = (unsigned short)parsenum(arg, 65536); }
@@ -130,7 +171,6 @@ static void cb_local(const char *arg)
    is_localnet_specified = 1;
 }
 
-int opt_want_local_only = 0;
 static void cb_local_only(const char *arg _unused_)
 { opt_want_local_only = 1; }
 
@@ -140,46 +180,123 @@ static void cb_chroot(const char *arg) { opt_chroot_dir = arg; }
 static const char *opt_base = NULL;
 static void cb_base(const char *arg) { opt_base = arg; }
 
+static void cb_gzip_level(const char *arg)
+{ http_set_gzip_level((int)parsenum(arg, 9)); }
+
 static const char *opt_privdrop_user = NULL;
 static void cb_user(const char *arg) { opt_privdrop_user = arg; }
 
 static const char *opt_daylog_fn = NULL;
 static void cb_daylog(const char *arg) { opt_daylog_fn = arg; }
 
+static void cb_graphs(const char *arg)
+{
+   if (!graph_configure(arg))
+      errx(1, "invalid --graphs \"%s\"", arg);
+}
+
+static unsigned int opt_host_graphs = 0;
+static void cb_host_graphs(const char *arg)
+{ opt_host_graphs = (unsigned int)parsenum(arg, TOP_HOSTS); }
+
 static const char *import_fn = NULL;
 static void cb_import(const char *arg) { import_fn = arg; }
 
 static const char *export_fn = NULL;
 static void cb_export(const char *arg) { export_fn = arg; }
 
+static unsigned int export_interval = 0;
+static void cb_export_interval(const char *arg)
+{ export_interval = (unsigned int)parsenum(arg, INT_MAX / 1000); }
+
+static unsigned int log_interval = 0;
+static void cb_export_log(const char *arg)
+{ log_interval = (unsigned int)parsenum(arg, INT_MAX / 1000); }
+
 static const char *pid_fn = NULL;
+static int sensors_seen = 0;
+static void cb_sensor(const char *arg) { sensor_add(arg); sensors_seen = 1; }
+
+static unsigned int sensor_interval = 10;
+static void cb_sensor_interval(const char *arg)
+{
+   if ((sensor_interval = parsenum(arg, INT_MAX / 1000)) == 0)
+      errx(1, "--sensor-interval must be at least 1");
+}
+
 static void cb_pidfile(const char *arg) { pid_fn = arg; }
 
-unsigned int opt_hosts_max = 1000;
+static int hosts_max_seen = 0;
 static void cb_hosts_max(const char *arg)
-{ opt_hosts_max = parsenum(arg, 0); }
+{ opt_hosts_max = parsenum(arg, 0); hosts_max_seen = 1; }
 
-unsigned int opt_hosts_keep = 500;
 static void cb_hosts_keep(const char *arg)
 { opt_hosts_keep = parsenum(arg, 0); }
 
-unsigned int opt_ports_max = 60;
+static void cb_memory_limit(const char *arg)
+{
+   if ((opt_memory_limit = parsenum(arg, 0)) == 0)
+      errx(1, "--memory-limit must be at least 1 MB");
+}
+
+static void cb_admit(const char *arg)
+{ opt_admit_bytes = (unsigned int)parsenum(arg, UINT_MAX); }
+
 static void cb_ports_max(const char *arg)
 { opt_ports_max = parsenum(arg, 65536); }
 
-unsigned int opt_ports_keep = 30;
 static void cb_ports_keep(const char *arg)
 { opt_ports_keep = parsenum(arg, 65536); }
 
-unsigned int opt_highest_port = 65535;
 static void cb_highest_port(const char *arg)
 { opt_highest_port = parsenum(arg, 65535); }
 
-int opt_wait_secs = -1;
 static void cb_wait_secs(const char *arg)
 { opt_wait_secs = (int)parsenum(arg, 0); }
 
-int opt_want_hexdump = 0;
+static void cb_ring_size(const char *arg)
+{
+   if ((opt_ring_size = parsenum(arg, 4096)) == 0)
+      errx(1, "--ring-size must be at least 1 MB");
+}
+
+static void cb_fanout(const char *arg)
+{
+   if ((opt_fanout = parsenum(arg, 1024)) == 0)
+      errx(1, "--fanout must be at least 1");
+}
+
+static void cb_fanout_mode(const char *arg)
+{
+   if (strcmp(arg, "cpu") == 0)
+      opt_fanout_cpu = 1;
+   else if (strcmp(arg, "hash") == 0)
+      opt_fanout_cpu = 0;
+   else
+      errx(1, "--fanout-mode must be \"hash\" or \"cpu\", not \"%s\"", arg);
+}
+
+static void cb_xdp_queues(const char *arg)
+{
+   if ((opt_xdp_queues = parsenum(arg, 1024)) == 0)
+      errx(1, "--xdp-queues must be at least 1");
+}
+
+static void cb_queue_size(const char *arg)
+{
+   if ((opt_queue_size = parsenum(arg, 1U << 30)) == 0)
+      errx(1, "--queue-size must be at least 1");
+}
+
+static void cb_threads(const char *arg _unused_)
+{ opt_capture_threads = 1; }
+
+static void cb_numa(const char *arg _unused_)
+{ opt_want_numa = 1; }
+
+static void cb_huge_pages(const char *arg _unused_)
+{ opt_want_huge_pages = 1; }
+
 static void cb_hexdump(const char *arg _unused_)
 { opt_want_hexdump = 1; }
 
@@ -201,10 +318,14 @@ static struct cmdline_arg cmdline_args[] = {
    {"-i",             "interface",       cb_interface,   -1},
    {"-f",             "filter",          cb_filter,      -1},
    {"-r",             "capfile",         cb_capfile,      0},
+   {"--flow",         "[addr:]port",     cb_flow,         0},
+   {"--timing",       NULL,              cb_timing,       0},
+   {"--replay",       "count",           cb_replay,       0},
    {"-p",             "port",            cb_port,         0},
    {"-b",             "bindaddr",        cb_bindaddr,    -1},
-   {"-l",             "network/netmask", cb_local,        0},
+   {"-l",             "network/netmask", cb_local,       -1},
    {"--base",         "path",            cb_base,         0},
+   {"--gzip-level",   "level",           cb_gzip_level,   0},
    {"--local-only",   NULL,              cb_local_only,   0},
    {"--snaplen",      "bytes",           cb_snaplen,      0},
    {"--pppoe",        NULL,              cb_pppoe,        0},
@@ -213,25 +334,47 @@ static struct cmdline_arg cmdline_args[] = {
    {"--no-daemon",    NULL,              cb_no_daemon,    0},
    {"--no-promisc",   NULL,              cb_no_promisc,   0},
    {"--no-dns",       NULL,              cb_no_dns,       0},
+   {"--dns-workers",  "count",           cb_dns_workers,  0},
+   {"--dns-timeout",  "secs",            cb_dns_timeout,  0},
+   {"--dns-cache",    "count",           cb_dns_cache,    0},
    {"--no-macs",      NULL,              cb_no_macs,      0},
    {"--no-lastseen",  NULL,              cb_no_lastseen,  0},
+   {"--no-peers",     NULL,              cb_no_peers,     0},
    {"--chroot",       "dir",             cb_chroot,       0},
    {"--user",         "username",        cb_user,         0},
    {"--daylog",       "filename",        cb_daylog,       0},
+   {"--graphs",       "spec",            cb_graphs,       0},
+   {"--host-graphs",  "count",           cb_host_graphs,  0},
    {"--import",       "filename",        cb_import,       0},
    {"--export",       "filename",        cb_export,       0},
+   {"--export-interval", "secs",         cb_export_interval, 0},
+   {"--export-log",   "secs",            cb_export_log,   0},
+   {"--sensor",       "host[:port]",     cb_sensor,      -1},
+   {"--sensor-interval", "secs",         cb_sensor_interval, 0},
    {"--pidfile",      "filename",        cb_pidfile,      0},
    {"--hosts-max",    "count",           cb_hosts_max,    0},
    {"--hosts-keep",   "count",           cb_hosts_keep,   0},
+   {"--memory-limit", "MB",              cb_memory_limit, 0},
+   {"--admit",        "bytes",           cb_admit,        0},
    {"--ports-max",    "count",           cb_ports_max,    0},
    {"--ports-keep",   "count",           cb_ports_keep,   0},
    {"--highest-port", "port",            cb_highest_port, 0},
    {"--wait",         "secs",            cb_wait_secs,    0},
+   {"--threads",      NULL,              cb_threads,      0},
+   {"--ring-size",    "MB",              cb_ring_size,    0},
+   {"--fanout",       "count",           cb_fanout,       0},
+   {"--fanout-mode",  "hash|cpu",        cb_fanout_mode,  0},
+   {"--xdp-queues",   "count",           cb_xdp_queues,   0},
+   {"--queue-size",   "packets",         cb_queue_size,   0},
+   {"--numa",         NULL,              cb_numa,         0},
+   {"--huge-pages",   NULL,              cb_huge_pages,   0},
    {"--hexdump",      NULL,              cb_hexdump,      0},
    {"--version",      NULL,              cb_version,      0},
    {"--help",         NULL,              cb_help,         0},
 #ifdef __OpenBSD__
    {"--pf",           NULL,              cb_pf,           0},
+   {"--pf-states",    "count",           cb_pf_states,    0},
+   {"--pf-interval",  "msec",            cb_pf_interval,  0},
 #endif
    {NULL,             NULL,              NULL,            0}
 };
@@ -326,12 +469,34 @@ static void parse_cmdline(const int argc, char * const *argv) {
       opt_privdrop_user = PRIVDROP_USER;
 
    /* sanity check args */
-   if (!opt_pf_seen && !opt_iface_seen && opt_capfile == NULL)
-      errx(1, "must specify either interface (-i) or capture file (-r)");
+   if (!opt_pf_seen && !opt_iface_seen && opt_capfile == NULL &&
+       opt_flow == NULL)
+      errx(1, "must specify either interface (-i), capture file (-r) "
+         "or --flow");
+
+   if (opt_flow != NULL && (opt_capfile != NULL || opt_pf_seen))
+      errx(1, "--flow doesn't work with a capture file (-r) or --pf");
 
    if (opt_pf_seen && opt_iface_seen && opt_capfile != NULL)
       errx(1, "can't specify both interface (-i) and capture file (-r)");
 
+   if ((opt_want_timing || opt_replay > 1) && opt_capfile == NULL)
+      errx(1, "--timing and --replay only work with a capture file (-r)");
+
+   if ((export_interval != 0) && (export_fn == NULL))
+      errx(1, "--export-interval needs an --export file");
+
+   if ((log_interval != 0) && (export_fn == NULL))
+      errx(1, "--export-log needs an --export file");
+
+   if (sensors_seen && opt_capfile != NULL)
+      errx(1, "--sensor doesn't work with a capture file (-r)");
+
+   if ((opt_memory_limit != 0) && !hosts_max_seen) {
+      opt_hosts_max = UINT_MAX;
+      verbosef("--memory-limit lifts the default --hosts-max");
+   }
+
    if ((opt_hosts_max != 0) && (opt_hosts_keep >= opt_hosts_max)) {
       opt_hosts_keep = opt_hosts_max / 2;
       warnx("reducing --hosts-keep to %u, to be under --hosts-max (%u)",
@@ -358,27 +523,137 @@ static void parse_cmdline(const int argc, char * const *argv) {
       verbosef("--hexdump implies --no-daemon");
    }
 
+   if ((opt_fanout > 1) && !opt_capture_threads) {
+      opt_capture_threads = 1;
+      verbosef("--fanout implies --threads");
+   }
+
+   if ((opt_xdp_queues > 1) && !opt_capture_threads) {
+      opt_capture_threads = 1;
+      verbosef("--xdp-queues implies --threads");
+   }
+
+   if (opt_queue_size && !opt_capture_threads) {
+      opt_capture_threads = 1;
+      verbosef("--queue-size implies --threads");
+   }
+
    if (opt_want_local_only && !is_localnet_specified)
       verbosef("WARNING: --local-only without -l only matches the local host");
 }
 
+/* Peak resident size, in megabytes. */
+static double peak_rss_mb(void) {
+   struct rusage ru;
+
+   if (getrusage(RUSAGE_SELF, &ru) != 0)
+      return 0;
+#ifdef __APPLE__
+   return (double)ru.ru_maxrss / 1048576; /* bytes */
+#else
+   return (double)ru.ru_maxrss / 1024; /* kilobytes */
+#endif
+}
+
+static void print_phase(const char *name, const int64_t nsec,
+                        const uint64_t packets) {
+   printf("  %-8s %9.3f s", name, (double)nsec / 1e9);
+   if (nsec > 0)
+      printf(" %9.3f Mpps", (double)packets * 1e3 / (double)nsec);
+   printf("\n");
+}
+
 static void run_from_capfile(void) {
+   struct cap_timing timing;
+   struct timespec t, t_phase;
+   int64_t total_nsec, flush_nsec, export_nsec = 0, reduce_nsec;
+
    now_init();
    graph_init();
    hosts_db_init();
-   cap_from_file(opt_capfile);
-   if (export_fn != NULL) db_export(export_fn);
+   memset(&timing, 0, sizeof(timing));
+   timer_start(&t);
+   cap_from_file(opt_capfile, opt_replay, opt_want_timing ? &timing : NULL);
+   timer_start(&t_phase);
+   acct_flush();
+   flush_nsec = timer_nsec(&t_phase);
+   if (export_fn != NULL) {
+      timer_start(&t_phase);
+      db_export(export_fn);
+      export_nsec = timer_nsec(&t_phase);
+   }
+   total_nsec = timer_nsec(&t);
+
+   if (opt_want_timing) {
+      /* Reducing happens from inside accounting; report it separately. */
+      reduce_nsec = hosts_db_reduce_nsec();
+      timing.acct_nsec += flush_nsec - reduce_nsec;
+      printf("%llu packets in %.3f s", (llu)timing.packets,
+             (double)total_nsec / 1e9);
+      if (total_nsec > 0)
+         printf(", %.3f Mpps",
+                (double)timing.packets * 1e3 / (double)total_nsec);
+      printf("\n%u hosts, peak RSS %.1f MB\n",
+             hosts_db_count(), peak_rss_mb());
+      if (timing.threads != 0)
+         printf("  read by %u threads\n", timing.threads);
+      else {
+         print_phase("capture", timing.capture_nsec, timing.packets);
+         print_phase("decode", timing.decode_nsec, timing.packets);
+         print_phase("acct", timing.acct_nsec, timing.packets);
+      }
+      print_phase("reduce", reduce_nsec, timing.packets);
+      if (export_fn != NULL)
+         print_phase("export", export_nsec, timing.packets);
+   }
    hosts_db_free();
+   names_free();
    graph_free();
+   acct_free_localnet();
    verbosef("Total packets: %llu, bytes: %llu",
             (llu)acct_total_packets,
             (llu)acct_total_bytes);
 }
 
+/* --- Timers, run from the main loop by event_timers_run() --- */
+
+/* At the start of each real second: flush the flow cache, and move the
+ * graphs on.  Rotating has nothing to do with how often capture wakes up.
+ */
+static void
+on_second(void *arg _unused_)
+{
+   acct_flush();
+   graph_rotate();
+   hosts_graph_tick();
+   event_after(now_msec_to_real_second(), on_second, NULL);
+}
+
+static void
+on_export(void *arg _unused_)
+{
+   if (running)
+      export_pending = 1;
+   event_after((int)export_interval * 1000, on_export, NULL);
+}
+
+static void
+on_log(void *arg _unused_)
+{
+   if (running) {
+      acct_flush();
+      if (db_log_append())
+         export_pending = 1; /* to compact the log */
+   }
+   event_after((int)log_interval * 1000, on_log, NULL);
+}
+
 /* --- Program body --- */
 int
 main(int argc, char **argv)
 {
+   int cap_timeout = -1; /* how often to poll capture, in msec */
+
    test_64order();
    parse_cmdline(argc-1, argv+1);
 
@@ -400,15 +675,19 @@ main(int argc, char **argv)
 
    /* do this first as it forks - minimize memory use */
    if (opt_want_dns) dns_init(opt_privdrop_user);
+   event_init();
    if (opt_pf_seen) {
 #ifdef __OpenBSD__
       pfsync_start();
 #endif
-   } else {
+   } else if (opt_iface_seen) {
       cap_start(opt_want_promisc);
+      localip_watch_start();
    }
+   if (opt_flow != NULL) flow_start(opt_flow);
    http_init_base(opt_base);
    http_listen(opt_bindport);
+   sensor_init(sensor_interval); /* looks them up, so before chroot() */
    ncache_init(); /* must do before chroot() */
 
    privdrop(opt_chroot_dir, opt_privdrop_user);
@@ -418,7 +697,16 @@ main(int argc, char **argv)
    if (opt_daylog_fn != NULL) daylog_init(opt_daylog_fn);
    graph_init();
    hosts_db_init();
+   hosts_graph_init(opt_host_graphs);
    if (import_fn != NULL) db_import(import_fn);
+   if (log_interval != 0)
+      /* The log follows the export, so only replay it over that export. */
+      db_log_init(export_fn,
+         (import_fn != NULL) && (strcmp(import_fn, export_fn) == 0));
+   if (!opt_pf_seen && opt_iface_seen) {
+      cap_start_threads();
+      cap_timeout = cap_event_init();
+   }
 
    if (signal(SIGTERM, sig_shutdown) == SIG_ERR)
       errx(1, "signal(SIGTERM) failed");
@@ -429,67 +717,70 @@ main(int argc, char **argv)
    if (signal(SIGUSR2, sig_export) == SIG_ERR)
       errx(1, "signal(SIGUSR2) failed");
 
+   on_second(NULL); /* the first rotate, which arms it */
+   if (export_interval != 0)
+      event_after((int)export_interval * 1000, on_export, NULL);
+   if (log_interval != 0)
+      event_after((int)log_interval * 1000, on_log, NULL);
+
    verbosef("entering main loop");
    daemonize_finish();
 
    while (running) {
-      int select_ret;
-      int max_fd = -1;
-      int use_timeout = 0;
-      int cap_ret;
-      struct timeval timeout;
+      int ready, timeout = cap_timeout, http_timeout, sensor_timeout;
+      int cap_ret = 1;
       struct timespec t;
-      fd_set rs, ws;
 
-      FD_ZERO(&rs);
-      FD_ZERO(&ws);
-      if (opt_pf_seen) {
 #ifdef __OpenBSD__
-         pfsync_fd_set(&rs, &max_fd, &timeout, &use_timeout);
+      if (opt_pf_seen)
+         timeout = pfsync_timeout_msec(); /* until the next read */
 #endif
-      } else {
-         cap_fd_set(&rs, &max_fd, &timeout, &use_timeout);
-      }
-      http_fd_set(&rs, &ws, &max_fd, &timeout, &use_timeout);
-
-      select_ret = select(max_fd+1, &rs, &ws, NULL,
-         (use_timeout) ? &timeout : NULL);
-      if (select_ret == 0 && !use_timeout)
-            errx(1, "select() erroneously timed out");
-      if (select_ret == -1) {
-         if (errno == EINTR)
-            continue;
-         else
-            err(1, "select()");
-      }
+      http_timeout = http_timeout_msec();
+      if (http_timeout != -1 && (timeout == -1 || http_timeout < timeout))
+         timeout = http_timeout;
+      sensor_timeout = sensor_timeout_msec();
+      if (sensor_timeout != -1 && (timeout == -1 || sensor_timeout < timeout))
+         timeout = sensor_timeout;
+
+      ready = event_wait(timeout); /* or until the next timer */
+      if (ready == -1 && errno != EINTR)
+         err(1, "event_wait()");
+      /* After a signal, nothing is ready but the loop still goes round, so
+       * that a pending export or reset is seen to straight away.
+       */
 
       timer_start(&t);
       now_update();
+      event_timers_run(); /* rotation, and timed exports and logs */
 
-      if (export_pending) {
+      /* If the last export is still being written, this one waits for it,
+       * and so does a reset.
+       */
+      if (export_pending && !db_export_busy()) {
+         acct_flush();
          if (export_fn != NULL)
-            db_export(export_fn);
+            db_export_start(export_fn);
          export_pending = 0;
       }
 
-      if (reset_pending) {
-         if (export_pending)
-            continue; /* export before reset */
+      if (reset_pending && !export_pending) {
+         acct_flush();
          hosts_db_reset();
          graph_reset();
+         db_log_reset();
          reset_pending = 0;
       }
 
-      graph_rotate();
+      event_dispatch(); /* address changes, flows and the web interface */
       if (opt_pf_seen) {
 #ifdef __OpenBSD__
          cap_ret = pfsync_poll();
 #endif
-      } else {
-         cap_ret = cap_poll(&rs);
-      }
+      } else if (opt_iface_seen)
+         cap_ret = cap_poll();
       dns_poll();
-      http_poll(&rs, &ws);
+      http_poll();
+      sensor_poll();
       timer_stop(&t, 1000000000, "event processing took longer than a second");
 
       if (!cap_ret) {
@@ -501,12 +792,24 @@ main(int argc, char **argv)
    verbosef("pcap stats: %u packets received, %u packets dropped",
       cap_pkts_recv, cap_pkts_drop);
    http_stop();
+   snapshot_stop();
    cap_stop();
+   localip_watch_stop();
+   flow_stop();
+   event_free();
+   acct_flush();
    dns_stop();
-   if (export_fn != NULL) db_export(export_fn);
+   if (export_fn != NULL) {
+      db_log_append(); /* in case the export fails */
+      db_log_free(db_export(export_fn));
+   }
+   sensor_free();
    hosts_db_free();
+   names_free();
+   hosts_graph_free();
    graph_free();
    if (opt_daylog_fn != NULL) daylog_free();
+   acct_free_localnet();
    ncache_free();
    if (pid_fn) pidfile_unlink();
    verbosef("shut down");
@@ -10,20 +10,33 @@
 #define _GNU_SOURCE 1 /* for O_NOFOLLOW in Linux */
 
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <netinet/in.h> /* for ntohs() and friends */
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include "cdefs.h"
+#include "conv.h"
 #include "err.h"
 #include "hosts_db.h"
 #include "graph_db.h"
 #include "db.h"
+#include "snapshot.h"
+#include "str.h"
 
 static const unsigned char export_file_header[] = {0xDA, 0x31, 0x41, 0x59};
 static const unsigned char export_tag_hosts_ver1[] = {0xDA, 'H', 'S', 0x01};
+static const unsigned char export_tag_hosts_col1[] = {0xDA, 'H', 'C', 0x01};
+static const unsigned char export_tag_hosts_col2[] = {0xDA, 'H', 'C', 0x02};
 static const unsigned char export_tag_graph_ver1[] = {0xDA, 'G', 'R', 0x01};
+static const unsigned char export_tag_graph_ver2[] = {0xDA, 'G', 'R', 0x02};
+static const unsigned char delta_header[] = {0xDA, 'D', 'L', 0x01};
 
 #ifndef swap64
 static uint64_t swap64(uint64_t _x) {
@@ -58,6 +71,194 @@ test_64order(void)
    assert(hton64(ntoh64(no)) == no);
 }
 
+/* Load a network order uint32_t from memory. */
+uint32_t
+db_get32(const void *p)
+{
+   uint32_t tmp;
+
+   memcpy(&tmp, p, sizeof(tmp));
+   return ntohl(tmp);
+}
+
+/* Load a network order uint64_t from memory. */
+uint64_t
+db_get64(const void *p)
+{
+   uint64_t tmp;
+
+   memcpy(&tmp, p, sizeof(tmp));
+   return ntoh64(tmp);
+}
+
+/* ---------------------------------------------------------------------------
+ * Buffering.  db_import() and db_export() hand their fd to db_io, and the
+ * helpers below then read or write it a megabyte at a time, so each field
+ * of each host costs a memcpy() instead of a syscall.  Any other fd (e.g. a
+ * snapshot child's pipe) is still read or written directly.
+ *
+ * db_mem_open() points db_io at memory instead, for a while, and
+ * db_str_open() at a string to write to.
+ */
+#define DB_IO_BUFSIZE (1024 * 1024)
+#define DB_MEM_FD (-2)
+
+struct db_io {
+   int fd;              /* -1 if nothing is being buffered */
+   int writing;
+   unsigned char *buf;  /* NULL when reading from memory */
+   const unsigned char *rd; /* what's being read: buf, or the memory */
+   size_t pos;          /* reading: next byte to hand out */
+   size_t len;          /* bytes in buf */
+   unsigned int ofs;    /* file position of buf[0] */
+   struct str *out;     /* writing to memory: where it goes */
+};
+
+static struct db_io db_io = { -1, 0, NULL, NULL, 0, 0, 0, NULL },
+   db_io_saved = { -1, 0, NULL, NULL, 0, 0, 0, NULL };
+
+static void
+db_io_start(const int fd, const int writing)
+{
+   off_t ofs = lseek(fd, 0, SEEK_CUR);
+
+   assert(db_io.fd == -1);
+   db_io.fd = fd;
+   db_io.writing = writing;
+   db_io.buf = xmalloc(DB_IO_BUFSIZE);
+   db_io.rd = db_io.buf;
+   db_io.pos = db_io.len = 0;
+   db_io.ofs = (ofs == -1) ? 0 : (unsigned int)ofs; /* e.g. appending */
+}
+
+/* Write out everything buffered.  Returns 0 on failure, 1 on success. */
+static int
+db_io_flush(void)
+{
+   size_t done = 0;
+
+   if (db_io.fd == DB_MEM_FD) {
+      str_appendn(db_io.out, (const char *)db_io.buf, db_io.len);
+      done = db_io.len;
+   }
+   while (done < db_io.len) {
+      ssize_t numwr = write(db_io.fd, db_io.buf + done, db_io.len - done);
+
+      if (numwr == -1) {
+         if (errno == EINTR)
+            continue;
+         warn("couldn't write %d bytes", (int)(db_io.len - done));
+         return 0;
+      }
+      done += (size_t)numwr;
+   }
+   db_io.ofs += (unsigned int)db_io.len;
+   db_io.len = 0;
+   return 1;
+}
+
+/* Stop buffering.  Returns 0 if the last of the output couldn't be written,
+ * 1 otherwise.
+ */
+static int
+db_io_finish(void)
+{
+   int ret = 1;
+
+   if (db_io.writing)
+      ret = db_io_flush();
+   free(db_io.buf);
+   db_io.buf = NULL;
+   db_io.fd = -1;
+   return ret;
+}
+
+/* Throw away what's buffered and carry on reading from pos. */
+static int
+db_io_seek(const unsigned int pos)
+{
+   assert(!db_io.writing);
+   if (lseek(db_io.fd, (off_t)pos, SEEK_SET) == -1) {
+      warn("lseek(%u) failed", pos);
+      return 0;
+   }
+   db_io.pos = db_io.len = 0;
+   db_io.ofs = pos;
+   return 1;
+}
+
+int
+db_mem_open(const void *p, const size_t len)
+{
+   assert(db_io_saved.fd == -1); /* doesn't nest */
+   db_io_saved = db_io;
+   db_io.fd = DB_MEM_FD;
+   db_io.writing = 0;
+   db_io.buf = NULL;
+   db_io.rd = p;
+   db_io.pos = 0;
+   db_io.len = len;
+   db_io.ofs = 0;
+   return DB_MEM_FD;
+}
+
+void
+db_mem_close(void)
+{
+   assert(db_io.fd == DB_MEM_FD);
+   assert(!db_io.writing);
+   db_io = db_io_saved;
+   db_io_saved.fd = -1;
+}
+
+/* Point the write helpers at the end of s, until db_str_close(). */
+static int
+db_str_open(struct str *s)
+{
+   assert(db_io_saved.fd == -1); /* doesn't nest */
+   db_io_saved = db_io;
+   db_io.fd = DB_MEM_FD;
+   db_io.writing = 1;
+   db_io.buf = xmalloc(DB_IO_BUFSIZE);
+   db_io.rd = db_io.buf;
+   db_io.pos = db_io.len = 0;
+   db_io.ofs = 0;
+   db_io.out = s;
+   return DB_MEM_FD;
+}
+
+static void
+db_str_close(void)
+{
+   assert(db_io.fd == DB_MEM_FD);
+   assert(db_io.writing);
+   db_io_flush(); /* can't fail */
+   free(db_io.buf);
+   db_io = db_io_saved;
+   db_io_saved.fd = -1;
+}
+
+/* Refill an empty read buffer.  Returns the number of bytes read, 0 at end
+ * of file, or -1 on error.
+ */
+static ssize_t
+db_io_fill(void)
+{
+   ssize_t numread;
+
+   assert(db_io.pos == db_io.len);
+   if (db_io.fd == DB_MEM_FD)
+      return 0; /* there's no more */
+   db_io.ofs += (unsigned int)db_io.len;
+   db_io.pos = db_io.len = 0;
+   do
+      numread = read(db_io.fd, db_io.buf, DB_IO_BUFSIZE);
+   while (numread == -1 && errno == EINTR);
+   if (numread > 0)
+      db_io.len = (size_t)numread;
+   return numread;
+}
+
 /* ---------------------------------------------------------------------------
  * Read-from-file helpers.  They all return 0 on failure, and 1 on success.
  */
@@ -65,12 +266,51 @@ test_64order(void)
 unsigned int
 xtell(const int fd)
 {
-   off_t ofs = lseek(fd, 0, SEEK_CUR);
+   off_t ofs;
+
+   if (fd == db_io.fd)
+      return db_io.ofs + (unsigned int)(db_io.writing ? db_io.len :
+                                                        db_io.pos);
+   ofs = lseek(fd, 0, SEEK_CUR);
    if (ofs == -1)
       err(1, "lseek(0, SEEK_CUR) failed");
    return (unsigned int)ofs;
 }
 
+/* Read <len> bytes from the buffer, refilling it as needed. */
+static int
+readn_buffered(void *dest, const size_t len)
+{
+   unsigned char *d = dest;
+   size_t got = 0;
+
+   while (got < len) {
+      size_t n = db_io.len - db_io.pos;
+
+      if (n == 0) {
+         ssize_t numread = db_io_fill();
+
+         if (numread == -1) {
+            warn("at pos %u: couldn't read %d bytes",
+               xtell(db_io.fd), (int)(len - got));
+            return 0;
+         }
+         if (numread == 0) {
+            warnx("at pos %u: tried to read %d bytes, got %d",
+               xtell(db_io.fd) - (unsigned int)got, (int)len, (int)got);
+            return 0;
+         }
+         continue;
+      }
+      if (n > len - got)
+         n = len - got;
+      memcpy(d + got, db_io.rd + db_io.pos, n);
+      db_io.pos += n;
+      got += n;
+   }
+   return 1;
+}
+
 /* Read <len> bytes from <fd>, warn() and return 0 on failure,
  * or return 1 for success.
  */
@@ -79,6 +319,9 @@ readn(const int fd, void *dest, const size_t len)
 {
    ssize_t numread;
 
+   if (fd == db_io.fd)
+      return readn_buffered(dest, len);
+
    numread = read(fd, dest, len);
    if (numread == (ssize_t)len) return 1;
 
@@ -124,7 +367,7 @@ read16(const int fd, uint16_t *dest)
    uint16_t tmp;
 
    assert(sizeof(tmp) == 2);
-   if (!read(fd, &tmp, sizeof(tmp))) return 0;
+   if (!readn(fd, &tmp, sizeof(tmp))) return 0;
    *dest = ntohs(tmp);
    return 1;
 }
@@ -138,7 +381,7 @@ read32(const int fd, uint32_t *dest)
    uint32_t tmp;
 
    assert(sizeof(tmp) == 4);
-   if (!read(fd, &tmp, sizeof(tmp))) return 0;
+   if (!readn(fd, &tmp, sizeof(tmp))) return 0;
    *dest = ntohl(tmp);
    return 1;
 }
@@ -185,7 +428,7 @@ read64(const int fd, uint64_t *dest)
    uint64_t tmp;
 
    assert(sizeof(tmp) == 8);
-   if (!read(fd, &tmp, sizeof(tmp))) return 0;
+   if (!readn(fd, &tmp, sizeof(tmp))) return 0;
    *dest = ntoh64(tmp);
    return 1;
 }
@@ -202,6 +445,20 @@ writen(const int fd, const void *dest, const size_t len)
 {
    ssize_t numwr;
 
+   if (fd == db_io.fd) {
+      if (db_io.len + len > DB_IO_BUFSIZE && !db_io_flush())
+         return 0;
+      if (len <= DB_IO_BUFSIZE) {
+         memcpy(db_io.buf + db_io.len, dest, len);
+         db_io.len += len;
+         return 1;
+      }
+      /* Too big to buffer: write it straight out, after what's already
+       * been flushed.
+       */
+      db_io.ofs += (unsigned int)len;
+   }
+
    numwr = write(fd, dest, len);
    if (numwr == (ssize_t)len) return 1;
 
@@ -292,15 +549,64 @@ read_file_header(const int fd, const uint8_t expected[4])
    return 1;
 }
 
-/* Returns 0 on failure, 1 on success. */
+/* Map the whole file, and hand it to hosts_db to adopt the hosts section in
+ * place.  Its ports are laid out as in host records of version ver.
+ * Returns 0 on failure, 1 on success.
+ */
 static int
-db_import_from_fd(const int fd)
+db_import_columnar(const int fd, const int ver)
 {
+   struct stat st;
+   void *map;
+   size_t pos = xtell(fd);
+
+   if (fstat(fd, &st) == -1) {
+      warn("fstat() failed");
+      return 0;
+   }
+   map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   if (map == MAP_FAILED) {
+      warn("mmap() failed");
+      return 0;
+   }
+   if (!hosts_db_import_columnar(map, (size_t)st.st_size, &pos, ver))
+      return 0;
+   return db_io_seek((unsigned int)pos);
+}
+
+/* graph_fn reads the graphs section, or if it's NULL, it's left unread.
+ * Returns 0 on failure, 1 on success.
+ */
+static int
+db_import_from_fd(const int fd, int (*graph_fn)(const int fd, const int ver))
+{
+   uint8_t tag[4];
+
    if (!read_file_header(fd, export_file_header)) return 0;
-   if (!read_file_header(fd, export_tag_hosts_ver1)) return 0;
-   if (!hosts_db_import(fd)) return 0;
-   if (!read_file_header(fd, export_tag_graph_ver1)) return 0;
-   if (!graph_import(fd)) return 0;
+   if (!readn(fd, tag, sizeof(tag))) return 0;
+   if (memcmp(tag, export_tag_hosts_col2, sizeof(tag)) == 0) {
+      if (!db_import_columnar(fd, 5)) return 0;
+   } else if (memcmp(tag, export_tag_hosts_col1, sizeof(tag)) == 0) {
+      if (!db_import_columnar(fd, 4)) return 0;
+   } else if (memcmp(tag, export_tag_hosts_ver1, sizeof(tag)) == 0) {
+      if (!hosts_db_import(fd)) return 0;
+   } else {
+      warnx("bad hosts section header: %02x%02x%02x%02x",
+         tag[0], tag[1], tag[2], tag[3]);
+      return 0;
+   }
+   if (graph_fn == NULL)
+      return 1;
+   if (!readn(fd, tag, sizeof(tag))) return 0;
+   if (memcmp(tag, export_tag_graph_ver2, sizeof(tag)) == 0) {
+      if (!graph_fn(fd, 2)) return 0;
+   } else if (memcmp(tag, export_tag_graph_ver1, sizeof(tag)) == 0) {
+      if (!graph_fn(fd, 1)) return 0;
+   } else {
+      warnx("bad graph section header: %02x%02x%02x%02x",
+         tag[0], tag[1], tag[2], tag[3]);
+      return 0;
+   }
    return 1;
 }
 
@@ -308,11 +614,16 @@ void
 db_import(const char *filename)
 {
    int fd = open(filename, O_RDONLY | O_NOFOLLOW);
+   int ok;
+
    if (fd == -1) {
       warn("can't import from \"%s\"", filename);
       return;
    }
-   if (!db_import_from_fd(fd)) {
+   db_io_start(fd, /*writing=*/0);
+   ok = db_import_from_fd(fd, graph_import);
+   db_io_finish();
+   if (!ok) {
       warnx("import failed");
       /* don't stay in an inconsistent state: */
       hosts_db_reset();
@@ -321,41 +632,554 @@ db_import(const char *filename)
    close(fd);
 }
 
+/* Merging, for darkstat-merge: add an export's hosts, and if with_graphs is
+ * set, its graphs, to what's in memory.  See hosts_db_set_merge().
+ * Returns 0 on failure, 1 on success.
+ */
+int
+db_merge(const char *filename, const int with_graphs)
+{
+   int fd = open(filename, O_RDONLY | O_NOFOLLOW);
+   int ok;
+
+   if (fd == -1) {
+      warn("can't merge \"%s\"", filename);
+      return 0;
+   }
+   db_io_start(fd, /*writing=*/0);
+   ok = db_import_from_fd(fd, with_graphs ? graph_merge : NULL);
+   db_io_finish();
+   close(fd);
+   if (!ok)
+      warnx("merging \"%s\" failed", filename);
+   return ok;
+}
+
 /* Returns 0 on failure, 1 on success. */
 static int
-db_export_to_fd(const int fd)
+db_export_to_fd(const int fd, void *arg _unused_)
 {
    if (!writen(fd, export_file_header, sizeof(export_file_header)))
       return 0;
-   if (!writen(fd, export_tag_hosts_ver1, sizeof(export_tag_hosts_ver1)))
+   if (!writen(fd, export_tag_hosts_col2, sizeof(export_tag_hosts_col2)))
       return 0;
    if (!hosts_db_export(fd))
       return 0;
-   if (!writen(fd, export_tag_graph_ver1, sizeof(export_tag_graph_ver1)))
+   if (!writen(fd, export_tag_graph_ver2, sizeof(export_tag_graph_ver2)))
       return 0;
    if (!graph_export(fd))
       return 0;
    return 1;
 }
 
-void
-db_export(const char *filename)
+/* Returns a newly allocated <filename><suffix>. */
+static char *
+suffixed(const char *filename, const char *suffix)
 {
-   int fd = open(filename, O_WRONLY | O_CREAT | O_NOFOLLOW | O_TRUNC, 0600);
+   const size_t len = strlen(filename) + strlen(suffix) + 1;
+   char *s = xmalloc(len);
+
+   snprintf(s, len, "%s%s", filename, suffix);
+   return s;
+}
+
+/* Write <filename>.tmp with write_fn, then sync it and rename it over
+ * <filename>, so a crash part way through leaves the last export intact.
+ * Returns 0 on failure, 1 on success.
+ */
+static int
+db_write_file(const char *filename, int (*write_fn)(const int fd, void *arg),
+   void *arg)
+{
+   char *tmp = suffixed(filename, ".tmp");
+   int fd, ok;
+
+   fd = open(tmp, O_WRONLY | O_CREAT | O_NOFOLLOW | O_TRUNC, 0600);
    if (fd == -1) {
-      warn("can't export to \"%s\"", filename);
-      return;
+      warn("can't export to \"%s\"", tmp);
+      free(tmp);
+      return 0;
    }
    verbosef("exporting db to file \"%s\"", filename);
-   if (!db_export_to_fd(fd))
+   db_io_start(fd, /*writing=*/1);
+   ok = write_fn(fd, arg);
+   if (!db_io_finish())
+      ok = 0;
+   if (ok && fsync(fd) == -1) {
+      warn("fsync(\"%s\") failed", tmp);
+      ok = 0;
+   }
+   if (close(fd) == -1 && ok) {
+      warn("close(\"%s\") failed", tmp);
+      ok = 0;
+   }
+   if (ok && rename(tmp, filename) == -1) {
+      warn("can't rename \"%s\" to \"%s\"", tmp, filename);
+      ok = 0;
+   }
+   if (!ok) {
       warnx("export failed");
-   else
+      unlink(tmp);
+   } else
       verbosef("export successful");
+   free(tmp);
+   return ok;
+}
 
-   /* FIXME: should write to another filename and use the rename() syscall to
-    * atomically update the output file on success
-    */
+int
+db_export(const char *filename)
+{
+   return db_write_file(filename, db_export_to_fd, NULL);
+}
+
+/* Write every host as a part of a merged export, for db_export_parts(): a
+ * host count and host ver5 records.  Returns 0 on failure, 1 on success.
+ */
+int
+db_export_part(const char *filename)
+{
+   int fd = open(filename, O_WRONLY | O_CREAT | O_NOFOLLOW | O_TRUNC, 0600);
+   int ok;
+
+   if (fd == -1) {
+      warn("can't write part \"%s\"", filename);
+      return 0;
+   }
+   db_io_start(fd, /*writing=*/1);
+   ok = hosts_db_export_changed(fd, 0);
+   if (!db_io_finish())
+      ok = 0;
+   if (close(fd) == -1)
+      ok = 0;
+   return ok;
+}
+
+struct db_parts {
+   char *const *filenames;
+   unsigned int count;
+};
+
+/* Copy the host records out of each part, after a hosts_db ver1 header
+ * with their total count, then write the graphs in memory.
+ */
+static int
+db_export_parts_to_fd(const int fd, void *arg)
+{
+   const struct db_parts *parts = arg;
+   unsigned char buf[65536];
+   unsigned int pos, i;
+   uint32_t total = 0, count;
+
+   if (!writen(fd, export_file_header, sizeof(export_file_header)))
+      return 0;
+   if (!writen(fd, export_tag_hosts_ver1, sizeof(export_tag_hosts_ver1)))
+      return 0;
+   pos = xtell(fd);
+   if (!write32(fd, 0)) /* filled in below */
+      return 0;
+   for (i = 0; i < parts->count; i++) {
+      const int part = open(parts->filenames[i], O_RDONLY | O_NOFOLLOW);
+      ssize_t got;
+
+      if (part == -1) {
+         warn("can't read part \"%s\"", parts->filenames[i]);
+         return 0;
+      }
+      if (!read32(part, &count)) { /* unbuffered: db_io is writing */
+         close(part);
+         return 0;
+      }
+      total += count;
+      while ((got = read(part, buf, sizeof(buf))) > 0)
+         if (!writen(fd, buf, (size_t)got)) {
+            close(part);
+            return 0;
+         }
+      close(part);
+      if (got == -1) {
+         warn("can't read part \"%s\"", parts->filenames[i]);
+         return 0;
+      }
+   }
+   if (!writen(fd, export_tag_graph_ver2, sizeof(export_tag_graph_ver2)))
+      return 0;
+   if (!graph_export(fd))
+      return 0;
+   if (!db_io_flush())
+      return 0;
+   total = htonl(total);
+   if (pwrite(fd, &total, sizeof(total), (off_t)pos) != sizeof(total)) {
+      warn("pwrite() failed");
+      return 0;
+   }
+   return 1;
+}
+
+int
+db_export_parts(const char *filename, char *const *parts,
+   const unsigned int count)
+{
+   struct db_parts p;
+
+   p.filenames = parts;
+   p.count = count;
+   return db_write_file(filename, db_export_parts_to_fd, &p);
+}
+
+/* ---------------------------------------------------------------------------
+ * Change log.  Between exports, the hosts counted since the last batch are
+ * appended to <export>.log, along with the graphs, so a crash loses seconds
+ * of accounting instead of everything since the last export.  Records hold
+ * totals, not increments: replaying the log over the export it follows
+ * just overwrites hosts with their latest state.
+ *
+ * An export is a checkpoint.  As its snapshot is taken, the log is renamed
+ * to <export>.log.prev and a new one is started; once the export is safely
+ * in place, .log.prev goes.  Until then, replaying .log.prev and then .log
+ * over whichever export is on disk gives the latest state either way.
+ */
+static const unsigned char log_file_header[] = {0xDA, 'L', 'G', 0x02};
+#define LOG_BATCH 'B'
+#define LOG_RESET 'R'
+
+/* Don't compact a log smaller than this, however small the export is. */
+#define LOG_COMPACT_MIN (1024 * 1024)
+
+static struct {
+   int fd;              /* -1 if not logging */
+   char *fn, *prev_fn;
+   int have_prev;       /* whether prev_fn is on disk */
+   unsigned int gen;    /* hosts counted in this generation or later are due */
+   off_t size;          /* of the log */
+   off_t compact_size;  /* compact once it's bigger than this */
+} db_log = { -1, NULL, NULL, 0, 0, 0, 0 };
+
+/* Replay one log file.  An incomplete batch at the end is what a crash
+ * while appending leaves behind, and is skipped.
+ */
+static void
+db_log_replay(const char *filename)
+{
+   struct stat st;
+   unsigned int batches = 0, resets = 0;
+   int fd = open(filename, O_RDONLY | O_NOFOLLOW);
+
+   if (fd == -1) {
+      if (errno != ENOENT)
+         warn("can't replay change log \"%s\"", filename);
+      return;
+   }
+   if (fstat(fd, &st) == -1) {
+      warn("fstat(\"%s\") failed", filename);
+      close(fd);
+      return;
+   }
+   db_io_start(fd, /*writing=*/0);
+   if (read_file_header(fd, log_file_header))
+      for (;;) {
+         const unsigned int pos = xtell(fd);
+         uint8_t type;
+         uint32_t len;
+
+         if ((off_t)pos == st.st_size)
+            break;
+         if (!read8(fd, &type))
+            break;
+         if (type == LOG_RESET) {
+            hosts_db_reset();
+            graph_reset();
+            resets++;
+            continue;
+         }
+         if (type != LOG_BATCH || !read32(fd, &len) || len == 0 ||
+             (off_t)pos + 5 + len > st.st_size) {
+            warnx("\"%s\": skipping incomplete record at %u",
+               filename, pos);
+            break;
+         }
+         if (!hosts_db_import(fd) || !graph_import(fd, 2) ||
+             xtell(fd) != pos + 5 + len) {
+            warnx("\"%s\": bad batch at %u", filename, pos);
+            break;
+         }
+         batches++;
+      }
+   db_io_finish();
    close(fd);
+   verbosef("replayed %u batches and %u resets from \"%s\"",
+      batches, resets, filename);
+}
+
+/* Open the log for appending, starting it if it's new or empty.  Returns 0
+ * on failure, 1 on success.
+ */
+static int
+db_log_open(void)
+{
+   assert(db_log.fd == -1);
+   db_log.fd = open(db_log.fn, O_WRONLY | O_CREAT | O_NOFOLLOW, 0600);
+   if (db_log.fd == -1) {
+      warn("can't open change log \"%s\"", db_log.fn);
+      return 0;
+   }
+   db_log.size = lseek(db_log.fd, 0, SEEK_END);
+   if (db_log.size == -1)
+      err(1, "lseek(\"%s\") failed", db_log.fn);
+   if (db_log.size == 0) {
+      if (!writen(db_log.fd, log_file_header, sizeof(log_file_header))) {
+         close(db_log.fd);
+         db_log.fd = -1;
+         return 0;
+      }
+      db_log.size = sizeof(log_file_header);
+   }
+   return 1;
+}
+
+/* Compact once the log outgrows the export it follows. */
+static void
+db_log_set_compact_size(const char *export_fn)
+{
+   struct stat st;
+
+   db_log.compact_size = LOG_COMPACT_MIN;
+   if (stat(export_fn, &st) == 0 && st.st_size > db_log.compact_size)
+      db_log.compact_size = st.st_size;
+}
+
+void
+db_log_init(const char *export_fn, const int replay)
+{
+   struct stat st;
+
+   db_log.fn = suffixed(export_fn, ".log");
+   db_log.prev_fn = suffixed(export_fn, ".log.prev");
+   if (replay) {
+      db_log_replay(db_log.prev_fn);
+      db_log_replay(db_log.fn);
+   } else {
+      /* They follow an export that wasn't imported. */
+      const int removed_prev = (unlink(db_log.prev_fn) == 0);
+
+      if ((unlink(db_log.fn) == 0) || removed_prev)
+         verbosef("removed stale change log of \"%s\"", export_fn);
+   }
+   db_log.have_prev = (stat(db_log.prev_fn, &st) == 0);
+   db_log.gen = graph_generation();
+   db_log_set_compact_size(export_fn);
+   if (db_log_open())
+      verbosef("logging changes to \"%s\"", db_log.fn);
+}
+
+/* Append a batch.  On failure, the log is cut back to where it was, so
+ * there's never half a batch in front of the next one.  Returns 0 on
+ * failure, 1 on success.
+ */
+static int
+db_log_write_batch(void)
+{
+   const off_t start = db_log.size;
+   const unsigned int gen = graph_generation();
+   uint32_t len;
+   int ok;
+
+   if (hosts_db_count_changed(db_log.gen) == 0)
+      return 1; /* the graphs can wait for the next batch */
+   db_io_start(db_log.fd, /*writing=*/1);
+   ok = write8(db_log.fd, LOG_BATCH) &&
+        write32(db_log.fd, 0) && /* filled in below */
+        hosts_db_export_changed(db_log.fd, db_log.gen) &&
+        graph_export(db_log.fd);
+   len = xtell(db_log.fd) - (unsigned int)start - 5;
+   if (!db_io_finish())
+      ok = 0;
+   if (ok) {
+      len = htonl(len);
+      if (pwrite(db_log.fd, &len, sizeof(len), start + 1) != sizeof(len)) {
+         warn("pwrite(\"%s\") failed", db_log.fn);
+         ok = 0;
+      }
+   }
+   if (ok && fsync(db_log.fd) == -1) {
+      warn("fsync(\"%s\") failed", db_log.fn);
+      ok = 0;
+   }
+   if (!ok) {
+      if (ftruncate(db_log.fd, start) == -1 ||
+          lseek(db_log.fd, start, SEEK_SET) == -1)
+         err(1, "can't cut back change log \"%s\"", db_log.fn);
+      warnx("couldn't append to change log \"%s\"", db_log.fn);
+      return 0;
+   }
+   db_log.size = lseek(db_log.fd, 0, SEEK_CUR);
+   db_log.gen = gen;
+   return 1;
+}
+
+int
+db_log_append(void)
+{
+   if (db_log.fd == -1)
+      return 0;
+   db_log_write_batch();
+   return (db_log.size > db_log.compact_size);
+}
+
+void
+db_log_reset(void)
+{
+   const uint8_t r = LOG_RESET;
+
+   if (db_log.fd == -1)
+      return;
+   if (!writen(db_log.fd, &r, sizeof(r)) || fsync(db_log.fd) == -1)
+      warnx("couldn't log reset to \"%s\"", db_log.fn);
+   else
+      db_log.size += sizeof(r);
+   db_log.gen = graph_generation();
+}
+
+/* An export is about to be taken: bring the log up to date, and start a new
+ * one unless the last checkpoint never finished.
+ */
+static void
+db_log_checkpoint(void)
+{
+   if (db_log.fd == -1)
+      return;
+   db_log_write_batch();
+   if (db_log.have_prev)
+      return;
+   close(db_log.fd);
+   db_log.fd = -1;
+   if (rename(db_log.fn, db_log.prev_fn) == -1)
+      warn("can't rename \"%s\" to \"%s\"", db_log.fn, db_log.prev_fn);
+   else
+      db_log.have_prev = 1;
+   db_log_open();
+}
+
+/* The export has everything the old log had. */
+static void
+db_log_checkpoint_done(const char *export_fn)
+{
+   if (db_log.fn == NULL)
+      return;
+   if (db_log.have_prev && unlink(db_log.prev_fn) == 0)
+      db_log.have_prev = 0;
+   db_log_set_compact_size(export_fn);
+}
+
+void
+db_log_free(const int exported)
+{
+   if (db_log.fn == NULL)
+      return;
+   if (db_log.fd != -1)
+      close(db_log.fd);
+   db_log.fd = -1;
+   if (exported) {
+      /* The export has everything. */
+      unlink(db_log.prev_fn);
+      unlink(db_log.fn);
+   }
+   free(db_log.fn);
+   free(db_log.prev_fn);
+   db_log.fn = db_log.prev_fn = NULL;
+}
+
+/* ---------------------------------------------------------------------------
+ * Background export: the file is written by a snapshot child, so capture
+ * carries on in the parent while it's being serialized.
+ */
+static int export_running = 0;
+
+static int
+db_export_child(void *arg, const int fd _unused_)
+{
+   return db_export((const char *)arg);
+}
+
+static void
+db_export_done(void *arg, char *buf, size_t len _unused_, int ok)
+{
+   /* The child has already said how it went. */
+   free(buf);
+   export_running = 0;
+   if (ok)
+      db_log_checkpoint_done((const char *)arg);
+}
+
+void
+db_export_start(const char *filename)
+{
+   assert(!export_running);
+   db_log_checkpoint();
+   if (snapshot_start(db_export_child, db_export_done,
+                      (void *)filename, -1) == -1) {
+      if (db_export(filename))
+         db_log_checkpoint_done(filename);
+      return;
+   }
+   export_running = 1;
+}
+
+int
+db_export_busy(void)
+{
+   return export_running;
+}
+
+/* ---------------------------------------------------------------------------
+ * Deltas, for federation (see sensor.c and export-format.txt): the hosts
+ * counted in generation since or later, with this generation, and the bytes
+ * put in the graphs so far.  A since from the future is from before a
+ * restart, and gets everything.  Returns NULL on failure.
+ */
+struct str *
+db_delta(unsigned int since)
+{
+   struct str *s = str_make();
+   const unsigned int gen = graph_generation();
+   uint64_t in, out;
+   int fd, ok;
+
+   if (since > gen)
+      since = 0;
+   graph_totals(&in, &out);
+   fd = db_str_open(s);
+   ok = writen(fd, delta_header, sizeof(delta_header)) &&
+        write32(fd, gen) &&
+        write64(fd, in) &&
+        write64(fd, out) &&
+        hosts_db_export_changed(fd, since);
+   db_str_close();
+   if (!ok) {
+      str_free(s);
+      return NULL;
+   }
+   return s;
+}
+
+/* Read a delta into d, with its hosts in a table of their own.
+ * Returns 0 on failure, 1 on success.
+ */
+int
+db_delta_read(const void *buf, const size_t len, struct db_delta *d)
+{
+   const int fd = db_mem_open(buf, len);
+   uint32_t gen = 0;
+   int ok;
+
+   d->hosts = NULL;
+   ok = read_file_header(fd, delta_header) &&
+        read32(fd, &gen) &&
+        read64(fd, &(d->graph_in)) &&
+        read64(fd, &(d->graph_out)) &&
+        (d->hosts = hosts_db_import_sensor(fd)) != NULL;
+   db_mem_close();
+   d->generation = gen;
+   return ok;
 }
 
 /* vim:set ts=3 sw=3 tw=78 et: */
@@ -3,6 +3,8 @@
  * db.h: load and save in-memory database from/to file
  * copyright (c) 2007-2012 Ben Stewart, Emil Mikulic.
  */
+#ifndef __DARKSTAT_DB_H
+#define __DARKSTAT_DB_H
 
 #include <sys/types.h> /* for size_t */
 #include <stdint.h> /* for uint64_t */
@@ -10,9 +12,49 @@
 struct addr;
 
 void db_import(const char *filename);
-void db_export(const char *filename);
+int db_export(const char *filename);
+
+/* Export from a snapshot child, without stalling the caller.  Only one can
+ * run at a time: check db_export_busy() first.
+ */
+void db_export_start(const char *filename);
+int db_export_busy(void);
+
+/* For darkstat-merge, see db.c. */
+int db_merge(const char *filename, const int with_graphs);
+int db_export_part(const char *filename);
+int db_export_parts(const char *filename, char *const *parts,
+   const unsigned int count);
+
+/* Append-only log of changes between exports, see db.c.  db_log_init()
+ * replays the existing log first if replay is set.  db_log_append()
+ * returns 1 when the log has grown big enough to be worth an export.
+ */
+void db_log_init(const char *export_fn, const int replay);
+int db_log_append(void);
+void db_log_reset(void);
+void db_log_free(const int exported);
+
+/* Federation deltas, see db.c. */
+struct str;
+struct hashtable;
+struct db_delta {
+   unsigned int generation;     /* the sensor's, to pass back as since */
+   uint64_t graph_in, graph_out; /* bytes it has put in its graphs */
+   struct hashtable *hosts;     /* for hosts_db_fold_sensor() */
+};
+struct str *db_delta(unsigned int since);
+int db_delta_read(const void *buf, const size_t len, struct db_delta *d);
 void test_64order(void);
 
+/* Point the read helpers at memory instead of a file, until db_mem_close().
+ * Returns the fd to pass them.
+ */
+int db_mem_open(const void *p, const size_t len);
+void db_mem_close(void);
+uint32_t db_get32(const void *p); /* network order, in place */
+uint64_t db_get64(const void *p);
+
 /* read helpers */
 unsigned int xtell(const int fd);
 int readn(const int fd, void *dest, const size_t len);
@@ -33,4 +75,5 @@ int write32(const int fd, const uint32_t i);
 int write64(const int fd, const uint64_t i);
 int writeaddr(const int fd, const struct addr *const a);
 
+#endif /* __DARKSTAT_DB_H */
 /* vim:set ts=3 sw=3 tw=78 et: */
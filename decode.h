@@ -54,5 +54,11 @@ struct linkhdr {
 const struct linkhdr *getlinkhdr(const int linktype);
 int getsnaplen(const struct linkhdr *lh);
 
+/* Decodes plain Ethernet, IPv4 and TCP or UDP, filling in the whole summary
+ * except for packets, which is left zero.  Returns 0 without touching the
+ * summary for anything else, which needs the DLT_EN10MB linkhdr's decoder.
+ */
+int decode_ether_fast(DECODER_ARGS);
+
 #endif /* __DARKSTAT_DECODE_H */
 /* vim:set ts=3 sw=3 tw=78 expandtab: */
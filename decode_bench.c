@@ -0,0 +1,382 @@
+/* darkstat 3
+ * copyright (c) 2026 darkstat contributors.
+ *
+ * decode_bench.c: microbenchmark for decoding and accounting
+ *
+ * You may use, modify and redistribute this file under the terms of the
+ * GNU General Public License version 2. (see COPYING.GPL)
+ */
+
+/* Usage:
+ *  make bench
+ *  make bench PCAP=/path/to/capture.pcap
+ * or directly:
+ *  ./decode_bench [-n packets] decode_corpus/ether_* capture.pcap
+ *
+ * Each input is either a pcap file, or in the same format as for
+ * decode_fuzzer: the first two bytes are the linktype, the rest is one
+ * packet.  Its packets are replayed, over and over, through:
+ *  - the linkhdr's decoder,
+ *  - the fast path in front of it, the way cap.c does it, for DLT_EN10MB,
+ *  - decoding and then acct_for_batch() into the hosts_db, in batches.
+ * The two decoders must agree on every packet.  For each, we report the
+ * time per packet, the packet rate, and with glibc, the allocations per
+ * packet.
+ *
+ * Accounting doesn't fold repeated packets together the way cap.c's batch
+ * does, or replaying a single packet would mostly measure that.
+ */
+
+#include "acct.h"
+#include "decode.h"
+#include "err.h"
+#include "graph_db.h"
+#include "hosts_db.h"
+#include "localip.h"
+#include "now.h"
+#include "opt.h"
+
+#include <errno.h>
+#include <pcap.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __GLIBC__
+/* Count allocations by standing in front of glibc's malloc. */
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+extern void *__libc_memalign(size_t, size_t);
+
+static unsigned long long allocs = 0;
+
+void *malloc(size_t size) {
+  allocs++;
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t num, size_t size) {
+  allocs++;
+  return __libc_calloc(num, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+  allocs++;
+  return __libc_realloc(ptr, size);
+}
+
+int posix_memalign(void **ptr, size_t alignment, size_t size) {
+  allocs++;
+  *ptr = __libc_memalign(alignment, size);
+  return (*ptr == NULL) ? ENOMEM : 0;
+}
+# define HAVE_ALLOC_COUNT 1
+#endif
+
+#define DEFAULT_PACKETS 2000000
+#define BATCH 64 /* like CAP_BATCH */
+#define ROUNDS 5
+
+struct packet {
+  struct pcap_pkthdr hdr;
+  uint8_t *data;
+};
+
+struct input {
+  const struct linkhdr *lh;
+  struct packet *pkts;
+  size_t num_pkts;
+};
+
+static long num_replay = DEFAULT_PACKETS;
+static volatile uint64_t sink;
+static struct pktsummary batch[BATCH];
+
+static double now_ns(void) {
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (double)t.tv_sec * 1e9 + (double)t.tv_nsec;
+}
+
+static void add_packet(struct input *in, const struct pcap_pkthdr *hdr,
+                       const uint8_t *data) {
+  struct packet *p;
+
+  in->pkts = realloc(in->pkts, (in->num_pkts + 1) * sizeof(*in->pkts));
+  if (in->pkts == NULL)
+    errx(1, "out of memory");
+  p = &in->pkts[in->num_pkts++];
+  p->hdr = *hdr;
+  if ((p->data = malloc(hdr->caplen)) == NULL)
+    errx(1, "out of memory");
+  memcpy(p->data, data, hdr->caplen);
+}
+
+static int is_pcap(const uint8_t *buf, const size_t len) {
+  static const uint8_t magic[][4] = {
+    { 0xa1, 0xb2, 0xc3, 0xd4 }, { 0xd4, 0xc3, 0xb2, 0xa1 }, /* usec */
+    { 0xa1, 0xb2, 0x3c, 0x4d }, { 0x4d, 0x3c, 0xb2, 0xa1 }, /* nsec */
+    { 0x0a, 0x0d, 0x0d, 0x0a },                             /* pcapng */
+  };
+  size_t i;
+
+  if (len < 4)
+    return 0;
+  for (i = 0; i < sizeof(magic) / sizeof(*magic); i++)
+    if (memcmp(buf, magic[i], 4) == 0)
+      return 1;
+  return 0;
+}
+
+static int load_pcap(const char *fn, struct input *in) {
+  char errbuf[PCAP_ERRBUF_SIZE];
+  struct pcap_pkthdr *hdr;
+  const u_char *data;
+  pcap_t *pcap;
+
+  if ((pcap = pcap_open_offline(fn, errbuf)) == NULL) {
+    fprintf(stderr, "%s: %s\n", fn, errbuf);
+    return 0;
+  }
+  if ((in->lh = getlinkhdr(pcap_datalink(pcap))) == NULL) {
+    fprintf(stderr, "%s: no decoder for linktype %d\n",
+            fn, pcap_datalink(pcap));
+    pcap_close(pcap);
+    return 0;
+  }
+  while (pcap_next_ex(pcap, &hdr, &data) == 1)
+    add_packet(in, hdr, data);
+  pcap_close(pcap);
+  return 1;
+}
+
+static int load(const char *fn, struct input *in) {
+  static uint8_t buf[65536];
+  struct pcap_pkthdr hdr;
+  int16_t linktype;
+  size_t len;
+  FILE *f;
+
+  in->pkts = NULL;
+  in->num_pkts = 0;
+  if ((f = fopen(fn, "rb")) == NULL) {
+    perror(fn);
+    return 0;
+  }
+  len = fread(buf, 1, sizeof(buf), f);
+  fclose(f);
+  if (is_pcap(buf, len))
+    return load_pcap(fn, in);
+
+  if (len < sizeof(linktype)) {
+    fprintf(stderr, "%s: too short\n", fn);
+    return 0;
+  }
+  memcpy(&linktype, buf, sizeof(linktype));
+  if ((in->lh = getlinkhdr(linktype)) == NULL) {
+    fprintf(stderr, "%s: no decoder for linktype %d\n", fn, linktype);
+    return 0;
+  }
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.caplen = hdr.len = (uint32_t)(len - sizeof(linktype));
+  add_packet(in, &hdr, buf + sizeof(linktype));
+  return 1;
+}
+
+static void free_input(struct input *in) {
+  size_t i;
+
+  for (i = 0; i < in->num_pkts; i++)
+    free(in->pkts[i].data);
+  free(in->pkts);
+}
+
+static int decode(const struct linkhdr *lh, const int fast,
+                  const struct packet *p, struct pktsummary *sm) {
+  if (fast && decode_ether_fast(&p->hdr, p->data, sm))
+    return 1;
+  memset(sm, 0, sizeof(*sm));
+  return lh->decoder(&p->hdr, p->data, sm);
+}
+
+static int same_summary(const struct pktsummary *a,
+                        const struct pktsummary *b) {
+  return addr_equal(&a->src, &b->src) &&
+         addr_equal(&a->dst, &b->dst) &&
+         a->len == b->len &&
+         a->proto == b->proto &&
+         a->tcp_flags == b->tcp_flags &&
+         a->src_port == b->src_port &&
+         a->dst_port == b->dst_port &&
+         memcmp(a->src_mac, b->src_mac, sizeof(a->src_mac)) == 0 &&
+         memcmp(a->dst_mac, b->dst_mac, sizeof(a->dst_mac)) == 0;
+}
+
+/* Returns the index of the first packet that the two decoders disagree on,
+ * or -1.
+ */
+static long check_fast(const struct input *in) {
+  size_t i;
+
+  for (i = 0; i < in->num_pkts; i++) {
+    struct pktsummary general, fast;
+    int ret_general, ret_fast;
+
+    ret_general = decode(in->lh, 0, &in->pkts[i], &general);
+    ret_fast = decode(in->lh, 1, &in->pkts[i], &fast);
+    if (ret_general != ret_fast ||
+        (ret_general && !same_summary(&general, &fast)))
+      return (long)i;
+  }
+  return -1;
+}
+
+struct result {
+  double ns; /* per packet, best round */
+  double allocs; /* per packet */
+};
+
+static struct result bench_decode(const struct input *in, const int fast) {
+  struct result r = { 0, 0 };
+  int round;
+
+  for (round = 0; round < ROUNDS; round++) {
+    double start = now_ns(), took;
+    uint64_t sum = 0;
+    long i;
+
+    for (i = 0; i < num_replay; i++) {
+      struct pktsummary *sm = &batch[i % BATCH];
+
+      if (decode(in->lh, fast, &in->pkts[(size_t)i % in->num_pkts], sm))
+        sum += sm->len + sm->src_port;
+    }
+    sink += sum;
+    took = (now_ns() - start) / (double)num_replay;
+    if (round == 0 || took < r.ns)
+      r.ns = took;
+  }
+  return r;
+}
+
+static struct result bench_acct(const struct input *in) {
+  struct result r = { 0, 0 };
+  struct local_ips local_ips;
+  const int fast = (in->lh->linktype == DLT_EN10MB);
+  int round;
+
+  localip_init(&local_ips);
+  for (round = 0; round < ROUNDS; round++) {
+    double start, took;
+    unsigned long long allocs_before = 0;
+    size_t n = 0;
+    long i;
+
+    hosts_db_reset();
+    graph_reset();
+#ifdef HAVE_ALLOC_COUNT
+    allocs_before = allocs;
+#endif
+    start = now_ns();
+    for (i = 0; i < num_replay; i++) {
+      if (!decode(in->lh, fast, &in->pkts[(size_t)i % in->num_pkts],
+                  &batch[n]))
+        continue;
+      batch[n].packets = 1;
+      if (++n == BATCH) {
+        acct_for_batch(batch, n, &local_ips, NULL);
+        n = 0;
+      }
+    }
+    acct_for_batch(batch, n, &local_ips, NULL);
+    acct_flush();
+    took = (now_ns() - start) / (double)num_replay;
+    if (round == 0 || took < r.ns) {
+      r.ns = took;
+#ifdef HAVE_ALLOC_COUNT
+      r.allocs = (double)(allocs - allocs_before) / (double)num_replay;
+#endif
+    }
+    (void)allocs_before;
+  }
+  localip_free(&local_ips);
+  return r;
+}
+
+static void report(const char *what, const struct result *r,
+                   const int with_allocs) {
+  printf("  %-14s %8.2f ns/packet %8.2f Mpps", what, r->ns, 1e3 / r->ns);
+#ifdef HAVE_ALLOC_COUNT
+  if (with_allocs)
+    printf(" %8.4f allocs/packet", r->allocs);
+#else
+  (void)with_allocs;
+#endif
+  printf("\n");
+}
+
+static int run(const char *fn) {
+  struct input in;
+  struct result r;
+  long bad;
+
+  if (!load(fn, &in))
+    return 0;
+  if (in.num_pkts == 0) {
+    fprintf(stderr, "%s: no packets\n", fn);
+    free_input(&in);
+    return 0;
+  }
+  printf("%s: %zu packet%s, linktype %d\n", fn, in.num_pkts,
+         (in.num_pkts == 1) ? "" : "s", in.lh->linktype);
+
+  r = bench_decode(&in, 0);
+  report("decode", &r, 0);
+  if (in.lh->linktype == DLT_EN10MB) {
+    if ((bad = check_fast(&in)) != -1) {
+      printf("FAIL: %s: fast path disagrees with decode_ether() "
+             "on packet %ld\n", fn, bad + 1);
+      free_input(&in);
+      return 0;
+    }
+    r = bench_decode(&in, 1);
+    report("fast path", &r, 0);
+  }
+  r = bench_acct(&in);
+  report("decode + acct", &r, 1);
+
+  free_input(&in);
+  return 1;
+}
+
+static void usage(const char *argv0) {
+  fprintf(stderr, "usage: %s [-n packets] file ...\n", argv0);
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  int i = 1, ok = 1;
+
+  if (i + 1 < argc && strcmp(argv[i], "-n") == 0) {
+    if ((num_replay = atol(argv[i + 1])) <= 0)
+      usage(argv[0]);
+    i += 2;
+  }
+  if (i == argc)
+    usage(argv[0]);
+
+  now_init();
+  graph_init();
+  hosts_db_init();
+  for (; i < argc; i++)
+    ok &= run(argv[i]);
+  hosts_db_free();
+  graph_free();
+  return ok ? 0 : 1;
+}
+
+/* vim:set ts=2 sts=2 sw=2 tw=80 et: */
@@ -113,6 +113,21 @@ static void decode(int linktype, const uint8_t* data, size_t size) {
     printf("ret = %d\n", ret);
     if (ret) print_summary(&sm);
   }
+
+  /* Whatever the fast path takes, it must decode the same way. */
+  struct pktsummary fast;
+  if (linktype == DLT_EN10MB && decode_ether_fast(&hdr, data, &fast)) {
+    assert(ret);
+    assert(addr_equal(&fast.src, &sm.src));
+    assert(addr_equal(&fast.dst, &sm.dst));
+    assert(fast.len == sm.len);
+    assert(fast.proto == sm.proto);
+    assert(fast.tcp_flags == sm.tcp_flags);
+    assert(fast.src_port == sm.src_port);
+    assert(fast.dst_port == sm.dst_port);
+    assert(memcmp(fast.src_mac, sm.src_mac, sizeof(sm.src_mac)) == 0);
+    assert(memcmp(fast.dst_mac, sm.dst_mac, sizeof(sm.dst_mac)) == 0);
+  }
 }
 
 int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
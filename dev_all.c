@@ -9,6 +9,7 @@
  */
 #include "acct.c"
 #include "addr.c"
+#include "admit.c"
 #include "bsd.c"
 #include "cap.c"
 #include "conv.c"
@@ -17,15 +18,28 @@
 #include "decode.c"
 #include "dns.c"
 #include "err.c"
+#include "event.c"
+#include "flow.c"
 #include "graph_db.c"
 #include "hosts_db.c"
+#include "hosts_graph.c"
 #include "hosts_sort.c"
+#include "hosts_top.c"
+#include "hll.c"
 #include "html.c"
 #include "http.c"
 #include "localip.c"
+#include "lpm.c"
+#include "metrics.c"
+#include "names.c"
 #include "ncache.c"
 #include "now.c"
+#include "numa.c"
+#include "opt.c"
 #include "pidfile.c"
+#include "pktq.c"
+#include "slab.c"
+#include "snapshot.c"
 #include "str.c"
 
 #include "darkstat.c"
@@ -1,12 +1,24 @@
 /* darkstat 3
  * copyright (c) 2001-2014 Emil Mikulic.
  *
- * dns.c: synchronous DNS in a child process.
+ * dns.c: DNS in a child process, with a pool of resolver threads.
  *
  * You may use, modify and redistribute this file under the terms of the
  * GNU General Public License version 2. (see COPYING.GPL)
  */
 
+/* The parent batches the addresses it wants looked up, and writes them to
+ * the child once per main loop iteration, from dns_poll().  The child hands
+ * them to opt_dns_workers threads, each of which does one blocking lookup
+ * at a time, so that one slow PTR query doesn't hold up the rest.  Replies
+ * go back in whatever order they finish.
+ *
+ * The parent only queues an address that isn't already waiting, so the
+ * child never has the same one twice.  It also remembers the last
+ * opt_dns_cache names it got, and failures, for a while: a host that's
+ * evicted from hosts_db and comes back gets its name without a lookup.
+ */
+
 #include "cdefs.h"
 #include "cap.h"
 #include "conv.h"
@@ -14,7 +26,12 @@
 #include "dns.h"
 #include "err.h"
 #include "hosts_db.h"
+#include "metrics.h"
+#include "names.h"
+#include "now.h"
+#include "opt.h"
 #include "queue.h"
+#include "snapshot.h"
 #include "str.h"
 #include "tree.h"
 #include "bsd.h" /* for setproctitle, strlcpy */
@@ -25,7 +42,9 @@
 #include <assert.h>
 #include <errno.h>
 #include <netdb.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -37,6 +56,8 @@
 
 static void dns_main(void) _noreturn_; /* the child process runs this */
 
+#define DNS_BATCH 32 /* most addresses or replies moved in one read */
+
 #define CHILD 0 /* child process uses this socket */
 #define PARENT 1
 static int dns_sock[2];
@@ -73,15 +94,19 @@ dns_init(const char *privdrop_user)
       close(dns_sock[CHILD]);
       dns_sock[CHILD] = -1;
       fd_set_nonblock(dns_sock[PARENT]);
+      snapshot_fd_add(dns_sock[PARENT]);
       verbosef("DNS child has PID %d", pid);
    }
 }
 
+static void name_cache_free(void);
+
 void
 dns_stop(void)
 {
    if (pid == -1)
       return; /* no child was started */
+   snapshot_fd_remove(dns_sock[PARENT]);
    close(dns_sock[PARENT]);
    if (kill(pid, SIGINT) == -1)
       err(1, "kill");
@@ -89,6 +114,7 @@ dns_stop(void)
    if (waitpid(pid, NULL, 0) == -1)
       err(1, "waitpid");
    verbosef("dns_stop() done waiting for child");
+   name_cache_free();
 }
 
 struct tree_rec {
@@ -97,28 +123,157 @@ struct tree_rec {
 };
 
 static int
-tree_cmp(struct tree_rec *a, struct tree_rec *b)
+ip_cmp(const struct addr *a, const struct addr *b)
 {
-   if (a->ip.family != b->ip.family)
+   if (a->family != b->family)
       /* Sort IPv4 to the left of IPv6.  */
-      return ((a->ip.family == IPv4) ? -1 : +1);
+      return ((a->family == IPv4) ? -1 : +1);
 
-   if (a->ip.family == IPv4)
-      return (memcmp(&a->ip.ip.v4, &b->ip.ip.v4, sizeof(a->ip.ip.v4)));
+   if (a->family == IPv4)
+      return (memcmp(&a->ip.v4, &b->ip.v4, sizeof(a->ip.v4)));
    else {
-      assert(a->ip.family == IPv6);
-      return (memcmp(&a->ip.ip.v6, &b->ip.ip.v6, sizeof(a->ip.ip.v6)));
+      assert(a->family == IPv6);
+      return (memcmp(&a->ip.v6, &b->ip.v6, sizeof(a->ip.v6)));
    }
 }
 
+static int
+tree_cmp(struct tree_rec *a, struct tree_rec *b)
+{
+   return ip_cmp(&a->ip, &b->ip);
+}
+
 static RB_HEAD(tree_t, tree_rec) ip_tree = RB_INITIALIZER(&tree_rec);
 RB_GENERATE_STATIC(tree_t, tree_rec, ptree, tree_cmp)
+static unsigned int ip_tree_count = 0; /* waiting for the child */
+static struct str *defer_buf = NULL;
+
+/* The name cache: a tree to find names by address, and a list from most to
+ * least recently used, to evict from the end of.
+ */
+#define NAME_TTL 3600    /* secs that a name is kept */
+#define NAME_TTL_NEG 300 /* and a failure, to retry sooner */
+
+struct cache_rec {
+   RB_ENTRY(cache_rec) ntree;
+   struct cache_rec *newer, *older;
+   struct addr ip;
+   time_t expires; /* now_mono() */
+   uint32_t name; /* see names.h */
+};
+
+static int
+name_cmp(struct cache_rec *a, struct cache_rec *b)
+{
+   return ip_cmp(&a->ip, &b->ip);
+}
+
+static RB_HEAD(name_t, cache_rec) name_tree = RB_INITIALIZER(&cache_rec);
+RB_GENERATE_STATIC(name_t, cache_rec, ntree, name_cmp)
+static struct cache_rec *newest = NULL, *oldest = NULL;
+static unsigned int name_count = 0;
+static uint64_t name_hits = 0, name_misses = 0;
+
+static void
+name_unlink(struct cache_rec *n)
+{
+   if (n->newer != NULL) n->newer->older = n->older; else newest = n->older;
+   if (n->older != NULL) n->older->newer = n->newer; else oldest = n->newer;
+   n->newer = n->older = NULL;
+}
+
+static void
+name_link_newest(struct cache_rec *n)
+{
+   n->older = newest;
+   n->newer = NULL;
+   if (newest != NULL) newest->newer = n; else oldest = n;
+   newest = n;
+}
+
+static void
+name_remove(struct cache_rec *n)
+{
+   RB_REMOVE(name_t, &name_tree, n);
+   name_unlink(n);
+   name_unref(n->name);
+   free(n);
+   name_count--;
+}
+
+static void
+name_cache_free(void)
+{
+   while (oldest != NULL)
+      name_remove(oldest);
+}
+
+/* Returns the cached name for ip, or NAME_NONE. */
+static uint32_t
+name_get(const struct addr *const ip)
+{
+   struct cache_rec tmp, *n;
+
+   memcpy(&tmp.ip, ip, sizeof(tmp.ip));
+   if ((n = RB_FIND(name_t, &name_tree, &tmp)) == NULL) {
+      name_misses++;
+      return (NAME_NONE);
+   }
+   if (n->expires <= now_mono()) {
+      name_remove(n);
+      name_misses++;
+      return (NAME_NONE);
+   }
+   name_unlink(n);
+   name_link_newest(n);
+   name_hits++;
+   return (n->name);
+}
+
+static void
+name_put(const struct addr *const ip, const char *name, const int failed)
+{
+   struct cache_rec *n = xmalloc(sizeof(*n)), *old;
+
+   memcpy(&n->ip, ip, sizeof(n->ip));
+   if ((old = RB_INSERT(name_t, &name_tree, n)) != NULL) {
+      free(n);
+      n = old;
+      name_unlink(n);
+      name_unref(n->name);
+   } else
+      name_count++;
+   n->name = name_intern(name);
+   n->expires = now_mono() + (failed ? NAME_TTL_NEG : NAME_TTL);
+   name_link_newest(n);
+   while (name_count > opt_dns_cache)
+      name_remove(oldest);
+}
+
+/* Addresses queued since the last dns_poll(), and any that the socket
+ * wouldn't take yet.
+ */
+static struct addr out_buf[DNS_BATCH * 4];
+static size_t out_len = 0; /* in bytes */
+
+/* A snapshot child shares the DNS socket but not ip_tree, so the parent
+ * would never match up the replies.  Instead, dns_queue() appends the
+ * addresses to buf, for the parent to queue them itself.
+ */
+void
+dns_defer(struct str *buf)
+{
+   defer_buf = buf;
+}
+
+static void dns_flush(void);
+static void dns_unqueue(const struct addr *const ipaddr);
 
 void
 dns_queue(const struct addr *const ipaddr)
 {
    struct tree_rec *rec;
-   ssize_t num_w;
+   uint32_t name;
 
    if (pid == -1)
       return; /* no child was started - we're not doing any DNS */
@@ -128,6 +283,17 @@ dns_queue(const struct addr *const ipaddr)
       return;
    }
 
+   if ((name = name_get(ipaddr)) != NAME_NONE) {
+      /* Seen before, no need to ask. */
+      struct bucket *b = host_find(ipaddr);
+
+      if (b != NULL && b->u.host.dns == NAME_NONE) {
+         name_ref(name);
+         b->u.host.dns = name;
+      }
+      return;
+   }
+
    rec = xmalloc(sizeof(*rec));
    memcpy(&rec->ip, ipaddr, sizeof(rec->ip));
 
@@ -138,14 +304,41 @@ dns_queue(const struct addr *const ipaddr)
       free(rec);
       return;
    }
+   ip_tree_count++;
+
+   if (defer_buf != NULL) {
+      str_appendn(defer_buf, (const char *)ipaddr, sizeof(*ipaddr));
+      return;
+   }
+   if (out_len == sizeof(out_buf))
+      dns_flush();
+   if (out_len == sizeof(out_buf)) {
+      /* The child is far behind, let the address be queued again later. */
+      dns_unqueue(ipaddr);
+      return;
+   }
+   memcpy((char *)out_buf + out_len, ipaddr, sizeof(*ipaddr));
+   out_len += sizeof(*ipaddr);
+}
 
-   num_w = write(dns_sock[PARENT], ipaddr, sizeof(*ipaddr)); /* won't block */
+/* Write as much of out_buf to the child as it will take. */
+static void
+dns_flush(void)
+{
+   ssize_t num_w;
+
+   if (out_len == 0)
+      return;
+   num_w = write(dns_sock[PARENT], out_buf, out_len); /* won't block */
    if (num_w == 0)
-      warnx("dns_queue: write: ignoring end of file");
-   else if (num_w == -1)
-      warn("dns_queue: ignoring write error");
-   else if (num_w != sizeof(*ipaddr))
-      err(1, "dns_queue: wrote %zu instead of %zu", num_w, sizeof(*ipaddr));
+      warnx("dns_flush: write: ignoring end of file");
+   else if (num_w == -1) {
+      if (errno != EAGAIN)
+         warn("dns_flush: ignoring write error");
+   } else {
+      out_len -= (size_t)num_w;
+      memmove(out_buf, (char *)out_buf + num_w, out_len);
+   }
 }
 
 static void
@@ -157,36 +350,70 @@ dns_unqueue(const struct addr *const ipaddr)
    if ((rec = RB_FIND(tree_t, &ip_tree, &tmp)) != NULL) {
       RB_REMOVE(tree_t, &ip_tree, rec);
       free(rec);
+      ip_tree_count--;
    }
    else
       verbosef("couldn't unqueue %s - not in queue!", addr_to_str(ipaddr));
 }
 
+void
+dns_metrics(struct str *buf)
+{
+   metrics_header(buf, "darkstat_dns_queue", "gauge",
+      "Addresses waiting for the DNS child to look up their names.");
+   str_appendf(buf, "darkstat_dns_queue %u\n", ip_tree_count);
+   metrics_header(buf, "darkstat_dns_cache_names", "gauge",
+      "Names, and failed lookups, remembered by the DNS cache.");
+   str_appendf(buf, "darkstat_dns_cache_names %u\n", name_count);
+   metrics_header(buf, "darkstat_dns_cache_hits_total", "counter",
+      "Addresses whose names came from the DNS cache.");
+   str_appendf(buf, "darkstat_dns_cache_hits_total %qu\n", (qu)name_hits);
+   metrics_header(buf, "darkstat_dns_cache_misses_total", "counter",
+      "Addresses whose names weren't in the DNS cache.");
+   str_appendf(buf, "darkstat_dns_cache_misses_total %qu\n", (qu)name_misses);
+}
+
+/* Replies read from the child but not yet taken, and the start of one that
+ * hasn't all arrived.
+ */
+static struct dns_reply in_buf[DNS_BATCH];
+static size_t in_len = 0, in_pos = 0; /* in bytes */
+
 /*
  * Returns non-zero if result waiting, stores IP and name into given pointers
- * (name buffer is allocated by dns_poll)
+ * (name buffer is allocated by dns_poll), and whether the lookup failed.
  */
 static int
-dns_get_result(struct addr *ipaddr, char **name)
+dns_get_result(struct addr *ipaddr, char **name, int *failed)
 {
    struct dns_reply reply;
    ssize_t numread;
 
-   numread = read(dns_sock[PARENT], &reply, sizeof(reply));
-   if (numread == -1) {
-      if (errno == EAGAIN)
-         return (0); /* no input waiting */
-      else
-         goto error;
+   if (in_len - in_pos < sizeof(reply)) {
+      /* Keep the partial reply, and read as many more as are waiting. */
+      in_len -= in_pos;
+      memmove(in_buf, (char *)in_buf + in_pos, in_len);
+      in_pos = 0;
+      numread = read(dns_sock[PARENT], (char *)in_buf + in_len,
+         sizeof(in_buf) - in_len);
+      if (numread == -1) {
+         if (errno == EAGAIN)
+            return (0); /* no input waiting */
+         else
+            goto error;
+      }
+      if (numread == 0)
+         goto error; /* EOF */
+      in_len += (size_t)numread;
+      if (in_len < sizeof(reply))
+         return (0); /* the rest of it is still on the way */
    }
-   if (numread == 0)
-      goto error; /* EOF */
-   if (numread != sizeof(reply))
-      errx(1, "dns_get_result read got %zu, expected %zu",
-         numread, sizeof(reply));
+   memcpy(&reply, (char *)in_buf + in_pos, sizeof(reply));
+   in_pos += sizeof(reply);
 
    /* Return successful reply. */
    memcpy(ipaddr, &reply.addr, sizeof(*ipaddr));
+   *failed = (reply.error != 0);
    if (reply.error != 0) {
       /* Identify common special cases.  */
       const char *type = "none";
@@ -213,7 +440,7 @@ dns_get_result(struct addr *ipaddr, char **name)
 
 error:
    warn("dns_get_result: ignoring read error");
-   /* FIXME: re-align to stream?  restart dns child? */
+   /* FIXME: restart dns child? */
    return (0);
 }
 
@@ -222,25 +449,34 @@ dns_poll(void)
 {
    struct addr ip;
    char *name;
+   int failed;
 
    if (pid == -1)
       return; /* no child was started - we're not doing any DNS */
 
-   while (dns_get_result(&ip, &name)) {
+   dns_flush();
+   while (dns_get_result(&ip, &name, &failed)) {
       /* push into hosts_db */
-      struct bucket *b = host_find(&ip);
+      struct bucket *b;
+
+      if (opt_dns_cache != 0)
+         name_put(&ip, name, failed);
+      b = host_find(&ip);
 
       if (b == NULL) {
          verbosef("resolved %s to %s but it's not in the DB!",
             addr_to_str(&ip), name);
-         return;
+         free(name);
+         continue;
       }
-      if (b->u.host.dns != NULL) {
+      if (b->u.host.dns != NAME_NONE) {
          verbosef("resolved %s to %s but it's already in the DB!",
             addr_to_str(&ip), name);
-         return;
+         free(name);
+         continue;
       }
-      b->u.host.dns = name;
+      b->u.host.dns = name_intern(name);
+      free(name);
    }
 }
 
@@ -251,7 +487,13 @@ struct qitem {
    struct addr ip;
 };
 
+/* The child's queue, shared by its reading thread and the workers. */
 static STAILQ_HEAD(qhead, qitem) queue = STAILQ_HEAD_INITIALIZER(queue);
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+
+/* Replies are written whole, one worker at a time. */
+static pthread_mutex_t reply_lock = PTHREAD_MUTEX_INITIALIZER;
 
 static void
 enqueue(const struct addr *const ip)
@@ -260,24 +502,27 @@ enqueue(const struct addr *const ip)
 
    i = xmalloc(sizeof(*i));
    memcpy(&i->ip, ip, sizeof(i->ip));
+   pthread_mutex_lock(&queue_lock);
    STAILQ_INSERT_TAIL(&queue, i, entries);
+   pthread_cond_signal(&queue_cond);
+   pthread_mutex_unlock(&queue_lock);
    verbosef("DNS: enqueued %s", addr_to_str(ip));
 }
 
-/* Return non-zero and populate <ip> pointer if queue isn't empty. */
-static int
+/* Wait for the queue to be non-empty, and take the first <ip>. */
+static void
 dequeue(struct addr *ip)
 {
    struct qitem *i;
 
-   i = STAILQ_FIRST(&queue);
-   if (i == NULL)
-      return (0);
+   pthread_mutex_lock(&queue_lock);
+   while ((i = STAILQ_FIRST(&queue)) == NULL)
+      pthread_cond_wait(&queue_cond, &queue_lock);
    STAILQ_REMOVE_HEAD(&queue, entries);
+   pthread_mutex_unlock(&queue_lock);
    memcpy(ip, &i->ip, sizeof(*ip));
    free(i);
    verbosef("DNS: dequeued %s", addr_to_str(ip));
-   return 1;
 }
 
 static void
@@ -291,107 +536,135 @@ xwrite(const int d, const void *buf, const size_t nbytes)
       err(1, "wrote %d bytes instead of all %d bytes", (int)ret, (int)nbytes);
 }
 
+static void
+resolve(const struct addr *const ip, struct dns_reply *reply)
+{
+   struct sockaddr_in sin;
+   struct sockaddr_in6 sin6;
+   struct hostent *he;
+   char host[NI_MAXHOST];
+   int ret, flags;
+
+   reply->addr = *ip;
+   flags = NI_NAMEREQD;
+#  ifdef NI_IDN
+   flags |= NI_IDN;
+#  endif
+   switch (ip->family) {
+      case IPv4:
+         sin.sin_family = AF_INET;
+         sin.sin_addr.s_addr = ip->ip.v4;
+         ret = getnameinfo((struct sockaddr *) &sin, sizeof(sin),
+                           host, sizeof(host), NULL, 0, flags);
+         if (ret == EAI_FAMILY) {
+            verbosef("getnameinfo error %s, trying gethostbyname",
+               gai_strerror(ret));
+            /* Not thread-safe, but this fallback is only for systems
+             * without IPv4 getnameinfo(), hence the lock.
+             */
+            pthread_mutex_lock(&reply_lock);
+            he = gethostbyaddr(&sin.sin_addr.s_addr,
+               sizeof(sin.sin_addr.s_addr), sin.sin_family);
+            if (he == NULL) {
+               ret = EAI_FAIL;
+               verbosef("gethostbyname error %s", hstrerror(h_errno));
+            } else {
+               ret = 0;
+               strlcpy(host, he->h_name, sizeof(host));
+            }
+            pthread_mutex_unlock(&reply_lock);
+         }
+         break;
+      case IPv6:
+         sin6.sin6_family = AF_INET6;
+         memcpy(&sin6.sin6_addr, &ip->ip.v6, sizeof(sin6.sin6_addr));
+         ret = getnameinfo((struct sockaddr *) &sin6, sizeof(sin6),
+                           host, sizeof(host), NULL, 0, flags);
+         break;
+      default:
+         errx(1, "unexpected ip.family = %d", ip->family);
+   }
+
+   if (ret != 0) {
+      reply->name[0] = '\0';
+      reply->error = ret;
+   } else {
+      assert(sizeof(reply->name) > sizeof(char *)); /* not just a ptr */
+      strlcpy(reply->name, host, sizeof(reply->name));
+      reply->error = 0;
+   }
+}
+
+static void *
+dns_worker(void *arg _unused_)
+{
+   for (;;) {
+      struct addr ip;
+      struct dns_reply reply;
+
+      dequeue(&ip);
+      resolve(&ip, &reply);
+      pthread_mutex_lock(&reply_lock);
+      xwrite(dns_sock[CHILD], &reply, sizeof(reply));
+      pthread_mutex_unlock(&reply_lock);
+      verbosef("DNS: %s is \"%s\".", addr_to_str(&reply.addr),
+         (reply.error == 0) ? reply.name : gai_strerror(reply.error));
+   }
+   return (NULL);
+}
+
 static void
 dns_main(void)
 {
-   struct addr ip;
+   struct addr buf[DNS_BATCH];
+   size_t len = 0;
+   unsigned int i;
 
    setproctitle("DNS child");
-   fd_set_nonblock(dns_sock[CHILD]);
-   verbosef("DNS child entering main DNS loop");
-   for (;;) {
-      int blocking;
+   if (opt_dns_timeout != 0) {
+      /* getnameinfo() has no timeout of its own, but the resolver reads
+       * this, on glibc and the BSDs.
+       */
+      char res_options[64];
+
+      snprintf(res_options, sizeof(res_options), "timeout:%u attempts:1",
+         opt_dns_timeout);
+      if (setenv("RES_OPTIONS", res_options, 1) == -1)
+         err(1, "setenv(RES_OPTIONS)");
+   }
+   for (i=0; i<opt_dns_workers; i++) {
+      pthread_t thread;
+      int ret = pthread_create(&thread, NULL, dns_worker, NULL);
 
-      if (STAILQ_EMPTY(&queue)) {
-         blocking = 1;
-         fd_set_block(dns_sock[CHILD]);
-         verbosef("entering blocking read loop");
-      } else {
-         blocking = 0;
-         fd_set_nonblock(dns_sock[CHILD]);
-         verbosef("non-blocking poll");
-      }
-      for (;;) {
-         /* While we have input to process... */
-         ssize_t numread = read(dns_sock[CHILD], &ip, sizeof(ip));
-         if (numread == 0)
-            exit(0); /* end of file, nothing more to do here. */
-         if (numread == -1) {
-            if (!blocking && (errno == EAGAIN))
-               break; /* ran out of input */
-            /* else error */
-            err(1, "DNS: read failed");
-         }
-         if (numread != sizeof(ip))
-            err(1, "DNS: read got %zu bytes, expecting %zu",
-               numread, sizeof(ip));
-         enqueue(&ip);
-         if (blocking) {
-            /* After one blocking read, become non-blocking so that when we
-             * run out of input we fall through to queue processing.
-             */
-            blocking = 0;
-            fd_set_nonblock(dns_sock[CHILD]);
-         }
+      if (ret != 0)
+         errx(1, "DNS: pthread_create: %s", strerror(ret));
+      pthread_detach(thread);
+   }
+   fd_set_block(dns_sock[CHILD]);
+   verbosef("DNS child entering main DNS loop, with %u workers",
+      opt_dns_workers);
+   for (;;) {
+      /* Take as many addresses as have arrived, keeping any partial one. */
+      ssize_t numread = read(dns_sock[CHILD], (char *)buf + len,
+         sizeof(buf) - len);
+      size_t pos;
+
+      if (numread == 0)
+         exit(0); /* end of file, nothing more to do here. */
+      if (numread == -1) {
+         if (errno == EINTR)
+            continue;
+         err(1, "DNS: read failed");
       }
+      len += (size_t)numread;
+      for (pos = 0; len - pos >= sizeof(*buf); pos += sizeof(*buf)) {
+         struct addr ip;
 
-      /* Process queue. */
-      if (dequeue(&ip)) {
-         struct dns_reply reply;
-         struct sockaddr_in sin;
-         struct sockaddr_in6 sin6;
-         struct hostent *he;
-         char host[NI_MAXHOST];
-         int ret, flags;
-
-         reply.addr = ip;
-         flags = NI_NAMEREQD;
-#  ifdef NI_IDN
-         flags |= NI_IDN;
-#  endif
-         switch (ip.family) {
-            case IPv4:
-               sin.sin_family = AF_INET;
-               sin.sin_addr.s_addr = ip.ip.v4;
-               ret = getnameinfo((struct sockaddr *) &sin, sizeof(sin),
-                                 host, sizeof(host), NULL, 0, flags);
-               if (ret == EAI_FAMILY) {
-                  verbosef("getnameinfo error %s, trying gethostbyname",
-                     gai_strerror(ret));
-                  he = gethostbyaddr(&sin.sin_addr.s_addr,
-                     sizeof(sin.sin_addr.s_addr), sin.sin_family);
-                  if (he == NULL) {
-                     ret = EAI_FAIL;
-                     verbosef("gethostbyname error %s", hstrerror(h_errno));
-                  } else {
-                     ret = 0;
-                     strlcpy(host, he->h_name, sizeof(host));
-                  }
-               }
-               break;
-            case IPv6:
-               sin6.sin6_family = AF_INET6;
-               memcpy(&sin6.sin6_addr, &ip.ip.v6, sizeof(sin6.sin6_addr));
-               ret = getnameinfo((struct sockaddr *) &sin6, sizeof(sin6),
-                                 host, sizeof(host), NULL, 0, flags);
-               break;
-            default:
-               errx(1, "unexpected ip.family = %d", ip.family);
-         }
-
-         if (ret != 0) {
-            reply.name[0] = '\0';
-            reply.error = ret;
-         } else {
-            assert(sizeof(reply.name) > sizeof(char *)); /* not just a ptr */
-            strlcpy(reply.name, host, sizeof(reply.name));
-            reply.error = 0;
-         }
-         fd_set_block(dns_sock[CHILD]);
-         xwrite(dns_sock[CHILD], &reply, sizeof(reply));
-         verbosef("DNS: %s is \"%s\".", addr_to_str(&reply.addr),
-            (ret == 0) ? reply.name : gai_strerror(ret));
+         memcpy(&ip, (char *)buf + pos, sizeof(ip));
+         enqueue(&ip);
       }
+      len -= pos;
+      memmove(buf, (char *)buf + pos, len);
    }
 }
 
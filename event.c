@@ -0,0 +1,329 @@
+/* darkstat 3
+ * copyright (c) 2026 darkstat contributors.
+ *
+ * event.c: waiting for file descriptors with epoll, kqueue or select()
+ *
+ * You may use, modify and redistribute this file under the terms of the
+ * GNU General Public License version 2. (see COPYING.GPL)
+ */
+
+/* Registrations are kept per fd, in a table indexed by the fd, and stay put
+ * between waits, so the cost of a wait is in what's ready rather than in
+ * everything that's registered.  select() is the fallback, and has to
+ * rebuild its sets from the table every time.
+ *
+ * Timers are few (the once-a-second rotation, exports, the change log) so
+ * they're a small array, searched whole.
+ */
+
+#include "config.h"
+#include "conv.h"
+#include "err.h"
+#include "event.h"
+#include "now.h"
+
+#if defined(HAVE_SYS_EPOLL_H)
+# define EVENT_EPOLL
+# include <sys/epoll.h>
+#elif defined(HAVE_SYS_EVENT_H)
+# define EVENT_KQUEUE
+# include <sys/types.h>
+# include <sys/event.h>
+# include <sys/time.h>
+#else
+# include <sys/select.h>
+#endif
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+struct event_handler {
+   int events; /* 0 if the fd isn't registered */
+   event_fn *fn;
+   void *arg;
+};
+
+static struct event_handler *handlers = NULL;
+static int num_handlers = 0;
+
+/* Most fds handed back by one wait. */
+#define EVENT_MAX 64
+
+struct event_ready {
+   int fd;
+   int events;
+};
+
+static struct event_ready ready[EVENT_MAX];
+static int num_ready = 0;
+
+struct event_timer {
+   event_fn *fn; /* NULL if unused */
+   void *arg;
+   int64_t due;  /* now_mono_msec() */
+};
+
+#define EVENT_TIMERS_MAX 8
+
+static struct event_timer timers[EVENT_TIMERS_MAX];
+
+#if defined(EVENT_EPOLL) || defined(EVENT_KQUEUE)
+static int event_fd = -1;
+#else
+static int max_fd = -1;
+#endif
+
+void event_init(void) {
+#if defined(EVENT_EPOLL)
+   if ((event_fd = epoll_create(EVENT_MAX)) == -1)
+      err(1, "epoll_create()");
+   verbosef("waiting for events with epoll");
+#elif defined(EVENT_KQUEUE)
+   if ((event_fd = kqueue()) == -1)
+      err(1, "kqueue()");
+   verbosef("waiting for events with kqueue");
+#else
+   verbosef("waiting for events with select()");
+#endif
+}
+
+void event_free(void) {
+#if defined(EVENT_EPOLL) || defined(EVENT_KQUEUE)
+   if (event_fd != -1)
+      close(event_fd);
+   event_fd = -1;
+#endif
+   free(handlers);
+   handlers = NULL;
+   num_handlers = 0;
+   num_ready = 0;
+   memset(timers, 0, sizeof(timers));
+}
+
+#if defined(EVENT_KQUEUE)
+/* Add or remove one kqueue filter. */
+static void event_kevent(const int fd, const short filter, const int add) {
+   struct kevent kev;
+
+   EV_SET(&kev, fd, filter, add ? EV_ADD : EV_DELETE, 0, 0, NULL);
+   if (kevent(event_fd, &kev, 1, NULL, 0, NULL) == -1 &&
+       !(errno == ENOENT && !add))
+      err(1, "kevent(fd %d)", fd);
+}
+#endif
+
+int event_set(const int fd, const int events, event_fn *fn, void *arg) {
+   int old;
+
+   assert(fd >= 0);
+#if !defined(EVENT_EPOLL) && !defined(EVENT_KQUEUE)
+   if (fd >= FD_SETSIZE) {
+      if (events == 0)
+         return 0;
+      verbosef("can't select() on fd %d, FD_SETSIZE is %d", fd, FD_SETSIZE);
+      return -1;
+   }
+#endif
+   if (fd >= num_handlers) {
+      int n = num_handlers ? num_handlers : 16;
+
+      if (events == 0)
+         return 0; /* was never registered */
+      while (n <= fd)
+         n *= 2;
+      handlers = xrealloc(handlers, n * sizeof(*handlers));
+      memset(handlers + num_handlers, 0,
+         (n - num_handlers) * sizeof(*handlers));
+      num_handlers = n;
+   }
+   old = handlers[fd].events;
+   handlers[fd].events = events;
+   handlers[fd].fn = fn;
+   handlers[fd].arg = arg;
+   if (events == old)
+      return 0;
+
+#if defined(EVENT_EPOLL)
+   {
+      struct epoll_event ev;
+      int op;
+
+      memset(&ev, 0, sizeof(ev));
+      ev.data.fd = fd;
+      if (events & EVENT_READ)
+         ev.events |= EPOLLIN;
+      if (events & EVENT_WRITE)
+         ev.events |= EPOLLOUT;
+      op = (old == 0) ? EPOLL_CTL_ADD :
+           (events == 0) ? EPOLL_CTL_DEL : EPOLL_CTL_MOD;
+      if (epoll_ctl(event_fd, op, fd, &ev) == -1)
+         err(1, "epoll_ctl(fd %d)", fd);
+   }
+#elif defined(EVENT_KQUEUE)
+   if ((old ^ events) & EVENT_READ)
+      event_kevent(fd, EVFILT_READ, events & EVENT_READ);
+   if ((old ^ events) & EVENT_WRITE)
+      event_kevent(fd, EVFILT_WRITE, events & EVENT_WRITE);
+#else
+   if (events != 0 && fd > max_fd)
+      max_fd = fd;
+#endif
+   return 0;
+}
+
+void event_after(const int msec, event_fn *fn, void *arg) {
+   struct event_timer *t = NULL;
+   int i;
+
+   assert(fn != NULL);
+   for (i = 0; i < EVENT_TIMERS_MAX; i++)
+      if (timers[i].fn == fn && timers[i].arg == arg) {
+         t = &timers[i];
+         break;
+      } else if (timers[i].fn == NULL && t == NULL)
+         t = &timers[i];
+   if (t == NULL)
+      errx(1, "more than %d timers", EVENT_TIMERS_MAX);
+   t->fn = fn;
+   t->arg = arg;
+   t->due = now_mono_msec() + msec;
+}
+
+void event_timers_run(void) {
+   const int64_t now = now_mono_msec();
+   int i;
+
+   for (i = 0; i < EVENT_TIMERS_MAX; i++)
+      if (timers[i].fn != NULL && timers[i].due <= now) {
+         event_fn *fn = timers[i].fn;
+
+         timers[i].fn = NULL; /* before fn, which can set it again */
+         fn(timers[i].arg);
+      }
+}
+
+/* timeout_msec, cut short by the next timer. */
+static int timers_timeout(int timeout_msec) {
+   int64_t now = 0;
+   int i;
+
+   for (i = 0; i < EVENT_TIMERS_MAX; i++)
+      if (timers[i].fn != NULL) {
+         int64_t until;
+
+         if (now == 0)
+            now = now_mono_msec();
+         until = (timers[i].due > now) ? timers[i].due - now : 0;
+         if (timeout_msec == -1 || until < timeout_msec)
+            timeout_msec = (int)until;
+      }
+   return timeout_msec;
+}
+
+int event_wait(int timeout_msec) {
+#if defined(EVENT_EPOLL)
+   struct epoll_event evs[EVENT_MAX];
+   int i, n;
+
+   num_ready = 0;
+   timeout_msec = timers_timeout(timeout_msec);
+   n = epoll_wait(event_fd, evs, EVENT_MAX, timeout_msec);
+   if (n == -1)
+      return -1;
+   for (i = 0; i < n; i++) {
+      int events = 0;
+
+      if (evs[i].events & EPOLLIN)
+         events |= EVENT_READ;
+      if (evs[i].events & EPOLLOUT)
+         events |= EVENT_WRITE;
+      if (evs[i].events & (EPOLLERR | EPOLLHUP))
+         events |= EVENT_READ | EVENT_WRITE; /* let the handler find out */
+      ready[num_ready].fd = evs[i].data.fd;
+      ready[num_ready].events = events;
+      num_ready++;
+   }
+   return n;
+#elif defined(EVENT_KQUEUE)
+   struct kevent evs[EVENT_MAX];
+   struct timespec ts, *tsp = NULL;
+   int i, n;
+
+   num_ready = 0;
+   timeout_msec = timers_timeout(timeout_msec);
+   if (timeout_msec >= 0) {
+      ts.tv_sec = timeout_msec / 1000;
+      ts.tv_nsec = (long)(timeout_msec % 1000) * 1000000;
+      tsp = &ts;
+   }
+   n = kevent(event_fd, NULL, 0, evs, EVENT_MAX, tsp);
+   if (n == -1)
+      return -1;
+   for (i = 0; i < n; i++) {
+      ready[num_ready].fd = (int)evs[i].ident;
+      ready[num_ready].events =
+         (evs[i].filter == EVFILT_WRITE) ? EVENT_WRITE : EVENT_READ;
+      num_ready++;
+   }
+   return n;
+#else
+   fd_set rs, ws;
+   struct timeval tv, *tvp = NULL;
+   int fd, n, top = -1;
+
+   num_ready = 0;
+   timeout_msec = timers_timeout(timeout_msec);
+   FD_ZERO(&rs);
+   FD_ZERO(&ws);
+   for (fd = 0; fd <= max_fd; fd++) {
+      if (handlers[fd].events & EVENT_READ)
+         FD_SET(fd, &rs);
+      if (handlers[fd].events & EVENT_WRITE)
+         FD_SET(fd, &ws);
+      if (handlers[fd].events != 0)
+         top = fd;
+   }
+   max_fd = top; /* forget about fds removed since */
+   if (timeout_msec >= 0) {
+      tv.tv_sec = timeout_msec / 1000;
+      tv.tv_usec = (timeout_msec % 1000) * 1000;
+      tvp = &tv;
+   }
+   n = select(max_fd + 1, &rs, &ws, NULL, tvp);
+   if (n == -1)
+      return -1;
+   for (fd = 0; fd <= max_fd && num_ready < EVENT_MAX; fd++) {
+      int events = 0;
+
+      if (FD_ISSET(fd, &rs))
+         events |= EVENT_READ;
+      if (FD_ISSET(fd, &ws))
+         events |= EVENT_WRITE;
+      if (events != 0) {
+         ready[num_ready].fd = fd;
+         ready[num_ready].events = events;
+         num_ready++;
+      }
+   }
+   return n;
+#endif
+}
+
+void event_dispatch(void) {
+   int i;
+
+   for (i = 0; i < num_ready; i++) {
+      const int fd = ready[i].fd;
+
+      /* Look it up each time: an earlier handler can have changed it. */
+      if (fd < num_handlers && handlers[fd].fn != NULL &&
+          (handlers[fd].events & ready[i].events))
+         handlers[fd].fn(handlers[fd].arg);
+   }
+   num_ready = 0;
+}
+
+/* vim:set ts=3 sw=3 tw=78 expandtab: */
@@ -0,0 +1,47 @@
+/* darkstat 3
+ * copyright (c) 2026 darkstat contributors.
+ *
+ * event.h: waiting for file descriptors with epoll, kqueue or select()
+ *
+ * You may use, modify and redistribute this file under the terms of the
+ * GNU General Public License version 2. (see COPYING.GPL)
+ */
+#ifndef __DARKSTAT_EVENT_H
+#define __DARKSTAT_EVENT_H
+
+#define EVENT_READ  1
+#define EVENT_WRITE 2
+
+typedef void (event_fn)(void *arg);
+
+void event_init(void);
+void event_free(void);
+
+/* Wait for fd to be ready for the given events, then call fn(arg) from
+ * event_dispatch().  The registration stays until changed, and events of 0
+ * removes it.  fn can be NULL, to only wake up event_wait().
+ * Returns -1 if the fd can't be waited on.
+ */
+int event_set(const int fd, const int events, event_fn *fn, void *arg);
+
+/* Wait up to timeout_msec, or forever if it's -1, for registered fds to be
+ * ready, or for the next timer.  Returns how many are, or -1 with errno set.
+ */
+int event_wait(const int timeout_msec);
+
+/* Call fn(arg) from event_timers_run(), once msec have passed.  Timers are
+ * one-shot, and setting one again for the same fn and arg moves it.
+ * event_wait() waits no longer than until the next one is due.
+ */
+void event_after(const int msec, event_fn *fn, void *arg);
+
+/* Call the handlers of the timers that are due. */
+void event_timers_run(void);
+
+/* Call the handlers of the fds that event_wait() found ready.  Handlers can
+ * change any registration, including their own.
+ */
+void event_dispatch(void);
+
+#endif /* __DARKSTAT_EVENT_H */
+/* vim:set ts=3 sw=3 tw=78 expandtab: */
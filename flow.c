@@ -0,0 +1,754 @@
+/* darkstat 3
+ * copyright (c) 2026 darkstat contributors.
+ *
+ * flow.c: collecting NetFlow v9, IPFIX and sFlow from routers
+ *
+ * You may use, modify and redistribute this file under the terms of the
+ * GNU General Public License version 2. (see COPYING.GPL)
+ */
+
+/* Links too fast to capture on can still be counted by the routers on
+ * them, which describe their traffic instead: NetFlow v9 and IPFIX export a
+ * record for each flow, with its byte and packet counts, and sFlow exports
+ * the headers of one in every so many packets.  Either way, each becomes a
+ * pktsummary with packets > 1, like the pf backend's, and they go to
+ * acct_for_batch() in batches.
+ *
+ * NetFlow v9 and IPFIX records can only be read with the template that the
+ * exporter sent for them earlier.  Templates are kept per exporter and per
+ * observation domain (the source id, in v9), and records that come before
+ * their template are dropped until the exporter sends it again, which they
+ * do every so often.  Options records are only read for the sampling
+ * interval, which then applies to the domain's records that don't carry
+ * their own.
+ *
+ * The three share one UDP port, and are told apart by their version.
+ */
+
+#include "acct.h"
+#include "addr.h"
+#include "conv.h"
+#include "decode.h"
+#include "err.h"
+#include "event.h"
+#include "flow.h"
+#include "localip.h"
+#include "metrics.h"
+#include "opt.h"
+#include "snapshot.h"
+#include "str.h"
+#include "tree.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <assert.h>
+#include <errno.h>
+#include <pcap.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define FLOW_BATCH 256          /* summaries per acct_for_batch() */
+#define FLOW_READS 64           /* datagrams per wakeup, at most */
+#define FLOW_SOCKS_MAX 8
+#define FLOW_TEMPLATES_MAX 4096 /* from all exporters */
+#define FLOW_DOMAINS_MAX 1024   /* (exporter, domain id) pairs with templates */
+#define FLOW_RCVBUF (4 << 20)   /* to ride out bursts of datagrams */
+
+/* Information elements, which NetFlow v9 numbers the same way. */
+#define IE_OCTETS        1
+#define IE_PACKETS       2
+#define IE_PROTO         4
+#define IE_SRC_PORT      7
+#define IE_SRC_V4        8
+#define IE_DST_PORT      11
+#define IE_DST_V4        12
+#define IE_SRC_V6        27
+#define IE_DST_V6        28
+#define IE_SAMPLING      34
+#define IE_SRC_MAC       56
+#define IE_DST_MAC       80
+#define IE_SAMPLING_PKTS 305
+
+#define IE_VARLEN 65535 /* an IPFIX field's length, when each record has it */
+#define IE_ENTERPRISE 0x8000
+
+struct flow_field {
+   uint16_t type; /* 0 for the ones we don't read */
+   uint16_t len;  /* or IE_VARLEN */
+};
+
+struct flow_tmpl {
+   RB_ENTRY(flow_tmpl) link;
+   uint16_t id;
+   uint16_t nfields;
+   int options;
+   size_t min_len; /* of a record, counting variable-length fields as 1 */
+   struct flow_field *field;
+};
+
+struct flow_domain {
+   RB_ENTRY(flow_domain) link;
+   struct addr exporter;
+   uint32_t id;
+   uint32_t sampling; /* from its options records, or 1 */
+   RB_HEAD(tmpl_t, flow_tmpl) tmpls;
+};
+
+static int
+tmpl_cmp(struct flow_tmpl *a, struct flow_tmpl *b)
+{
+   return (int)a->id - (int)b->id;
+}
+
+static int
+domain_cmp(struct flow_domain *a, struct flow_domain *b)
+{
+   if (a->exporter.family != b->exporter.family)
+      return (a->exporter.family == IPv4) ? -1 : +1;
+   if (a->exporter.family == IPv4) {
+      const int c = memcmp(&a->exporter.ip.v4, &b->exporter.ip.v4,
+         sizeof(a->exporter.ip.v4));
+      if (c != 0)
+         return c;
+   } else {
+      const int c = memcmp(&a->exporter.ip.v6, &b->exporter.ip.v6,
+         sizeof(a->exporter.ip.v6));
+      if (c != 0)
+         return c;
+   }
+   return (a->id < b->id) ? -1 : (a->id > b->id);
+}
+
+RB_GENERATE_STATIC(tmpl_t, flow_tmpl, link, tmpl_cmp)
+static RB_HEAD(domain_t, flow_domain) domains = RB_INITIALIZER(&domains);
+RB_GENERATE_STATIC(domain_t, flow_domain, link, domain_cmp)
+static unsigned int num_templates = 0, num_domains = 0;
+
+static int socks[FLOW_SOCKS_MAX];
+static unsigned int num_socks = 0;
+static struct local_ips local_ips;
+
+static struct pktsummary batch[FLOW_BATCH];
+static size_t batch_len = 0;
+
+static struct {
+   uint64_t datagrams, records, errors, unknown;
+} stats;
+
+static uint16_t get16(const uint8_t *p) {
+   return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static uint32_t get32(const uint8_t *p) {
+   return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+      (uint32_t)p[2] << 8 | p[3];
+}
+
+/* A big-endian counter of any length up to 8 bytes. */
+static uint64_t getn(const uint8_t *p, const size_t len) {
+   uint64_t n = 0;
+   size_t i;
+
+   if (len > 8)
+      return 0;
+   for (i=0; i<len; i++)
+      n = (n << 8) | p[i];
+   return n;
+}
+
+/* ---------------------------------------------------------------------------
+ * Templates.  A domain only exists while it has some, so that datagrams
+ * from anywhere can't make them pile up.
+ */
+static struct flow_domain *domain_get(const struct addr *exporter,
+   const uint32_t id, const int create) {
+   struct flow_domain tmp, *d;
+
+   memset(&tmp, 0, sizeof(tmp));
+   tmp.exporter = *exporter;
+   tmp.id = id;
+   if ((d = RB_FIND(domain_t, &domains, &tmp)) != NULL || !create)
+      return d;
+   if (num_domains >= FLOW_DOMAINS_MAX)
+      return NULL;
+   d = xcalloc(1, sizeof(*d));
+   d->exporter = *exporter;
+   d->id = id;
+   d->sampling = 1;
+   RB_INIT(&d->tmpls);
+   RB_INSERT(domain_t, &domains, d);
+   num_domains++;
+   return d;
+}
+
+static struct flow_tmpl *tmpl_get(struct flow_domain *d, const uint16_t id) {
+   struct flow_tmpl tmp;
+
+   tmp.id = id;
+   return RB_FIND(tmpl_t, &d->tmpls, &tmp);
+}
+
+/* Frees d as well if that was its last template. */
+static void tmpl_remove(struct flow_domain *d, struct flow_tmpl *t) {
+   RB_REMOVE(tmpl_t, &d->tmpls, t);
+   free(t->field);
+   free(t);
+   num_templates--;
+   if (RB_EMPTY(&d->tmpls)) {
+      RB_REMOVE(domain_t, &domains, d);
+      free(d);
+      num_domains--;
+   }
+}
+
+/* Takes over fields.  A template that's sent again replaces the old one.
+ * The domain is made for the first template that's kept.
+ */
+static void tmpl_put(const struct addr *exporter, const uint32_t domain_id,
+   const uint16_t id, const int options, struct flow_field *fields,
+   const uint16_t nfields) {
+   struct flow_domain *d = domain_get(exporter, domain_id, 0);
+   struct flow_tmpl *t = (d == NULL) ? NULL : tmpl_get(d, id);
+   size_t min_len = 0;
+   uint16_t i;
+
+   for (i=0; i<nfields; i++)
+      min_len += (fields[i].len == IE_VARLEN) ? 1 : fields[i].len;
+   if (min_len == 0) {
+      free(fields);
+      return; /* would never get anywhere */
+   }
+   if (t == NULL) {
+      if (num_templates >= FLOW_TEMPLATES_MAX ||
+          (d == NULL && (d = domain_get(exporter, domain_id, 1)) == NULL)) {
+         free(fields);
+         return;
+      }
+      t = xmalloc(sizeof(*t));
+      t->id = id;
+      RB_INSERT(tmpl_t, &d->tmpls, t);
+      num_templates++;
+   } else
+      free(t->field);
+   t->options = options;
+   t->field = fields;
+   t->nfields = nfields;
+   t->min_len = min_len;
+}
+
+static void templates_free(void) {
+   struct flow_domain *d;
+
+   /* The last template of each domain takes it with it. */
+   while ((d = RB_MIN(domain_t, &domains)) != NULL)
+      tmpl_remove(d, RB_MIN(tmpl_t, &d->tmpls));
+}
+
+/* ---------------------------------------------------------------------------
+ * Decoding.
+ */
+static void flow_add(const struct pktsummary *sm) {
+   batch[batch_len++] = *sm;
+   if (batch_len == FLOW_BATCH)
+      flow_flush();
+}
+
+void flow_flush(void) {
+   if (batch_len == 0)
+      return;
+   acct_for_batch(batch, batch_len, &local_ips, NULL);
+   stats.records += batch_len;
+   batch_len = 0;
+}
+
+/* Read one record of template t from p, which has len bytes left in its
+ * set.  Returns the record's length, or 0 if it doesn't fit.
+ */
+static size_t decode_record(struct flow_domain *d,
+   const struct flow_tmpl *t, const uint8_t *p, const size_t len) {
+   struct pktsummary sm;
+   uint64_t sampling = 0;
+   size_t ofs = 0;
+   uint16_t i;
+
+   memset(&sm, 0, sizeof(sm));
+   sm.proto = IPPROTO_INVALID;
+   for (i=0; i<t->nfields; i++) {
+      size_t flen = t->field[i].len;
+      const uint8_t *f;
+
+      if (flen == IE_VARLEN) {
+         if (ofs + 1 > len)
+            return 0;
+         flen = p[ofs++];
+         if (flen == 255) {
+            if (ofs + 2 > len)
+               return 0;
+            flen = get16(p + ofs);
+            ofs += 2;
+         }
+      }
+      if (ofs + flen > len)
+         return 0;
+      f = p + ofs;
+      ofs += flen;
+
+      switch (t->field[i].type) {
+      case IE_OCTETS:  sm.len = getn(f, flen); break;
+      case IE_PACKETS: sm.packets = getn(f, flen); break;
+      case IE_PROTO:
+         if (flen == 1)
+            sm.proto = f[0];
+         break;
+      case IE_SRC_PORT: sm.src_port = (uint16_t)getn(f, flen); break;
+      case IE_DST_PORT: sm.dst_port = (uint16_t)getn(f, flen); break;
+      case IE_SRC_V4:
+      case IE_DST_V4:
+         if (flen == 4) {
+            struct addr *a = (t->field[i].type == IE_SRC_V4) ?
+               &sm.src : &sm.dst;
+
+            a->family = IPv4;
+            memcpy(&a->ip.v4, f, 4);
+         }
+         break;
+      case IE_SRC_V6:
+      case IE_DST_V6:
+         if (flen == 16) {
+            struct addr *a = (t->field[i].type == IE_SRC_V6) ?
+               &sm.src : &sm.dst;
+
+            a->family = IPv6;
+            memcpy(&a->ip.v6, f, 16);
+         }
+         break;
+      case IE_SRC_MAC:
+         if (flen == sizeof(sm.src_mac))
+            memcpy(sm.src_mac, f, flen);
+         break;
+      case IE_DST_MAC:
+         if (flen == sizeof(sm.dst_mac))
+            memcpy(sm.dst_mac, f, flen);
+         break;
+      case IE_SAMPLING:
+      case IE_SAMPLING_PKTS:
+         sampling = getn(f, flen);
+         break;
+      }
+   }
+
+   if (t->options) {
+      if (sampling != 0 && sampling <= UINT32_MAX)
+         d->sampling = (uint32_t)sampling;
+      return ofs;
+   }
+   if (sm.src.family == 0 || sm.dst.family == 0 || sm.len == 0)
+      return ofs; /* nothing to count */
+   if (sampling == 0)
+      sampling = d->sampling;
+   if (sm.packets == 0)
+      sm.packets = 1;
+   sm.len *= sampling;
+   sm.packets *= sampling;
+   if (sm.proto != IPPROTO_TCP && sm.proto != IPPROTO_UDP)
+      sm.src_port = sm.dst_port = 0;
+   flow_add(&sm);
+   return ofs;
+}
+
+/* Read a set of templates.  v9 options templates give the lengths of their
+ * scope and option fields in bytes, IPFIX ones give the count of all of them
+ * and then of the scope ones.  Scope fields aren't read.  Returns 0 if the
+ * set is malformed.
+ */
+static int decode_templates(const struct addr *exporter,
+   const uint32_t domain_id, const uint8_t *p, size_t len, const int ipfix,
+   const int options) {
+   const size_t hdr = options ? 6 : 4;
+
+   while (len >= hdr) {
+      const uint16_t id = get16(p);
+      unsigned int n = get16(p + 2), scope = 0, i;
+      struct flow_field *fields;
+
+      if (options && !ipfix) {
+         scope = get16(p + 2) / 4;
+         n = scope + get16(p + 4) / 4;
+      } else if (options)
+         scope = get16(p + 4);
+      p += hdr;
+      len -= hdr;
+      if (id < 256)
+         return 0;
+      if (n == 0) {
+         /* IPFIX withdraws a template this way. */
+         struct flow_domain *d = domain_get(exporter, domain_id, 0);
+         struct flow_tmpl *t = (d == NULL) ? NULL : tmpl_get(d, id);
+
+         if (t != NULL)
+            tmpl_remove(d, t);
+         continue;
+      }
+      if (n > UINT16_MAX)
+         return 0;
+
+      fields = xmalloc(n * sizeof(*fields));
+      for (i=0; i<n; i++) {
+         if (len < 4) {
+            free(fields);
+            return 0;
+         }
+         fields[i].type = get16(p);
+         fields[i].len = get16(p + 2);
+         p += 4;
+         len -= 4;
+         if (ipfix && (fields[i].type & IE_ENTERPRISE)) {
+            if (len < 4) {
+               free(fields);
+               return 0;
+            }
+            p += 4;
+            len -= 4;
+            fields[i].type = 0;
+         }
+         if (!ipfix && fields[i].len == IE_VARLEN) {
+            free(fields);
+            return 0;
+         }
+         if (i < scope)
+            fields[i].type = 0;
+      }
+      tmpl_put(exporter, domain_id, id, options, fields, (uint16_t)n);
+   }
+   return 1;
+}
+
+/* NetFlow v9 and IPFIX only differ in their headers, set ids and
+ * variable-length fields.
+ */
+static void decode_netflow(const struct addr *exporter, const uint8_t *p,
+   size_t len, const int ipfix) {
+   const size_t hdr = ipfix ? 16 : 20;
+   const uint16_t set_tmpl = ipfix ? 2 : 0, set_opts = ipfix ? 3 : 1;
+   uint32_t domain_id;
+   struct flow_domain *d;
+
+   if (len < hdr) {
+      stats.errors++;
+      return;
+   }
+   if (ipfix) {
+      const size_t msg_len = get16(p + 2);
+
+      if (msg_len < hdr || msg_len > len) {
+         stats.errors++;
+         return;
+      }
+      len = msg_len;
+   }
+   domain_id = get32(p + hdr - 4);
+   d = domain_get(exporter, domain_id, 0);
+   p += hdr;
+   len -= hdr;
+
+   while (len >= 4) {
+      const uint16_t id = get16(p);
+      const size_t set_len = get16(p + 2);
+
+      if (set_len < 4 || set_len > len) {
+         stats.errors++;
+         return;
+      }
+      if (id == set_tmpl || id == set_opts) {
+         const int ok = decode_templates(exporter, domain_id, p + 4,
+            set_len - 4, ipfix, id == set_opts);
+
+         /* It may have come or gone with its templates. */
+         d = domain_get(exporter, domain_id, 0);
+         if (!ok) {
+            stats.errors++;
+            return;
+         }
+      } else if (id >= 256) {
+         const struct flow_tmpl *t = (d == NULL) ? NULL : tmpl_get(d, id);
+
+         if (t == NULL)
+            stats.unknown++;
+         else {
+            const uint8_t *r = p + 4;
+            size_t left = set_len - 4, used;
+
+            /* Anything shorter than a record is padding. */
+            while (left >= t->min_len &&
+                   (used = decode_record(d, t, r, left)) != 0) {
+               r += used;
+               left -= used;
+            }
+         }
+      }
+      p += set_len;
+      len -= set_len;
+   }
+}
+
+/* sFlow's raw packet header record: the first bytes of a sampled packet,
+ * which the capture decoders can read.
+ */
+static void decode_sflow_header(const uint8_t *p, const size_t len,
+   const uint32_t rate) {
+   const struct linkhdr *lh;
+   struct pcap_pkthdr ph;
+   struct pktsummary sm;
+   uint32_t hdr_len;
+
+   if (len < 16)
+      return;
+   switch (get32(p)) {
+   case 1:  lh = getlinkhdr(DLT_EN10MB); break;
+   case 11: /* IPv4 */
+   case 12: lh = getlinkhdr(DLT_RAW); break; /* IPv6 */
+   default: return;
+   }
+   hdr_len = get32(p + 12);
+   if (lh == NULL || hdr_len > len - 16)
+      return;
+   memset(&ph, 0, sizeof(ph));
+   ph.caplen = hdr_len;
+   ph.len = get32(p + 4);
+   memset(&sm, 0, sizeof(sm));
+   if (!lh->decoder(&ph, p + 16, &sm))
+      return;
+   sm.packets = (rate != 0) ? rate : 1;
+   sm.len *= sm.packets;
+   flow_add(&sm);
+}
+
+/* A flow sample, or an expanded one, which has wider interface numbers. */
+static void decode_sflow_sample(const uint8_t *p, const size_t len,
+   const int expanded) {
+   const size_t hdr = expanded ? 44 : 32;
+   uint32_t rate, n;
+   size_t ofs = hdr;
+
+   if (len < hdr) {
+      stats.errors++;
+      return;
+   }
+   rate = get32(p + (expanded ? 12 : 8));
+   n = get32(p + hdr - 4);
+   while (n-- > 0 && ofs + 8 <= len) {
+      const uint32_t format = get32(p + ofs), rec_len = get32(p + ofs + 4);
+
+      ofs += 8;
+      if (rec_len > len - ofs) {
+         stats.errors++;
+         return;
+      }
+      if (format == 1)
+         decode_sflow_header(p + ofs, rec_len, rate);
+      ofs += rec_len;
+   }
+}
+
+static void decode_sflow(const uint8_t *p, const size_t len) {
+   size_t ofs;
+   uint32_t n;
+
+   if (len < 8) {
+      stats.errors++;
+      return;
+   }
+   switch (get32(p + 4)) { /* the agent's address */
+   case 1:  ofs = 8 + 4; break;
+   case 2:  ofs = 8 + 16; break;
+   default: stats.errors++; return;
+   }
+   ofs += 12; /* sub-agent, sequence number, uptime */
+   if (len < ofs + 4) {
+      stats.errors++;
+      return;
+   }
+   n = get32(p + ofs);
+   ofs += 4;
+   while (n-- > 0 && ofs + 8 <= len) {
+      const uint32_t format = get32(p + ofs), sample_len = get32(p + ofs + 4);
+
+      ofs += 8;
+      if (sample_len > len - ofs) {
+         stats.errors++;
+         return;
+      }
+      if (format == 1 || format == 3)
+         decode_sflow_sample(p + ofs, sample_len, format == 3);
+      ofs += sample_len;
+   }
+}
+
+void flow_decode(const struct addr *exporter, const uint8_t *pkt,
+   const size_t len) {
+   stats.datagrams++;
+   if (len >= 4 && get32(pkt) == 5)
+      decode_sflow(pkt, len);
+   else if (len >= 2 && get16(pkt) == 9)
+      decode_netflow(exporter, pkt, len, 0);
+   else if (len >= 2 && get16(pkt) == 10)
+      decode_netflow(exporter, pkt, len, 1);
+   else
+      stats.errors++;
+}
+
+/* ---------------------------------------------------------------------------
+ * Sockets.
+ */
+static int sockaddr_to_addr(const struct sockaddr_storage *ss,
+   struct addr *a) {
+   if (ss->ss_family == AF_INET) {
+      a->family = IPv4;
+      a->ip.v4 = ((const struct sockaddr_in *)ss)->sin_addr.s_addr;
+      return 1;
+   }
+   if (ss->ss_family == AF_INET6) {
+      a->family = IPv6;
+      memcpy(&a->ip.v6, &((const struct sockaddr_in6 *)ss)->sin6_addr,
+         sizeof(a->ip.v6));
+      return 1;
+   }
+   return 0;
+}
+
+static void flow_read(void *arg) {
+   static uint8_t buf[65536];
+   const int fd = *(const int *)arg;
+   int i;
+
+   for (i=0; i<FLOW_READS; i++) {
+      struct sockaddr_storage from;
+      socklen_t fromlen = sizeof(from);
+      struct addr exporter;
+      ssize_t got;
+
+      got = recvfrom(fd, buf, sizeof(buf), 0, (struct sockaddr *)&from,
+         &fromlen);
+      if (got == -1) {
+         if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            warn("flow: recvfrom");
+         break;
+      }
+      if (sockaddr_to_addr(&from, &exporter))
+         flow_decode(&exporter, buf, (size_t)got);
+   }
+   flow_flush();
+}
+
+static void flow_listen_one(const struct addrinfo *ai) {
+   char ipaddr[INET6_ADDRSTRLEN];
+   int fd, sockopt;
+
+   if (num_socks == FLOW_SOCKS_MAX)
+      return;
+   if (getnameinfo(ai->ai_addr, ai->ai_addrlen, ipaddr, sizeof(ipaddr),
+                   NULL, 0, NI_NUMERICHOST) != 0)
+      strcpy(ipaddr, "?");
+   if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) == -1) {
+      warn("flow: socket for %s", ipaddr);
+      return;
+   }
+   fd_set_nonblock(fd);
+#ifdef IPV6_V6ONLY
+   if (ai->ai_family == AF_INET6) {
+      sockopt = 1;
+      if (setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY,
+                     &sockopt, sizeof(sockopt)) == -1)
+         err(1, "can't set IPV6_V6ONLY");
+   }
+#endif
+   sockopt = FLOW_RCVBUF;
+   if (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &sockopt, sizeof(sockopt)) == -1)
+      verbosef("flow: can't grow the receive buffer of %s", ipaddr);
+   if (bind(fd, ai->ai_addr, ai->ai_addrlen) == -1) {
+      warn("flow: bind(\"%s\") failed", ipaddr);
+      close(fd);
+      return;
+   }
+   verbosef("collecting flows on %s", ipaddr);
+   snapshot_fd_add(fd);
+   socks[num_socks++] = fd;
+}
+
+void flow_start(const char *spec) {
+   struct addrinfo hints, *ais, *ai;
+   char *host = NULL;
+   const char *port = spec, *colon = strrchr(spec, ':');
+   unsigned int i;
+   int ret;
+
+   /* [addr:]port, where addr can be a [v6addr] */
+   if (colon != NULL) {
+      port = colon + 1;
+      if (spec[0] == '[' && colon > spec + 1 && colon[-1] == ']')
+         host = split_string(spec, 1, (size_t)(colon - spec - 2));
+      else
+         host = split_string(spec, 0, (size_t)(colon - spec));
+   }
+   memset(&hints, 0, sizeof(hints));
+   hints.ai_family = AF_UNSPEC;
+   hints.ai_socktype = SOCK_DGRAM;
+   hints.ai_flags = AI_PASSIVE;
+   if ((ret = getaddrinfo(host, port, &hints, &ais)) != 0)
+      errx(1, "can't look up flow address \"%s\": %s", spec,
+         gai_strerror(ret));
+   for (ai = ais; ai != NULL; ai = ai->ai_next)
+      flow_listen_one(ai);
+   freeaddrinfo(ais);
+   free(host);
+   if (num_socks == 0)
+      errx(1, "was not able to bind any flow sockets");
+
+   for (i=0; i<num_socks; i++)
+      if (event_set(socks[i], EVENT_READ, flow_read, &socks[i]) == -1)
+         errx(1, "can't wait on flow socket %d", socks[i]);
+   localip_init(&local_ips);
+   if (title_interfaces == NULL)
+      title_interfaces = xstrdup(spec);
+}
+
+void flow_stop(void) {
+   unsigned int i;
+
+   for (i=0; i<num_socks; i++) {
+      event_set(socks[i], 0, NULL, NULL);
+      snapshot_fd_remove(socks[i]);
+      close(socks[i]);
+   }
+   if (num_socks != 0)
+      localip_free(&local_ips);
+   num_socks = 0;
+   templates_free();
+}
+
+void flow_metrics(struct str *buf) {
+   if (num_socks == 0)
+      return;
+   metrics_header(buf, "darkstat_flow_datagrams_total", "counter",
+      "NetFlow, IPFIX and sFlow datagrams received.");
+   str_appendf(buf, "darkstat_flow_datagrams_total %qu\n",
+      (qu)stats.datagrams);
+   metrics_header(buf, "darkstat_flow_records_total", "counter",
+      "Flow records and packet samples accounted for.");
+   str_appendf(buf, "darkstat_flow_records_total %qu\n", (qu)stats.records);
+   metrics_header(buf, "darkstat_flow_errors_total", "counter",
+      "Flow datagrams that were malformed, or of an unknown version.");
+   str_appendf(buf, "darkstat_flow_errors_total %qu\n", (qu)stats.errors);
+   metrics_header(buf, "darkstat_flow_unknown_sets_total", "counter",
+      "Sets of flow records dropped for want of their template.");
+   str_appendf(buf, "darkstat_flow_unknown_sets_total %qu\n",
+      (qu)stats.unknown);
+   metrics_header(buf, "darkstat_flow_templates", "gauge",
+      "NetFlow v9 and IPFIX templates kept, from all exporters.");
+   str_appendf(buf, "darkstat_flow_templates %u\n", num_templates);
+}
+
+/* vim:set ts=3 sw=3 tw=78 expandtab: */
@@ -0,0 +1,35 @@
+/* darkstat 3
+ * copyright (c) 2026 darkstat contributors.
+ *
+ * flow.h: collecting NetFlow v9, IPFIX and sFlow from routers
+ *
+ * You may use, modify and redistribute this file under the terms of the
+ * GNU General Public License version 2. (see COPYING.GPL)
+ */
+#ifndef __DARKSTAT_FLOW_H
+#define __DARKSTAT_FLOW_H
+
+#include <stddef.h> /* for size_t */
+#include <stdint.h>
+
+struct addr;
+struct str;
+
+/* Listen for flow datagrams on spec, which is [addr:]port.  It binds, so it
+ * has to come before privdrop(), and after event_init().
+ */
+void flow_start(const char *spec);
+void flow_stop(void);
+
+/* Account for the records in one datagram from exporter.  They go to
+ * acct_for_batch() in batches, and flow_flush() sends the last of them.
+ * The socket's event handler does both, so these are only for flow_test.
+ */
+void flow_decode(const struct addr *exporter, const uint8_t *pkt,
+   const size_t len);
+void flow_flush(void);
+
+void flow_metrics(struct str *buf); /* for /metrics */
+
+#endif /* __DARKSTAT_FLOW_H */
+/* vim:set ts=3 sw=3 tw=78 expandtab: */
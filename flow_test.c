@@ -0,0 +1,444 @@
+/* darkstat 3
+ * copyright (c) 2026 darkstat contributors.
+ *
+ * You may use, modify and redistribute this file under the terms of the
+ * GNU General Public License version 2. (see COPYING.GPL)
+ */
+
+#include "acct.h"
+#include "conv.h"
+#include "decode.h"
+#include "err.h"
+#include "event.h"
+#include "flow.h"
+#include "localip.h"
+#include "metrics.h"
+#include "snapshot.h"
+#include "str.h"
+
+#include <arpa/inet.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* What flow.c and decode.c need from the rest of darkstat. */
+int opt_want_pppoe = 0;
+char *title_interfaces = NULL;
+
+void *xmalloc(const size_t size) {
+  void *p = malloc(size);
+  if (p == NULL) abort();
+  return p;
+}
+
+void *xcalloc(const size_t num, const size_t size) {
+  void *p = calloc(num, size);
+  if (p == NULL) abort();
+  return p;
+}
+
+char *xstrdup(const char *s) { (void)s; abort(); }
+char *split_string(const char *src, const size_t left, const size_t right) {
+  (void)src; (void)left; (void)right;
+  abort();
+}
+void fd_set_nonblock(const int fd) { (void)fd; abort(); }
+int event_set(const int fd, const int events, event_fn *fn, void *arg) {
+  (void)fd; (void)events; (void)fn; (void)arg;
+  abort();
+}
+void localip_init(struct local_ips *ips) { (void)ips; abort(); }
+void localip_free(struct local_ips *ips) { (void)ips; abort(); }
+void snapshot_fd_add(const int fd) { (void)fd; abort(); }
+void snapshot_fd_remove(const int fd) { (void)fd; abort(); }
+void metrics_header(struct str *buf, const char *metric, const char *type,
+    const char *help) {
+  (void)buf; (void)metric; (void)type; (void)help;
+  abort();
+}
+void str_appendf(struct str *s, const char *format, ...) {
+  (void)s; (void)format;
+  abort();
+}
+void err(const int code, const char *format, ...) { (void)format; exit(code); }
+void errx(const int code, const char *format, ...) { (void)format; exit(code); }
+void warn(const char *format, ...) { (void)format; }
+void warnx(const char *format, ...) { (void)format; }
+void verbosef(const char *format, ...) { (void)format; }
+
+/* The summaries that flow.c accounts for. */
+static struct pktsummary got[64];
+static size_t num_got = 0;
+
+void acct_for_batch(const struct pktsummary * const sms, const size_t n,
+                    const struct local_ips * const local_ips,
+                    struct acct_shard * const shard) {
+  size_t i;
+
+  (void)local_ips; (void)shard;
+  for (i = 0; i < n && num_got < sizeof(got) / sizeof(*got); i++)
+    got[num_got++] = sms[i];
+}
+
+static int retcode = 0;
+
+static void check(const int ok, const char *what) {
+  printf("%s: %s\n", ok ? "PASS" : "FAIL", what);
+  if (!ok)
+    retcode = 1;
+}
+
+/* Building datagrams. */
+static uint8_t pkt[2048];
+static size_t len;
+
+static void put8(const unsigned int v) { pkt[len++] = (uint8_t)v; }
+static void put16(const unsigned int v) { put8(v >> 8); put8(v & 0xff); }
+static void put32(const uint32_t v) { put16(v >> 16); put16(v & 0xffff); }
+static void put64(const uint64_t v) {
+  put32((uint32_t)(v >> 32));
+  put32((uint32_t)v);
+}
+static void put_bytes(const void *p, const size_t n) {
+  memcpy(pkt + len, p, n);
+  len += n;
+}
+static void put_v4(const char *s) {
+  struct in_addr a;
+  inet_pton(AF_INET, s, &a);
+  put_bytes(&a, 4);
+}
+static void put_v6(const char *s) {
+  struct in6_addr a;
+  inet_pton(AF_INET6, s, &a);
+  put_bytes(&a, 16);
+}
+/* Fill in a length at ofs, of everything from start. */
+static void set_len16(const size_t ofs, const size_t start) {
+  pkt[ofs] = (uint8_t)((len - start) >> 8);
+  pkt[ofs + 1] = (uint8_t)(len - start);
+}
+static void set_len32(const size_t ofs, const size_t start) {
+  pkt[ofs] = pkt[ofs + 1] = 0;
+  set_len16(ofs + 2, start);
+}
+
+static struct addr exporter_a, exporter_b;
+
+static void decode(const struct addr *exporter) {
+  num_got = 0;
+  flow_decode(exporter, pkt, len);
+  flow_flush();
+}
+
+static int is_v4(const struct addr *a, const char *s) {
+  struct in_addr want;
+  inet_pton(AF_INET, s, &want);
+  return a->family == IPv4 && a->ip.v4 == want.s_addr;
+}
+
+static int is_v6(const struct addr *a, const char *s) {
+  struct in6_addr want;
+  inet_pton(AF_INET6, s, &want);
+  return a->family == IPv6 && memcmp(&a->ip.v6, &want, 16) == 0;
+}
+
+static void v9_header(const unsigned int count, const uint32_t source_id) {
+  len = 0;
+  put16(9);
+  put16(count);
+  put32(1000);        /* uptime */
+  put32(1700000000);  /* unix secs */
+  put32(1);           /* sequence */
+  put32(source_id);
+}
+
+static void v9_template(void) {
+  const size_t set = len;
+
+  put16(0);   /* template set */
+  put16(0);   /* length, below */
+  put16(256); /* template id */
+  put16(7);
+  put16(8);  put16(4);  /* source address */
+  put16(12); put16(4);  /* destination address */
+  put16(1);  put16(4);  /* octets */
+  put16(2);  put16(4);  /* packets */
+  put16(4);  put16(1);  /* protocol */
+  put16(7);  put16(2);  /* source port */
+  put16(11); put16(2);  /* destination port */
+  set_len16(set + 2, set);
+}
+
+static void v9_record(const char *src, const char *dst, const uint32_t octets,
+    const uint32_t packets, const unsigned int proto) {
+  put_v4(src);
+  put_v4(dst);
+  put32(octets);
+  put32(packets);
+  put8(proto);
+  put16(1234);
+  put16(80);
+}
+
+static void v9_data(void) {
+  const size_t set = len;
+
+  put16(256);
+  put16(0);
+  v9_record("10.0.0.1", "192.0.2.1", 1500, 3, 6);
+  v9_record("10.0.0.2", "192.0.2.2", 84, 1, 1);
+  put8(0); put8(0); /* padding */
+  set_len16(set + 2, set);
+}
+
+static void test_netflow_v9(void) {
+  /* Data before the template can't be read. */
+  v9_header(2, 7);
+  v9_data();
+  decode(&exporter_a);
+  check(num_got == 0, "v9: no records before the template");
+
+  v9_header(3, 7);
+  v9_template();
+  v9_data();
+  decode(&exporter_a);
+  check(num_got == 2, "v9: two records after the template");
+  check(is_v4(&got[0].src, "10.0.0.1") && is_v4(&got[0].dst, "192.0.2.1"),
+      "v9: addresses");
+  check(got[0].len == 1500 && got[0].packets == 3, "v9: counts");
+  check(got[0].proto == 6 && got[0].src_port == 1234 &&
+      got[0].dst_port == 80, "v9: TCP ports");
+  check(got[1].proto == 1 && got[1].src_port == 0 && got[1].dst_port == 0,
+      "v9: no ports for ICMP");
+
+  /* The template was for exporter_a's source id 7 only. */
+  v9_header(2, 8);
+  v9_data();
+  decode(&exporter_a);
+  check(num_got == 0, "v9: templates are per source id");
+  v9_header(2, 7);
+  v9_data();
+  decode(&exporter_b);
+  check(num_got == 0, "v9: templates are per exporter");
+  v9_header(2, 7);
+  v9_data();
+  decode(&exporter_a);
+  check(num_got == 2, "v9: the template is remembered");
+
+  /* A set that runs past the end of the datagram. */
+  v9_header(2, 7);
+  v9_data();
+  len -= 10;
+  decode(&exporter_a);
+  check(num_got == 0, "v9: a truncated datagram is dropped");
+}
+
+static void ipfix_header(const uint32_t domain) {
+  len = 0;
+  put16(10);
+  put16(0); /* length, below */
+  put32(1700000000);
+  put32(1);
+  put32(domain);
+}
+
+static void test_ipfix(void) {
+  size_t set;
+
+  ipfix_header(1);
+  /* An options template, for the sampling interval. */
+  set = len;
+  put16(3);
+  put16(0);
+  put16(300); /* template id */
+  put16(2);   /* fields */
+  put16(1);   /* scope fields */
+  put16(48); put16(1);  /* scope: sampler id */
+  put16(34); put16(4);  /* sampling interval */
+  set_len16(set + 2, set);
+  /* And a template with an enterprise field and a variable-length one. */
+  set = len;
+  put16(2);
+  put16(0);
+  put16(400);
+  put16(6);
+  put16(27); put16(16);                    /* source IPv6 */
+  put16(28); put16(16);                    /* destination IPv6 */
+  put16(0x8000 | 1); put16(4); put32(9);  /* enterprise 9's field 1 */
+  put16(82); put16(65535);                 /* interface name */
+  put16(1);  put16(8);                     /* octets */
+  put16(4);  put16(1);                     /* protocol */
+  set_len16(set + 2, set);
+  /* The options record. */
+  set = len;
+  put16(300);
+  put16(0);
+  put8(1);
+  put32(10);
+  set_len16(set + 2, set);
+  /* Two data records. */
+  set = len;
+  put16(400);
+  put16(0);
+  put_v6("2001:db8::1");
+  put_v6("2001:db8::2");
+  put32(0xdeadbeef);
+  put8(4); put_bytes("eth0", 4);
+  put64(5000000000ULL);
+  put8(17);
+  put_v6("2001:db8::3");
+  put_v6("2001:db8::4");
+  put32(0);
+  put8(255); put16(3); put_bytes("et1", 3);
+  put64(100);
+  put8(6);
+  set_len16(set + 2, set);
+  set_len16(2, 0);
+
+  decode(&exporter_a);
+  check(num_got == 2, "ipfix: two records");
+  check(is_v6(&got[0].src, "2001:db8::1") && is_v6(&got[0].dst, "2001:db8::2"),
+      "ipfix: IPv6 addresses");
+  check(got[0].len == 50000000000ULL && got[0].packets == 10,
+      "ipfix: 64-bit octets, scaled by the sampling interval");
+  check(got[0].proto == 17, "ipfix: protocol after a variable-length field");
+  check(is_v6(&got[1].src, "2001:db8::3") && got[1].len == 1000 &&
+      got[1].proto == 6, "ipfix: a long variable-length field");
+
+  /* Withdrawing the template. */
+  ipfix_header(1);
+  set = len;
+  put16(2);
+  put16(0);
+  put16(400);
+  put16(0);
+  set_len16(set + 2, set);
+  set = len;
+  put16(400);
+  put16(0);
+  put_v6("2001:db8::1");
+  put_v6("2001:db8::2");
+  put32(0);
+  put8(0);
+  put64(1);
+  put8(6);
+  set_len16(set + 2, set);
+  set_len16(2, 0);
+  decode(&exporter_a);
+  check(num_got == 0, "ipfix: a withdrawn template is gone");
+
+  /* Withdrawing the last one as well, then sending data for it. */
+  ipfix_header(1);
+  set = len;
+  put16(3);
+  put16(0);
+  put16(300);
+  put16(0);
+  put16(0);
+  set_len16(set + 2, set);
+  set = len;
+  put16(300);
+  put16(0);
+  put32(1000);
+  set_len16(set + 2, set);
+  set_len16(2, 0);
+  decode(&exporter_a);
+  check(num_got == 0, "ipfix: a domain without templates is gone");
+
+  /* A message length that's longer than the datagram. */
+  ipfix_header(1);
+  put16(2); put16(4);
+  set_len16(2, 0);
+  pkt[3] += 1;
+  decode(&exporter_a);
+  check(num_got == 0, "ipfix: a short datagram is dropped");
+}
+
+static void test_sflow(void) {
+  static const uint8_t ether_ip_tcp[] = {
+    /* Ethernet */
+    0, 1, 2, 3, 4, 5,  6, 7, 8, 9, 10, 11,  0x08, 0x00,
+    /* IPv4, 1000 bytes long, TCP */
+    0x45, 0, 0x03, 0xe8,  0, 0, 0, 0,  64, 6, 0, 0,
+    10, 0, 0, 5,  198, 51, 100, 7,
+    /* TCP, ports 443 and 50000, ACK */
+    0x01, 0xbb, 0xc3, 0x50,  0, 0, 0, 0,  0, 0, 0, 0,
+    0x50, 0x10, 0, 0,  0, 0, 0, 0,
+  };
+  size_t sample, rec;
+
+  len = 0;
+  put32(5);   /* version */
+  put32(1);   /* agent address is IPv4 */
+  put_v4("192.0.2.254");
+  put32(0);   /* sub-agent */
+  put32(1);   /* sequence */
+  put32(1000);
+  put32(2);   /* samples */
+
+  /* A counter sample, which is skipped. */
+  put32(2);
+  put32(4);
+  put32(0);
+
+  /* A flow sample, 1 in 512. */
+  put32(1);
+  sample = len;
+  put32(0);   /* length, below */
+  put32(1);   /* sequence */
+  put32(3);   /* source id */
+  put32(512); /* sampling rate */
+  put32(0);   /* pool */
+  put32(0);   /* drops */
+  put32(1);   /* input */
+  put32(2);   /* output */
+  put32(1);   /* records */
+  put32(1);   /* raw packet header */
+  rec = len;
+  put32(0);   /* length, below */
+  put32(1);    /* Ethernet */
+  put32(1014); /* frame length */
+  put32(4);    /* stripped */
+  put32(sizeof(ether_ip_tcp));
+  put_bytes(ether_ip_tcp, sizeof(ether_ip_tcp));
+  while (len % 4 != 0)
+    put8(0);
+  set_len32(rec, rec + 4);
+  set_len32(sample, sample + 4);
+
+  decode(&exporter_a);
+  check(num_got == 1, "sflow: one sampled packet");
+  check(is_v4(&got[0].src, "10.0.0.5") && is_v4(&got[0].dst, "198.51.100.7"),
+      "sflow: addresses from the header");
+  check(got[0].proto == 6 && got[0].src_port == 443 &&
+      got[0].dst_port == 50000, "sflow: ports from the header");
+  check(got[0].len == 1000 * 512 && got[0].packets == 512,
+      "sflow: scaled by the sampling rate");
+
+  /* A sample that runs past the end. */
+  len -= 8;
+  decode(&exporter_a);
+  check(num_got == 0, "sflow: a truncated datagram is dropped");
+}
+
+int main() {
+  exporter_a.family = IPv4;
+  exporter_a.ip.v4 = htonl(0xc0000201);
+  exporter_b.family = IPv4;
+  exporter_b.ip.v4 = htonl(0xc0000202);
+
+  test_netflow_v9();
+  test_ipfix();
+  test_sflow();
+
+  len = 0;
+  put32(0x12345678);
+  decode(&exporter_a);
+  check(num_got == 0, "an unknown version is dropped");
+
+  flow_stop();
+  return retcode;
+}
+/* vim:set ts=2 sts=2 sw=2 tw=80 et: */
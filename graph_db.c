@@ -9,51 +9,151 @@
 
 #include <sys/types.h>
 
+#include "cdefs.h"
 #include "cap.h"
 #include "conv.h"
 #include "db.h"
 #include "acct.h"
+#include "daylog.h"
 #include "err.h"
 #include "str.h"
 #include "html.h"
 #include "graph_db.h"
+#include "hosts_db.h"
 #include "now.h"
 #include "opt.h"
 
 #include <assert.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h> /* for memcpy() */
 #include <time.h>
 
 #define GRAPH_WIDTH "320"
 #define GRAPH_HEIGHT "200"
+#define GRAPH_BARS_SHOWN 160 /* most that fit GRAPH_WIDTH, with gaps */
 
+/* Each graph is a ring of num_bars bars, the current one at pos and the
+ * oldest just after it.  Which time a bar stands for is worked out from
+ * last_real when it's needed, so moving the graphs on (or back) never
+ * moves any bars.
+ */
 struct graph {
    uint64_t *in, *out;
-   unsigned int offset; /* i.e. seconds start at 0, days start at 1 */
    unsigned int pos, num_bars;
-   const char *unit;
    unsigned int bar_secs; /* one bar represents <n> seconds */
+   char name[16];         /* e.g. "minutes", or "minutes5" for 5 minutes */
+   char unit[24];         /* e.g. "minutes", or "5-minute bars" */
 };
 
-static struct graph
-   graph_secs = {NULL, NULL, 0, 0, 60, "seconds", 1},
-   graph_mins = {NULL, NULL, 0, 0, 60, "minutes", 60},
-   graph_hrs  = {NULL, NULL, 0, 0, 24, "hours",   3600},
-   graph_days = {NULL, NULL, 1, 0, 31, "days",    86400};
+#define GRAPHS_MAX 8
+#define GRAPH_BARS_MAX 100000
 
-static struct graph *graph_db[] = {
-   &graph_secs, &graph_mins, &graph_hrs, &graph_days
-};
+static struct graph graph_db[GRAPHS_MAX];
+static unsigned int graph_db_size = 0;
+static const char graph_default_spec[] = "1s:60,1m:60,1h:24,1d:31";
 
-static unsigned int graph_db_size = sizeof(graph_db)/sizeof(*graph_db);
 static time_t start_mono, start_real, last_real;
+static unsigned int generation = 0;
+static uint64_t total_in = 0, total_out = 0; /* ever put in the graphs */
+
+/* What's been counted this second, for graph_fold() to add to every graph
+ * at once, instead of once per packet.  The daylog gets it from
+ * graph_rotate(), which only ever runs in the main process.
+ */
+struct pending {
+   uint64_t bytes, packets;
+};
+static struct pending pending[MAX_GRAPH_DIR + 1],
+   pending_day[MAX_GRAPH_DIR + 1];
+
+static const struct {
+   unsigned int secs;
+   char letter;
+   const char *name;
+} graph_units[] = {
+   { 86400, 'd', "day" },
+   { 3600,  'h', "hour" },
+   { 60,    'm', "minute" },
+   { 1,     's', "second" }
+};
+#define NUM_UNITS (sizeof(graph_units) / sizeof(*graph_units))
+
+/* Name g after the biggest unit its bars are a whole number of. */
+static void graph_name(struct graph *g) {
+   unsigned int u, n;
+
+   for (u=0; g->bar_secs % graph_units[u].secs != 0; u++)
+      ;
+   n = g->bar_secs / graph_units[u].secs;
+   if (n == 1) {
+      snprintf(g->name, sizeof(g->name), "%ss", graph_units[u].name);
+      snprintf(g->unit, sizeof(g->unit), "%ss", graph_units[u].name);
+   } else {
+      snprintf(g->name, sizeof(g->name), "%ss%u", graph_units[u].name, n);
+      snprintf(g->unit, sizeof(g->unit), "%u-%s bars", n,
+         graph_units[u].name);
+   }
+}
+
+/* Set up the graphs from a spec like "1s:60,1m:60,1h:24,1d:31": a comma
+ * separated list of a bar length, in seconds unless it ends in m, h or d,
+ * and how many bars to keep.  Has to be called before graph_init(), if at
+ * all.  Returns 0 if the spec is no good.
+ */
+int graph_configure(const char *spec) {
+   const char *p = spec;
+
+   assert(graph_db[0].in == NULL);
+   graph_db_size = 0;
+   while (*p != '\0') {
+      struct graph *g;
+      unsigned long len, bars, secs;
+      unsigned int u, i;
+      char *end;
+
+      if (graph_db_size == GRAPHS_MAX)
+         return 0;
+      len = strtoul(p, &end, 10);
+      if (end == p || len == 0) return 0;
+      secs = 1;
+      for (u=0; u<NUM_UNITS; u++)
+         if (*end == graph_units[u].letter) {
+            secs = graph_units[u].secs;
+            end++;
+            break;
+         }
+      if (*end != ':' || len > 365UL * 86400 / secs) return 0;
+      p = end + 1;
+      bars = strtoul(p, &end, 10);
+      if (end == p || bars < 2 || bars > GRAPH_BARS_MAX) return 0;
+      if (*end == ',' && end[1] != '\0')
+         end++;
+      else if (*end != '\0')
+         return 0;
+      p = end;
+
+      g = &graph_db[graph_db_size];
+      memset(g, 0, sizeof(*g));
+      g->bar_secs = (unsigned int)(len * secs);
+      g->num_bars = (unsigned int)bars;
+      for (i=0; i<graph_db_size; i++)
+         if (graph_db[i].bar_secs == g->bar_secs)
+            return 0; /* the same bars twice */
+      graph_name(g);
+      graph_db_size++;
+   }
+   return graph_db_size > 0;
+}
 
 void graph_init(void) {
    unsigned int i;
+
+   if (graph_db_size == 0 && !graph_configure(graph_default_spec))
+      errx(1, "bad default graphs");
    for (i=0; i<graph_db_size; i++) {
-      graph_db[i]->in  = xmalloc(sizeof(uint64_t) * graph_db[i]->num_bars);
-      graph_db[i]->out = xmalloc(sizeof(uint64_t) * graph_db[i]->num_bars);
+      graph_db[i].in  = xmalloc(sizeof(uint64_t) * graph_db[i].num_bars);
+      graph_db[i].out = xmalloc(sizeof(uint64_t) * graph_db[i].num_bars);
    }
    graph_reset();
 }
@@ -67,158 +167,169 @@ void graph_reset(void) {
    unsigned int i;
 
    for (i=0; i<graph_db_size; i++)
-      zero_graph(graph_db[i]);
+      zero_graph(&graph_db[i]);
 
    /* Reset starting time. */
    start_mono = now_mono();
    start_real = now_real();
    last_real = 0;
+   generation++;
 
    /* Clear counters. */
+   memset(pending, 0, sizeof(pending)); /* but not the daylog's */
+   total_in = total_out = 0;
    acct_total_bytes = 0;
    acct_total_packets = 0;
 }
 
-void graph_free(void) {
-   unsigned int i;
+void graph_acct(uint64_t amount, uint64_t packets, enum graph_dir dir) {
+   assert(dir == GRAPH_IN || dir == GRAPH_OUT);
+   pending[dir].bytes += amount;
+   pending[dir].packets += packets;
+}
 
-   for (i=0; i<graph_db_size; i++) {
-      free(graph_db[i]->in);
-      free(graph_db[i]->out);
+/* Add what's pending to the current bar of every graph. */
+static void graph_fold(void) {
+   unsigned int i, dir;
+
+   for (dir=MIN_GRAPH_DIR; dir<=MAX_GRAPH_DIR; dir++) {
+      const uint64_t bytes = pending[dir].bytes;
+
+      if (bytes == 0 && pending[dir].packets == 0)
+         continue;
+      pending_day[dir].bytes += bytes;
+      pending_day[dir].packets += pending[dir].packets;
+      for (i=0; i<graph_db_size; i++)
+         if (dir == GRAPH_IN)
+            graph_db[i].in[ graph_db[i].pos ] += bytes;
+         else
+            graph_db[i].out[ graph_db[i].pos ] += bytes;
+      if (dir == GRAPH_IN)
+         total_in += bytes;
+      else
+         total_out += bytes;
+      pending[dir].bytes = pending[dir].packets = 0;
    }
 }
 
-void graph_acct(uint64_t amount, enum graph_dir dir) {
-   unsigned int i;
-   for (i=0; i<graph_db_size; i++)
-      if (dir == GRAPH_IN) {
-         graph_db[i]->in[  graph_db[i]->pos ] += amount;
-      } else {
-         assert(dir == GRAPH_OUT);
-         graph_db[i]->out[ graph_db[i]->pos ] += amount;
+static void daylog_fold(void) {
+   unsigned int dir;
+
+   for (dir=MIN_GRAPH_DIR; dir<=MAX_GRAPH_DIR; dir++)
+      if (pending_day[dir].bytes != 0 || pending_day[dir].packets != 0) {
+         daylog_acct(pending_day[dir].bytes, pending_day[dir].packets,
+            (enum graph_dir)dir);
+         pending_day[dir].bytes = pending_day[dir].packets = 0;
       }
 }
 
-/* Advance a graph: advance the pos, zeroing out bars as we move. */
-static void advance(struct graph *g, const unsigned int pos) {
-   if (g->pos == pos)
-      return; /* didn't need to advance */
-   do {
-      g->pos = (g->pos + 1) % g->num_bars;
-      g->in[g->pos] = g->out[g->pos] = 0;
-   } while (g->pos != pos);
+void graph_free(void) {
+   unsigned int i;
+
+   graph_fold();
+   daylog_fold(); /* the last of it */
+   for (i=0; i<graph_db_size; i++) {
+      free(graph_db[i].in);
+      free(graph_db[i].out);
+      graph_db[i].in = graph_db[i].out = NULL;
+   }
 }
 
-/* Rotate a graph: rotate all bars so that the bar at the current pos is moved
- * to the newly given pos.
+/* Real time t, as seconds since the epoch in local time, so that bars start
+ * on the local minute, hour or day.
  */
-static void rotate(struct graph *g, const unsigned int pos) {
-   uint64_t *tmp;
-   unsigned int i, ofs;
-   size_t size;
-
-   if (pos == g->pos)
-      return; /* nothing to rotate */
-
-   size = sizeof(*tmp) * g->num_bars;
-   tmp = xmalloc(size);
-   ofs = g->num_bars + pos - g->pos;
-
-   for (i=0; i<g->num_bars; i++)
-      tmp[ (i+ofs) % g->num_bars ] = g->in[i];
-   memcpy(g->in, tmp, size);
-
-   for (i=0; i<g->num_bars; i++)
-      tmp[ (i+ofs) % g->num_bars ] = g->out[i];
-   memcpy(g->out, tmp, size);
-
-   free(tmp);
-   assert(g->num_bars > 0);
-   assert(pos == ( (g->pos + ofs) % g->num_bars ));
-   g->pos = pos;
+static int64_t local_secs(const time_t t) {
+   struct tm lt = *localtime(&t), gt = *gmtime(&t);
+   int days = lt.tm_yday - gt.tm_yday;
+
+   if (lt.tm_year != gt.tm_year)
+      days = (lt.tm_year > gt.tm_year) ? 1 : -1; /* across new year */
+   return (int64_t)t + (int64_t)days * 86400 +
+      (lt.tm_hour - gt.tm_hour) * 3600 +
+      (lt.tm_min - gt.tm_min) * 60 +
+      (lt.tm_sec - gt.tm_sec);
 }
 
-static void graph_resync(const time_t new_real) {
-   struct tm *tm;
-   /*
-    * If real time went backwards, we assume that the time adjustment should
-    * only affect display.  i.e., if we have:
-    *
-    * second 15: 12  bytes
-    * second 16: 345 bytes
-    * second 17: <-- current pos
-    *
-    * and time goes backwards to second 8, we will shift the graph around to
-    * get:
-    *
-    * second 6: 12  bytes
-    * second 7: 345 bytes
-    * second 8: <-- current pos
-    *
-    * We don't make any corrections for time being stepped forward,
-    * it's treated as though there was no traffic during that time.
-    *
-    * We rely on graph advancement to happen at the correct real time to
-    * account for, for example, bandwidth used per day.
-    */
-   assert(new_real < last_real);
-
-   tm = localtime(&new_real);
-   if (tm->tm_sec == 60)
-      tm->tm_sec = 59; /* mis-handle leap seconds */
-
-   rotate(&graph_secs, tm->tm_sec);
-   rotate(&graph_mins, tm->tm_min);
-   rotate(&graph_hrs, tm->tm_hour);
-   rotate(&graph_days, tm->tm_mday - 1);
-
-   last_real = new_real;
+/* Move the graphs on to real time t, which is after last_real, zeroing the
+ * bars that are passed.
+ */
+static void roll_forward(const time_t t) {
+   const int64_t from = local_secs(last_real), to = local_secs(t);
+   unsigned int i;
+
+   for (i=0; i<graph_db_size; i++) {
+      struct graph *g = &graph_db[i];
+      const int64_t steps = to / g->bar_secs - from / g->bar_secs;
+
+      if (steps <= 0)
+         continue; /* e.g. the clocks went back an hour */
+      if (steps >= g->num_bars) {
+         zero_graph(g);
+         g->pos = (unsigned int)((g->pos + steps) % g->num_bars);
+      } else {
+         int64_t k;
+
+         for (k=0; k<steps; k++) {
+            g->pos = (g->pos + 1) % g->num_bars;
+            g->in[g->pos] = g->out[g->pos] = 0;
+         }
+      }
+   }
+   last_real = t;
 }
 
 void graph_rotate(void) {
    time_t t, td;
-   struct tm *tm;
-   unsigned int i;
 
+   graph_fold(); /* into the second it was counted in */
+   daylog_fold();
    t = now_real();
    td = t - last_real;
 
    if (last_real == 0) {
       verbosef("first rotate");
       last_real = t;
-      tm = localtime(&t);
-      graph_secs.pos = tm->tm_sec;
-      graph_mins.pos = tm->tm_min;
-      graph_hrs.pos = tm->tm_hour;
-      graph_days.pos = tm->tm_mday - 1;
+      generation++;
       return;
    }
 
    if (t == last_real)
       return; /* time has not advanced a full second, don't rotate */
+   generation++;
 
    if (t < last_real) {
+      /* If real time went backwards, we assume that the time adjustment
+       * should only affect display: the bars stay where they are, and are
+       * labelled as if they led up to the new time.
+       *
+       * We don't make any corrections for time being stepped forward,
+       * it's treated as though there was no traffic during that time.
+       */
       verbosef("graph_db: realtime went backwards! "
                "(from %ld to %ld, offset is %ld)",
                last_real, t, td);
-      graph_resync(t);
+      last_real = t;
       return;
    }
 
    /* else, normal rotation */
-   last_real = t;
-   tm = localtime(&t);
+   roll_forward(t);
+}
 
-   /* zero out graphs which have been completely rotated through */
-   for (i=0; i<graph_db_size; i++)
-      if (td >= (int)(graph_db[i]->num_bars * graph_db[i]->bar_secs))
-         zero_graph(graph_db[i]);
-
-   /* advance the current position, zeroing up to it */
-   advance(&graph_secs, tm->tm_sec);
-   advance(&graph_mins, tm->tm_min);
-   advance(&graph_hrs, tm->tm_hour);
-   advance(&graph_days, tm->tm_mday - 1);
+/* Changes whenever the graphs rotate (once a second) or are reset, so web
+ * pages made from the same generation are at most a second apart.
+ */
+unsigned int graph_generation(void) {
+   return generation;
+}
+
+/* Bytes put in the graphs since startup or the last reset, for a
+ * federation aggregator to tell how many are new.
+ */
+void graph_totals(uint64_t *in, uint64_t *out) {
+   graph_fold();
+   *in = total_in;
+   *out = total_out;
 }
 
 /* ---------------------------------------------------------------------------
@@ -226,62 +337,177 @@ void graph_rotate(void) {
  *
  * This function will retrieve the data sans the header.  We expect the caller
  * to have validated the header of the segment, and left the file position at
- * the start of the data.
+ * the start of the data.  ver is the section's version: ver1 always has the
+ * four original graphs.
+ *
+ * Each graph in the file goes into the one here with the same bar length,
+ * if there is one, newest bar first, for as many bars as both have.
  */
-int graph_import(const int fd) {
+static const unsigned int graph_ver1_secs[] = { 1, 60, 3600, 86400 };
+
+static int graph_import_one(const int fd, const int ver, const unsigned int i) {
+   uint64_t *in, *out;
+   uint32_t bar_secs, num_bars, pos;
+   unsigned int filepos = xtell(fd), j, k, n;
+   struct graph *g = NULL;
+
+   if (ver == 1) {
+      uint8_t num_bars8, pos8;
+
+      if (!read8(fd, &num_bars8)) return 0;
+      if (!read8(fd, &pos8)) return 0;
+      bar_secs = graph_ver1_secs[i];
+      num_bars = num_bars8;
+      pos = pos8;
+   } else {
+      if (!read32(fd, &bar_secs)) return 0;
+      if (!read32(fd, &num_bars)) return 0;
+      if (!read32(fd, &pos)) return 0;
+   }
+
+   verbosef("at file pos %u, importing graph of %u %u-second bars",
+      filepos, (unsigned int)num_bars, (unsigned int)bar_secs);
+
+   if (pos >= num_bars || num_bars > GRAPH_BARS_MAX) {
+      warnx("pos is %u, should be < num_bars which is %u",
+         (unsigned int)pos, (unsigned int)num_bars);
+      return 0;
+   }
+
+   in = xmalloc(sizeof(*in) * num_bars);
+   out = xmalloc(sizeof(*out) * num_bars);
+   for (j=0; j<num_bars; j++)
+      if (!read64(fd, &in[j]) || !read64(fd, &out[j])) {
+         free(in);
+         free(out);
+         return 0;
+      }
+
+   for (j=0; j<graph_db_size; j++)
+      if (graph_db[j].bar_secs == bar_secs)
+         g = &graph_db[j];
+   if (g == NULL)
+      verbosef("no graph of %u-second bars, skipping it",
+         (unsigned int)bar_secs);
+   else {
+      zero_graph(g);
+      n = MIN(g->num_bars, num_bars);
+      for (k=0; k<n; k++) {
+         const unsigned int mine = (g->pos + g->num_bars - k) % g->num_bars,
+            theirs = (pos + num_bars - k) % num_bars;
+
+         g->in[mine] = in[theirs];
+         g->out[mine] = out[theirs];
+      }
+   }
+   free(in);
+   free(out);
+   return 1;
+}
+
+int graph_import(const int fd, const int ver) {
    uint64_t last;
-   unsigned int i, j;
+   uint8_t count = 4;
+   unsigned int i;
 
    if (!read64(fd, &last)) return 0;
    last_real = last;
+   if (ver != 1 && !read8(fd, &count)) return 0;
 
-   for (i=0; i<graph_db_size; i++) {
-      unsigned char num_bars, pos;
-      unsigned int filepos = xtell(fd);
+   for (i=0; i<count; i++)
+      if (!graph_import_one(fd, ver, i))
+         return 0;
 
-      if (!read8(fd, &num_bars)) return 0;
-      if (!read8(fd, &pos)) return 0;
+   /* Anything imported before this was not counted since. */
+   generation++;
+   return 1;
+}
 
-      verbosef("at file pos %u, importing graph with %u bars",
-         filepos, (unsigned int)num_bars);
+/* ---------------------------------------------------------------------------
+ * Merging, for darkstat-merge: add the graphs from a file to the ones in
+ * memory, with the bars for the same time lined up.  Whichever is behind is
+ * moved on to the other's last_time first.
+ * Returns 0 on failure, 1 on success.
+ */
+int graph_merge(const int fd, const int ver) {
+   struct graph mine[GRAPHS_MAX];
+   const time_t my_last = last_real;
+   time_t their_last;
+   unsigned int i, j;
 
-      if (pos >= num_bars) {
-         warn("pos is %u, should be < num_bars which is %u",
-            (unsigned int)pos, (unsigned int)num_bars);
-         return 0;
-      }
+   graph_fold();
+   if (my_last == 0)
+      return graph_import(fd, ver); /* nothing to add to */
 
-      if (graph_db[i]->num_bars != num_bars) {
-         warn("num_bars is %u, expecting %u",
-            (unsigned int)num_bars, graph_db[i]->num_bars);
-         return 0;
-      }
+   /* Import over copies, so the graphs in memory are kept. */
+   for (i=0; i<graph_db_size; i++) {
+      const size_t size = sizeof(uint64_t) * graph_db[i].num_bars;
 
-      graph_db[i]->pos = pos;
-      for (j=0; j<num_bars; j++) {
-         if (!read64(fd, &(graph_db[i]->in[j]))) return 0;
-         if (!read64(fd, &(graph_db[i]->out[j]))) return 0;
+      mine[i] = graph_db[i];
+      graph_db[i].in = xmalloc(size);
+      graph_db[i].out = xmalloc(size);
+      memcpy(graph_db[i].in, mine[i].in, size);
+      memcpy(graph_db[i].out, mine[i].out, size);
+   }
+   if (!graph_import(fd, ver)) {
+      for (i=0; i<graph_db_size; i++) {
+         free(graph_db[i].in);
+         free(graph_db[i].out);
+         graph_db[i] = mine[i];
       }
+      last_real = my_last;
+      return 0;
+   }
+   if (last_real < my_last)
+      roll_forward(my_last);
+
+   /* Swap, catch up, and add the file's bars in. */
+   for (i=0; i<graph_db_size; i++) {
+      struct graph theirs = graph_db[i];
+
+      graph_db[i] = mine[i];
+      mine[i] = theirs;
    }
+   their_last = last_real;
+   last_real = my_last;
+   if (their_last > my_last)
+      roll_forward(their_last);
+   for (i=0; i<graph_db_size; i++) {
+      for (j=0; j<graph_db[i].num_bars; j++) {
+         const unsigned int k = (mine[i].pos + graph_db[i].num_bars -
+            (graph_db[i].pos + graph_db[i].num_bars - j) %
+               graph_db[i].num_bars) % graph_db[i].num_bars;
 
+         graph_db[i].in[j] += mine[i].in[k];
+         graph_db[i].out[j] += mine[i].out[k];
+      }
+      free(mine[i].in);
+      free(mine[i].out);
+   }
    return 1;
 }
 
 /* ---------------------------------------------------------------------------
  * Database Export: Dump hosts_db into a file provided by the caller.
- * The caller is responsible for writing out the header first.
+ * The caller is responsible for writing out the header first.  This is
+ * always graph_db ver2.
  */
 int graph_export(const int fd) {
    unsigned int i, j;
 
+   graph_fold();
    if (!write64(fd, (uint64_t)last_real)) return 0;
+   if (!write8(fd, (uint8_t)graph_db_size)) return 0;
    for (i=0; i<graph_db_size; i++) {
-      if (!write8(fd, graph_db[i]->num_bars)) return 0;
-      if (!write8(fd, graph_db[i]->pos)) return 0;
+      const struct graph *g = &graph_db[i];
 
-      for (j=0; j<graph_db[i]->num_bars; j++) {
-         if (!write64(fd, graph_db[i]->in[j])) return 0;
-         if (!write64(fd, graph_db[i]->out[j])) return 0;
+      if (!write32(fd, g->bar_secs)) return 0;
+      if (!write32(fd, g->num_bars)) return 0;
+      if (!write32(fd, g->pos)) return 0;
+
+      for (j=0; j<g->num_bars; j++) {
+         if (!write64(fd, g->in[j])) return 0;
+         if (!write64(fd, g->out[j])) return 0;
       }
    }
    return 1;
@@ -296,6 +522,7 @@ struct str *html_front_page(void) {
    char start_when[100];
    time_t d_real, d_mono;
 
+   graph_fold();
    buf = str_make();
    html_open(buf, "Graphs", /*path_depth=*/0, /*want_graph_js=*/1);
 
@@ -326,7 +553,7 @@ struct str *html_front_page(void) {
       cap_pkts_recv,
       cap_pkts_drop);
 
-   str_append(buf,
+   str_appendf(buf,
       "<div id=\"graphs\">\n"
       "Graphs require JavaScript.\n"
       "<script type=\"text/javascript\">\n"
@@ -334,8 +561,9 @@ struct str *html_front_page(void) {
       "var graph_width = " GRAPH_WIDTH ";\n"
       "var graph_height = " GRAPH_HEIGHT ";\n"
       "var bar_gap = 1;\n"
-      "var graphs_uri = \"graphs.xml\";\n"
-      "var graphs = [\n"
+      "var graphs_uri = \"graphs.xml?bars=%u\";\n"
+      "var graphs = [\n",
+      GRAPH_BARS_SHOWN
    );
 
    for (i=0; i<graph_db_size; i++)
@@ -345,8 +573,9 @@ struct str *html_front_page(void) {
             "title:\"last %u %s\", "
             "bar_secs:%u"
          " }%s\n",
-         i, graph_db[i]->unit, graph_db[i]->num_bars, graph_db[i]->unit,
-         graph_db[i]->bar_secs, (i < graph_db_size-1) ? "," : "");
+         i, graph_db[i].name, MIN(graph_db[i].num_bars, GRAPH_BARS_SHOWN),
+         graph_db[i].unit, graph_db[i].bar_secs,
+         (i < graph_db_size-1) ? "," : "");
       /* trailing comma breaks on IE, makes the array one element longer */
 
    str_append(buf,
@@ -363,11 +592,40 @@ struct str *html_front_page(void) {
 
 /* ---------------------------------------------------------------------------
  * Web interface: graphs.xml
+ *
+ * The query string can ask for graph=<name> to get just that one, and
+ * bars=<n> to get only the newest n bars of each.  With host=<ip>, it's that
+ * host's own graphs instead, which are empty if it doesn't have any.  Each bar is labelled with
+ * the second, minute, hour or day of the month it starts on.
  */
-struct str *xml_graphs(void) {
-   unsigned int i, j;
+static unsigned int bar_label(const struct graph *g, const unsigned int age) {
+   const int64_t local = local_secs(last_real);
+   const time_t start = (time_t)(local - local % g->bar_secs -
+      (int64_t)age * g->bar_secs);
+   const struct tm *tm = gmtime(&start); /* already local */
+
+   if (g->bar_secs < 60)    return (unsigned int)tm->tm_sec;
+   if (g->bar_secs < 3600)  return (unsigned int)tm->tm_min;
+   if (g->bar_secs < 86400) return (unsigned int)tm->tm_hour;
+   return (unsigned int)tm->tm_mday;
+}
+
+struct str *xml_graphs(const char *query) {
+   unsigned int i, j, bars = GRAPH_BARS_MAX;
    struct str *buf = str_make(), *rf;
+   char *qs_bars = qs_get(query, "bars"), *qs_graph = qs_get(query, "graph");
+   char *qs_host = qs_get(query, "host");
 
+   if (qs_bars != NULL) {
+      char *ep;
+      unsigned long n = strtoul(qs_bars, &ep, 10);
+
+      if (qs_bars[0] != '\0' && *ep == '\0' && n > 0 && n < bars)
+         bars = (unsigned int)n;
+      free(qs_bars);
+   }
+
+   graph_fold();
    str_appendf(buf, "<graphs tp=\"%qu\" tb=\"%qu\" pc=\"%u\" pd=\"%u\" rf=\"",
       (qu)acct_total_packets,
       (qu)acct_total_bytes,
@@ -378,22 +636,32 @@ struct str *xml_graphs(void) {
    str_free(rf);
    str_append(buf, "\">\n");
 
-   for (i=0; i<graph_db_size; i++) {
-      const struct graph *g = graph_db[i];
-
-      str_appendf(buf, "<%s>\n", g->unit);
-      j = g->pos;
-      do {
-         j = (j + 1) % g->num_bars;
-         /* <element pos="" in="" out=""/> */
-         str_appendf(buf, "<e p=\"%u\" i=\"%qu\" o=\"%qu\"/>\n",
-            g->offset + j,
-            (qu)g->in[j],
-            (qu)g->out[j]);
-      } while (j != g->pos);
-      str_appendf(buf, "</%s>\n", g->unit);
+   if (qs_host != NULL)
+      xml_host_graphs(buf, qs_host, bars);
+   else {
+      for (i=0; i<graph_db_size; i++) {
+         const struct graph *g = &graph_db[i];
+         const unsigned int n = MIN(g->num_bars, bars);
+
+         if (qs_graph != NULL && strcmp(qs_graph, g->name) != 0)
+            continue;
+         str_appendf(buf, "<%s>\n", g->name);
+         for (j=n; j>0; j--) {
+            const unsigned int k =
+               (g->pos + g->num_bars - (j-1)) % g->num_bars;
+
+            /* <element pos="" in="" out=""/> */
+            str_appendf(buf, "<e p=\"%u\" i=\"%qu\" o=\"%qu\"/>\n",
+               bar_label(g, j-1),
+               (qu)g->in[k],
+               (qu)g->out[k]);
+         }
+         str_appendf(buf, "</%s>\n", g->name);
+      }
    }
    str_append(buf, "</graphs>\n");
+   free(qs_graph);
+   free(qs_host);
    return (buf);
 }
 
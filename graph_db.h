@@ -15,16 +15,20 @@ enum graph_dir {
    MAX_GRAPH_DIR = 2
 };
 
+int graph_configure(const char *spec);
 void graph_init(void);
 void graph_reset(void);
 void graph_free(void);
-void graph_acct(uint64_t amount, enum graph_dir dir);
+void graph_acct(uint64_t amount, uint64_t packets, enum graph_dir dir);
 void graph_rotate(void);
-int graph_import(const int fd);
+unsigned int graph_generation(void);
+void graph_totals(uint64_t *in, uint64_t *out);
+int graph_import(const int fd, const int ver);
+int graph_merge(const int fd, const int ver);
 int graph_export(const int fd);
 
 struct str *html_front_page(void);
-struct str *xml_graphs(void);
+struct str *xml_graphs(const char *query);
 
 #endif
 /* vim:set ts=3 sw=3 tw=78 expandtab: */
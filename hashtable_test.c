@@ -0,0 +1,233 @@
+/* darkstat 3
+ * copyright (c) 2026 darkstat contributors.
+ *
+ * You may use, modify and redistribute this file under the terms of the
+ * GNU General Public License version 2. (see COPYING.GPL)
+ */
+
+/* The hashtable is private to hosts_db.c, so take all of it. */
+#include "hosts_db.c"
+
+static int retcode = 0;
+
+static void check(const int ok, const char *what) {
+  printf("%s: %s\n", ok ? "PASS" : "FAIL", what);
+  if (!ok)
+    retcode = 1;
+}
+
+/* Ports below WRAP all hash to the last few slots of any size of table,
+ * so their runs wrap around to slot 0.  The rest are spread out.
+ */
+#define WRAP 64
+#define PORTS 3000
+
+static uint32_t hash_func_test(const struct hashtable *h _unused_,
+                               const void *key) {
+  const uint16_t port = CASTKEY(uint16_t);
+
+  if (port < WRAP)
+    return UINT32_MAX - (port % 4);
+  return hash_mix(port);
+}
+
+HASHTABLE_GENERATE(ht_test, hash_func_test, key_func_port_tcp,
+                   find_func_port_tcp, make_func_port_tcp)
+
+/* What the table should hold. */
+static int present[PORTS];
+static uint64_t total[PORTS];
+static uint32_t nr_present = 0;
+
+static void reference_clear(void) {
+  memset(present, 0, sizeof(present));
+  nr_present = 0;
+}
+
+static uint32_t seed = 1;
+
+static uint32_t rnd(void) {
+  seed ^= seed << 13;
+  seed ^= seed >> 17;
+  seed ^= seed << 5;
+  return seed;
+}
+
+static uint16_t rnd_port(void) {
+  /* Plenty of the wrapping ones. */
+  if (rnd() % 4 == 0)
+    return (uint16_t)(rnd() % WRAP);
+  return (uint16_t)(rnd() % PORTS);
+}
+
+/* Counts of what happened mid-rehash, or across the end of the table. */
+static unsigned int rehash_inserts, rehash_finds, rehash_removes,
+    rehash_reduces, wrapped_removes;
+
+static void insert_or_find(struct hashtable *h, const uint16_t port) {
+  static uint64_t next_total = 0;
+  struct bucket *b;
+
+  if (h->old_table != NULL) {
+    if (present[port])
+      rehash_finds++;
+    else
+      rehash_inserts++;
+  }
+  b = ht_test_find_or_insert(h, &port, NO_REDUCE);
+  if (b->u.port_tcp.port != port) {
+    check(0, "find_or_insert returns the right port");
+    return;
+  }
+  if (!present[port]) {
+    /* Every total is different, so a reduce keeps exactly count_keep. */
+    total[port] = (uint32_t)(++next_total * 2654435761U);
+    b->in = total[port];
+    present[port] = 1;
+    nr_present++;
+  } else if (b->in != total[port])
+    check(0, "find_or_insert finds the existing bucket");
+}
+
+static void search(struct hashtable *h, const uint16_t port) {
+  struct bucket *b;
+
+  if (h->old_table != NULL)
+    rehash_finds++;
+  b = ht_test_search(h, &port);
+  if (present[port] ? (b == NULL || b->u.port_tcp.port != port ||
+                       b->in != total[port])
+                    : (b != NULL))
+    check(0, "search agrees with the reference");
+}
+
+/* Remove one port the way hashtable_reduce() does. */
+static void remove_port(struct hashtable *h, const uint16_t port) {
+  uint32_t pos;
+  struct bucket *b;
+
+  if (h->old_table != NULL)
+    rehash_removes++;
+  hashtable_rehash_finish(h);
+  pos = hashtable_probe(h, h->table, h->mask, hash_func_test(h, &port),
+                        &port, find_func_port_tcp);
+  if (!present[port]) {
+    if (pos != UINT32_MAX)
+      check(0, "a removed port isn't in the table");
+    return;
+  }
+  if (pos == UINT32_MAX) {
+    check(0, "a present port is in the table");
+    return;
+  }
+  if (pos < (h->table[pos].hash & h->mask))
+    wrapped_removes++;
+  b = h->table[pos].b;
+  h->free_func(b);
+  slab_release(b);
+  hashtable_remove_slot(h, pos);
+  present[port] = 0;
+  nr_present--;
+}
+
+static int cmp_desc(const void *a, const void *b) {
+  const uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+  return (x < y) - (x > y);
+}
+
+static void reduce(struct hashtable *h) {
+  uint64_t *totals, cutoff;
+  uint32_t i, n = 0;
+
+  if (nr_present <= h->count_keep)
+    return;
+  if (h->old_table != NULL)
+    rehash_reduces++;
+  totals = malloc(nr_present * sizeof(*totals));
+  for (i = 0; i < PORTS; i++)
+    if (present[i])
+      totals[n++] = total[i];
+  qsort(totals, n, sizeof(*totals), cmp_desc);
+  cutoff = totals[h->count_keep];
+  free(totals);
+  for (i = 0; i < PORTS; i++)
+    if (present[i] && total[i] <= cutoff) {
+      present[i] = 0;
+      nr_present--;
+    }
+  hashtable_reduce(h);
+}
+
+/* Walk every slot of both tables, and check they hold just what the
+ * reference does.
+ */
+static int agrees(const struct hashtable *h) {
+  static int seen[PORTS];
+  const struct bucket *b;
+  uint32_t i, n = 0;
+  int ok = 1;
+
+  memset(seen, 0, sizeof(seen));
+  HASHTABLE_FOREACH(h, i, b) {
+    const uint16_t port = b->u.port_tcp.port;
+
+    if (port >= PORTS || !present[port] || seen[port] ||
+        b->in != total[port])
+      ok = 0;
+    else
+      seen[port] = 1;
+    n++;
+  }
+  return ok && n == nr_present && h->count == nr_present;
+}
+
+/* Tables only grow, so start over with a small one now and then to see
+ * plenty of rehashes.
+ */
+#define ROUNDS 100
+#define STEPS 4000
+
+int main() {
+  struct slab *slab = slab_make();
+  struct hashtable *h = NULL;
+  uint32_t round, step, i;
+  int ok = 1;
+
+  for (round = 0; round < ROUNDS; round++) {
+    hashtable_free(h);
+    reference_clear();
+    h = hashtable_make(slab, 3, PORTS, 200, hash_func_test,
+                       free_func_port_tcp, key_func_port_tcp,
+                       find_func_port_tcp, make_func_port_tcp,
+                       format_cols_port_tcp, format_row_port_tcp);
+    for (step = 0; step < STEPS; step++) {
+      const uint32_t op = rnd() % 128;
+
+      if (op < 64)
+        insert_or_find(h, rnd_port());
+      else if (op < 96)
+        search(h, rnd_port());
+      else if (op < 127)
+        remove_port(h, rnd_port());
+      else
+        reduce(h);
+      if (step % 7 == 0 && !agrees(h))
+        ok = 0;
+    }
+  }
+  check(ok, "inserts, finds, removes and reduces agree with the reference");
+  check(rehash_inserts > 0, "some inserts happened mid-rehash");
+  check(rehash_finds > 0, "some finds happened mid-rehash");
+  check(rehash_removes > 0, "some removes happened mid-rehash");
+  check(rehash_reduces > 0, "some reduces happened mid-rehash");
+  check(wrapped_removes > 0, "some removes were across the wrap-around");
+
+  for (i = 0; i < PORTS; i++)
+    search(h, (uint16_t)i);
+  check(agrees(h), "every port is found or not found as it should be");
+  hashtable_free(h);
+  slab_destroy(slab);
+  return retcode;
+}
+/* vim:set ts=2 sts=2 sw=2 tw=80 et: */
@@ -0,0 +1,71 @@
+/* darkstat 3
+ * copyright (c) 2026 darkstat contributors.
+ *
+ * hll.c: HyperLogLog counting of distinct things
+ *
+ * You may use, modify and redistribute this file under the terms of the
+ * GNU General Public License version 2. (see COPYING.GPL)
+ */
+
+/* The top bits of a hash pick a register, which keeps the longest run of
+ * leading zeros, plus one, seen in the rest of the hash.  A run of k zeros
+ * turns up about once in 2^k different hashes, so the harmonic mean of the
+ * registers says how many there were.  Flajolet et al., "HyperLogLog: the
+ * analysis of a near-optimal cardinality estimation algorithm", 2007, with
+ * their corrections for small and large counts.
+ */
+
+#include "hll.h"
+
+#include <assert.h>
+#include <math.h>
+
+void hll_add(uint8_t *reg, const unsigned int bits, const uint32_t hash) {
+   const unsigned int max_rank = 32 - bits + 1;
+   uint32_t w = hash << bits;
+   unsigned int rank = 1;
+
+   assert(bits >= HLL_BITS_MIN && bits <= HLL_BITS_MAX);
+   while (rank < max_rank && (w & 0x80000000U) == 0) {
+      w <<= 1;
+      rank++;
+   }
+   if (reg[hash >> (32 - bits)] < rank)
+      reg[hash >> (32 - bits)] = (uint8_t)rank;
+}
+
+uint64_t hll_count(const uint8_t *reg, const unsigned int bits) {
+   const uint32_t m = 1U << bits;
+   const double two32 = 4294967296.0;
+   double alpha, sum = 0, e;
+   uint32_t i, zeros = 0;
+
+   assert(bits >= HLL_BITS_MIN && bits <= HLL_BITS_MAX);
+   switch (m) {
+   case 16: alpha = 0.673; break;
+   case 32: alpha = 0.697; break;
+   case 64: alpha = 0.709; break;
+   default: alpha = 0.7213 / (1 + 1.079 / m); break;
+   }
+   for (i=0; i<m; i++) {
+      sum += ldexp(1.0, -(int)reg[i]);
+      if (reg[i] == 0)
+         zeros++;
+   }
+   e = alpha * m * m / sum;
+   if (e <= 2.5 * m && zeros != 0)
+      e = m * log((double)m / zeros); /* linear counting */
+   else if (e > two32 / 30)
+      e = -two32 * log(1 - e / two32);
+   return (uint64_t)(e + 0.5);
+}
+
+void hll_merge(uint8_t *into, const uint8_t *from, const unsigned int bits) {
+   uint32_t i;
+
+   for (i=0; i<(1U << bits); i++)
+      if (into[i] < from[i])
+         into[i] = from[i];
+}
+
+/* vim:set ts=3 sw=3 tw=78 expandtab: */
@@ -0,0 +1,31 @@
+/* darkstat 3
+ * copyright (c) 2026 darkstat contributors.
+ *
+ * hll.h: HyperLogLog counting of distinct things
+ *
+ * You may use, modify and redistribute this file under the terms of the
+ * GNU General Public License version 2. (see COPYING.GPL)
+ */
+#ifndef __DARKSTAT_HLL_H
+#define __DARKSTAT_HLL_H
+
+#include <stdint.h>
+
+/* A sketch is an array of (1 << bits) one-byte registers, all zero when
+ * nothing has been added, so it can live inside whatever it counts for.
+ * The standard error is about 1.04 / sqrt(1 << bits).
+ */
+#define HLL_BITS_MIN 4
+#define HLL_BITS_MAX 16
+
+/* Add a thing by its 32-bit hash, which has to be well mixed. */
+void hll_add(uint8_t *reg, const unsigned int bits, const uint32_t hash);
+
+/* Estimate how many different hashes were added. */
+uint64_t hll_count(const uint8_t *reg, const unsigned int bits);
+
+/* Make into count everything that was added to either sketch. */
+void hll_merge(uint8_t *into, const uint8_t *from, const unsigned int bits);
+
+#endif /* __DARKSTAT_HLL_H */
+/* vim:set ts=3 sw=3 tw=78 expandtab: */
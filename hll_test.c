@@ -0,0 +1,84 @@
+/* darkstat 3
+ * copyright (c) 2026 darkstat contributors.
+ *
+ * You may use, modify and redistribute this file under the terms of the
+ * GNU General Public License version 2. (see COPYING.GPL)
+ */
+
+#include "hll.h"
+
+#include <stdio.h>
+#include <string.h>
+
+static int retcode = 0;
+
+static void check(const int ok, const char *what) {
+  printf("%s: %s\n", ok ? "PASS" : "FAIL", what);
+  if (!ok)
+    retcode = 1;
+}
+
+/* The MurmurHash3 finalizer, to turn a counter into well mixed hashes. */
+static uint32_t mix(uint32_t h) {
+  h ^= h >> 16;
+  h *= 0x85EBCA6BU;
+  h ^= h >> 13;
+  h *= 0xC2B2AE35U;
+  h ^= h >> 16;
+  return h;
+}
+
+/* Whether the estimate is within 3% plus a little of n. */
+static int close_to(const uint64_t got, const uint64_t n) {
+  const uint64_t err = got > n ? got - n : n - got;
+  return err <= n * 3 / 100 + 2;
+}
+
+static void test_count(const uint32_t n) {
+  static uint8_t reg[1 << 12];
+  uint32_t i;
+  uint64_t got;
+  char what[80];
+
+  memset(reg, 0, sizeof(reg));
+  for (i = 0; i < n; i++) {
+    hll_add(reg, 12, mix(i));
+    hll_add(reg, 12, mix(i)); /* again, which changes nothing */
+  }
+  got = hll_count(reg, 12);
+  snprintf(what, sizeof(what), "%u distinct counted as %llu",
+      n, (unsigned long long)got);
+  check(close_to(got, n), what);
+}
+
+int main() {
+  uint8_t a[1 << 12], b[1 << 12], small[1 << HLL_BITS_MIN];
+  uint32_t i;
+
+  memset(a, 0, sizeof(a));
+  check(hll_count(a, 12) == 0, "empty counts as 0");
+
+  test_count(1);
+  test_count(100);
+  test_count(5000);
+  test_count(100000);
+  test_count(2000000);
+
+  /* Two halves, with some overlap, merge into the whole. */
+  memset(b, 0, sizeof(b));
+  for (i = 0; i < 60000; i++)
+    hll_add(a, 12, mix(i));
+  for (i = 40000; i < 100000; i++)
+    hll_add(b, 12, mix(i));
+  hll_merge(a, b, 12);
+  check(close_to(hll_count(a, 12), 100000), "merged halves count the whole");
+
+  /* The smallest sketch still gets the order of magnitude. */
+  memset(small, 0, sizeof(small));
+  for (i = 0; i < 1000; i++)
+    hll_add(small, HLL_BITS_MIN, mix(i));
+  check(hll_count(small, HLL_BITS_MIN) > 500 &&
+      hll_count(small, HLL_BITS_MIN) < 2000, "16 registers count 1000");
+  return retcode;
+}
+/* vim:set ts=2 sts=2 sw=2 tw=80 et: */
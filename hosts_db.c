@@ -7,19 +7,30 @@
  * GNU General Public License version 2. (see COPYING.GPL)
  */
 
+#include "admit.h"
+#include "cap.h"
 #include "cdefs.h"
 #include "conv.h"
 #include "decode.h"
 #include "dns.h"
 #include "err.h"
+#include "flow.h"
+#include "graph_db.h"
+#include "hll.h"
 #include "hosts_db.h"
 #include "db.h"
 #include "html.h"
+#include "http.h"
+#include "metrics.h"
+#include "names.h"
 #include "ncache.h"
 #include "now.h"
 #include "opt.h"
+#include "pf.h"
+#include "slab.h"
 #include "str.h"
 
+#include <sys/mman.h> /* munmap() */
 #include <netdb.h>  /* struct addrinfo */
 #include <assert.h>
 #include <errno.h>
@@ -38,19 +49,43 @@ typedef uint32_t (hash_func_t)(const struct hashtable *, const void *);
 typedef void (free_func_t)(struct bucket *);
 typedef const void * (key_func_t)(const struct bucket *);
 typedef int (find_func_t)(const struct bucket *, const void *);
-typedef struct bucket * (make_func_t)(const void *);
+typedef struct bucket * (make_func_t)(struct slab *, const void *);
 typedef void (format_cols_func_t)(struct str *);
 typedef void (format_row_func_t)(struct str *, const struct bucket *);
 
+/* The table is open-addressed with Robin Hood linear probing.  Each slot
+ * keeps the full hash of its bucket's key next to the pointer, so a probe
+ * only has to touch the slot array, and only dereferences the bucket when
+ * the hashes match.
+ */
+struct hashslot {
+   uint32_t hash;
+   struct bucket *b;    /* NULL if the slot is empty */
+};
+
+/* A flat table doesn't hash into slots.  It keeps its buckets packed at the
+ * front of the slot array, in hash order, and bisects to find them.  That
+ * suits tables that stay tiny, like ip_protos, and it never has an old
+ * table.
+ */
 struct hashtable {
    uint8_t bits;     /* size of hashtable in bits */
+   uint8_t flat;     /* sorted array instead of open addressing */
    uint32_t size, mask;
    uint32_t count, count_max, count_keep;   /* items in table */
-   uint32_t coeff;   /* coefficient for Fibonacci hashing */
-   struct bucket **table;
+   struct hashslot *table;
+   struct slab *slab; /* where buckets are allocated from */
+
+   /* While growing, the previous table is kept frozen and its slots are
+    * moved across a few at a time.  Slots below old_pos have been moved.
+    */
+   struct hashslot *old_table;
+   uint32_t old_size, old_mask, old_pos;
 
    struct {
       uint64_t inserts, searches, deletions, rehashes;
+      uint64_t probes;     /* slots looked at past the home slot */
+      uint64_t collisions; /* slots with the same hash but another key */
    } stats;
 
    hash_func_t *hash_func;
@@ -66,7 +101,9 @@ struct hashtable {
    /* returns true if given bucket matches key (passed as void*) */
 
    make_func_t *make_func;
-   /* returns bucket containing new record with key (passed as void*) */
+   /* returns bucket allocated from the slab, containing new record with key
+    * (passed as void*)
+    */
 
    format_cols_func_t *format_cols_func;
    /* append table columns to str */
@@ -75,32 +112,73 @@ struct hashtable {
    /* format record and append to str */
 };
 
+/* The bucket at position i of the table followed by the unmoved part of the
+ * old table, or NULL for an empty slot.
+ */
+static struct bucket *
+hashtable_slot(const struct hashtable *h, uint32_t i)
+{
+   if (i < h->size)
+      return (h->table[i].b);
+   i -= h->size;
+   if (i < h->old_pos)
+      return (NULL); /* already moved */
+   return (h->old_table[i].b);
+}
+
+/* Loop over every bucket in a (possibly NULL) hashtable. */
+#define HASHTABLE_FOREACH(ht, i, bp) \
+   for (i = 0; (ht) != NULL && i < (ht)->size + (ht)->old_size; i++) \
+      if (((bp) = hashtable_slot((ht), i)) == NULL) {} else
+
 static void hashtable_reduce(struct hashtable *ht);
 static void hashtable_free(struct hashtable *h);
+static void hashtable_empty(struct hashtable *h);
+static void hosts_top_rebuild(void);
 
 #define HOST_BITS 1  /* initial size of hosts table */
 #define PORT_BITS 1  /* initial size of ports tables */
 #define PROTO_BITS 1 /* initial size of proto table */
 
+/* Peer sketches are 64 one-byte registers, a cache line, for a standard
+ * error of about 13%.
+ */
+#define PEERS_BITS 6
+#define PEERS_SIZE (1U << PEERS_BITS)
+
 /* We only use one hosts_db hashtable and this is it. */
 static struct hashtable *hosts_db = NULL;
 
-/* phi^-1 (reciprocal of golden ratio) = (sqrt(5) - 1) / 2 */
-static const double phi_1 =
-   0.61803398874989490252573887119069695472717285156250;
+/* How long reducing and starting a rehash of hosts_db take, for /metrics. */
+static struct histogram reduce_hist = HISTOGRAM_INIT(HISTOGRAM_NSEC);
+static struct histogram rehash_hist = HISTOGRAM_INIT(HISTOGRAM_NSEC);
+
+/* Every hash ends with the MurmurHash3 finalizer.  The slot is picked from
+ * the low bits of the hash, so each bit of the key has to reach all of them:
+ * sequential IPv4 scans and IPv6 addresses that only differ in their last
+ * 64 bits otherwise pile up in a few probe runs.
+ */
+static uint32_t hash_mix(uint32_t h) {
+   h ^= h >> 16;
+   h *= 0x85EBCA6BU;
+   h ^= h >> 13;
+   h *= 0xC2B2AE35U;
+   h ^= h >> 16;
+   return (h);
+}
 
-/* Co-prime of u, using phi^-1 */
-static uint32_t coprime(const uint32_t u) {
-   return ( (uint32_t)( (double)(u) * phi_1 ) | 1U );
+/* Fold another 32-bit word into a hash in progress. */
+static uint32_t hash_word(uint32_t h, uint32_t w) {
+   w *= 0xCC9E2D51U;
+   w = (w << 15) | (w >> 17);
+   w *= 0x1B873593U;
+   h ^= w;
+   h = (h << 13) | (h >> 19);
+   return (h * 5 + 0xE6546B64U);
 }
 
-/*
- * This is the "recommended" IPv4 hash function, as seen in FreeBSD's
- * src/sys/netinet/tcp_hostcache.c 1.1
- */
 static uint32_t ipv4_hash(const struct addr *const a) {
-   uint32_t ip = a->ip.v4;
-   return ( (ip) ^ ((ip) >> 7) ^ ((ip) >> 17) );
+   return (hash_mix(hash_word(IPv4, (uint32_t)a->ip.v4)));
 }
 
 #ifndef s6_addr32
@@ -116,14 +194,15 @@ static uint32_t ipv4_hash(const struct addr *const a) {
 # endif
 #endif
 
-/*
- * This is the IPv6 hash function used by FreeBSD in the same file as above,
- * svn rev 122922.
- */
 static uint32_t ipv6_hash(const struct addr *const a) {
    const struct in6_addr *const ip6 = &(a->ip.v6);
-   return ( ip6->s6_addr32[0] ^ ip6->s6_addr32[1] ^
-            ip6->s6_addr32[2] ^ ip6->s6_addr32[3] );
+   uint32_t h = IPv6;
+
+   h = hash_word(h, ip6->s6_addr32[0]);
+   h = hash_word(h, ip6->s6_addr32[1]);
+   h = hash_word(h, ip6->s6_addr32[2]);
+   h = hash_word(h, ip6->s6_addr32[3]);
+   return (hash_mix(h));
 }
 
 /* ---------------------------------------------------------------------------
@@ -141,18 +220,30 @@ hash_func_host(const struct hashtable *h _unused_, const void *key)
    }
 }
 
+/* Hash n host addresses in one go.  There's no dependency between them, so
+ * the multiplies for several addresses can be in flight at once.
+ */
+static void
+hash_hosts(const struct addr *const *a, uint32_t *hash, const size_t n)
+{
+   size_t i;
+
+   for (i = 0; i < n; i++)
+      hash[i] = hash_func_host(NULL, a[i]);
+}
+
 #define CASTKEY(type) (*((const type *)key))
 
 static uint32_t
-hash_func_short(const struct hashtable *h, const void *key)
+hash_func_short(const struct hashtable *h _unused_, const void *key)
 {
-   return (CASTKEY(uint16_t) * h->coeff);
+   return (hash_mix(CASTKEY(uint16_t)));
 }
 
 static uint32_t
-hash_func_byte(const struct hashtable *h, const void *key)
+hash_func_byte(const struct hashtable *h _unused_, const void *key)
 {
-   return (CASTKEY(uint8_t) * h->coeff);
+   return (hash_mix(CASTKEY(uint8_t)));
 }
 
 /* ---------------------------------------------------------------------------
@@ -216,61 +307,73 @@ find_func_ip_proto(const struct bucket *b, const void *key)
  */
 
 #define MAKE_BUCKET(name_bucket, name_content, type) struct { \
-   struct bucket *next; \
-   uint64_t in, out, total; \
+   uint64_t in, out; \
    union { struct type t; } u; } _custom_bucket; \
-   struct bucket *name_bucket = xcalloc(1, sizeof(_custom_bucket)); \
+   struct bucket *name_bucket = slab_alloc(slab, sizeof(_custom_bucket)); \
    struct type *name_content = &(name_bucket->u.type); \
-   name_bucket->next = NULL; \
-   name_bucket->in = name_bucket->out = name_bucket->total = 0;
+   name_bucket->in = name_bucket->out = 0;
 
 static struct bucket *
-make_func_host(const void *key)
+make_func_host(struct slab *slab, const void *key)
 {
    MAKE_BUCKET(b, h, host);
    h->addr = CASTKEY(struct addr);
-   h->dns = NULL;
+   h->dns = NAME_NONE;
    h->last_seen_mono = 0;
+   memset(&h->top_pos, 0, sizeof(h->top_pos));
+   h->changed = 0;
+   h->saved = 0;
    memset(&h->mac_addr, 0, sizeof(h->mac_addr));
+   h->graph_slot = 0;
    h->ports_tcp = NULL;
    h->ports_tcp_remote = NULL;
    h->ports_udp = NULL;
    h->ports_udp_remote = NULL;
    h->ip_protos = NULL;
+   h->peers = NULL;
+   memset(&h->hot_key, 0, sizeof(h->hot_key));
    return (b);
 }
 
+static void saved_release(void);
+static void host_restore(struct bucket *host);
+
 static void
 free_func_host(struct bucket *b)
 {
    struct host *h = &(b->u.host);
-   if (h->dns != NULL) free(h->dns);
+   hosts_graph_release(b);
+   name_unref(h->dns);
+   if (h->saved != 0) saved_release();
    hashtable_free(h->ports_tcp);
    hashtable_free(h->ports_tcp_remote);
    hashtable_free(h->ports_udp);
    hashtable_free(h->ports_udp_remote);
    hashtable_free(h->ip_protos);
+   if (h->peers != NULL) slab_release(h->peers);
 }
 
 static struct bucket *
-make_func_port_tcp(const void *key)
+make_func_port_tcp(struct slab *slab, const void *key)
 {
    MAKE_BUCKET(b, p, port_tcp);
    p->port = CASTKEY(uint16_t);
+   p->peers = NULL;
    p->syn = 0;
    return (b);
 }
 
 static struct bucket *
-make_func_port_udp(const void *key)
+make_func_port_udp(struct slab *slab, const void *key)
 {
    MAKE_BUCKET(b, p, port_udp);
    p->port = CASTKEY(uint16_t);
+   p->peers = NULL;
    return (b);
 }
 
 static struct bucket *
-make_func_ip_proto(const void *key)
+make_func_ip_proto(struct slab *slab, const void *key)
 {
    MAKE_BUCKET(b, p, ip_proto);
    p->proto = CASTKEY(uint8_t);
@@ -283,6 +386,18 @@ free_func_simple(struct bucket *b _unused_)
    /* nop */
 }
 
+static void
+free_func_port_tcp(struct bucket *b)
+{
+   if (b->u.port_tcp.peers != NULL) slab_release(b->u.port_tcp.peers);
+}
+
+static void
+free_func_port_udp(struct bucket *b)
+{
+   if (b->u.port_udp.peers != NULL) slab_release(b->u.port_udp.peers);
+}
+
 /* ---------------------------------------------------------------------------
  * format_func collection (ordered by struct)
  */
@@ -311,17 +426,31 @@ format_cols_host(struct str *buf)
       "</tr>\n");
 }
 
+/* The rows below are written a piece at a time, rather than through
+ * str_appendf(), because there can be a lot of them.
+ */
 static void
-format_row_host(struct str *buf, const struct bucket *b)
+format_num_cell(struct str *buf, const uint64_t n)
 {
-   const char *ip = addr_to_str(&(b->u.host.addr));
+   str_append(buf, " <td class=\"num\">");
+   str_append_u64(buf, n, 1);
+   str_append(buf, "</td>\n");
+}
 
-   str_appendf(buf,
-      "<tr>\n"
-      " <td><a href=\"./%s/\">%s</a></td>\n"
-      " <td>%s</td>\n",
-      ip, ip,
-      (b->u.host.dns == NULL) ? "" : b->u.host.dns);
+static void
+format_row_host(struct str *buf, const struct bucket *b)
+{
+   char ip[INET6_ADDRSTRLEN], name[NAME_BUF_LEN];
+   const size_t ip_len = addr_format(&(b->u.host.addr), ip);
+
+   str_append(buf, "<tr>\n <td><a href=\"./");
+   str_appendn(buf, ip, ip_len);
+   str_append(buf, "/\">");
+   str_appendn(buf, ip, ip_len);
+   str_append(buf, "</a></td>\n <td>");
+   if (b->u.host.dns != NAME_NONE)
+      str_append(buf, name_str(b->u.host.dns, name));
+   str_append(buf, "</td>\n");
 
    if (hosts_db_show_macs)
       str_appendf(buf,
@@ -333,13 +462,9 @@ format_row_host(struct str *buf, const struct bucket *b)
          b->u.host.mac_addr[4],
          b->u.host.mac_addr[5]);
 
-   str_appendf(buf,
-      " <td class=\"num\">%'qu</td>\n"
-      " <td class=\"num\">%'qu</td>\n"
-      " <td class=\"num\">%'qu</td>\n",
-      (qu)b->in,
-      (qu)b->out,
-      (qu)b->total);
+   format_num_cell(buf, b->in);
+   format_num_cell(buf, b->out);
+   format_num_cell(buf, BUCKET_TOTAL(b));
 
    if (opt_want_lastseen) {
       int64_t last = b->u.host.last_seen_mono;
@@ -364,15 +489,16 @@ format_row_host(struct str *buf, const struct bucket *b)
       str_append(buf, "</td>");
    }
 
-   str_appendf(buf, "</tr>\n");
+   str_append(buf, "</tr>\n");
 
    /* Only resolve hosts "on demand" */
-   if (b->u.host.dns == NULL)
+   if (b->u.host.dns == NAME_NONE)
       dns_queue(&(b->u.host.addr));
 }
 
+/* Ports on the host itself get a column for how many peers used them. */
 static void
-format_cols_port_tcp(struct str *buf)
+format_cols_port(struct str *buf, const int syns, const int peers)
 {
    str_append(buf,
       "<table>\n"
@@ -382,68 +508,112 @@ format_cols_port_tcp(struct str *buf)
       " <th>In</td>\n"
       " <th>Out</td>\n"
       " <th>Total</td>\n"
-      " <th>SYNs</td>\n"
-      "</tr>\n"
    );
+   if (syns) str_append(buf,
+      " <th>SYNs</td>\n");
+   if (peers) str_append(buf,
+      " <th>Peers</td>\n");
+   str_append(buf,
+      "</tr>\n");
 }
 
+static uint64_t peers_count(const uint8_t *peers);
+
 static void
-format_row_port_tcp(struct str *buf, const struct bucket *b)
+format_peers_cell(struct str *buf, const uint8_t *peers)
+{
+   if (peers == NULL)
+      str_append(buf, " <td></td>\n");
+   else
+      str_appendf(buf, " <td class=\"num\">~%'qu</td>\n",
+         (qu)peers_count(peers));
+}
+
+static void
+format_row_tcp(struct str *buf, const struct bucket *b, const int peers)
 {
    const struct port_tcp *p = &(b->u.port_tcp);
 
    str_appendf(buf,
       "<tr>\n"
       " <td class=\"num\">%u</td>\n"
-      " <td>%s</td>\n"
-      " <td class=\"num\">%'qu</td>\n"
-      " <td class=\"num\">%'qu</td>\n"
-      " <td class=\"num\">%'qu</td>\n"
-      " <td class=\"num\">%'qu</td>\n"
-      "</tr>\n",
+      " <td>%s</td>\n",
       p->port,
-      getservtcp(p->port),
-      (qu)b->in,
-      (qu)b->out,
-      (qu)b->total,
-      (qu)p->syn
-   );
+      getservtcp(p->port));
+   format_num_cell(buf, b->in);
+   format_num_cell(buf, b->out);
+   format_num_cell(buf, BUCKET_TOTAL(b));
+   format_num_cell(buf, p->syn);
+   if (peers)
+      format_peers_cell(buf, p->peers);
+   str_append(buf, "</tr>\n");
 }
 
 static void
-format_cols_port_udp(struct str *buf)
+format_row_udp(struct str *buf, const struct bucket *b, const int peers)
 {
-   str_append(buf,
-      "<table>\n"
+   const struct port_udp *p = &(b->u.port_udp);
+
+   str_appendf(buf,
       "<tr>\n"
-      " <th>Port</td>\n"
-      " <th>Service</td>\n"
-      " <th>In</td>\n"
-      " <th>Out</td>\n"
-      " <th>Total</td>\n"
-      "</tr>\n"
-   );
+      " <td class=\"num\">%u</td>\n"
+      " <td>%s</td>\n",
+      p->port,
+      getservudp(p->port));
+   format_num_cell(buf, b->in);
+   format_num_cell(buf, b->out);
+   format_num_cell(buf, BUCKET_TOTAL(b));
+   if (peers)
+      format_peers_cell(buf, p->peers);
+   str_append(buf, "</tr>\n");
+}
+
+static void
+format_cols_port_tcp(struct str *buf)
+{
+   format_cols_port(buf, 1, 0);
+}
+
+static void
+format_row_port_tcp(struct str *buf, const struct bucket *b)
+{
+   format_row_tcp(buf, b, 0);
+}
+
+static void
+format_cols_port_tcp_local(struct str *buf)
+{
+   format_cols_port(buf, 1, opt_want_peers);
+}
+
+static void
+format_row_port_tcp_local(struct str *buf, const struct bucket *b)
+{
+   format_row_tcp(buf, b, opt_want_peers);
+}
+
+static void
+format_cols_port_udp(struct str *buf)
+{
+   format_cols_port(buf, 0, 0);
 }
 
 static void
 format_row_port_udp(struct str *buf, const struct bucket *b)
 {
-   const struct port_udp *p = &(b->u.port_udp);
+   format_row_udp(buf, b, 0);
+}
 
-   str_appendf(buf,
-      "<tr>\n"
-      " <td class=\"num\">%u</td>\n"
-      " <td>%s</td>\n"
-      " <td class=\"num\">%'qu</td>\n"
-      " <td class=\"num\">%'qu</td>\n"
-      " <td class=\"num\">%'qu</td>\n"
-      "</tr>\n",
-      p->port,
-      getservudp(p->port),
-      (qu)b->in,
-      (qu)b->out,
-      (qu)b->total
-   );
+static void
+format_cols_port_udp_local(struct str *buf)
+{
+   format_cols_port(buf, 0, opt_want_peers);
+}
+
+static void
+format_row_port_udp_local(struct str *buf, const struct bucket *b)
+{
+   format_row_udp(buf, b, opt_want_peers);
 }
 
 static void
@@ -478,7 +648,7 @@ format_row_ip_proto(struct str *buf, const struct bucket *b)
       getproto(p->proto),
       (qu)b->in,
       (qu)b->out,
-      (qu)b->total
+      (qu)BUCKET_TOTAL(b)
    );
 }
 
@@ -486,7 +656,8 @@ format_row_ip_proto(struct str *buf, const struct bucket *b)
  * Initialise a hashtable.
  */
 static struct hashtable *
-hashtable_make(const uint8_t bits,
+hashtable_make(struct slab *slab,
+   const uint8_t bits,
    const unsigned int count_max,
    const unsigned int count_keep,
    hash_func_t *hash_func,
@@ -506,16 +677,21 @@ hashtable_make(const uint8_t bits,
    hash->count_keep = count_keep;
    hash->size = 1U << bits;
    hash->mask = hash->size - 1;
-   hash->coeff = coprime(hash->size);
    hash->hash_func = hash_func;
    hash->free_func = free_func;
    hash->key_func = key_func;
    hash->find_func = find_func;
    hash->make_func = make_func;
+   hash->slab = slab;
    hash->format_cols_func = format_cols_func;
    hash->format_row_func = format_row_func;
+   hash->flat = 0;
    hash->count = 0;
    hash->table = xcalloc(hash->size, sizeof(*hash->table));
+   slab_charge(slab, sizeof(*hash) + hash->size * sizeof(*hash->table));
+   slab_advise(hash->table, hash->size * sizeof(*hash->table));
+   hash->old_table = NULL;
+   hash->old_size = hash->old_mask = hash->old_pos = 0;
    memset(&(hash->stats), 0, sizeof(hash->stats));
    return (hash);
 }
@@ -527,106 +703,368 @@ void
 hosts_db_init(void)
 {
    assert(hosts_db == NULL);
-   hosts_db = hashtable_make(HOST_BITS, opt_hosts_max, opt_hosts_keep,
+   hosts_db = hashtable_make(slab_make(), HOST_BITS, opt_hosts_max, opt_hosts_keep,
       hash_func_host, free_func_host, key_func_host, find_func_host,
       make_func_host, format_cols_host, format_row_host);
+   admit_init();
+}
+
+/* How far the slot at pos is from where its hash wanted it to be. */
+#define PROBE_DIST(table, mask, pos) \
+   (((pos) - ((table)[pos].hash & (mask))) & (mask))
+
+/* Place a bucket into the table, which must have a free slot. */
+static void
+hashtable_place(struct hashtable *h, uint32_t hash, struct bucket *b)
+{
+   uint32_t pos = hash & h->mask, dist = 0;
+
+   for (;;) {
+      struct hashslot *slot = &(h->table[pos]);
+      uint32_t slot_dist;
+
+      if (slot->b == NULL) {
+         slot->hash = hash;
+         slot->b = b;
+         return;
+      }
+      /* Robin Hood: take the slot from anything closer to its home. */
+      slot_dist = PROBE_DIST(h->table, h->mask, pos);
+      if (slot_dist < dist) {
+         uint32_t tmp_hash = slot->hash;
+         struct bucket *tmp_b = slot->b;
+
+         slot->hash = hash;
+         slot->b = b;
+         hash = tmp_hash;
+         b = tmp_b;
+         dist = slot_dist;
+      }
+      pos = (pos + 1) & h->mask;
+      dist++;
+   }
+}
+
+/* Move up to n slots from the old table into the new one. */
+static void
+hashtable_rehash_step(struct hashtable *h, uint32_t n)
+{
+   if (h->old_table == NULL)
+      return;
+   for (; n > 0 && h->old_pos < h->old_size; n--, h->old_pos++) {
+      const struct hashslot *slot = &(h->old_table[h->old_pos]);
+
+      if (slot->b != NULL)
+         hashtable_place(h, slot->hash, slot->b);
+   }
+   if (h->old_pos == h->old_size) {
+      free(h->old_table);
+      slab_uncharge(h->slab, h->old_size * sizeof(*h->old_table));
+      h->old_table = NULL;
+      h->old_size = h->old_mask = h->old_pos = 0;
+   }
+}
+
+/* Finish any rehash in progress, before changes that can't cope with two
+ * tables.
+ */
+static void
+hashtable_rehash_finish(struct hashtable *h)
+{
+   hashtable_rehash_step(h, h->old_size);
 }
 
+/* Start growing the table to the given size.  The slots are moved over
+ * incrementally by later inserts and searches, rather than all at once,
+ * which would stall the capture path on a large table.
+ */
 static void
 hashtable_rehash(struct hashtable *h, const uint8_t bits)
 {
-   struct bucket **old_table, **new_table;
-   uint32_t i, old_size;
+   struct timespec t;
+
    assert(h != NULL);
    assert(bits > 0);
 
+   if (h == hosts_db)
+      timer_start(&t);
+   hashtable_rehash_finish(h);
    h->stats.rehashes++;
-   old_size = h->size;
-   old_table = h->table;
+   h->old_table = h->table;
+   h->old_size = h->size;
+   h->old_mask = h->mask;
+   h->old_pos = 0;
 
    h->bits = bits;
    h->size = 1U << bits;
    h->mask = h->size - 1;
-   h->coeff = coprime(h->size);
-   new_table = xcalloc(h->size, sizeof(*new_table));
-
-   for (i=0; i<old_size; i++) {
-      struct bucket *next, *b = old_table[i];
-      while (b != NULL) {
-         uint32_t pos = h->hash_func(h, h->key_func(b)) & h->mask;
-         next = b->next;
-         b->next = new_table[pos];
-         new_table[pos] = b;
-         b = next;
-      }
+   h->table = xcalloc(h->size, sizeof(*h->table));
+   slab_charge(h->slab, h->size * sizeof(*h->table));
+   slab_advise(h->table, h->size * sizeof(*h->table));
+   if (h == hosts_db)
+      histogram_add(&rehash_hist, (uint64_t)timer_nsec(&t));
+}
+
+/* Grow the table up front to take n more buckets, so that inserting them
+ * doesn't rehash along the way.
+ */
+static void
+hashtable_reserve(struct hashtable *h, const uint32_t n)
+{
+   uint8_t bits = h->bits;
+
+   while ((uint64_t)(h->count + n) * 5 > ((uint64_t)1 << bits) * 4)
+      bits++;
+   if (bits > h->bits) {
+      hashtable_rehash(h, bits);
+      hashtable_rehash_finish(h);
    }
+}
 
-   free(h->table);
-   h->table = new_table;
+/* Slots moved per insert or search while a rehash is in progress.  The new
+ * table is twice the size and the old one was at most 80% full, so moving
+ * more than two slots per insert always finishes before the new table
+ * fills.
+ */
+#define REHASH_STEP_INSERT 8
+#define REHASH_STEP_SEARCH 2
+
+/* Return the first position in a flat table whose hash is >= the given
+ * one.
+ */
+static uint32_t
+hashtable_flat_lower(const struct hashtable *h, const uint32_t hash)
+{
+   uint32_t lo = 0, hi = h->count;
+
+   while (lo < hi) {
+      uint32_t mid = lo + (hi - lo) / 2;
+
+      if (h->table[mid].hash < hash)
+         lo = mid + 1;
+      else
+         hi = mid;
+   }
+   return (lo);
 }
 
 static void
-hashtable_insert(struct hashtable *h, struct bucket *b)
+hashtable_flat_insert(struct hashtable *h, const uint32_t hash,
+   struct bucket *b)
 {
    uint32_t pos;
+
+   if (h->count == h->size) {
+      h->stats.rehashes++;
+      h->table = xrealloc(h->table, 2 * h->size * sizeof(*h->table));
+      memset(h->table + h->size, 0, h->size * sizeof(*h->table));
+      slab_charge(h->slab, h->size * sizeof(*h->table));
+      h->bits++;
+      h->size *= 2;
+      h->mask = h->size - 1;
+   }
+   pos = hashtable_flat_lower(h, hash);
+   memmove(h->table + pos + 1, h->table + pos,
+      (h->count - pos) * sizeof(*h->table));
+   h->table[pos].hash = hash;
+   h->table[pos].b = b;
+}
+
+/* The operations that hash, compare or make buckets take those functions
+ * as arguments, and are always inlined.  HASHTABLE_GENERATE() below passes
+ * them constants, which gives each kind of table its own copy with the
+ * hash and compare inlined too, rather than calls through the pointers in
+ * struct hashtable.  Those are left for freeing and formatting, and for
+ * checking that each table is used with the right copy.
+ */
+#ifdef __GNUC__
+# define HASHTABLE_INLINE static inline __attribute__((always_inline))
+#else
+# define HASHTABLE_INLINE static inline
+#endif
+
+HASHTABLE_INLINE void
+hashtable_insert_by(struct hashtable *h, struct bucket *b,
+   hash_func_t *hash_func, key_func_t *key_func)
+{
    assert(h != NULL);
    assert(b != NULL);
-   assert(b->next == NULL);
+
+   if (h->flat) {
+      hashtable_flat_insert(h, hash_func(h, key_func(b)), b);
+      h->count++;
+      h->stats.inserts++;
+      return;
+   }
 
    /* Rehash on 80% occupancy */
-   if ((h->count > h->size) ||
-       ((h->size - h->count) < h->size / 5))
+   if ((uint64_t)(h->count + 1) * 5 > (uint64_t)h->size * 4)
       hashtable_rehash(h, h->bits+1);
+   else
+      hashtable_rehash_step(h, REHASH_STEP_INSERT);
 
-   pos = h->hash_func(h, h->key_func(b)) & h->mask;
-   if (h->table[pos] == NULL)
-      h->table[pos] = b;
-   else {
-      /* Insert at top of chain. */
-      b->next = h->table[pos];
-      h->table[pos] = b;
-   }
+   hashtable_place(h, hash_func(h, key_func(b)), b);
    h->count++;
    h->stats.inserts++;
 }
 
+/* Return the position of hash/key in the given slot array, or UINT32_MAX if
+ * it's not there.
+ */
+HASHTABLE_INLINE uint32_t
+hashtable_probe(struct hashtable *h, const struct hashslot *table,
+   const uint32_t mask, const uint32_t hash, const void *key,
+   find_func_t *find_func)
+{
+   uint32_t pos = hash & mask, dist;
+
+   for (dist = 0; ; dist++) {
+      const struct hashslot *slot = &(table[pos]);
+
+      /* An empty slot, or one closer to home than we are, ends the run. */
+      if ((slot->b == NULL) || (PROBE_DIST(table, mask, pos) < dist))
+         break;
+      if (slot->hash == hash) {
+         if (find_func(slot->b, key)) {
+            h->stats.probes += dist;
+            return (pos);
+         }
+         h->stats.collisions++;
+      }
+      pos = (pos + 1) & mask;
+   }
+   h->stats.probes += dist;
+   return (UINT32_MAX);
+}
+
 /* Return bucket matching key, or NULL if no such entry. */
-static struct bucket *
-hashtable_search(struct hashtable *h, const void *key)
+HASHTABLE_INLINE struct bucket *
+hashtable_search_by(struct hashtable *h, const void *key,
+   hash_func_t *hash_func, find_func_t *find_func)
 {
-   uint32_t pos;
-   struct bucket *b;
+   uint32_t hash, pos;
 
    h->stats.searches++;
-   pos = h->hash_func(h, key) & h->mask;
-   b = h->table[pos];
-   while (b != NULL) {
-      if (h->find_func(b, key))
-         return (b);
-      else
-         b = b->next;
+   hash = hash_func(h, key);
+   if (h->flat) {
+      for (pos = hashtable_flat_lower(h, hash);
+           (pos < h->count) && (h->table[pos].hash == hash); pos++)
+         if (find_func(h->table[pos].b, key))
+            return (h->table[pos].b);
+      return (NULL);
+   }
+   hashtable_rehash_step(h, REHASH_STEP_SEARCH);
+   pos = hashtable_probe(h, h->table, h->mask, hash, key, find_func);
+   if (pos != UINT32_MAX)
+      return (h->table[pos].b);
+   if (h->old_table != NULL) {
+      /* The old table is frozen, so anything found at or above old_pos
+       * hasn't been moved yet.
+       */
+      pos = hashtable_probe(h, h->old_table, h->old_mask, hash, key,
+         find_func);
+      if ((pos != UINT32_MAX) && (pos >= h->old_pos))
+         return (h->old_table[pos].b);
    }
    return (NULL);
 }
 
+/* Start loading the slots where n hosts would be, ahead of searching for
+ * them.
+ */
+static void
+hashtable_prefetch_hosts(const struct hashtable *h,
+   const struct addr *const *a, const size_t n)
+{
+   uint32_t hash[HOSTS_PREFETCH_MAX];
+   size_t i;
+
+   assert(n <= HOSTS_PREFETCH_MAX);
+   hash_hosts(a, hash, n);
+   for (i = 0; i < n; i++)
+      PREFETCH(&(h->table[hash[i] & h->mask]));
+}
+
+/* Empty the slot at pos, shifting back the run that follows it.  The bucket
+ * is not freed.  There must be no rehash in progress.
+ */
+static void
+hashtable_remove_slot(struct hashtable *h, uint32_t pos)
+{
+   uint32_t next = (pos + 1) & h->mask;
+
+   assert(h->old_table == NULL);
+   if (h->flat) {
+      memmove(h->table + pos, h->table + pos + 1,
+         (h->count - pos - 1) * sizeof(*h->table));
+      pos = h->count - 1;
+   } else while ((h->table[next].b != NULL) &&
+          (PROBE_DIST(h->table, h->mask, next) > 0)) {
+      h->table[pos] = h->table[next];
+      pos = next;
+      next = (next + 1) & h->mask;
+   }
+   h->table[pos].b = NULL;
+   h->count--;
+   h->stats.deletions++;
+}
+
 typedef enum { NO_REDUCE = 0, ALLOW_REDUCE = 1 } reduce_bool;
 /* Search for a key.  If it's not there, make and insert a bucket for it. */
-static struct bucket *
-hashtable_find_or_insert(struct hashtable *h, const void *key,
-      const reduce_bool allow_reduce)
+HASHTABLE_INLINE struct bucket *
+hashtable_find_or_insert_by(struct hashtable *h, const void *key,
+      const reduce_bool allow_reduce, hash_func_t *hash_func,
+      key_func_t *key_func, find_func_t *find_func, make_func_t *make_func)
 {
-   struct bucket *b = hashtable_search(h, key);
+   struct bucket *b = hashtable_search_by(h, key, hash_func, find_func);
 
    if (b == NULL) {
       /* Not found, so insert after checking occupancy. */
       if (allow_reduce && (h->count >= h->count_max))
          hashtable_reduce(h);
-      b = h->make_func(key);
-      hashtable_insert(h, b);
+      b = make_func(h->slab, key);
+      hashtable_insert_by(h, b, hash_func, key_func);
    }
    return (b);
 }
 
+/* Define name_search(), name_insert() and name_find_or_insert() for
+ * tables made with the given functions, which must match the ones that
+ * the table was made with.
+ */
+#define HASHTABLE_GENERATE(name, hashf, keyf, findf, makef)          \
+static _unused_ struct bucket *                                         \
+name##_search(struct hashtable *h, const void *key)                     \
+{                                                                       \
+   assert(h->find_func == findf);                                       \
+   return (hashtable_search_by(h, key, hashf, findf));                  \
+}                                                                       \
+                                                                        \
+static _unused_ void                                                    \
+name##_insert(struct hashtable *h, struct bucket *b)                    \
+{                                                                       \
+   assert(h->key_func == keyf);                                         \
+   hashtable_insert_by(h, b, hashf, keyf);                              \
+}                                                                       \
+                                                                        \
+static _unused_ struct bucket *                                         \
+name##_find_or_insert(struct hashtable *h, const void *key,             \
+   const reduce_bool allow_reduce)                                      \
+{                                                                       \
+   assert(h->make_func == makef);                                       \
+   return (hashtable_find_or_insert_by(h, key, allow_reduce,            \
+      hashf, keyf, findf, makef));                                      \
+}
+
+HASHTABLE_GENERATE(ht_host, hash_func_host, key_func_host, find_func_host,
+   make_func_host)
+HASHTABLE_GENERATE(ht_port_tcp, hash_func_short, key_func_port_tcp,
+   find_func_port_tcp, make_func_port_tcp)
+HASHTABLE_GENERATE(ht_port_udp, hash_func_short, key_func_port_udp,
+   find_func_port_udp, make_func_port_udp)
+HASHTABLE_GENERATE(ht_ip_proto, hash_func_byte, key_func_ip_proto,
+   find_func_ip_proto, make_func_ip_proto)
+
 /*
  * Frees the hashtable and the buckets.  The contents are assumed to be
  * "simple" -- i.e. no "destructor" action is required beyond simply freeing
@@ -639,15 +1077,15 @@ hashtable_free(struct hashtable *h)
 
    if (h == NULL)
       return;
+   hashtable_rehash_finish(h);
    for (i=0; i<h->size; i++) {
-      struct bucket *tmp, *b = h->table[i];
-      while (b != NULL) {
-         tmp = b;
-         b = b->next;
-         h->free_func(tmp);
-         free(tmp);
+      struct bucket *b = h->table[i].b;
+      if (b != NULL) {
+         h->free_func(b);
+         slab_release(b);
       }
    }
+   slab_uncharge(h->slab, sizeof(*h) + h->size * sizeof(*h->table));
    free(h->table);
    free(h);
 }
@@ -658,7 +1096,37 @@ hashtable_free(struct hashtable *h)
 struct bucket *
 host_get(const struct addr *const a)
 {
-   return (hashtable_find_or_insert(hosts_db, a, NO_REDUCE));
+   return (ht_host_find_or_insert(hosts_db, a, NO_REDUCE));
+}
+
+/* ---------------------------------------------------------------------------
+ * Return existing host, or insert a new one if there's room for it or it
+ * has earned its place, see admit.c.
+ */
+struct bucket *
+host_admit(const struct addr *const a, const uint64_t bytes)
+{
+   struct bucket *b;
+   uint32_t hash;
+
+   if ((opt_admit_bytes == 0) || (hosts_db->count < hosts_db->count_keep))
+      return (ht_host_find_or_insert(hosts_db, a, NO_REDUCE));
+   hash = hash_func_host(hosts_db, a);
+   admit_seen(hash);
+   if ((b = ht_host_search(hosts_db, a)) != NULL)
+      return (b);
+   if (!admit_host(hash, bytes))
+      return (NULL);
+   b = make_func_host(hosts_db->slab, a);
+   ht_host_insert(hosts_db, b);
+   return (b);
+}
+
+/* Hint that host_get() is coming up soon for each of n hosts. */
+void
+host_prefetch(const struct addr *const *a, const size_t n)
+{
+   hashtable_prefetch_hosts(hosts_db, a, n);
 }
 
 /* ---------------------------------------------------------------------------
@@ -667,7 +1135,7 @@ host_get(const struct addr *const a)
 struct bucket *
 host_find(const struct addr *const a)
 {
-   return (hashtable_search(hosts_db, a));
+   return (ht_host_search(hosts_db, a));
 }
 
 /* ---------------------------------------------------------------------------
@@ -702,7 +1170,7 @@ host_search(const char *ipstr)
    freeaddrinfo(ai);
 
    verbosef("search(%s) turned into %s", ipstr, addr_to_str(&a));
-   return (hashtable_search(hosts_db, &a));
+   return (ht_host_search(hosts_db, &a));
 }
 
 /* ---------------------------------------------------------------------------
@@ -712,101 +1180,293 @@ static void
 hashtable_reduce(struct hashtable *ht)
 {
    uint32_t i, pos, rmd;
-   const struct bucket **table;
-   uint64_t cutoff;
+   uint64_t *totals, cutoff;
 
    assert(ht->count_keep < ht->count);
+   hashtable_rehash_finish(ht);
 
-   /* Fill table with pointers to buckets in hashtable. */
-   table = xcalloc(ht->count, sizeof(*table));
-   for (pos=0, i=0; i<ht->size; i++) {
-      struct bucket *b = ht->table[i];
-      while (b != NULL) {
-         table[pos++] = b;
-         b = b->next;
-      }
-   }
+   /* Find the total of the (keep+1)th biggest bucket, by selection rather
+    * than sorting.  A flat array of totals is much kinder to the cache than
+    * chasing bucket pointers.
+    */
+   totals = xmalloc(ht->count * sizeof(*totals));
+   for (pos=0, i=0; i<ht->size; i++)
+      if (ht->table[i].b != NULL)
+         totals[pos++] = BUCKET_TOTAL(ht->table[i].b);
    assert(pos == ht->count);
-   qsort_buckets(table, ht->count, 0, ht->count_keep, TOTAL);
-   cutoff = table[ht->count_keep]->total;
-   free(table);
+   cutoff = select_u64_desc(totals, ht->count, ht->count_keep);
+   free(totals);
 
-   /* Remove all elements with total <= cutoff. */
+   /* Remove all elements with total <= cutoff.  Removing a slot shifts the
+    * next one back into it, so look at the same position again.  The shift
+    * can also wrap slot 0 around to the end, which just means we see that
+    * bucket twice.
+    */
    rmd = 0;
-   for (i=0; i<ht->size; i++) {
-      struct bucket *last = NULL, *next, *b = ht->table[i];
-      while (b != NULL) {
-         next = b->next;
-         if (b->total <= cutoff) {
-            /* Remove this one. */
-            ht->free_func(b);
-            free(b);
-            if (last == NULL)
-               ht->table[i] = next;
-            else
-               last->next = next;
-            rmd++;
-            ht->count--;
-         } else {
-            last = b;
-         }
-         b = next;
-      }
+   for (i=0; i<ht->size; ) {
+      struct bucket *b = ht->table[i].b;
+
+      if ((b != NULL) && (BUCKET_TOTAL(b) <= cutoff)) {
+         ht->free_func(b);
+         slab_release(b);
+         hashtable_remove_slot(ht, i);
+         rmd++;
+      } else
+         i++;
    }
    verbosef("hashtable_reduce: removed %u buckets, left %u",
       rmd, ht->count);
-   hashtable_rehash(ht, ht->bits); /* is this needed? */
-}
-
-/* Reduce hosts_db if needed. */
-void hosts_db_reduce(void)
-{
-   if (hosts_db->count >= hosts_db->count_max)
-      hashtable_reduce(hosts_db);
+   if (ht == hosts_db)
+      hosts_top_rebuild();
 }
 
 /* ---------------------------------------------------------------------------
- * Reset hosts_db to empty.
+ * With --memory-limit, hosts are weighed by their traffic for each byte they
+ * take up, counting their port and protocol tables, peer sketches and the
+ * part of their DNS name that's theirs alone.  A busy host with a handful of
+ * ports outweighs a quiet one that's been scanned across thousands.  The
+ * bytes are added up when reducing, rather than kept up to date in every
+ * host as packets come in.
  */
-void
-hosts_db_reset(void)
+
+/* Memory held by one of a host's port or protocol tables. */
+static size_t
+hashtable_bytes(const struct hashtable *h)
 {
-   unsigned int i;
+   const struct bucket *b;
+   uint32_t i;
+   size_t bytes;
 
-   for (i=0; i<hosts_db->size; i++) {
-      struct bucket *next, *b = hosts_db->table[i];
-      while (b != NULL) {
-         next = b->next;
-         hosts_db->free_func(b);
-         free(b);
-         b = next;
-      }
-      hosts_db->table[i] = NULL;
+   if (h == NULL)
+      return (0);
+   bytes = sizeof(*h) + (h->size + h->old_size) * sizeof(*h->table);
+   HASHTABLE_FOREACH(h, i, b) {
+      bytes += slab_size(b);
+      if ((h->free_func == free_func_port_tcp) &&
+          (b->u.port_tcp.peers != NULL))
+         bytes += slab_size(b->u.port_tcp.peers);
+      else if ((h->free_func == free_func_port_udp) &&
+          (b->u.port_udp.peers != NULL))
+         bytes += slab_size(b->u.port_udp.peers);
    }
-   verbosef("hosts_db reset to empty, freed %u hosts", hosts_db->count);
-   hosts_db->count = 0;
+   return (bytes);
 }
 
-/* ---------------------------------------------------------------------------
- * Deallocate hosts_db.
- */
-void hosts_db_free(void)
+/* Memory that removing a host would free. */
+static size_t
+host_bytes(const struct bucket *b)
 {
-   uint32_t i;
+   const struct host *h = &(b->u.host);
 
-   assert(hosts_db != NULL);
-   for (i=0; i<hosts_db->size; i++) {
-      struct bucket *tmp, *b = hosts_db->table[i];
-      while (b != NULL) {
-         tmp = b;
-         b = b->next;
-         hosts_db->free_func(tmp);
-         free(tmp);
+   return (slab_size(b) + name_bytes(h->dns) +
+      ((h->peers != NULL) ? slab_size(h->peers) : 0) +
+      hashtable_bytes(h->ports_tcp) + hashtable_bytes(h->ports_tcp_remote) +
+      hashtable_bytes(h->ports_udp) + hashtable_bytes(h->ports_udp_remote) +
+      hashtable_bytes(h->ip_protos));
+}
+
+/* Memory used by hosts_db and the host names, which is kept up to date as
+ * things are allocated and freed, so it's cheap to check on every packet.
+ */
+static uint64_t
+hosts_db_bytes(void)
+{
+   return ((uint64_t)slab_used(hosts_db->slab) + names_bytes());
+}
+
+/* Traffic for each byte of a host, in 256ths, without overflowing. */
+static uint64_t
+host_value(const struct bucket *b, const size_t bytes)
+{
+   const uint64_t total = BUCKET_TOTAL(b);
+
+   return ((total / bytes) * 256 + (total % bytes) * 256 / bytes);
+}
+
+struct host_cost {
+   uint64_t value;
+   size_t bytes;
+};
+
+static int
+cmp_host_cost(const void *x, const void *y)
+{
+   const uint64_t a = ((const struct host_cost *)x)->value,
+                  b = ((const struct host_cost *)y)->value;
+
+   return ((a > b) - (a < b));
+}
+
+/* Remove the least valuable hosts until hosts_db uses no more than target
+ * bytes.
+ */
+static void
+hosts_db_reduce_bytes(const uint64_t target)
+{
+   const uint64_t used = hosts_db_bytes();
+   struct host_cost *costs;
+   uint64_t freed, cutoff;
+   uint32_t i, pos, rmd, ties;
+
+   hashtable_rehash_finish(hosts_db);
+   if (hosts_db->count == 0)
+      return;
+   costs = xmalloc(hosts_db->count * sizeof(*costs));
+   for (pos=0, i=0; i<hosts_db->size; i++) {
+      const struct bucket *b = hosts_db->table[i].b;
+
+      if (b != NULL) {
+         costs[pos].bytes = host_bytes(b);
+         costs[pos].value = host_value(b, costs[pos].bytes);
+         pos++;
       }
    }
-   free(hosts_db->table);
-   free(hosts_db);
+   assert(pos == hosts_db->count);
+   qsort(costs, pos, sizeof(*costs), cmp_host_cost);
+   for (freed=0, i=0; (i < pos) && (used - freed > target); i++)
+      freed += costs[i].bytes;
+   cutoff = costs[(i > 0) ? i - 1 : 0].value;
+   /* Hosts often tie, say a scan's worth of them with one packet each, so
+    * only remove as many at the cutoff as it took to get there.
+    */
+   for (ties=0; (i > 0) && (costs[i-1].value == cutoff); i--)
+      ties++;
+   free(costs);
+
+   /* Same as hashtable_reduce(), with value instead of total. */
+   rmd = 0;
+   for (i=0; i<hosts_db->size; ) {
+      struct bucket *b = hosts_db->table[i].b;
+      uint64_t value;
+
+      if ((b != NULL) &&
+          (((value = host_value(b, host_bytes(b))) < cutoff) ||
+           ((value == cutoff) && (ties > 0)))) {
+         if (value == cutoff)
+            ties--;
+         free_func_host(b);
+         slab_release(b);
+         hashtable_remove_slot(hosts_db, i);
+         rmd++;
+      } else
+         i++;
+   }
+   verbosef("hosts_db_reduce: removed %u hosts, left %u in %llu bytes",
+      rmd, hosts_db->count, (llu)hosts_db_bytes());
+   hosts_top_rebuild();
+}
+
+/* Reduce hosts_db if needed. */
+void hosts_db_reduce(void)
+{
+   const uint64_t limit = (uint64_t)opt_memory_limit * 1024 * 1024;
+   const int over_count = (hosts_db->count >= hosts_db->count_max);
+   struct timespec t;
+
+   if (!over_count && ((limit == 0) || (hosts_db_bytes() <= limit)))
+      return;
+   timer_start(&t);
+   if (over_count)
+      hashtable_reduce(hosts_db);
+   else
+      hosts_db_reduce_bytes(limit / 4 * 3); /* so it's a while till the next */
+   histogram_add(&reduce_hist, (uint64_t)timer_nsec(&t));
+}
+
+/* Time spent reducing, for the -r --timing report. */
+int64_t hosts_db_reduce_nsec(void)
+{
+   return (int64_t)reduce_hist.sum;
+}
+
+uint32_t hosts_db_count(void)
+{
+   return hosts_db->count;
+}
+
+/* ---------------------------------------------------------------------------
+ * Reset hosts_db to empty.
+ */
+void
+hosts_db_reset(void)
+{
+   uint32_t count = hosts_db->count;
+
+   hosts_top_clear();
+   hashtable_empty(hosts_db);
+   admit_reset();
+   verbosef("hosts_db reset to empty, freed %u hosts", count);
+}
+
+/* ---------------------------------------------------------------------------
+ * Deallocate hosts_db.
+ */
+void hosts_db_free(void)
+{
+   struct slab *slab;
+
+   assert(hosts_db != NULL);
+   verbosef("hosts_db: %llu searches, %llu probes past home, "
+      "%llu hash collisions, %llu rehashes",
+      (llu)hosts_db->stats.searches, (llu)hosts_db->stats.probes,
+      (llu)hosts_db->stats.collisions, (llu)hosts_db->stats.rehashes);
+   slab = hosts_db->slab;
+   hosts_top_clear();
+   hashtable_free(hosts_db);
+   slab_destroy(slab);
    hosts_db = NULL;
+   admit_free();
+}
+
+/* ---------------------------------------------------------------------------
+ * Ports inside a host.  The port tables are the whole record, but a host's
+ * few busiest ports are also kept in h->hot, which is checked first.  Bucket
+ * pointers stay put while a table grows, so the only thing that can leave a
+ * hot pointer dangling is hashtable_reduce() freeing its bucket.
+ */
+enum { HOT_TCP = 1, HOT_TCP_REMOTE, HOT_UDP, HOT_UDP_REMOTE };
+#define HOT_KEY(table, port) (((uint32_t)(table) << 16) | (port))
+
+static struct bucket *
+hot_port_find(const struct host *h, const uint32_t key)
+{
+   unsigned int i;
+
+   for (i=0; i<HOST_HOT_PORTS; i++)
+      if (h->hot_key[i] == key)
+         return (h->hot[i]);
+   return (NULL);
+}
+
+/* Look the port up in its table, then make it hot if it's busier than the
+ * least busy hot port.
+ */
+static struct bucket *
+hot_port_get(struct host *h, struct hashtable *ht, const uint32_t key,
+   const uint16_t port, const int tcp)
+{
+   const uint64_t deletions = ht->stats.deletions;
+   struct bucket *b = tcp ?
+      ht_port_tcp_find_or_insert(ht, &port, ALLOW_REDUCE) :
+      ht_port_udp_find_or_insert(ht, &port, ALLOW_REDUCE);
+   unsigned int i, min = 0;
+
+   if (ht->stats.deletions != deletions)
+      memset(&h->hot_key, 0, sizeof(h->hot_key)); /* reduced */
+   for (i=0; i<HOST_HOT_PORTS; i++) {
+      if (h->hot_key[i] == 0) {
+         min = i;
+         break;
+      }
+      if (BUCKET_TOTAL(h->hot[i]) < BUCKET_TOTAL(h->hot[min]))
+         min = i;
+   }
+   if ((h->hot_key[min] == 0) ||
+       (BUCKET_TOTAL(b) >= BUCKET_TOTAL(h->hot[min]))) {
+      h->hot_key[min] = key;
+      h->hot[min] = b;
+   }
+   return (b);
 }
 
 /* ---------------------------------------------------------------------------
@@ -816,24 +1476,35 @@ struct bucket *
 host_get_port_tcp(struct bucket *host, const uint16_t port)
 {
    struct host *h = &host->u.host;
+   struct bucket *b;
+   if (h->saved != 0) host_restore(host);
+   if ((b = hot_port_find(h, HOT_KEY(HOT_TCP, port))) != NULL)
+      return (b);
    if (h->ports_tcp == NULL)
-      h->ports_tcp = hashtable_make(PORT_BITS, opt_ports_max, opt_ports_keep,
-         hash_func_short, free_func_simple, key_func_port_tcp,
+      h->ports_tcp = hashtable_make(slab_owner(host),
+         PORT_BITS, opt_ports_max, opt_ports_keep,
+         hash_func_short, free_func_port_tcp, key_func_port_tcp,
          find_func_port_tcp, make_func_port_tcp,
-         format_cols_port_tcp, format_row_port_tcp);
-   return (hashtable_find_or_insert(h->ports_tcp, &port, ALLOW_REDUCE));
+         format_cols_port_tcp_local, format_row_port_tcp_local);
+   return (hot_port_get(h, h->ports_tcp, HOT_KEY(HOT_TCP, port), port, 1));
 }
 
 struct bucket *
 host_get_port_tcp_remote(struct bucket *host, const uint16_t port)
 {
    struct host *h = &host->u.host;
+   struct bucket *b;
+   if (h->saved != 0) host_restore(host);
+   if ((b = hot_port_find(h, HOT_KEY(HOT_TCP_REMOTE, port))) != NULL)
+      return (b);
    if (h->ports_tcp_remote == NULL)
       h->ports_tcp_remote = hashtable_make(
+          slab_owner(host),
           PORT_BITS, opt_ports_max, opt_ports_keep, hash_func_short,
-          free_func_simple, key_func_port_tcp, find_func_port_tcp,
+          free_func_port_tcp, key_func_port_tcp, find_func_port_tcp,
           make_func_port_tcp, format_cols_port_tcp, format_row_port_tcp);
-   return (hashtable_find_or_insert(h->ports_tcp_remote, &port, ALLOW_REDUCE));
+   return (hot_port_get(h, h->ports_tcp_remote,
+      HOT_KEY(HOT_TCP_REMOTE, port), port, 1));
 }
 
 /* ---------------------------------------------------------------------------
@@ -843,24 +1514,35 @@ struct bucket *
 host_get_port_udp(struct bucket *host, const uint16_t port)
 {
    struct host *h = &host->u.host;
+   struct bucket *b;
+   if (h->saved != 0) host_restore(host);
+   if ((b = hot_port_find(h, HOT_KEY(HOT_UDP, port))) != NULL)
+      return (b);
    if (h->ports_udp == NULL)
-      h->ports_udp = hashtable_make(PORT_BITS, opt_ports_max, opt_ports_keep,
-         hash_func_short, free_func_simple, key_func_port_udp,
+      h->ports_udp = hashtable_make(slab_owner(host),
+         PORT_BITS, opt_ports_max, opt_ports_keep,
+         hash_func_short, free_func_port_udp, key_func_port_udp,
          find_func_port_udp, make_func_port_udp,
-         format_cols_port_udp, format_row_port_udp);
-   return (hashtable_find_or_insert(h->ports_udp, &port, ALLOW_REDUCE));
+         format_cols_port_udp_local, format_row_port_udp_local);
+   return (hot_port_get(h, h->ports_udp, HOT_KEY(HOT_UDP, port), port, 0));
 }
 
 struct bucket *
 host_get_port_udp_remote(struct bucket *host, const uint16_t port)
 {
    struct host *h = &host->u.host;
+   struct bucket *b;
+   if (h->saved != 0) host_restore(host);
+   if ((b = hot_port_find(h, HOT_KEY(HOT_UDP_REMOTE, port))) != NULL)
+      return (b);
    if (h->ports_udp_remote == NULL)
       h->ports_udp_remote = hashtable_make(
+          slab_owner(host),
           PORT_BITS, opt_ports_max, opt_ports_keep, hash_func_short,
-          free_func_simple, key_func_port_udp, find_func_port_udp,
+          free_func_port_udp, key_func_port_udp, find_func_port_udp,
           make_func_port_udp, format_cols_port_udp, format_row_port_udp);
-   return (hashtable_find_or_insert(h->ports_udp_remote, &port, ALLOW_REDUCE));
+   return (hot_port_get(h, h->ports_udp_remote,
+      HOT_KEY(HOT_UDP_REMOTE, port), port, 0));
 }
 
 /* ---------------------------------------------------------------------------
@@ -872,12 +1554,193 @@ host_get_ip_proto(struct bucket *host, const uint8_t proto)
    struct host *h = &host->u.host;
    static const unsigned int PROTOS_MAX = 512, PROTOS_KEEP = 256;
    assert(h != NULL);
-   if (h->ip_protos == NULL)
-      h->ip_protos = hashtable_make(PROTO_BITS, PROTOS_MAX, PROTOS_KEEP,
+   if (h->saved != 0) host_restore(host);
+   if (h->ip_protos == NULL) {
+      h->ip_protos = hashtable_make(slab_owner(host),
+         PROTO_BITS, PROTOS_MAX, PROTOS_KEEP,
          hash_func_byte, free_func_simple, key_func_ip_proto,
          find_func_ip_proto, make_func_ip_proto,
          format_cols_ip_proto, format_row_ip_proto);
-   return (hashtable_find_or_insert(h->ip_protos, &proto, ALLOW_REDUCE));
+      h->ip_protos->flat = 1;
+   }
+   return (ht_ip_proto_find_or_insert(h->ip_protos, &proto, ALLOW_REDUCE));
+}
+
+/* ---------------------------------------------------------------------------
+ * Peer sketches, allocated from the same slab as their host or port the
+ * first time they're needed.  Sketches only ever grow by union, so shards,
+ * sensors and imports can all merge theirs in, in any order, any number of
+ * times.
+ */
+static uint64_t
+peers_count(const uint8_t *peers)
+{
+   return (peers == NULL ? 0 : hll_count(peers, PEERS_BITS));
+}
+
+static uint8_t *
+peers_get(uint8_t **peers, const struct bucket *owner)
+{
+   if (*peers == NULL)
+      *peers = slab_alloc(slab_owner(owner), PEERS_SIZE);
+   return (*peers);
+}
+
+static void
+peers_merge(uint8_t **into, const struct bucket *owner, const uint8_t *from)
+{
+   if (from != NULL)
+      hll_merge(peers_get(into, owner), from, PEERS_BITS);
+}
+
+uint32_t
+host_hash(const struct addr *const a)
+{
+   return (hash_func_host(NULL, a));
+}
+
+void
+host_add_peer(struct bucket *host, const uint32_t peer)
+{
+   if (host->u.host.saved != 0) host_restore(host);
+   hll_add(peers_get(&host->u.host.peers, host), PEERS_BITS, peer);
+}
+
+void
+port_tcp_add_peer(struct bucket *port, const uint32_t peer)
+{
+   hll_add(peers_get(&port->u.port_tcp.peers, port), PEERS_BITS, peer);
+}
+
+void
+port_udp_add_peer(struct bucket *port, const uint32_t peer)
+{
+   hll_add(peers_get(&port->u.port_udp.peers, port), PEERS_BITS, peer);
+}
+
+/* ---------------------------------------------------------------------------
+ * Shards: private hosts tables filled by one capture thread each, and
+ * periodically folded into the global hosts_db by the main thread.
+ */
+struct hashtable *
+hosts_shard_make(void)
+{
+   return (hashtable_make(slab_make(), HOST_BITS, opt_hosts_max, opt_hosts_keep,
+      hash_func_host, free_func_host, key_func_host, find_func_host,
+      make_func_host, format_cols_host, format_row_host));
+}
+
+void
+hosts_shard_free(struct hashtable *shard)
+{
+   struct slab *slab = shard->slab;
+
+   hashtable_free(shard);
+   slab_destroy(slab);
+}
+
+struct bucket *
+hosts_shard_get(struct hashtable *shard, const struct addr *const a)
+{
+   return (ht_host_find_or_insert(shard, a, NO_REDUCE));
+}
+
+void
+hosts_shard_prefetch(struct hashtable *shard,
+   const struct addr *const *a, const size_t n)
+{
+   hashtable_prefetch_hosts(shard, a, n);
+}
+
+/* Shards aren't reduced, that would lose traffic that's already counted.
+ * Once one has as many hosts as hosts_db may, it's due to be merged.
+ */
+int
+hosts_shard_full(const struct hashtable *shard)
+{
+   return (shard->count >= shard->count_max);
+}
+
+static void
+bucket_add(struct bucket *dst, const struct bucket *src)
+{
+   dst->in    += src->in;
+   dst->out   += src->out;
+}
+
+/* Add the host's ports and protocols from a shard to its hosts_db entry. */
+static void
+host_merge(struct bucket *dst, const struct bucket *src)
+{
+   const struct host *h = &src->u.host;
+   const struct bucket *b;
+   uint32_t i;
+
+   HASHTABLE_FOREACH(h->ip_protos, i, b)
+      bucket_add(host_get_ip_proto(dst, b->u.ip_proto.proto), b);
+   peers_merge(&dst->u.host.peers, dst, h->peers);
+   HASHTABLE_FOREACH(h->ports_tcp, i, b) {
+      struct bucket *p = host_get_port_tcp(dst, b->u.port_tcp.port);
+      bucket_add(p, b);
+      p->u.port_tcp.syn += b->u.port_tcp.syn;
+      peers_merge(&p->u.port_tcp.peers, p, b->u.port_tcp.peers);
+   }
+   HASHTABLE_FOREACH(h->ports_tcp_remote, i, b) {
+      struct bucket *p = host_get_port_tcp_remote(dst, b->u.port_tcp.port);
+      bucket_add(p, b);
+      p->u.port_tcp.syn += b->u.port_tcp.syn;
+   }
+   HASHTABLE_FOREACH(h->ports_udp, i, b) {
+      struct bucket *p = host_get_port_udp(dst, b->u.port_udp.port);
+      bucket_add(p, b);
+      peers_merge(&p->u.port_udp.peers, p, b->u.port_udp.peers);
+   }
+   HASHTABLE_FOREACH(h->ports_udp_remote, i, b)
+      bucket_add(host_get_port_udp_remote(dst, b->u.port_udp.port), b);
+}
+
+/* Empty a hashtable, keeping its current size. */
+static void
+hashtable_empty(struct hashtable *h)
+{
+   uint32_t i;
+
+   hashtable_rehash_finish(h);
+   for (i=0; i<h->size; i++) {
+      struct bucket *b = h->table[i].b;
+      if (b != NULL) {
+         h->free_func(b);
+         slab_release(b);
+         h->table[i].b = NULL;
+      }
+   }
+   h->count = 0;
+}
+
+/* Fold the contents of shard into hosts_db, leaving the shard empty. */
+void
+hosts_shard_merge(struct hashtable *shard)
+{
+   const struct bucket *b;
+   uint32_t i;
+
+   HASHTABLE_FOREACH(shard, i, b) {
+      struct bucket *h;
+
+      hosts_db_reduce();
+      h = host_admit(&b->u.host.addr, BUCKET_TOTAL(b));
+      if (h == NULL)
+         continue;
+      bucket_add(h, b);
+      memcpy(h->u.host.mac_addr, b->u.host.mac_addr,
+         sizeof(h->u.host.mac_addr));
+      h->u.host.last_seen_mono =
+         MAX(h->u.host.last_seen_mono, b->u.host.last_seen_mono);
+      host_merge(h, b);
+      h->u.host.changed = graph_generation();
+      hosts_top_update(h);
+   }
+   hashtable_empty(shard);
 }
 
 static struct str *html_hosts_main(const char *qs);
@@ -918,7 +1781,7 @@ html_hosts(const char *uri, const char *query)
 const struct bucket **
 hashtable_list_buckets(struct hashtable *ht)
 {
-   const struct bucket **table;
+   const struct bucket **table, *b;
    unsigned int i, pos;
 
    if ((ht == NULL) || (ht->count == 0)) {
@@ -927,40 +1790,27 @@ hashtable_list_buckets(struct hashtable *ht)
 
    /* Fill table with pointers to buckets in hashtable. */
    table = xcalloc(ht->count, sizeof(*table));
-   for (pos=0, i=0; i<ht->size; i++) {
-      struct bucket *b = ht->table[i];
-      while (b != NULL) {
-         table[pos++] = b;
-         b = b->next;
-      }
-   }
+   pos = 0;
+   HASHTABLE_FOREACH(ht, i, b)
+      table[pos++] = b;
    assert(pos == ht->count);
    return table;
 }
 
-typedef void (hashtable_foreach_func_t)(const struct bucket *, const void *);
-
 /* ---------------------------------------------------------------------------
- * Loop over all buckets in the given hashtable, calling the supplied function
- * with each bucket and the supplied user_data.
+ * Rebuild the hosts_top heaps from all of hosts_db.
  */
 static void
-hashtable_foreach(struct hashtable *ht,
-   hashtable_foreach_func_t *hashtable_foreach_func,
-   const void *user_data)
+hosts_top_rebuild(void)
 {
-   const struct bucket **table;
-   unsigned int i;
-
-   table = hashtable_list_buckets(ht);
-   if (table == NULL)
-      return;
+   struct bucket *b;
+   uint32_t i;
 
-   for (i = 0; i<ht->count; i++) {
-      const struct bucket *b = table[i];
-      (*hashtable_foreach_func)(b, user_data);
+   hosts_top_clear();
+   HASHTABLE_FOREACH(hosts_db, i, b) {
+      memset(&b->u.host.top_pos, 0, sizeof(b->u.host.top_pos));
+      hosts_top_update(b);
    }
-   free(table);
 }
 
 /* ---------------------------------------------------------------------------
@@ -970,13 +1820,11 @@ static void
 format_table(struct str *buf, struct hashtable *ht, unsigned int start,
    const enum sort_dir sort, const int full)
 {
-   const struct bucket **table;
-   unsigned int i, end;
+   const struct bucket **table = NULL;
+   unsigned int i, end, n = 0;
    int alt = 0;
 
-   table = hashtable_list_buckets(ht);
-
-   if (table == NULL) {
+   if ((ht == NULL) || (ht->count == 0)) {
       str_append(buf, "<p>The table is empty.</p>\n");
       return;
    }
@@ -988,8 +1836,19 @@ format_table(struct str *buf, struct hashtable *ht, unsigned int start,
    } else
       end = MIN(ht->count, (uint32_t)start+MAX_ENTRIES);
 
+   /* The first pages of hosts only need the top hosts. */
+   if ((ht == hosts_db) && (end <= TOP_HOSTS)) {
+      table = xcalloc(TOP_HOSTS, sizeof(*table));
+      n = hosts_top_list(table, sort);
+   }
+   if (n < end) {
+      free(table);
+      table = hashtable_list_buckets(ht);
+      n = ht->count;
+   }
+
    str_appendf(buf, "(%u-%u of %u)<br>\n", start+1, end, ht->count);
-   qsort_buckets(table, ht->count, start, end, sort);
+   qsort_buckets(table, n, start, end, sort);
    ht->format_cols_func(buf);
 
    for (i=start; i<end; i++) {
@@ -1091,34 +1950,257 @@ done:
 #undef FULL
 }
 
+/* ---------------------------------------------------------------------------
+ * Machine readable: hosts as JSON, filtered and sorted here so that only
+ * what's wanted goes over the wire.  The query string can have:
+ *
+ *   net=addr[/len]   only hosts inside the network
+ *   min=bytes        only hosts with at least this many bytes in total
+ *   sort=in|out|total|lastseen   (default total)
+ *   limit=n          at most n hosts, 0 for no limit (default 100)
+ */
+#define JSON_LIMIT 100
+
+struct host_filter {
+   int want_net;
+   struct addr net, mask;
+   uint64_t min_total;
+};
+
+static int
+host_filter_match(const struct host_filter *f, const struct bucket *b)
+{
+   const struct addr *a = &(b->u.host.addr);
+
+   if (BUCKET_TOTAL(b) < f->min_total)
+      return 0;
+   if (f->want_net && ((a->family != f->net.family) ||
+                       !addr_inside(a, &(f->net), &(f->mask))))
+      return 0;
+   return 1;
+}
+
+/* Parse addr[/len] into f.  Returns 0 on failure. */
+static int
+host_filter_net(struct host_filter *f, const char *spec)
+{
+   char *net = xstrdup(spec), *slash, *ep;
+   unsigned long pfxlen, maxlen;
+   uint8_t *p;
+   unsigned int i;
+
+   if ((slash = strchr(net, '/')) != NULL)
+      *slash = '\0';
+   if (str_to_addr(net, &(f->net)) != 0) {
+      free(net);
+      return 0;
+   }
+   maxlen = (f->net.family == IPv6) ? 128 : 32;
+   pfxlen = maxlen;
+   if (slash != NULL) {
+      pfxlen = strtoul(slash + 1, &ep, 10);
+      if ((slash[1] == '\0') || (*ep != '\0') || (pfxlen > maxlen)) {
+         free(net);
+         return 0;
+      }
+   }
+   free(net);
+
+   memset(&(f->mask), 0, sizeof(f->mask));
+   f->mask.family = f->net.family;
+   p = (f->net.family == IPv6) ? f->mask.ip.v6.s6_addr
+                               : (uint8_t *)&(f->mask.ip.v4);
+   for (i = 0; i < pfxlen / 8; i++)
+      p[i] = 0xff;
+   if (pfxlen % 8)
+      p[i] = (uint8_t)(0xff << (8 - pfxlen % 8));
+   addr_mask(&(f->net), &(f->mask));
+   f->want_net = 1;
+   return 1;
+}
+
+/* Append s as a JSON string.  Only control characters, quotes and
+ * backslashes are escaped: bytes from 0x80 up pass through, so UTF-8 comes
+ * out as the same characters rather than as one \u00XX per byte.
+ */
+static void
+json_append_string(struct str *buf, const char *s)
+{
+   const char *run = s;
+
+   str_append(buf, "\"");
+   for (; *s != '\0'; s++) {
+      const unsigned char c = (unsigned char)*s;
+      char esc[7];
+
+      if ((c >= 0x20) && (c != 0x7f) && (c != '"') && (c != '\\'))
+         continue;
+      str_appendn(buf, run, (size_t)(s - run));
+      if ((c == '"') || (c == '\\'))
+         snprintf(esc, sizeof(esc), "\\%c", c);
+      else
+         snprintf(esc, sizeof(esc), "\\u%04x", c);
+      str_append(buf, esc);
+      run = s + 1;
+   }
+   str_appendn(buf, run, (size_t)(s - run));
+   str_append(buf, "\"");
+}
+
+static void
+json_host(struct str *buf, const struct bucket *b)
+{
+   const struct host *h = &(b->u.host);
+   char name[NAME_BUF_LEN];
+
+   str_append(buf, "{\"ip\":");
+   json_append_string(buf, addr_to_str(&(h->addr)));
+   if (h->dns != NAME_NONE) {
+      str_append(buf, ",\"hostname\":");
+      json_append_string(buf, name_str(h->dns, name));
+   } else
+      dns_queue(&(h->addr)); /* on demand, as for the HTML */
+   if (hosts_db_show_macs) {
+      char mac[18];
+
+      snprintf(mac, sizeof(mac), "%02x:%02x:%02x:%02x:%02x:%02x",
+         h->mac_addr[0], h->mac_addr[1], h->mac_addr[2],
+         h->mac_addr[3], h->mac_addr[4], h->mac_addr[5]);
+      str_appendf(buf, ",\"mac\":\"%s\"", mac);
+   }
+   str_appendf(buf, ",\"in\":%qu,\"out\":%qu,\"total\":%qu",
+      (qu)b->in, (qu)b->out, (qu)BUCKET_TOTAL(b));
+   if (h->last_seen_mono == 0)
+      str_append(buf, ",\"last_seen\":null}");
+   else
+      str_appendf(buf, ",\"last_seen\":%qd}",
+         (qd)mono_to_real(h->last_seen_mono));
+}
+
+struct str *
+json_hosts(const char *qs)
+{
+   struct str *buf = str_make();
+   struct host_filter f;
+   char *qs_net, *qs_min, *qs_sort, *qs_limit, *ep;
+   const char *error = NULL;
+   const struct bucket **table = NULL;
+   enum sort_dir sort = TOTAL;
+   unsigned long limit = JSON_LIMIT;
+   uint32_t i, n = 0;
+
+   memset(&f, 0, sizeof(f));
+   qs_net = qs_get(qs, "net");
+   qs_min = qs_get(qs, "min");
+   qs_sort = qs_get(qs, "sort");
+   qs_limit = qs_get(qs, "limit");
+
+   if ((qs_net != NULL) && !host_filter_net(&f, qs_net))
+      error = "invalid value for \"net\"";
+   if (qs_min != NULL) {
+      f.min_total = (uint64_t)strtoull(qs_min, &ep, 10);
+      if ((qs_min[0] == '\0') || (*ep != '\0'))
+         error = "\"min\" is not a number";
+   }
+   if (qs_sort == NULL) sort = TOTAL;
+   else if (strcmp(qs_sort, "total") == 0) sort = TOTAL;
+   else if (strcmp(qs_sort, "in") == 0) sort = IN;
+   else if (strcmp(qs_sort, "out") == 0) sort = OUT;
+   else if (strcmp(qs_sort, "lastseen") == 0) sort = LASTSEEN;
+   else
+      error = "invalid value for \"sort\"";
+   if (qs_limit != NULL) {
+      limit = strtoul(qs_limit, &ep, 10);
+      if ((qs_limit[0] == '\0') || (*ep != '\0'))
+         error = "\"limit\" is not a number";
+   }
+   if ((limit == 0) || (limit > hosts_db->count))
+      limit = hosts_db->count;
+
+   if (error != NULL) {
+      str_append(buf, "{\"error\":");
+      json_append_string(buf, error);
+      str_append(buf, "}\n");
+      goto done;
+   }
+
+   /* If enough of the top hosts match, the answer is among them, because
+    * every other host sorts after all of them.
+    */
+   if (limit <= TOP_HOSTS) {
+      const struct bucket **top = xcalloc(TOP_HOSTS, sizeof(*top));
+      const unsigned int num_top = hosts_top_list(top, sort);
+
+      for (i = 0; i < num_top; i++)
+         if (host_filter_match(&f, top[i]))
+            top[n++] = top[i];
+      if ((n >= limit) || (num_top == hosts_db->count))
+         table = top;
+      else {
+         free(top);
+         n = 0;
+      }
+   }
+   if ((table == NULL) && (hosts_db->count > 0)) {
+      const struct bucket *b;
+
+      table = xcalloc(hosts_db->count, sizeof(*table));
+      HASHTABLE_FOREACH(hosts_db, i, b)
+         if (host_filter_match(&f, b))
+            table[n++] = b;
+   }
+   if (limit > n)
+      limit = n;
+   qsort_buckets(table, n, 0, limit, sort);
+
+   str_append(buf, "{\"hosts\":[");
+   for (i = 0; i < limit; i++) {
+      if (i > 0)
+         str_append(buf, ",\n");
+      json_host(buf, table[i]);
+   }
+   str_append(buf, "]}\n");
+   free(table);
+done:
+   free(qs_net);
+   free(qs_min);
+   free(qs_sort);
+   free(qs_limit);
+   return buf;
+}
+
 /* ---------------------------------------------------------------------------
  * Web interface: detailed view of a single host.
  */
 static struct str *html_hosts_detail(const char *ip) {
    struct bucket *h;
    struct str *buf, *ls_len;
-   char ls_when[100];
+   char ls_when[100], name[NAME_BUF_LEN];
    const char *canonical;
    time_t last_seen_real;
 
    h = host_search(ip);
    if (h == NULL)
       return (NULL); /* no such host */
+   if (h->u.host.saved != 0)
+      host_restore(h);
 
    canonical = addr_to_str(&(h->u.host.addr));
 
    /* Overview. */
    buf = str_make();
-   html_open(buf, ip, /*path_depth=*/2, /*want_graph_js=*/0);
+   html_open(buf, ip, /*path_depth=*/2,
+      /*want_graph_js=*/h->u.host.graph_slot != 0);
    if (strcmp(ip, canonical) != 0)
       str_appendf(buf, "(canonically <b>%s</b>)\n", canonical);
    str_appendf(buf,
       "<p>\n"
        "<b>Hostname:</b> %s<br>\n",
-      (h->u.host.dns == NULL)?"(resolving...)":h->u.host.dns);
+      (h->u.host.dns == NAME_NONE) ? "(resolving...)" :
+         name_str(h->u.host.dns, name));
 
    /* Resolve host "on demand" */
-   if (h->u.host.dns == NULL)
+   if (h->u.host.dns == NAME_NONE)
       dns_queue(&(h->u.host.addr));
 
    if (hosts_db_show_macs)
@@ -1169,7 +2251,36 @@ static struct str *html_hosts_detail(const char *ip) {
       "</p>\n",
       (qu)h->in,
       (qu)h->out,
-      (qu)h->total);
+      (qu)BUCKET_TOTAL(h));
+   if (h->u.host.peers != NULL)
+      str_appendf(buf,
+         "<p>\n"
+         " <b>Peers:</b> ~%'qu\n"
+         "</p>\n",
+         (qu)peers_count(h->u.host.peers));
+
+   if (h->u.host.graph_slot != 0) {
+      str_appendf(buf,
+         "<div id=\"graphs\">\n"
+         "Graphs require JavaScript.\n"
+         "<script type=\"text/javascript\">\n"
+         "//<![CDATA[\n"
+         "var graph_width = 320;\n"
+         "var graph_height = 200;\n"
+         "var bar_gap = 1;\n"
+         "var graphs_uri = \"../../graphs.xml?host=%s\";\n"
+         "var graphs = [\n"
+         " { id:\"g0\", name:\"seconds\", title:\"last %u seconds\", "
+            "bar_secs:1 },\n"
+         " { id:\"g1\", name:\"minutes\", title:\"last %u minutes\", "
+            "bar_secs:60 }\n"
+         "];\n"
+         "window.onload = graphs_init;\n"
+         "//]]>\n"
+         "</script>\n"
+         "</div>\n",
+         canonical, HOST_GRAPH_BARS, HOST_GRAPH_BARS);
+   }
 
    str_append(buf, "<h3>TCP ports on this host</h3>\n");
    format_table(buf, h->u.host.ports_tcp, 0,TOTAL,0);
@@ -1191,6 +2302,18 @@ static struct str *html_hosts_detail(const char *ip) {
    return buf;
 }
 
+/* ---------------------------------------------------------------------------
+ * Web interface: graphs.xml?host=<ip>, for the detail page.  Returns 0 if
+ * there's no such host, or it has no graphs.
+ */
+int
+xml_host_graphs(struct str *buf, const char *ip, const unsigned int bars)
+{
+   const struct bucket *h = host_search(ip);
+
+   return (h != NULL) && hosts_graph_xml(buf, h, bars);
+}
+
 /* ---------------------------------------------------------------------------
  * Database import and export code:
  * Initially written and contributed by Ben Stewart.
@@ -1199,6 +2322,7 @@ static struct str *html_hosts_detail(const char *ip) {
 static int hosts_db_export_ip(const struct hashtable *h, const int fd);
 static int hosts_db_export_tcp(const char magic, const struct hashtable *h,
                                const int fd);
+static int hosts_db_export_peers(const struct host *h, const int fd);
 static int hosts_db_export_udp(const char magic, const struct hashtable *h,
                                const int fd);
 
@@ -1207,73 +2331,332 @@ static const char
    export_proto_tcp        = 'T',
    export_proto_tcp_remote = 't',
    export_proto_udp        = 'U',
-   export_proto_udp_remote = 'u';
+   export_proto_udp_remote = 'u',
+   export_proto_peers      = 'D';
 
 static const unsigned char
    export_tag_host_ver1[] = {'H', 'S', 'T', 0x01},
    export_tag_host_ver2[] = {'H', 'S', 'T', 0x02},
    export_tag_host_ver3[] = {'H', 'S', 'T', 0x03},
-   export_tag_host_ver4[] = {'H', 'S', 'T', 0x04};
+   export_tag_host_ver4[] = {'H', 'S', 'T', 0x04},
+   export_tag_host_ver5[] = {'H', 'S', 'T', 0x05};
+
+/* Hand /metrics over in pieces of about this many bytes. */
+#define METRICS_PIECE 65536
+
+struct metrics_writer {
+   struct str *buf;
+   metrics_out_fn *out; /* NULL to keep the whole page in buf */
+   void *arg;
+   int ok;
+   char *prefix; /* of every host's metric name and labels */
+   size_t prefix_len;
+   unsigned int since; /* only hosts changed in this generation or later */
+};
 
-static void text_metrics_counter(struct str *buf, const char *metric, const char *type, const char *help);
-static void text_metrics_format_host(const struct bucket *b, const void *user_data);
+/* Pass buf to out() if it's big enough, or final is set. */
+static void
+text_metrics_flush(struct metrics_writer *w, const int final)
+{
+   char *s;
+   size_t len;
 
-/* ---------------------------------------------------------------------------
- * Web interface: export stats in Prometheus text format on /metrics
+   if (w->out == NULL || (!final && str_len(w->buf) < METRICS_PIECE))
+      return;
+   str_extract(w->buf, &len, &s);
+   if (w->ok && len > 0)
+      w->ok = w->out(w->arg, s, len);
+   free(s);
+   w->buf = str_make();
+}
+
+static void
+text_metrics_format_host(struct metrics_writer *w, const struct bucket *b)
+{
+   static const char dir[] = "\",dir=\"";
+   char key[INET6_ADDRSTRLEN + 64];
+   size_t len;
+
+   if (!w->ok)
+      return; /* nobody's listening */
+   if (b->u.host.changed < w->since)
+      return;
+
+   /* The labels are the same for both directions, so format them once. */
+   len = addr_format(&(b->u.host.addr), key);
+   if (hosts_db_show_macs) {
+      const int n = snprintf(key + len, sizeof(key) - len,
+         "\",mac=\"%x:%x:%x:%x:%x:%x",
+         b->u.host.mac_addr[0],
+         b->u.host.mac_addr[1],
+         b->u.host.mac_addr[2],
+         b->u.host.mac_addr[3],
+         b->u.host.mac_addr[4],
+         b->u.host.mac_addr[5]);
+
+      assert(n > 0 && (size_t)n < sizeof(key) - len);
+      len += (size_t)n;
+   }
+   memcpy(key + len, dir, sizeof(dir) - 1);
+   len += sizeof(dir) - 1;
+
+   str_appendn(w->buf, w->prefix, w->prefix_len);
+   str_appendn(w->buf, key, len);
+   str_append(w->buf, "in\"} ");
+   str_append_u64(w->buf, b->in, 0);
+   str_append(w->buf, "\n");
+   str_appendn(w->buf, w->prefix, w->prefix_len);
+   str_appendn(w->buf, key, len);
+   str_append(w->buf, "out\"} ");
+   str_append_u64(w->buf, b->out, 0);
+   str_append(w->buf, "\n");
+   text_metrics_flush(w, 0);
+}
+
+static void
+text_metrics_format_peers(struct metrics_writer *w, const struct bucket *b)
+{
+   char ip[INET6_ADDRSTRLEN];
+   size_t len;
+
+   if (!w->ok || b->u.host.changed < w->since || b->u.host.peers == NULL)
+      return;
+   len = addr_format(&(b->u.host.addr), ip);
+   str_appendn(w->buf, w->prefix, w->prefix_len);
+   str_appendn(w->buf, ip, len);
+   str_append(w->buf, "\"} ");
+   str_append_u64(w->buf, peers_count(b->u.host.peers), 0);
+   str_append(w->buf, "\n");
+   text_metrics_flush(w, 0);
+}
+
+/* With since=<generation> in the query, only hosts that have been counted
+ * since then are included.  A scraper that already has the rest can pass
+ * back the darkstat_generation of its last scrape, and get a page that
+ * grows with how many hosts are active rather than how many there are.
  */
-struct str *
-text_metrics()
+static struct str *
+text_metrics_write(const char *query, metrics_out_fn *out, void *arg,
+   int *ok)
 {
-   struct str *buf = str_make();
+   struct metrics_writer w;
+   const struct bucket *b;
+   char *qs_since;
+   uint32_t i;
 
-   text_metrics_counter(buf,
+   w.buf = str_make();
+   w.out = out;
+   w.arg = arg;
+   w.ok = 1;
+   w.prefix_len = xasprintf(&w.prefix,
+      "host_bytes_total{interface=\"%s\",ip=\"", title_interfaces);
+   w.since = 0;
+   if ((qs_since = qs_get(query, "since")) != NULL) {
+      w.since = (unsigned int)strtoul(qs_since, NULL, 10);
+      free(qs_since);
+      /* From before a restart, it means nothing now. */
+      if (w.since > graph_generation())
+         w.since = 0;
+   }
+
+   metrics_header(w.buf, "darkstat_generation", "gauge",
+      "Generation of the data, for scraping with ?since= next time.");
+   str_appendf(w.buf, "darkstat_generation %u\n", graph_generation());
+   metrics_header(w.buf,
       "host_bytes_total",
       "counter",
       "Total number of network bytes by host and direction.");
-   hashtable_foreach(hosts_db, &text_metrics_format_host, (void *)buf);
+   HASHTABLE_FOREACH(hosts_db, i, b)
+      text_metrics_format_host(&w, b);
+   free(w.prefix);
+   if (opt_want_peers) {
+      w.prefix_len = xasprintf(&w.prefix,
+         "host_peers{interface=\"%s\",ip=\"", title_interfaces);
+      metrics_header(w.buf,
+         "host_peers",
+         "gauge",
+         "Estimated number of distinct hosts that each host talked to.");
+      HASHTABLE_FOREACH(hosts_db, i, b)
+         text_metrics_format_peers(&w, b);
+      free(w.prefix);
+   }
 
-   return buf;
+   /* darkstat's own health. */
+   metrics_header(w.buf, "darkstat_hosts", "gauge",
+      "Number of hosts in the hosts table.");
+   str_appendf(w.buf, "darkstat_hosts %u\n", hosts_db->count);
+   metrics_header(w.buf, "darkstat_hosts_bytes", "gauge",
+      "Memory used by hosts, their ports and protocols, and host names, "
+      "as counted against --memory-limit.");
+   str_appendf(w.buf, "darkstat_hosts_bytes %qu\n", (qu)hosts_db_bytes());
+   metrics_header(w.buf, "darkstat_hosts_searches_total", "counter",
+      "Lookups in the hosts table.");
+   str_appendf(w.buf, "darkstat_hosts_searches_total %qu\n",
+      (qu)hosts_db->stats.searches);
+   metrics_header(w.buf, "darkstat_hosts_probes_total", "counter",
+      "Slots looked at past the home slot by hosts table lookups.");
+   str_appendf(w.buf, "darkstat_hosts_probes_total %qu\n",
+      (qu)hosts_db->stats.probes);
+   metrics_header(w.buf, "darkstat_hosts_reduce_seconds", "histogram",
+      "Time taken to cut the hosts table down to --hosts-keep, or under "
+      "--memory-limit.");
+   metrics_histogram(w.buf, "darkstat_hosts_reduce_seconds", NULL,
+      &reduce_hist);
+   metrics_header(w.buf, "darkstat_hosts_rehash_seconds", "histogram",
+      "Time taken to start growing the hosts table.");
+   metrics_histogram(w.buf, "darkstat_hosts_rehash_seconds", NULL,
+      &rehash_hist);
+   admit_metrics(w.buf);
+   cap_metrics(w.buf);
+   dns_metrics(w.buf);
+   flow_metrics(w.buf);
+#ifdef __OpenBSD__
+   pfsync_metrics(w.buf);
+#endif
+   names_metrics(w.buf);
+   http_metrics(w.buf);
+
+   if (out == NULL)
+      return w.buf;
+   text_metrics_flush(&w, 1);
+   str_free(w.buf);
+   *ok = w.ok;
+   return NULL;
 }
 
-static void
-text_metrics_counter(struct str *buf,
-   const char *metric,
-   const char *type,
-   const char *help)
+/* ---------------------------------------------------------------------------
+ * Web interface: export stats in Prometheus text format on /metrics
+ */
+struct str *
+text_metrics(const char *query)
 {
-   str_appendf(buf, "# HELP %s %s\n", metric, help);
-   str_appendf(buf, "# TYPE %s %s\n", metric, type);
+   return text_metrics_write(query, NULL, NULL, NULL);
 }
 
-static void
-text_metrics_format_host_key(struct str *buf, const struct bucket *b) {
-   const char *ip = addr_to_str(&(b->u.host.addr));
+/* The same, a piece at a time, so the page never has to be in memory all at
+ * once.  Stops calling out() once it returns 0, and returns 0 if it ever
+ * did.
+ */
+int
+text_metrics_stream(const char *query, metrics_out_fn *out, void *arg)
+{
+   int ok;
 
-   str_appendf(buf,
-      "host_bytes_total{interface=\"%s\",ip=\"%s\"",
-      title_interfaces, ip);
+   text_metrics_write(query, out, arg, &ok);
+   return ok;
+}
 
-   if (hosts_db_show_macs)
-      str_appendf(buf, ",mac=\"%x:%x:%x:%x:%x:%x\"",
-         b->u.host.mac_addr[0],
-         b->u.host.mac_addr[1],
-         b->u.host.mac_addr[2],
-         b->u.host.mac_addr[3],
-         b->u.host.mac_addr[4],
-         b->u.host.mac_addr[5]);
+/* ---------------------------------------------------------------------------
+ * Merging, for darkstat-merge: while a keep function is set, imports add to
+ * the counters of the hosts already in memory instead of replacing them,
+ * and read past the hosts that it turns down.
+ */
+static hosts_db_keep_fn *merge_keep = NULL;
+
+void
+hosts_db_set_merge(hosts_db_keep_fn *keep)
+{
+   merge_keep = keep;
 }
 
-static void
-text_metrics_format_host(const struct bucket *b,
-   const void *user_data)
+/* What an imported counter should become. */
+#define IMPORTED(old, val) ((merge_keep != NULL) ? (old) + (val) : (val))
+
+/* Read past count entries of size bytes each.
+ * Returns 0 on failure, 1 on success.
+ */
+static int
+skip_entries(const int fd, unsigned int count, const size_t size)
 {
-   struct str *buf = (struct str *)user_data;
+   uint8_t buf[32];
 
-   text_metrics_format_host_key(buf, b);
-   str_appendf(buf, ",dir=\"in\"} %qu\n", (qu)b->in);
+   assert(size <= sizeof(buf));
+   while (count-- > 0)
+      if (!readn(fd, buf, size)) return 0;
+   return 1;
+}
 
-   text_metrics_format_host_key(buf, b);
-   str_appendf(buf, ",dir=\"out\"} %qu\n", (qu)b->out);
+/* Read past a ports table whose entries are size bytes each. */
+static int
+skip_ports_table(const int fd, const char magic, const size_t size)
+{
+   uint16_t count;
+
+   if (!expect8(fd, magic)) return 0;
+   if (!read16(fd, &count)) return 0;
+   return skip_entries(fd, count, size);
+}
+
+/* Read past the rest of a host record, from just after its address. */
+static int
+hosts_db_skip_host(const int fd, const int ver)
+{
+   uint8_t count;
+
+   if (ver > 1 && !skip_entries(fd, 1, 8)) return 0;   /* last seen */
+   if (!skip_entries(fd, 1, 6)) return 0;              /* MAC address */
+   if (!read8(fd, &count)) return 0;
+   if (!skip_entries(fd, count, 1)) return 0;          /* hostname */
+   if (!skip_entries(fd, 2, 8)) return 0;              /* in, out */
+
+   if (!expect8(fd, export_proto_ip)) return 0;
+   if (!read8(fd, &count)) return 0;
+   if (!skip_entries(fd, count, 1 + 8 + 8)) return 0;
+   if (!skip_ports_table(fd, export_proto_tcp, 2 + 8 + 8 + 8)) return 0;
+   if (!skip_ports_table(fd, export_proto_udp, 2 + 8 + 8)) return 0;
+   if (ver >= 4) {
+      if (!skip_ports_table(fd, export_proto_tcp_remote, 2 + 8 + 8 + 8))
+         return 0;
+      if (!skip_ports_table(fd, export_proto_udp_remote, 2 + 8 + 8))
+         return 0;
+   }
+   if (ver >= 5) {
+      uint32_t ports;
+
+      if (!expect8(fd, export_proto_peers)) return 0;
+      if (!read8(fd, &count)) return 0;
+      if (!skip_entries(fd, count, 1)) return 0;
+      if (!read32(fd, &ports)) return 0;
+      while (ports-- > 0) {
+         if (!skip_entries(fd, 1, 1 + 2)) return 0; /* proto, port */
+         if (!read8(fd, &count)) return 0;
+         if (!skip_entries(fd, count, 1)) return 0;
+      }
+   }
+   return 1;
+}
+
+/* Take an imported host's counters, and unless it was last seen before the
+ * host already in memory, its MAC address and name (which can be NULL).
+ */
+static struct bucket *
+host_import_fields(const struct addr *const a,
+   const uint64_t in, const uint64_t out,
+   const int have_last_seen, const time_t last_seen,
+   const uint8_t mac_addr[6], char *name)
+{
+   const int64_t mono = have_last_seen ? real_to_mono(last_seen) : 0;
+   struct bucket *b = (merge_keep != NULL) ? host_find(a) : NULL;
+   const int older = (b != NULL) && (mono < b->u.host.last_seen_mono);
+   struct host *h;
+
+   if (b == NULL)
+      b = host_get(a);
+   h = &(b->u.host);
+
+   b->in = IMPORTED(b->in, in);
+   b->out = IMPORTED(b->out, out);
+   if (have_last_seen && !older)
+      h->last_seen_mono = mono;
+   if (!older)
+      memcpy(h->mac_addr, mac_addr, sizeof(h->mac_addr));
+   if (name != NULL && (h->dns == NAME_NONE || !older)) {
+      name_unref(h->dns); /* a change log can repeat a host */
+      h->dns = name_intern(name);
+   }
+   free(name);
+   h->changed = graph_generation();
+   return b;
 }
 
 /* ---------------------------------------------------------------------------
@@ -1299,9 +2682,8 @@ hosts_db_import_ip(const int fd, struct bucket *host)
 
       /* Store data */
       b = host_get_ip_proto(host, proto);
-      b->in = in;
-      b->out = out;
-      b->total = in + out;
+      b->in = IMPORTED(b->in, in);
+      b->out = IMPORTED(b->out, out);
       assert(b->u.ip_proto.proto == proto); /* should be done by make fn */
    }
    return 1;
@@ -1332,11 +2714,10 @@ static int hosts_db_import_tcp(const int fd, const char magic,
 
       /* Store data */
       b = get_port_fn(host, port);
-      b->in = in;
-      b->out = out;
-      b->total = in + out;
+      b->in = IMPORTED(b->in, in);
+      b->out = IMPORTED(b->out, out);
       assert(b->u.port_tcp.port == port); /* done by make_func_port_tcp */
-      b->u.port_tcp.syn = syn;
+      b->u.port_tcp.syn = IMPORTED(b->u.port_tcp.syn, syn);
    }
    return 1;
 }
@@ -1365,14 +2746,93 @@ static int hosts_db_import_udp(const int fd, const char magic,
 
       /* Store data */
       b = get_port_fn(host, port);
-      b->in = in;
-      b->out = out;
-      b->total = in + out;
+      b->in = IMPORTED(b->in, in);
+      b->out = IMPORTED(b->out, out);
       assert(b->u.port_udp.port == port); /* done by make_func */
    }
    return 1;
 }
 
+/* ---------------------------------------------------------------------------
+ * Merge a sketch from a file into *peers.  One of another size can't be,
+ * so it's skipped.
+ * Returns 0 on failure, 1 on success.
+ */
+static int
+hosts_db_import_sketch(const int fd, uint8_t **peers,
+   const struct bucket *owner)
+{
+   uint8_t size, reg[PEERS_SIZE];
+
+   if (!read8(fd, &size)) return 0;
+   if (size != PEERS_SIZE)
+      return skip_entries(fd, size, 1);
+   if (!readn(fd, reg, sizeof(reg))) return 0;
+   peers_merge(peers, owner, reg);
+   return 1;
+}
+
+/* ---------------------------------------------------------------------------
+ * Load a host's peer sketches, and those of its ports.
+ * Returns 0 on failure, 1 on success.
+ */
+static int
+hosts_db_import_peers(const int fd, struct bucket *host)
+{
+   uint32_t ports;
+
+   if (!expect8(fd, export_proto_peers)) return 0;
+   if (!hosts_db_import_sketch(fd, &host->u.host.peers, host)) return 0;
+   if (!read32(fd, &ports)) return 0;
+   while (ports-- > 0) {
+      struct bucket *b;
+      uint8_t proto;
+      uint16_t port;
+
+      if (!read8(fd, &proto)) return 0;
+      if (!read16(fd, &port)) return 0;
+      if (proto == export_proto_tcp) {
+         b = host_get_port_tcp(host, port);
+         if (!hosts_db_import_sketch(fd, &b->u.port_tcp.peers, b)) return 0;
+      } else if (proto == export_proto_udp) {
+         b = host_get_port_udp(host, port);
+         if (!hosts_db_import_sketch(fd, &b->u.port_udp.peers, b)) return 0;
+      } else {
+         warnx("bad port peers protocol %02x", proto);
+         return 0;
+      }
+   }
+   return 1;
+}
+
+/* ---------------------------------------------------------------------------
+ * Load a host's proto and port subtables, which follow its counters in a
+ * host record.  Remote ports only came in with host ver4, and peers with
+ * ver5.
+ * Returns 0 on failure, 1 on success.
+ */
+static int
+hosts_db_import_ports(const int fd, struct bucket *host, const int ver)
+{
+   if (!hosts_db_import_ip(fd, host)) return 0;
+   if (!hosts_db_import_tcp(fd, export_proto_tcp, host, host_get_port_tcp))
+      return 0;
+   if (!hosts_db_import_udp(fd, export_proto_udp, host, host_get_port_udp))
+      return 0;
+
+   if (ver >= 4) {
+      if (!hosts_db_import_tcp(fd, export_proto_tcp_remote, host,
+                               host_get_port_tcp_remote))
+         return 0;
+      if (!hosts_db_import_udp(fd, export_proto_udp_remote, host,
+                               host_get_port_udp_remote))
+         return 0;
+   }
+   if (ver >= 5)
+      return hosts_db_import_peers(fd, host);
+   return 1;
+}
+
 /* ---------------------------------------------------------------------------
  * Load all hosts from a file.
  * Returns 0 on failure, 1 on success.
@@ -1382,14 +2842,16 @@ hosts_db_import_host(const int fd)
 {
    struct bucket *host;
    struct addr a;
-   uint8_t hostname_len;
-   uint64_t in, out;
+   uint8_t hostname_len, mac_addr[6];
+   uint64_t in, out, t = 0;
    unsigned int pos = xtell(fd);
-   char hdr[4];
+   char hdr[4], *name = NULL;
    int ver = 0;
 
    if (!readn(fd, hdr, sizeof(hdr))) return 0;
-   if (memcmp(hdr, export_tag_host_ver4, sizeof(hdr)) == 0)
+   if (memcmp(hdr, export_tag_host_ver5, sizeof(hdr)) == 0)
+      ver = 5;
+   else if (memcmp(hdr, export_tag_host_ver4, sizeof(hdr)) == 0)
       ver = 4;
    else if (memcmp(hdr, export_tag_host_ver3, sizeof(hdr)) == 0)
       ver = 3;
@@ -1411,59 +2873,39 @@ hosts_db_import_host(const int fd)
       if (!readaddr_ipv4(fd, &a))
          return 0;
    }
+   if (merge_keep != NULL && !merge_keep(&a))
+      return hosts_db_skip_host(fd, ver);
    verbosef("at file pos %u, importing host %s", pos, addr_to_str(&a));
-   host = host_get(&a);
-   assert(addr_equal(&(host->u.host.addr), &a));
 
-   if (ver > 1) {
-      uint64_t t;
+   if (ver > 1)
       if (!read64(fd, &t)) return 0;
-      host->u.host.last_seen_mono = real_to_mono(t);
-   }
 
-   assert(sizeof(host->u.host.mac_addr) == 6);
-   if (!readn(fd, host->u.host.mac_addr, sizeof(host->u.host.mac_addr)))
+   assert(sizeof(host->u.host.mac_addr) == sizeof(mac_addr));
+   if (!readn(fd, mac_addr, sizeof(mac_addr)))
       return 0;
 
    /* HOSTNAME */
-   assert(host->u.host.dns == NULL); /* make fn? */
    if (!read8(fd, &hostname_len)) return 0;
    if (hostname_len > 0) {
-      host->u.host.dns = xmalloc(hostname_len + 1);
-      host->u.host.dns[0] = '\0';
-
-      /* At this point, the hostname is attached to a host which is in our
-       * hosts_db, so if we bail out due to an import error, this pointer
-       * isn't lost and leaked, it can be cleaned up in hosts_db_{free,reset}
-       */
-
-      if (!readn(fd, host->u.host.dns, hostname_len)) return 0;
-      host->u.host.dns[hostname_len] = '\0';
+      name = xmalloc(hostname_len + 1);
+      if (!readn(fd, name, hostname_len)) {
+         free(name);
+         return 0;
+      }
+      name[hostname_len] = '\0';
    }
 
-   if (!read64(fd, &in)) return 0;
-   if (!read64(fd, &out)) return 0;
+   if (!read64(fd, &in) || !read64(fd, &out)) {
+      free(name);
+      return 0;
+   }
 
-   host->in = in;
-   host->out = out;
-   host->total = in + out;
+   host = host_import_fields(&a, in, out, ver > 1, (time_t)t, mac_addr,
+      name);
+   assert(addr_equal(&(host->u.host.addr), &a));
 
    /* Host's port and proto subtables: */
-   if (!hosts_db_import_ip(fd, host)) return 0;
-   if (!hosts_db_import_tcp(fd, export_proto_tcp, host, host_get_port_tcp))
-      return 0;
-   if (!hosts_db_import_udp(fd, export_proto_udp, host, host_get_port_udp))
-      return 0;
-
-   if (ver == 4) {
-      if (!hosts_db_import_tcp(fd, export_proto_tcp_remote, host,
-                               host_get_port_tcp_remote))
-         return 0;
-      if (!hosts_db_import_udp(fd, export_proto_udp_remote, host,
-                               host_get_port_udp_remote))
-         return 0;
-   }
-   return 1;
+   return hosts_db_import_ports(fd, host, ver);
 }
 
 /* ---------------------------------------------------------------------------
@@ -1476,74 +2918,589 @@ hosts_db_import_host(const int fd)
 int hosts_db_import(const int fd)
 {
    uint32_t host_count, i;
+   int ret = 1;
 
    if (!read32(fd, &host_count)) return 0;
 
    for (i=0; i<host_count; i++)
-      if (!hosts_db_import_host(fd)) return 0;
+      if (!hosts_db_import_host(fd)) {
+         ret = 0;
+         break;
+      }
 
-   return 1;
+   /* Imported counters were set, not added to. */
+   hosts_top_rebuild();
+   return ret;
 }
 
 /* ---------------------------------------------------------------------------
- * Database Export: Dump hosts_db into a file provided by the caller.
- * The caller is responsible for writing out export_tag_hosts_ver1 first.
+ * Federation: a delta from a sensor (see sensor.c) is read into a table of
+ * its own, then folded into hosts_db.  Its counters are the sensor's totals,
+ * so each sensor has a mirror of the last totals seen from it, and only the
+ * growth is added.  A counter that went down is one the sensor reset.
  */
-int hosts_db_export(const int fd)
+struct hashtable *
+hosts_db_import_sensor(const int fd)
+{
+   struct hashtable *view = hosts_db, *sensor;
+   uint32_t host_count, i;
+   int ret = 1;
+
+   assert(merge_keep == NULL);
+   hosts_db = hosts_shard_make(); /* so that the import goes there */
+   if (!read32(fd, &host_count))
+      ret = 0;
+   for (i=0; ret && i<host_count; i++)
+      if (!hosts_db_import_host(fd))
+         ret = 0;
+   sensor = hosts_db;
+   hosts_db = view;
+   if (!ret) {
+      hosts_shard_free(sensor);
+      return NULL;
+   }
+   return sensor;
+}
+
+/* How much now is past *last, which becomes now. */
+static uint64_t
+grown(uint64_t *last, const uint64_t now)
+{
+   const uint64_t d = (now >= *last) ? now - *last : now;
+
+   *last = now;
+   return d;
+}
+
+static void
+bucket_grow(struct bucket *dst, struct bucket *last, const struct bucket *now)
 {
+   dst->in += grown(&last->in, now->in);
+   dst->out += grown(&last->out, now->out);
+}
+
+static void
+fold_tcp(const struct hashtable *from, struct bucket *dst,
+   struct bucket *last,
+   struct bucket *(get_port_fn)(struct bucket *host, uint16_t port))
+{
+   const struct bucket *b;
    uint32_t i;
-   struct bucket *b;
 
-   if (!write32(fd, hosts_db->count)) return 0;
+   HASHTABLE_FOREACH(from, i, b) {
+      struct bucket *p = get_port_fn(dst, b->u.port_tcp.port),
+                    *m = get_port_fn(last, b->u.port_tcp.port);
 
-   for (i = 0; i<hosts_db->size; i++)
-   for (b = hosts_db->table[i]; b != NULL; b = b->next) {
-      /* For each host: */
-      if (!writen(fd, export_tag_host_ver4, sizeof(export_tag_host_ver4)))
-         return 0;
+      bucket_grow(p, m, b);
+      p->u.port_tcp.syn += grown(&m->u.port_tcp.syn, b->u.port_tcp.syn);
+      peers_merge(&p->u.port_tcp.peers, p, b->u.port_tcp.peers);
+   }
+}
 
-      if (!writeaddr(fd, &(b->u.host.addr)))
-         return 0;
+static void
+fold_udp(const struct hashtable *from, struct bucket *dst,
+   struct bucket *last,
+   struct bucket *(get_port_fn)(struct bucket *host, uint16_t port))
+{
+   const struct bucket *b;
+   uint32_t i;
 
-      if (!write64(fd, (uint64_t)mono_to_real(b->u.host.last_seen_mono)))
-         return 0;
+   HASHTABLE_FOREACH(from, i, b) {
+      struct bucket *p = get_port_fn(dst, b->u.port_udp.port);
 
-      assert(sizeof(b->u.host.mac_addr) == 6);
-      if (!writen(fd, b->u.host.mac_addr, sizeof(b->u.host.mac_addr)))
+      bucket_grow(p, get_port_fn(last, b->u.port_udp.port), b);
+      peers_merge(&p->u.port_udp.peers, p, b->u.port_udp.peers);
+   }
+}
+
+/* Fold what a sensor's hosts have done since mirror was last updated into
+ * hosts_db, and free sensor.
+ */
+void
+hosts_db_fold_sensor(struct hashtable *sensor, struct hashtable *mirror)
+{
+   const struct bucket *b, *p;
+   uint32_t i, j;
+
+   HASHTABLE_FOREACH(sensor, i, b) {
+      const struct host *s = &(b->u.host);
+      struct bucket *m = hosts_shard_get(mirror, &(s->addr)), *h;
+
+      hosts_db_reduce();
+      h = host_get(&(s->addr));
+      bucket_grow(h, m, b);
+      if (s->last_seen_mono >= h->u.host.last_seen_mono) {
+         h->u.host.last_seen_mono = s->last_seen_mono;
+         memcpy(h->u.host.mac_addr, s->mac_addr,
+            sizeof(h->u.host.mac_addr));
+      }
+      if (h->u.host.dns == NAME_NONE && s->dns != NAME_NONE) {
+         name_ref(s->dns);
+         h->u.host.dns = s->dns;
+      }
+      peers_merge(&h->u.host.peers, h, s->peers);
+
+      HASHTABLE_FOREACH(s->ip_protos, j, p)
+         bucket_grow(host_get_ip_proto(h, p->u.ip_proto.proto),
+                     host_get_ip_proto(m, p->u.ip_proto.proto), p);
+      fold_tcp(s->ports_tcp, h, m, host_get_port_tcp);
+      fold_tcp(s->ports_tcp_remote, h, m, host_get_port_tcp_remote);
+      fold_udp(s->ports_udp, h, m, host_get_port_udp);
+      fold_udp(s->ports_udp_remote, h, m, host_get_port_udp_remote);
+      h->u.host.changed = graph_generation();
+      hosts_top_update(h);
+   }
+   hosts_shard_free(sensor);
+}
+
+/* ---------------------------------------------------------------------------
+ * The columnar hosts section (see export-format.txt) keeps each field of
+ * every host in an array of its own, in 8-byte aligned columns, so that an
+ * import can map the file and take the hosts straight out of it.  Each
+ * host's protocols and ports are left in the mapping until something first
+ * needs them: see host_restore().  The mapping goes once no host needs it.
+ */
+#define COL_ALIGN 8
+#define COL_PAD(len) (((len) + COL_ALIGN - 1) & ~(uint64_t)(COL_ALIGN - 1))
+
+static struct {
+   void *map;          /* NULL if nothing is mapped */
+   size_t len;
+   const unsigned char *ports_ofs, *ports;
+   uint32_t hosts;     /* how many still have saved != 0 */
+   int ver;            /* of the host records that ports are laid out as */
+} saved_file = { NULL, 0, NULL, NULL, 0, 0 };
+
+static void
+saved_unmap(void)
+{
+   if (saved_file.map == NULL)
+      return;
+   if (munmap(saved_file.map, saved_file.len) == -1)
+      warn("munmap() failed");
+   saved_file.map = NULL;
+   verbosef("no host needs the imported file any more, unmapped it");
+}
+
+static void
+saved_release(void)
+{
+   assert(saved_file.hosts > 0);
+   if (--saved_file.hosts == 0)
+      saved_unmap();
+}
+
+/* Where in saved_file.ports host number i's protocols and ports are. */
+static void
+saved_ports_range(const uint32_t i, uint64_t *start, uint64_t *len)
+{
+   *start = db_get64(saved_file.ports_ofs + 8 * (size_t)i);
+   *len = db_get64(saved_file.ports_ofs + 8 * ((size_t)i + 1)) - *start;
+}
+
+/* Build a host's protocol and port tables from the mapped file. */
+static void
+host_restore(struct bucket *host)
+{
+   struct host *h = &(host->u.host);
+   uint64_t start, len;
+   int fd;
+
+   assert(h->saved != 0);
+   saved_ports_range(h->saved - 1, &start, &len);
+   h->saved = 0; /* before host_get_*(), which would come back here */
+   fd = db_mem_open(saved_file.ports + start, (size_t)len);
+   if (!hosts_db_import_ports(fd, host, saved_file.ver))
+      warnx("couldn't restore the ports of %s from the imported file",
+         addr_to_str(&(h->addr)));
+   db_mem_close();
+   saved_release();
+}
+
+/* Check that a column of count+1 offsets only goes up, to at most max. */
+static int
+col_offsets_ok(const unsigned char *ofs, const uint32_t count,
+   const uint64_t max)
+{
+   uint64_t prev = 0;
+   uint32_t i;
+
+   for (i = 0; i <= count; i++) {
+      const uint64_t o = db_get64(ofs + 8 * (size_t)i);
+
+      if (o < prev || o > max)
          return 0;
+      prev = o;
+   }
+   return 1;
+}
 
-      /* HOSTNAME */
-      if (b->u.host.dns == NULL) {
-         if (!write8(fd, 0)) return 0;
+/* ---------------------------------------------------------------------------
+ * Database Import: Adopt a columnar hosts section from a mapped file, which
+ * starts at *pos, and leave *pos just past it.  Its PORTS are laid out as in
+ * host records of version ver.  Takes ownership of the mapping, which is
+ * kept for as long as some host's ports are still in it.
+ * Returns 0 on failure, 1 on success.
+ */
+int
+hosts_db_import_columnar(const void *map, const size_t len, size_t *pos,
+   const int ver)
+{
+   const unsigned char *p = (const unsigned char *)map + *pos, *q;
+   const unsigned char *last_seen, *in, *out, *name_ofs, *addrs, *families,
+      *macs, *names;
+   const uint64_t avail = len - *pos;
+   uint64_t used, names_len, ports_len;
+   uint32_t count, i;
+
+   assert(saved_file.map == NULL);
+   saved_file.map = (void *)map;
+   saved_file.len = len;
+   saved_file.hosts = 0;
+   saved_file.ver = ver;
+
+   if (avail < COL_ALIGN)
+      goto truncated;
+   count = db_get32(p);
+   used = COL_ALIGN + (uint64_t)count * (3 * 8 + 16 + 1 + 6) +
+      ((uint64_t)count + 1) * 2 * 8;
+   if (avail < used)
+      goto truncated;
+
+   q = p + COL_ALIGN;
+   last_seen = q;             q += 8 * (size_t)count;
+   in = q;                    q += 8 * (size_t)count;
+   out = q;                   q += 8 * (size_t)count;
+   saved_file.ports_ofs = q;  q += 8 * ((size_t)count + 1);
+   name_ofs = q;              q += 8 * ((size_t)count + 1);
+   addrs = q;                 q += 16 * (size_t)count;
+   families = q;              q += (size_t)count;
+   macs = q;
+
+   used = COL_PAD(used);
+   names = p + used;
+   names_len = db_get64(name_ofs + 8 * (size_t)count);
+   if (names_len > avail - used)
+      goto truncated;
+   used = COL_PAD(used + names_len);
+   if (used > avail)
+      goto truncated;
+   saved_file.ports = p + used;
+   ports_len = db_get64(saved_file.ports_ofs + 8 * (size_t)count);
+   if (ports_len > avail - used)
+      goto truncated;
+   used = COL_PAD(used + ports_len);
+   if (used > avail)
+      goto truncated;
+   if (!col_offsets_ok(name_ofs, count, names_len) ||
+       !col_offsets_ok(saved_file.ports_ofs, count, ports_len)) {
+      warnx("columnar hosts section has bad offsets");
+      goto fail;
+   }
+
+   if (merge_keep == NULL)
+      hashtable_reserve(hosts_db, count);
+   for (i = 0; i < count; i++) {
+      struct bucket *b;
+      struct host *h;
+      struct addr a;
+      uint64_t name_start, name_len;
+      char *name;
+
+      if (families[i] == 4) {
+         a.family = IPv4;
+         memcpy(&(a.ip.v4), addrs + 16 * (size_t)i, sizeof(a.ip.v4));
+      } else if (families[i] == 6) {
+         a.family = IPv6;
+         memcpy(a.ip.v6.s6_addr, addrs + 16 * (size_t)i,
+            sizeof(a.ip.v6.s6_addr));
       } else {
-         int dnslen = strlen(b->u.host.dns);
+         warnx("host %u has unknown address family %u",
+            i, (unsigned int)families[i]);
+         goto fail;
+      }
+      if (merge_keep != NULL && !merge_keep(&a))
+         continue;
+      name = NULL;
+      name_start = db_get64(name_ofs + 8 * (size_t)i);
+      name_len = db_get64(name_ofs + 8 * ((size_t)i + 1)) - name_start;
+      if (name_len > 0) {
+         name = xmalloc((size_t)name_len + 1);
+         memcpy(name, names + name_start, (size_t)name_len);
+         name[name_len] = '\0';
+      }
+      b = host_import_fields(&a, db_get64(in + 8 * (size_t)i),
+         db_get64(out + 8 * (size_t)i), 1,
+         (time_t)db_get64(last_seen + 8 * (size_t)i),
+         macs + 6 * (size_t)i, name);
+      h = &(b->u.host);
+      if (merge_keep != NULL) {
+         /* Adding up needs the ports now, not later. */
+         uint64_t start, host_len;
+         int ok, pfd;
+
+         saved_ports_range(i, &start, &host_len);
+         pfd = db_mem_open(saved_file.ports + start, (size_t)host_len);
+         ok = hosts_db_import_ports(pfd, b, ver);
+         db_mem_close();
+         if (!ok)
+            goto fail;
+         continue;
+      }
+      if (h->saved == 0)
+         saved_file.hosts++;
+      h->saved = i + 1;
+   }
+   *pos += (size_t)used;
+   if (merge_keep == NULL)
+      verbosef("imported %u hosts, their ports are restored as needed",
+         count);
+   if (saved_file.hosts == 0)
+      saved_unmap();
+   hosts_top_rebuild();
+   return 1;
 
-         if (dnslen > 255) {
-           warnx("found a very long hostname: \"%s\"\n"
-              "wasn't expecting one longer than 255 chars (this one is %d)",
-              b->u.host.dns, dnslen);
-           dnslen = 255;
-         }
+truncated:
+   warnx("columnar hosts section is truncated");
+fail:
+   if (saved_file.hosts == 0)
+      saved_unmap();
+   return 0;
+}
+
+/* ---------------------------------------------------------------------------
+ * Database Export: Dump hosts_db into a file provided by the caller, as a
+ * columnar hosts section.  The caller is responsible for writing out
+ * export_tag_hosts_col2 first, at an offset that's a multiple of COL_ALIGN.
+ */
+#define TABLE_COUNT(t) ((t) == NULL ? 0 : (uint64_t)(t)->count)
+
+/* The length of a sketch in a file. */
+#define SKETCH_LEN(peers) (1 + ((peers) == NULL ? 0 : PEERS_SIZE))
+
+/* A host with no peers still has the start of a PEERS DATA section. */
+#define NO_PEERS_LEN (1 + SKETCH_LEN(NULL) + 4)
+
+/* How much hosts_db_export_peers() will write for the host. */
+static uint64_t
+host_peers_len(const struct host *h)
+{
+   const struct bucket *b;
+   uint64_t len = 1 + SKETCH_LEN(h->peers) + 4;
+   uint32_t i;
+
+   HASHTABLE_FOREACH(h->ports_tcp, i, b)
+      if (b->u.port_tcp.peers != NULL)
+         len += 1 + 2 + SKETCH_LEN(b->u.port_tcp.peers);
+   HASHTABLE_FOREACH(h->ports_udp, i, b)
+      if (b->u.port_udp.peers != NULL)
+         len += 1 + 2 + SKETCH_LEN(b->u.port_udp.peers);
+   return len;
+}
+
+/* How much hosts_db_export_ports() will write for the host. */
+static uint64_t
+host_ports_len(const struct bucket *b)
+{
+   const struct host *h = &(b->u.host);
+   uint64_t start, len;
+
+   if (h->saved != 0) {
+      saved_ports_range(h->saved - 1, &start, &len);
+      return len + (saved_file.ver < 5 ? NO_PEERS_LEN : 0);
+   }
+   return (2 + 17 * TABLE_COUNT(h->ip_protos)) +
+          (3 + 26 * TABLE_COUNT(h->ports_tcp)) +
+          (3 + 18 * TABLE_COUNT(h->ports_udp)) +
+          (3 + 26 * TABLE_COUNT(h->ports_tcp_remote)) +
+          (3 + 18 * TABLE_COUNT(h->ports_udp_remote)) +
+          host_peers_len(h);
+}
 
-         if (!write8(fd, (uint8_t)dnslen)) return 0;
-         if (!writen(fd, b->u.host.dns, dnslen)) return 0;
+/* A host's protocols and ports, laid out as in a host ver5 record.  If they
+ * haven't been restored yet, they're copied straight from the mapping, with
+ * no peers if it's from before ver5.
+ */
+static int
+hosts_db_export_ports(const int fd, const struct bucket *b)
+{
+   const struct host *h = &(b->u.host);
+   uint64_t start, len;
+
+   if (h->saved != 0) {
+      saved_ports_range(h->saved - 1, &start, &len);
+      if (!writen(fd, saved_file.ports + start, (size_t)len)) return 0;
+      if (saved_file.ver < 5) {
+         if (!write8(fd, export_proto_peers)) return 0;
+         if (!write8(fd, 0)) return 0;
+         if (!write32(fd, 0)) return 0;
       }
+      return 1;
+   }
+   if (!hosts_db_export_ip(h->ip_protos, fd)) return 0;
+   if (!hosts_db_export_tcp(export_proto_tcp, h->ports_tcp, fd))
+      return 0;
+   if (!hosts_db_export_udp(export_proto_udp, h->ports_udp, fd))
+      return 0;
+   if (!hosts_db_export_tcp(export_proto_tcp_remote, h->ports_tcp_remote, fd))
+      return 0;
+   if (!hosts_db_export_udp(export_proto_udp_remote, h->ports_udp_remote, fd))
+      return 0;
+   return hosts_db_export_peers(h, fd);
+}
+
+/* Write zeros to take a column that's len bytes into the section up to the
+ * next multiple of COL_ALIGN.
+ */
+static int
+write_col_pad(const int fd, const uint64_t len)
+{
+   static const uint8_t zeros[COL_ALIGN];
 
+   return writen(fd, zeros, (size_t)(COL_PAD(len) - len));
+}
+
+int hosts_db_export(const int fd)
+{
+   const uint32_t count = hosts_db->count;
+   uint64_t used, ofs;
+   uint32_t i;
+   struct bucket *b;
+
+   if (!write32(fd, count)) return 0;
+   if (!write32(fd, 0)) return 0; /* padding */
+
+   HASHTABLE_FOREACH(hosts_db, i, b)
+      if (!write64(fd, (uint64_t)mono_to_real(b->u.host.last_seen_mono)))
+         return 0;
+   HASHTABLE_FOREACH(hosts_db, i, b)
       if (!write64(fd, b->in)) return 0;
+   HASHTABLE_FOREACH(hosts_db, i, b)
       if (!write64(fd, b->out)) return 0;
 
-      if (!hosts_db_export_ip(b->u.host.ip_protos, fd)) return 0;
-      if (!hosts_db_export_tcp(export_proto_tcp, b->u.host.ports_tcp, fd))
-         return 0;
-      if (!hosts_db_export_udp(export_proto_udp, b->u.host.ports_udp, fd))
-         return 0;
-      if (!hosts_db_export_tcp(export_proto_tcp_remote,
-                               b->u.host.ports_tcp_remote, fd))
-         return 0;
-      if (!hosts_db_export_udp(export_proto_udp_remote,
-                               b->u.host.ports_udp_remote, fd))
+   if (!write64(fd, 0)) return 0;
+   ofs = 0;
+   HASHTABLE_FOREACH(hosts_db, i, b) {
+      ofs += host_ports_len(b);
+      if (!write64(fd, ofs)) return 0;
+   }
+   if (!write64(fd, 0)) return 0;
+   ofs = 0;
+   HASHTABLE_FOREACH(hosts_db, i, b) {
+      ofs += name_len(b->u.host.dns);
+      if (!write64(fd, ofs)) return 0;
+   }
+
+   HASHTABLE_FOREACH(hosts_db, i, b) {
+      uint8_t a[16];
+
+      memset(a, 0, sizeof(a));
+      if (b->u.host.addr.family == IPv4)
+         memcpy(a, &(b->u.host.addr.ip.v4), sizeof(b->u.host.addr.ip.v4));
+      else {
+         assert(b->u.host.addr.family == IPv6);
+         memcpy(a, b->u.host.addr.ip.v6.s6_addr, sizeof(a));
+      }
+      if (!writen(fd, a, sizeof(a))) return 0;
+   }
+   HASHTABLE_FOREACH(hosts_db, i, b)
+      if (!write8(fd, (uint8_t)b->u.host.addr.family)) return 0;
+   assert(sizeof(b->u.host.mac_addr) == 6);
+   HASHTABLE_FOREACH(hosts_db, i, b)
+      if (!writen(fd, b->u.host.mac_addr, sizeof(b->u.host.mac_addr)))
          return 0;
+   used = COL_ALIGN + (uint64_t)count * (3 * 8 + 16 + 1 + 6) +
+      ((uint64_t)count + 1) * 2 * 8;
+   if (!write_col_pad(fd, used)) return 0;
+   used = COL_PAD(used);
+
+   ofs = 0;
+   HASHTABLE_FOREACH(hosts_db, i, b)
+      if (b->u.host.dns != NAME_NONE) {
+         char name[NAME_BUF_LEN];
+         const size_t dnslen = strlen(name_str(b->u.host.dns, name));
+
+         if (!writen(fd, name, dnslen)) return 0;
+         ofs += dnslen;
+      }
+   if (!write_col_pad(fd, used + ofs)) return 0;
+   used = COL_PAD(used + ofs);
+
+   ofs = 0;
+   HASHTABLE_FOREACH(hosts_db, i, b) {
+      const unsigned int start = xtell(fd);
+
+      if (!hosts_db_export_ports(fd, b)) return 0;
+      assert(xtell(fd) - start == host_ports_len(b));
+      ofs += host_ports_len(b);
+   }
+   if (!write_col_pad(fd, used + ofs)) return 0;
+   return 1;
+}
+
+/* ---------------------------------------------------------------------------
+ * Dump one host as a host ver5 record.
+ */
+static int
+hosts_db_export_host(const int fd, const struct bucket *b)
+{
+   if (!writen(fd, export_tag_host_ver5, sizeof(export_tag_host_ver5)))
+      return 0;
+
+   if (!writeaddr(fd, &(b->u.host.addr)))
+      return 0;
+
+   if (!write64(fd, (uint64_t)mono_to_real(b->u.host.last_seen_mono)))
+      return 0;
+
+   assert(sizeof(b->u.host.mac_addr) == 6);
+   if (!writen(fd, b->u.host.mac_addr, sizeof(b->u.host.mac_addr)))
+      return 0;
+
+   /* HOSTNAME, at most 255 chars, which name_intern() made sure of */
+   if (b->u.host.dns == NAME_NONE) {
+      if (!write8(fd, 0)) return 0;
+   } else {
+      char name[NAME_BUF_LEN];
+      const size_t dnslen = strlen(name_str(b->u.host.dns, name));
+
+      if (!write8(fd, (uint8_t)dnslen)) return 0;
+      if (!writen(fd, name, dnslen)) return 0;
    }
+
+   if (!write64(fd, b->in)) return 0;
+   if (!write64(fd, b->out)) return 0;
+
+   return hosts_db_export_ports(fd, b);
+}
+
+/* How many hosts were counted in generation since or later. */
+uint32_t
+hosts_db_count_changed(const unsigned int since)
+{
+   uint32_t i, count = 0;
+   struct bucket *b;
+
+   HASHTABLE_FOREACH(hosts_db, i, b)
+      if (b->u.host.changed >= since)
+         count++;
+   return count;
+}
+
+/* ---------------------------------------------------------------------------
+ * Dump the hosts counted in generation since or later, in the hosts_db ver1
+ * layout that hosts_db_import() reads: a count, then host ver5 records.
+ */
+int
+hosts_db_export_changed(const int fd, const unsigned int since)
+{
+   uint32_t i;
+   struct bucket *b;
+
+   if (!write32(fd, hosts_db_count_changed(since))) return 0;
+   HASHTABLE_FOREACH(hosts_db, i, b)
+      if (b->u.host.changed >= since)
+         if (!hosts_db_export_host(fd, b)) return 0;
    return 1;
 }
 
@@ -1568,8 +3525,7 @@ hosts_db_export_ip(const struct hashtable *h, const int fd)
    assert(h->count < 256);
    if (!write8(fd, (uint8_t)h->count)) return 0;
 
-   for (i = 0; i<h->size; i++)
-   for (b = h->table[i]; b != NULL; b = b->next) {
+   HASHTABLE_FOREACH(h, i, b) {
       /* For each ip_proto bucket: */
 
       if (!write8(fd, b->u.ip_proto.proto)) return 0;
@@ -1602,8 +3558,7 @@ hosts_db_export_tcp(const char magic, const struct hashtable *h, const int fd)
    assert(h->count < 65536);
    if (!write16(fd, (uint16_t)h->count)) return 0;
 
-   for (i = 0; i<h->size; i++)
-   for (b = h->table[i]; b != NULL; b = b->next) {
+   HASHTABLE_FOREACH(h, i, b) {
       if (!write16(fd, b->u.port_tcp.port)) return 0;
       if (!write64(fd, b->u.port_tcp.syn)) return 0;
       if (!write64(fd, b->in)) return 0;
@@ -1635,8 +3590,7 @@ hosts_db_export_udp(const char magic, const struct hashtable *h, const int fd)
    assert(h->count < 65536);
    if (!write16(fd, (uint16_t)h->count)) return 0;
 
-   for (i = 0; i<h->size; i++)
-   for (b = h->table[i]; b != NULL; b = b->next) {
+   HASHTABLE_FOREACH(h, i, b) {
       if (!write16(fd, b->u.port_udp.port)) return 0;
       if (!write64(fd, b->in)) return 0;
       if (!write64(fd, b->out)) return 0;
@@ -1646,4 +3600,49 @@ hosts_db_export_udp(const char magic, const struct hashtable *h, const int fd)
    return 1;
 }
 
+/* ---------------------------------------------------------------------------
+ * Dump the peer sketches of a host and its ports.
+ */
+static int
+hosts_db_export_sketch(const uint8_t *peers, const int fd)
+{
+   if (peers == NULL)
+      return write8(fd, 0);
+   if (!write8(fd, (uint8_t)PEERS_SIZE)) return 0;
+   return writen(fd, peers, PEERS_SIZE);
+}
+
+static int
+hosts_db_export_peers(const struct host *h, const int fd)
+{
+   const struct bucket *b;
+   uint32_t i, ports = 0;
+
+   /* PEERS DATA */
+   if (!write8(fd, export_proto_peers)) return 0;
+   if (!hosts_db_export_sketch(h->peers, fd)) return 0;
+
+   HASHTABLE_FOREACH(h->ports_tcp, i, b)
+      if (b->u.port_tcp.peers != NULL)
+         ports++;
+   HASHTABLE_FOREACH(h->ports_udp, i, b)
+      if (b->u.port_udp.peers != NULL)
+         ports++;
+   if (!write32(fd, ports)) return 0;
+
+   HASHTABLE_FOREACH(h->ports_tcp, i, b)
+      if (b->u.port_tcp.peers != NULL) {
+         if (!write8(fd, export_proto_tcp)) return 0;
+         if (!write16(fd, b->u.port_tcp.port)) return 0;
+         if (!hosts_db_export_sketch(b->u.port_tcp.peers, fd)) return 0;
+      }
+   HASHTABLE_FOREACH(h->ports_udp, i, b)
+      if (b->u.port_udp.peers != NULL) {
+         if (!write8(fd, export_proto_udp)) return 0;
+         if (!write16(fd, b->u.port_udp.port)) return 0;
+         if (!hosts_db_export_sketch(b->u.port_udp.peers, fd)) return 0;
+      }
+   return 1;
+}
+
 /* vim:set ts=3 sw=3 tw=80 expandtab: */
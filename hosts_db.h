@@ -14,38 +14,57 @@
 #include "addr.h"
 
 struct hashtable;
+struct str;
+
+#define HOST_HOT_PORTS 4
 
 struct host {
    struct addr addr;
-   char *dns;
    uint8_t mac_addr[6];
+   uint16_t graph_slot; /* if non-zero, see hosts_graph */
+   uint32_t dns; /* see names.h */
    /* last_seen_mono is converted to/from time_t in export/import.
     * It can be negative (due to machine reboots).
     */
    int64_t last_seen_mono;
+   uint16_t top_pos[4]; /* for each sort_dir, see hosts_top */
+   unsigned int changed; /* graph_generation() when last counted */
+   uint32_t saved; /* if non-zero, ports and protocols are still in the
+                      imported file, see host_restore() */
    struct hashtable *ports_tcp;
    struct hashtable *ports_tcp_remote;
    struct hashtable *ports_udp;
    struct hashtable *ports_udp_remote;
    struct hashtable *ip_protos;
+   uint8_t *peers; /* sketch of the hosts it talked to, or NULL */
+   /* The busiest ports, across all four tables, so that most packets find
+    * theirs without hashing.  A key of 0 is an empty slot.
+    */
+   uint32_t hot_key[HOST_HOT_PORTS];
+   struct bucket *hot[HOST_HOT_PORTS];
 };
 
+/* Only ports on the host itself have peers: the hosts that used them. */
 struct port_tcp {
    uint16_t port;
+   uint8_t *peers; /* or NULL */
    uint64_t syn;
 };
 
 struct port_udp {
    uint16_t port;
+   uint8_t *peers; /* or NULL */
 };
 
 struct ip_proto {
    uint8_t proto;
 };
 
+/* Each table only allocates as much of the union as its own type needs, see
+ * MAKE_BUCKET.
+ */
 struct bucket {
-   struct bucket *next;
-   uint64_t in, out, total;
+   uint64_t in, out;
    union {
       struct host host;
       struct port_tcp port_tcp;
@@ -54,19 +73,38 @@ struct bucket {
    } u;
 };
 
+/* The total isn't stored, it's always in + out. */
+#define BUCKET_TOTAL(b) ((b)->in + (b)->out)
+
 enum sort_dir { IN, OUT, TOTAL, LASTSEEN };
 
 extern int hosts_db_show_macs;
 
 void hosts_db_init(void);
 void hosts_db_reduce(void);
+int64_t hosts_db_reduce_nsec(void); /* total time spent reducing */
+uint32_t hosts_db_count(void);
 void hosts_db_reset(void);
 void hosts_db_free(void);
 int hosts_db_import(const int fd);
+int hosts_db_import_columnar(const void *map, const size_t len, size_t *pos,
+   const int ver);
 int hosts_db_export(const int fd);
+typedef int (hosts_db_keep_fn)(const struct addr *const a);
+void hosts_db_set_merge(hosts_db_keep_fn *keep); /* NULL to stop merging */
+uint32_t hosts_db_count_changed(const unsigned int since);
+int hosts_db_export_changed(const int fd, const unsigned int since);
+struct hashtable *hosts_db_import_sensor(const int fd); /* NULL on failure */
+void hosts_db_fold_sensor(struct hashtable *sensor, struct hashtable *mirror);
 
 struct bucket *host_find(const struct addr *const a); /* can return NULL */
 struct bucket *host_get(const struct addr *const a);
+/* Like host_get(), but returns NULL for a new host that --admit turns away
+ * from a full table.  bytes is its traffic this time.
+ */
+struct bucket *host_admit(const struct addr *const a, const uint64_t bytes);
+#define HOSTS_PREFETCH_MAX 16 /* most hosts to prefetch at once */
+void host_prefetch(const struct addr *const *a, const size_t n);
 struct bucket *host_get_port_tcp(struct bucket *host, const uint16_t port);
 struct bucket *host_get_port_tcp_remote(struct bucket *host,
                                         const uint16_t port);
@@ -75,13 +113,59 @@ struct bucket *host_get_port_udp_remote(struct bucket *host,
                                         const uint16_t port);
 struct bucket *host_get_ip_proto(struct bucket *host, const uint8_t proto);
 
+/* Distinct peers, counted in small HyperLogLog sketches: a peer is given by
+ * its host_hash(), and the port is one on the host itself.
+ */
+uint32_t host_hash(const struct addr *const a);
+void host_add_peer(struct bucket *host, const uint32_t peer);
+void port_tcp_add_peer(struct bucket *port, const uint32_t peer);
+void port_udp_add_peer(struct bucket *port, const uint32_t peer);
+
+/* Per-thread shards of hosts_db, see hosts_shard_merge(). */
+struct hashtable *hosts_shard_make(void);
+void hosts_shard_free(struct hashtable *shard);
+struct bucket *hosts_shard_get(struct hashtable *shard,
+                               const struct addr *const a);
+void hosts_shard_prefetch(struct hashtable *shard,
+                          const struct addr *const *a, const size_t n);
+int hosts_shard_full(const struct hashtable *shard);
+void hosts_shard_merge(struct hashtable *shard);
+
 /* Web pages. */
 struct str *html_hosts(const char *uri, const char *query);
-struct str *text_metrics();
+struct str *json_hosts(const char *query);
+struct str *text_metrics(const char *query);
+int xml_host_graphs(struct str *buf, const char *ip, const unsigned int bars);
+
+/* Takes the next piece of /metrics.  Returns 0 to stop. */
+typedef int (metrics_out_fn)(void *arg, const char *s, size_t len);
+int text_metrics_stream(const char *query, metrics_out_fn *out, void *arg);
 
 /* From hosts_sort */
+uint64_t bucket_sort_key(const struct bucket *b, const enum sort_dir dir);
 void qsort_buckets(const struct bucket **a, size_t n,
    size_t left, size_t right, const enum sort_dir d);
+uint64_t select_u64_desc(uint64_t *v, size_t n, size_t k);
+
+/* From hosts_top: the biggest hosts_db entries in each sort order.  Call
+ * hosts_top_update() whenever a host's counters go up.
+ */
+#define TOP_HOSTS 300
+void hosts_top_update(struct bucket *b);
+void hosts_top_clear(void);
+unsigned int hosts_top_list(const struct bucket **table,
+   const enum sort_dir dir); /* unsorted, returns how many */
+
+/* From hosts_graph: per-host graphs of the biggest hosts, if
+ * hosts_graph_init() was given more than zero slots.
+ */
+#define HOST_GRAPH_BARS 60
+void hosts_graph_init(const unsigned int n); /* at most TOP_HOSTS */
+void hosts_graph_free(void);
+void hosts_graph_release(struct bucket *b);
+void hosts_graph_tick(void);
+int hosts_graph_xml(struct str *buf, const struct bucket *b,
+   const unsigned int bars);
 
 #endif /* __DARKSTAT_HOSTS_DB_H */
 /* vim:set ts=3 sw=3 tw=78 expandtab: */
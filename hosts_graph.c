@@ -0,0 +1,192 @@
+/* darkstat 3
+ * copyright (c) 2026 darkstat contributors.
+ *
+ * hosts_graph.c: traffic graphs of the biggest hosts.
+ *
+ * You may use, modify and redistribute this file under the terms of the
+ * GNU General Public License version 2. (see COPYING.GPL)
+ */
+
+/* With --host-graphs <n>, the n hosts with the most traffic (out of the ones
+ * in hosts_top) each get a graph of their last 60 seconds and 60 minutes.
+ * The graphs live in one arena of n slots, allocated up front, so they cost
+ * the same however many hosts come and go.
+ *
+ * Nothing is added on the packet path: once a second, each slot takes how
+ * much its host's counters have grown since the last second.  Every slot's
+ * rings are at the same position, which is kept here rather than per slot.
+ * A host that drops out of the top n gives up its slot, and its graph.
+ */
+
+#include "cdefs.h"
+#include "conv.h"
+#include "hosts_db.h"
+#include "now.h"
+#include "str.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define TIER_SECS 0
+#define TIER_MINS 1
+#define NUM_TIERS 2
+
+static const struct {
+   const char *name;
+   unsigned int bar_secs;
+} host_tiers[NUM_TIERS] = {
+   { "seconds", 1 },
+   { "minutes", 60 }
+};
+
+struct slot {
+   struct bucket *host;       /* NULL if free */
+   uint64_t last_in, last_out; /* the host's counters as of slots_real */
+   unsigned int wanted;       /* ticks when it was last in the top n */
+   uint64_t in[NUM_TIERS][HOST_GRAPH_BARS], out[NUM_TIERS][HOST_GRAPH_BARS];
+};
+
+static struct slot *slots = NULL;
+static unsigned int num_slots = 0, ticks = 0;
+static unsigned int ring_pos[NUM_TIERS];
+static time_t slots_real = 0;
+
+void hosts_graph_init(const unsigned int n) {
+   num_slots = n;
+   if (n > 0)
+      slots = xcalloc(n, sizeof(*slots));
+}
+
+void hosts_graph_free(void) {
+   free(slots);
+   slots = NULL;
+   num_slots = 0;
+}
+
+/* A host is going away, give up its slot. */
+void hosts_graph_release(struct bucket *b) {
+   if (b->u.host.graph_slot == 0)
+      return;
+   slots[b->u.host.graph_slot - 1].host = NULL;
+   b->u.host.graph_slot = 0;
+}
+
+static void take_slot(struct slot *s, struct bucket *b) {
+   memset(s, 0, sizeof(*s));
+   s->host = b;
+   s->last_in = b->in;
+   s->last_out = b->out;
+   s->wanted = ticks;
+   b->u.host.graph_slot = (uint16_t)(s - slots + 1);
+}
+
+/* Give the n biggest hosts slots, taking them from hosts that aren't. */
+static void assign_slots(void) {
+   const struct bucket *top[TOP_HOSTS];
+   const unsigned int n = hosts_top_list(top, TOTAL);
+   const unsigned int want = MIN(n, num_slots);
+   unsigned int i, free_slot = 0;
+
+   qsort_buckets(top, n, 0, want, TOTAL);
+   for (i=0; i<want; i++)
+      if (top[i]->u.host.graph_slot != 0)
+         slots[top[i]->u.host.graph_slot - 1].wanted = ticks;
+   for (i=0; i<num_slots; i++)
+      if (slots[i].host != NULL && slots[i].wanted != ticks)
+         hosts_graph_release(slots[i].host);
+   for (i=0; i<want; i++)
+      if (top[i]->u.host.graph_slot == 0) {
+         while (slots[free_slot].host != NULL)
+            free_slot++;
+         /* Only hosts_top's own view of the host is const. */
+         take_slot(&slots[free_slot], (struct bucket *)top[i]);
+      }
+}
+
+/* How much now is past *last, which becomes now. */
+static uint64_t slot_grown(uint64_t *last, const uint64_t now) {
+   const uint64_t d = (now >= *last) ? now - *last : 0;
+
+   *last = now;
+   return d;
+}
+
+/* Move tier t of every slot on by steps bars, zeroing them. */
+static void advance(const unsigned int t, const time_t steps) {
+   unsigned int i;
+   time_t k;
+
+   for (k=0; k<MIN(steps, HOST_GRAPH_BARS); k++) {
+      ring_pos[t] = (ring_pos[t] + 1) % HOST_GRAPH_BARS;
+      for (i=0; i<num_slots; i++)
+         slots[i].in[t][ring_pos[t]] = slots[i].out[t][ring_pos[t]] = 0;
+   }
+}
+
+/* Call once a second, after the graphs have rotated. */
+void hosts_graph_tick(void) {
+   const time_t t = now_real();
+   unsigned int i, tier;
+
+   if (num_slots == 0 || t == slots_real)
+      return;
+   if (slots_real == 0 || t < slots_real) {
+      slots_real = t; /* start, or the clock went back: carry on from here */
+      return;
+   }
+
+   /* What was counted up to now goes in the bars for slots_real. */
+   for (i=0; i<num_slots; i++) {
+      struct slot *s = &slots[i];
+      uint64_t d_in, d_out;
+
+      if (s->host == NULL)
+         continue;
+      d_in = slot_grown(&(s->last_in), s->host->in);
+      d_out = slot_grown(&(s->last_out), s->host->out);
+      for (tier=0; tier<NUM_TIERS; tier++) {
+         s->in[tier][ring_pos[tier]] += d_in;
+         s->out[tier][ring_pos[tier]] += d_out;
+      }
+   }
+   advance(TIER_SECS, t - slots_real);
+   advance(TIER_MINS, t / 60 - slots_real / 60);
+   slots_real = t;
+
+   ticks++;
+   assign_slots();
+}
+
+/* The newest bars (up to HOST_GRAPH_BARS) of b's graphs, in the same form
+ * as graphs.xml.  Returns 0 if b doesn't have any.
+ */
+int hosts_graph_xml(struct str *buf, const struct bucket *b,
+   const unsigned int bars) {
+   const struct slot *s;
+   const unsigned int n = MIN(bars, HOST_GRAPH_BARS);
+   unsigned int tier, j;
+
+   if (b->u.host.graph_slot == 0)
+      return 0;
+   s = &slots[b->u.host.graph_slot - 1];
+   for (tier=0; tier<NUM_TIERS; tier++) {
+      str_appendf(buf, "<%s>\n", host_tiers[tier].name);
+      for (j=n; j>0; j--) {
+         const unsigned int k =
+            (ring_pos[tier] + HOST_GRAPH_BARS - (j-1)) % HOST_GRAPH_BARS;
+         const time_t start = slots_real - (time_t)
+            ((j-1) * host_tiers[tier].bar_secs);
+         const struct tm *tm = localtime(&start);
+
+         str_appendf(buf, "<e p=\"%u\" i=\"%qu\" o=\"%qu\"/>\n",
+            (unsigned int)((tier == TIER_SECS) ? tm->tm_sec : tm->tm_min),
+            (qu)s->in[tier][k],
+            (qu)s->out[tier][k]);
+      }
+      str_appendf(buf, "</%s>\n", host_tiers[tier].name);
+   }
+   return 1;
+}
+
+/* vim:set ts=3 sw=3 tw=78 expandtab: */
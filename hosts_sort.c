@@ -1,201 +1,269 @@
 /* darkstat 3
  * copyright (c) 2001-2012 Emil Mikulic.
  *
- * hosts_sort.c: quicksort a table of buckets.
+ * hosts_sort.c: sort and select tables of buckets.
  *
  * You may use, modify and redistribute this file under the terms of the
  * GNU General Public License version 2. (see COPYING.GPL)
  */
 
-#include "cdefs.h"
+#include "conv.h"
 #include "err.h"
 #include "hosts_db.h"
 
-static int cmp_u64(const uint64_t a, const uint64_t b) {
-   if (a < b) return (1);
-   if (a > b) return (-1);
-   return (0);
-}
-
-static int cmp_i64(const int64_t a, const int64_t b) {
-   if (a < b) return (1);
-   if (a > b) return (-1);
-   return (0);
-}
+#include <assert.h>
+#include <stdlib.h>
 
-/* Comparator for sorting 'struct bucket' */
-static int cmp(const struct bucket * const *x, const struct bucket * const *y,
-    const enum sort_dir dir) {
+/* The sort key of a bucket, as a number where bigger sorts first. */
+uint64_t
+bucket_sort_key(const struct bucket *b, const enum sort_dir dir)
+{
    switch (dir) {
       case IN:
-         return cmp_u64((*x)->in, (*y)->in);
+         return b->in;
       case OUT:
-         return cmp_u64((*x)->out, (*y)->out);
+         return b->out;
       case TOTAL:
-         return cmp_u64((*x)->total, (*y)->total);
+         return BUCKET_TOTAL(b);
       case LASTSEEN:
-         return cmp_i64((*x)->u.host.last_seen_mono,
-                        (*y)->u.host.last_seen_mono);
+         /* Signed to unsigned, keeping the order. */
+         return (uint64_t)b->u.host.last_seen_mono ^ ((uint64_t)1 << 63);
       default:
-         errx(1, "cmp: unknown direction: %d", dir);
+         errx(1, "bucket_sort_key: unknown direction: %d", dir);
    }
 }
 
-/*
- * The quicksort code is derived from FreeBSD's
- * src/lib/libc/stdlib/qsort.c v1.12
+/* Sorting works on the keys copied out next to their buckets, so it
+ * compares plain numbers in one flat array instead of chasing a pointer and
+ * switching on the direction for every comparison.  Everything below sorts
+ * in decreasing order of key.
  */
+struct sort_entry {
+   uint64_t key;
+   const struct bucket *b;
+};
 
-/*-
- * Copyright (c) 1992, 1993
- *     The Regents of the University of California.  All rights reserved.
- *
- * Redistribution and use in source and binary forms, with or without
- * modification, are permitted provided that the following conditions
- * are met:
- * 1. Redistributions of source code must retain the above copyright
- *    notice, this list of conditions and the following disclaimer.
- * 2. Redistributions in binary form must reproduce the above copyright
- *    notice, this list of conditions and the following disclaimer in the
- *    documentation and/or other materials provided with the distribution.
- * 3. All advertising materials mentioning features or use of this software
- *    must display the following acknowledgement:
- *     This product includes software developed by the University of
- *     California, Berkeley and its contributors.
- * 4. Neither the name of the University nor the names of its contributors
- *    may be used to endorse or promote products derived from this software
- *    without specific prior written permission.
- *
- * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
- * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
- * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
- * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
- * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
- * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
- * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
- * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
- * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
- * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
- * SUCH DAMAGE.
+#define SORT_SMALL 16 /* insertion sort ranges this short */
+
+static void
+sort_swap(struct sort_entry *v, const size_t i, const size_t j)
+{
+   const struct sort_entry t = v[i];
+
+   v[i] = v[j];
+   v[j] = t;
+}
+
+static uint64_t
+med3_u64(const uint64_t a, const uint64_t b, const uint64_t c)
+{
+   if (a < b)
+      return (b < c) ? b : ((a < c) ? c : a);
+   else
+      return (b > c) ? b : ((a < c) ? a : c);
+}
+
+/* Partition v[lo:hi) into [lo:*lt) > pivot, [*lt:*gt) == pivot and
+ * [*gt:hi) < pivot.  Three ways, so long runs of equal keys (lots of tiny
+ * hosts) are dealt with at once.
  */
+static void
+sort_partition(struct sort_entry *v, const size_t lo, const size_t hi,
+   size_t *lt_out, size_t *gt_out)
+{
+   const uint64_t pivot =
+      med3_u64(v[lo].key, v[lo + (hi - lo) / 2].key, v[hi - 1].key);
+   size_t lt = lo, i = lo, gt = hi;
+
+   while (i < gt) {
+      if (v[i].key > pivot)
+         sort_swap(v, i++, lt++);
+      else if (v[i].key < pivot)
+         sort_swap(v, i, --gt);
+      else
+         i++;
+   }
+   *lt_out = lt;
+   *gt_out = gt;
+}
 
 static void
-vecswap(const struct bucket **pi, const struct bucket **pj, int n)
+sort_insertion(struct sort_entry *v, const size_t lo, const size_t hi)
 {
-   if (n <= 0)
-      return;
+   size_t i, j;
+
+   for (i = lo + 1; i < hi; i++) {
+      const struct sort_entry t = v[i];
 
-   do {
-      const struct bucket *t = *pi;
-      *pi++ = *pj;
-      *pj++ = t;
-   } while (--n > 0);
+      for (j = i; (j > lo) && (v[j - 1].key < t.key); j--)
+         v[j] = v[j - 1];
+      v[j] = t;
+   }
 }
 
-#define swap(a, b) { \
-   const struct bucket *t = *(const struct bucket **)(a); \
-   *(const struct bucket **)(a) = *(const struct bucket **)(b); \
-   *(const struct bucket **)(b) = t; \
+/* Heapsort v[lo:hi), for when quicksort is going badly. */
+static void
+sort_heap_down(struct sort_entry *v, const size_t lo, size_t i,
+   const size_t n)
+{
+   for (;;) {
+      size_t child = 2 * i + 1;
+
+      if (child >= n)
+         return;
+      /* A min-heap, so the smallest end up at the back. */
+      if ((child + 1 < n) && (v[lo + child + 1].key < v[lo + child].key))
+         child++;
+      if (v[lo + i].key <= v[lo + child].key)
+         return;
+      sort_swap(v, lo + i, lo + child);
+      i = child;
+   }
 }
 
-static const struct bucket **
-med3(const struct bucket **a,
-     const struct bucket **b,
-     const struct bucket **c,
-     const enum sort_dir dir)
+static void
+sort_heap(struct sort_entry *v, const size_t lo, const size_t hi)
 {
-   return (cmp(a, b, dir) < 0)
-    ? (cmp(b, c, dir) < 0 ? b : (cmp(a, c, dir) < 0 ? c : a ))
-    : (cmp(b, c, dir) > 0 ? b : (cmp(a, c, dir) < 0 ? a : c ));
+   const size_t n = hi - lo;
+   size_t i;
+
+   for (i = n / 2; i-- > 0; )
+      sort_heap_down(v, lo, i, n);
+   for (i = n; i-- > 1; ) {
+      sort_swap(v, lo, lo + i);
+      sort_heap_down(v, lo, 0, i);
+   }
 }
 
-/* Partial sort - only sort elements in the range [left:right] */
+static unsigned int
+depth_limit(size_t n)
+{
+   unsigned int d = 0;
+
+   while (n > 1) {
+      n >>= 1;
+      d += 2;
+   }
+   return (d);
+}
+
+/* Introsort v[lo:hi). */
+static void
+sort_range(struct sort_entry *v, size_t lo, size_t hi, unsigned int depth)
+{
+   while (hi - lo > SORT_SMALL) {
+      size_t lt, gt;
+
+      if (depth-- == 0) {
+         sort_heap(v, lo, hi);
+         return;
+      }
+      sort_partition(v, lo, hi, &lt, &gt);
+      /* Recurse into the smaller side, loop on the bigger one. */
+      if (lt - lo < hi - gt) {
+         sort_range(v, lo, lt, depth);
+         lo = gt;
+      } else {
+         sort_range(v, gt, hi, depth);
+         hi = lt;
+      }
+   }
+   sort_insertion(v, lo, hi);
+}
+
+/* Introselect: reorder v[lo:hi) so v[k] is what it would be if sorted, with
+ * nothing smaller before it, and nothing bigger after.
+ */
+static void
+sort_select(struct sort_entry *v, size_t lo, size_t hi, const size_t k)
+{
+   unsigned int depth = depth_limit(hi - lo);
+
+   assert((lo <= k) && (k < hi));
+   while (hi - lo > SORT_SMALL) {
+      size_t lt, gt;
+
+      if (depth-- == 0) {
+         sort_heap(v, lo, hi);
+         return;
+      }
+      sort_partition(v, lo, hi, &lt, &gt);
+      if (k < lt)
+         hi = lt;
+      else if (k >= gt)
+         lo = gt;
+      else
+         return;
+   }
+   sort_insertion(v, lo, hi);
+}
+
+/* Partial sort: only a[left:right) are guaranteed to end up where they
+ * would be if a[0:n) were sorted.
+ */
 void
 qsort_buckets(const struct bucket **a, size_t n,
    size_t left, size_t right,
    const enum sort_dir dir)
 {
-	const struct bucket **pa, **pb, **pc, **pd, **pl, **pm, **pn;
-	int d, r, swap_cnt;
-
-loop:
-	swap_cnt = 0;
-	if (n < 7) {
-		for (pm = a+1; pm < a+n; pm++)
-			for (pl = pm;
-			     (pl > a) && (cmp(pl-1, pl, dir) > 0);
-			     pl--)
-				swap(pl, pl-1);
-		return;
-	}
-	pm = a + (n / 2);
-	if (n > 7) {
-		pl = a;
-		pn = a + (n - 1);
-		if (n > 40) {
-			d = (n / 8);
-			pl = med3(pl, pl + d, pl + 2 * d, dir);
-			pm = med3(pm - d, pm, pm + d, dir);
-			pn = med3(pn - 2 * d, pn - d, pn, dir);
-		}
-		pm = med3(pl, pm, pn, dir);
-	}
-	swap(a, pm);
-	pa = pb = a + 1;
-
-	pc = pd = a + (n - 1);
-	for (;;) {
-		while (pb <= pc && (r = cmp(pb, a, dir)) <= 0) {
-			if (r == 0) {
-				swap_cnt = 1;
-				swap(pa, pb);
-				pa++;
-			}
-			pb++;
-		}
-		while (pb <= pc && (r = cmp(pc, a, dir)) >= 0) {
-			if (r == 0) {
-				swap_cnt = 1;
-				swap(pc, pd);
-				pd--;
-			}
-			pc--;
-		}
-		if (pb > pc)
-			break;
-		swap(pb, pc);
-		swap_cnt = 1;
-		pb++;
-		pc--;
-	}
-	if (swap_cnt == 0) {  /* Switch to insertion sort */
-		for (pm = a + 1; pm < a+n; pm++)
-			for (pl = pm;
-			     (pl > a) && (cmp(pl-1, pl, dir) > 0);
-			     pl--)
-				swap(pl, pl-1);
-		return;
-	}
-
-	pn = a + n;
-	r = MIN(pa - a, pb - pa);
-	vecswap(a, pb - r, r);
-	r = MIN(pd - pc, pn - pd - 1);
-	vecswap(pb, pn - r, r);
-	if (((r = pb - pa) > 1) && ((unsigned)r >= left))
-		qsort_buckets(a, r, left, right, dir);
-	if (((r = pd - pc) > 1) && (n - r <= right)) {
-		/* Iterate rather than recurse to save stack space */
-		if (n - r > left)
-			left = 0;
-		else
-			left -= n - r;
-		right -= n - r;
-		a += n - r;
-		n = r;
-		goto loop;
-	}
-/*		qsort(pn - r, r, cmp);*/
+   struct sort_entry *v;
+   size_t i;
+
+   if (right > n)
+      right = n;
+   if (left >= right)
+      return;
+   v = xmalloc(n * sizeof(*v));
+   for (i = 0; i < n; i++) {
+      v[i].key = bucket_sort_key(a[i], dir);
+      v[i].b = a[i];
+   }
+   if (left > 0)
+      sort_select(v, 0, n, left);
+   if (right < n)
+      sort_select(v, left, n, right);
+   sort_range(v, left, right, depth_limit(right - left));
+   for (i = left; i < right; i++)
+      a[i] = v[i].b;
+   free(v);
+}
+
+/* Return the value that would be at v[k] if v[0:n) were sorted in decreasing
+ * order.  Reorders v.  Quickselect in expected O(n), with a three-way
+ * partition so long runs of equal values (lots of tiny hosts) stay cheap.
+ */
+uint64_t
+select_u64_desc(uint64_t *v, size_t n, size_t k)
+{
+   size_t lo = 0, hi = n; /* the answer is somewhere in v[lo:hi) */
+
+   assert(k < n);
+   while (hi - lo > 1) {
+      const uint64_t pivot =
+         med3_u64(v[lo], v[lo + (hi - lo) / 2], v[hi - 1]);
+      size_t lt = lo, i = lo, gt = hi;
+
+      /* Partition into [lo:lt) > pivot, [lt:gt) == pivot, [gt:hi) < pivot */
+      while (i < gt) {
+         uint64_t t = v[i];
+
+         if (t > pivot) {
+            v[i++] = v[lt];
+            v[lt++] = t;
+         } else if (t < pivot) {
+            v[i] = v[--gt];
+            v[gt] = t;
+         } else
+            i++;
+      }
+      if (k < lt)
+         hi = lt;
+      else if (k >= gt)
+         lo = gt;
+      else
+         return (pivot);
+   }
+   return (v[lo]);
 }
 
 /* vim:set ts=3 sw=3 tw=78 expandtab: */
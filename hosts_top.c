@@ -0,0 +1,123 @@
+/* darkstat 3
+ * copyright (c) 2026 darkstat contributors.
+ *
+ * hosts_top.c: the biggest hosts in each sort order, kept up to date.
+ *
+ * You may use, modify and redistribute this file under the terms of the
+ * GNU General Public License version 2. (see COPYING.GPL)
+ */
+
+/* One min-heap per sort order holds the TOP_HOSTS biggest hosts, with the
+ * smallest of them on top.  Counters only ever go up (until a reset, or a
+ * reduce, which rebuild the heaps) so a host outside the heap only has to be
+ * compared against the top to see whether it's earned a place, and a host
+ * inside it can only sink.  That makes the first pages of /hosts/ a sort of
+ * TOP_HOSTS entries instead of the whole table.
+ */
+
+#include "hosts_db.h"
+
+#include <assert.h>
+
+#define NUM_SORTS (LASTSEEN + 1)
+
+struct top {
+   struct bucket *heap[TOP_HOSTS];
+   unsigned int n;
+};
+
+static struct top tops[NUM_SORTS];
+
+/* Put b at heap position i, and remember where it is. */
+static void top_place(struct top *t, const enum sort_dir dir,
+   const unsigned int i, struct bucket *b) {
+   t->heap[i] = b;
+   b->u.host.top_pos[dir] = (uint16_t)(i + 1);
+}
+
+static void top_sift_up(struct top *t, const enum sort_dir dir,
+   unsigned int i) {
+   struct bucket *b = t->heap[i];
+   const uint64_t key = bucket_sort_key(b, dir);
+
+   while (i > 0) {
+      const unsigned int parent = (i - 1) / 2;
+
+      if (bucket_sort_key(t->heap[parent], dir) <= key)
+         break;
+      top_place(t, dir, i, t->heap[parent]);
+      i = parent;
+   }
+   top_place(t, dir, i, b);
+}
+
+static void top_sift_down(struct top *t, const enum sort_dir dir,
+   unsigned int i) {
+   struct bucket *b = t->heap[i];
+   const uint64_t key = bucket_sort_key(b, dir);
+
+   for (;;) {
+      unsigned int child = 2 * i + 1;
+      uint64_t child_key;
+
+      if (child >= t->n)
+         break;
+      child_key = bucket_sort_key(t->heap[child], dir);
+      if (child + 1 < t->n) {
+         const uint64_t right_key =
+            bucket_sort_key(t->heap[child + 1], dir);
+
+         if (right_key < child_key) {
+            child++;
+            child_key = right_key;
+         }
+      }
+      if (key <= child_key)
+         break;
+      top_place(t, dir, i, t->heap[child]);
+      i = child;
+   }
+   top_place(t, dir, i, b);
+}
+
+void hosts_top_update(struct bucket *b) {
+   unsigned int d;
+
+   for (d = 0; d < NUM_SORTS; d++) {
+      const enum sort_dir dir = (enum sort_dir)d;
+      struct top *t = &tops[d];
+      const unsigned int pos = b->u.host.top_pos[d];
+
+      if (pos != 0)
+         top_sift_down(t, dir, pos - 1);
+      else if (t->n < TOP_HOSTS) {
+         t->heap[t->n] = b;
+         top_sift_up(t, dir, t->n++);
+      } else if (bucket_sort_key(b, dir) >
+                 bucket_sort_key(t->heap[0], dir)) {
+         t->heap[0]->u.host.top_pos[d] = 0;
+         top_place(t, dir, 0, b);
+         top_sift_down(t, dir, 0);
+      }
+   }
+}
+
+void hosts_top_clear(void) {
+   unsigned int d;
+
+   for (d = 0; d < NUM_SORTS; d++)
+      tops[d].n = 0;
+}
+
+unsigned int hosts_top_list(const struct bucket **table,
+   const enum sort_dir dir) {
+   const struct top *t = &tops[dir];
+   unsigned int i;
+
+   assert((unsigned int)dir < NUM_SORTS);
+   for (i = 0; i < t->n; i++)
+      table[i] = t->heap[i];
+   return t->n;
+}
+
+/* vim:set ts=3 sw=3 tw=78 expandtab: */
@@ -11,12 +11,18 @@
 #include "cdefs.h"
 #include "config.h"
 #include "conv.h"
+#include "db.h"
+#include "dns.h"
 #include "err.h"
+#include "event.h"
 #include "graph_db.h"
 #include "hosts_db.h"
 #include "http.h"
+#include "metrics.h"
 #include "now.h"
 #include "queue.h"
+#include "sensor.h"
+#include "snapshot.h"
 #include "str.h"
 
 #include <sys/uio.h>
@@ -28,6 +34,7 @@
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
@@ -43,12 +50,24 @@ static int http_base_len = 0;
 static const char mime_type_xml[] = "text/xml";
 static const char mime_type_html[] = "text/html; charset=us-ascii";
 static const char mime_type_text_prometheus[] = "text/plain; version=0.0.4";
+static const char mime_type_json[] = "application/json";
 static const char mime_type_css[] = "text/css";
 static const char mime_type_js[] = "text/javascript";
 static const char mime_type_png[] = "image/png";
+static const char mime_type_octet_stream[] = "application/octet-stream";
 static const char encoding_identity[] = "identity";
 static const char encoding_gzip[] = "gzip";
 
+/* Pages, for how long they take to render on /metrics. */
+enum page { PAGE_FRONT, PAGE_HOSTS, PAGE_HOSTS_JSON, PAGE_GRAPHS_XML,
+    PAGE_METRICS, PAGE_DELTA, PAGE_STATIC, NUM_PAGES };
+static const char *const page_label[NUM_PAGES] = {
+    "page=\"front\"", "page=\"hosts\"", "page=\"hosts.json\"",
+    "page=\"graphs.xml\"", "page=\"metrics\"", "page=\"delta\"",
+    "page=\"static\""
+};
+static struct histogram page_nsec[NUM_PAGES]; /* zero is HISTOGRAM_NSEC */
+
 static const char server[] = PACKAGE_NAME "/" PACKAGE_VERSION;
 static int idletime = 60;
 #define MAX_REQUEST_LENGTH 4000
@@ -64,34 +83,120 @@ struct connection {
     time_t last_active_mono;
     enum {
         RECV_REQUEST,          /* receiving request */
+        RENDER,                /* waiting for the page to be generated */
         SEND_HEADER_AND_REPLY, /* try to send header+reply together */
         SEND_HEADER,           /* sending generated header */
         SEND_REPLY,            /* sending reply */
         DONE                   /* conn closed, need to remove from queue */
         } state;
 
-    /* char request[request_length+1] is null-terminated */
+    /* char request[request_length+1] is null-terminated, and can hold the
+     * start of the next request, pipelined after this one
+     */
     char *request;
     size_t request_length;
-    int accept_gzip;
+    int accept_gzip, http10;
+    int keepalive; /* wait for another request after this one */
 
     /* request fields */
     char *method, *uri, *query; /* query can be NULL */
 
+    /* the page being generated for us, if any */
+    struct render *render;
+    LIST_ENTRY(connection) render_entries;
+
     char *header;
     const char *mime_type, *encoding, *header_extra;
+    const char *etag; /* quoted, or NULL for none */
     size_t header_length, header_sent;
     int header_dont_free, header_only, http_code;
 
     char *reply;
     int reply_dont_free;
     size_t reply_length, reply_sent;
+    int streaming; /* the reply is sent as it's generated */
 
     unsigned int total_sent; /* header + body = total, for logging */
+
+    LIST_ENTRY(connection) idle_entries; /* in the idle wheel */
+    int in_wheel;
+    time_t expires_mono;
 };
 
+/* Connections in progress.  Once they're DONE they move to donelist, and
+ * are freed by http_poll(), after the event handlers have all run.  Up to
+ * CONN_FREE_MAX freed connections are kept on freelist for reuse.
+ */
 static LIST_HEAD(conn_list_head, connection) connlist =
     LIST_HEAD_INITIALIZER(conn_list_head);
+static struct conn_list_head donelist = LIST_HEAD_INITIALIZER(conn_list_head);
+static struct conn_list_head freelist = LIST_HEAD_INITIALIZER(conn_list_head);
+static unsigned int freelist_length = 0;
+#define CONN_FREE_MAX 64
+
+/* Idle connections are timed out by a wheel of one list per second, of the
+ * connections that expire in that second.  idletime is shorter than the
+ * wheel, so everything in a slot expires at the same time.
+ */
+#define IDLE_WHEEL 64
+#define IDLE_SLOT(t) (&idle_wheel[(uint64_t)(t) % IDLE_WHEEL])
+static LIST_HEAD(idle_slot_head, connection) idle_wheel[IDLE_WHEEL];
+static time_t idle_next; /* the first second not yet timed out */
+static int idle_started = 0;
+
+/* Pages that need hosts_db or the graphs are generated in a snapshot child,
+ * so however long that takes, capture carries on.  Up to RENDER_MAX at once,
+ * and the rest wait their turn.  Requests for a page that's already on its
+ * way wait for that one instead of starting another.
+ */
+#define RENDER_MAX 4
+
+struct render {
+    LIST_ENTRY(render) entries; /* in renders */
+    LIST_HEAD(render_conn_head, connection) conns; /* waiting for the page */
+    enum page page;
+    char *url, *query; /* query can be NULL */
+    int gzip;
+    int started;
+    unsigned int generation; /* of the data, once started */
+    struct timespec start;
+};
+
+static LIST_HEAD(render_list_head, render) renders =
+    LIST_HEAD_INITIALIZER(render_list_head);
+static unsigned int render_running = 0;
+
+/* Generated pages are kept until the data changes, which graph_rotate()
+ * does once a second, so a page polled by many clients is only generated
+ * once per tick.  /metrics is always fresh.
+ */
+#define CACHE_ENTRIES 16
+
+struct cache_entry {
+    enum page page;
+    char *url, *query; /* url is NULL if the entry is unused */
+    int gzip;     /* whether it was asked for */
+    int gzipped;  /* whether the reply is */
+    unsigned int generation;
+    unsigned int last_used;
+    char *reply;
+    size_t reply_length;
+};
+
+static struct cache_entry cache[CACHE_ENTRIES];
+static unsigned int cache_clock = 0;
+
+/* What a snapshot child sends back, followed by dns_length bytes of
+ * addresses for dns_queue(), then the reply.
+ */
+struct rendered {
+    int found;
+    int gzip;
+    int streamed; /* the child sent the reply itself */
+    size_t dns_length, reply_length;
+};
+
+static void render_cancel(struct connection *conn);
 
 struct bindaddr_entry {
     STAILQ_ENTRY(bindaddr_entry) entries;
@@ -264,25 +369,22 @@ static char *make_safe_uri(char *uri)
 }
 
 /* ---------------------------------------------------------------------------
- * Allocate and initialize an empty connection.
+ * Start a connection's request and reply afresh, without freeing anything.
  */
-static struct connection *new_connection(void)
+static void request_init(struct connection *conn)
 {
-    struct connection *conn = xmalloc(sizeof(*conn));
-
-    conn->socket = -1;
-    memset(&conn->client, 0, sizeof(conn->client));
-    conn->last_active_mono = now_mono();
-    conn->request = NULL;
-    conn->request_length = 0;
     conn->accept_gzip = 0;
+    conn->http10 = 0;
+    conn->keepalive = 0;
     conn->method = NULL;
     conn->uri = NULL;
     conn->query = NULL;
+    conn->render = NULL;
     conn->header = NULL;
     conn->mime_type = NULL;
     conn->encoding = NULL;
     conn->header_extra = "";
+    conn->etag = NULL;
     conn->header_length = 0;
     conn->header_sent = 0;
     conn->header_dont_free = 0;
@@ -292,7 +394,43 @@ static struct connection *new_connection(void)
     conn->reply_dont_free = 0;
     conn->reply_length = 0;
     conn->reply_sent = 0;
+    conn->streaming = 0;
     conn->total_sent = 0;
+}
+
+/* Free what the request and its reply were using. */
+static void request_free(struct connection *conn)
+{
+    free(conn->method);
+    free(conn->uri);
+    free(conn->query);
+    if (!conn->header_dont_free)
+        free(conn->header);
+    if (!conn->reply_dont_free)
+        free(conn->reply);
+}
+
+/* ---------------------------------------------------------------------------
+ * Allocate, or reuse, and initialize an empty connection.
+ */
+static struct connection *new_connection(void)
+{
+    struct connection *conn = LIST_FIRST(&freelist);
+
+    if (conn != NULL) {
+        LIST_REMOVE(conn, entries);
+        freelist_length--;
+    } else
+        conn = xmalloc(sizeof(*conn));
+
+    conn->socket = -1;
+    memset(&conn->client, 0, sizeof(conn->client));
+    conn->last_active_mono = now_mono();
+    conn->request = NULL;
+    conn->request_length = 0;
+    request_init(conn);
+    conn->in_wheel = 0;
+    conn->expires_mono = 0;
 
     /* Make it harmless so it gets garbage-collected if it should, for some
      * reason, fail to be correctly filled out.
@@ -304,6 +442,72 @@ static struct connection *new_connection(void)
 
 
 
+/* ---------------------------------------------------------------------------
+ * Note activity on a connection, and push back its timeout.
+ */
+static void conn_touch(struct connection *conn)
+{
+    const time_t expires = now_mono() + idletime;
+
+    conn->last_active_mono = now_mono();
+    if (conn->in_wheel) {
+        if (conn->expires_mono == expires)
+            return;
+        LIST_REMOVE(conn, idle_entries);
+    }
+    conn->expires_mono = expires;
+    LIST_INSERT_HEAD(IDLE_SLOT(expires), conn, idle_entries);
+    conn->in_wheel = 1;
+}
+
+static void accept_event(void *arg);
+static void conn_event(void *arg);
+
+/* ---------------------------------------------------------------------------
+ * Wait for whatever the connection needs next, or retire it once it's done.
+ */
+static void conn_update(struct connection *conn)
+{
+    int events = 0;
+
+    switch (conn->state)
+    {
+    case RECV_REQUEST:
+        events = EVENT_READ;
+        break;
+
+    case RENDER:
+        /* Nothing to do with the socket until the page is ready. */
+        event_set(conn->socket, 0, NULL, NULL);
+        return;
+
+    case SEND_HEADER_AND_REPLY:
+    case SEND_HEADER:
+    case SEND_REPLY:
+        events = EVENT_WRITE;
+        break;
+
+    case DONE:
+        break;
+
+    default: errx(1, "invalid state");
+    }
+    if (events != 0 && event_set(conn->socket, events, conn_event, conn) == 0)
+        return;
+
+    /* Done, or it can't be waited on. */
+    conn->state = DONE;
+    event_set(conn->socket, 0, NULL, NULL);
+    if (conn->render != NULL)
+        render_cancel(conn);
+    if (conn->in_wheel) {
+        LIST_REMOVE(conn, idle_entries);
+        conn->in_wheel = 0;
+    }
+    LIST_REMOVE(conn, entries);
+    LIST_INSERT_HEAD(&donelist, conn, entries);
+}
+
 /* ---------------------------------------------------------------------------
  * Accept a connection from sockin and add it to the connection queue.
  */
@@ -328,6 +532,7 @@ static void accept_connection(const int sockin)
     }
 
     fd_set_nonblock(sock);
+    snapshot_fd_add(sock);
 
     /* allocate and initialise struct connection */
     conn = new_connection();
@@ -335,6 +540,8 @@ static void accept_connection(const int sockin)
     conn->state = RECV_REQUEST;
     memcpy(&conn->client, &addrin, sizeof(conn->client));
     LIST_INSERT_HEAD(&connlist, conn, entries);
+    conn_touch(conn);
+    conn_update(conn);
 
     getnameinfo((struct sockaddr *) &addrin, sin_size,
             ipaddr, sizeof(ipaddr), portstr, sizeof(portstr),
@@ -350,16 +557,12 @@ static void accept_connection(const int sockin)
 static void free_connection(struct connection *conn)
 {
     dverbosef("free_connection(%d)", conn->socket);
-    if (conn->socket != -1)
+    if (conn->socket != -1) {
+        snapshot_fd_remove(conn->socket);
         close(conn->socket);
+    }
     free(conn->request);
-    free(conn->method);
-    free(conn->uri);
-    free(conn->query);
-    if (!conn->header_dont_free)
-        free(conn->header);
-    if (!conn->reply_dont_free)
-        free(conn->reply);
+    request_free(conn);
 }
 
 
@@ -379,35 +582,53 @@ static char *rfc1123_date(char *dest, time_t when) {
 static void generate_header(struct connection *conn,
     const int code, const char *text)
 {
-    char date[DATE_LEN];
+    char date[DATE_LEN], length[40];
 
     assert(conn->header == NULL);
     assert(conn->mime_type != NULL);
     if (conn->encoding == NULL)
         conn->encoding = encoding_identity;
 
-    verbosef("http: %d %s (%s: %zu bytes)",
-             code,
-             text,
-             conn->encoding,
-             conn->reply_length);
+    if (!conn->streaming) {
+        verbosef("http: %d %s (%s: %zu bytes)",
+                 code,
+                 text,
+                 conn->encoding,
+                 conn->reply_length);
+        snprintf(length, sizeof(length), "Content-Length: %llu\r\n",
+            (llu)conn->reply_length);
+    } else {
+        verbosef("http: %d %s (%s: streaming)", code, text, conn->encoding);
+        /* An HTTP/1.0 client reads until we close. */
+        snprintf(length, sizeof(length), "%s",
+            conn->http10 ? "" : "Transfer-Encoding: chunked\r\n");
+    }
+    if (conn->streaming)
+        conn->keepalive = 0; /* the end of the reply is when we close */
     conn->header_length = xasprintf(&(conn->header),
         "HTTP/1.1 %d %s\r\n"
         "Date: %s\r\n"
         "Server: %s\r\n"
         "Vary: Accept-Encoding\r\n"
         "Content-Type: %s\r\n"
-        "Content-Length: %qu\r\n"
+        "%s"
         "Content-Encoding: %s\r\n"
+        "%s%s%s"
         "X-Robots-Tag: noindex, noarchive\r\n"
         "%s"
+        "%s"
         "\r\n",
         code, text,
         rfc1123_date(date, now_real()),
         server,
         conn->mime_type,
-        (qu)conn->reply_length,
+        length,
         conn->encoding,
+        conn->etag ? "ETag: " : "",
+        conn->etag ? conn->etag : "",
+        conn->etag ? "\r\n" : "",
+        !conn->keepalive ? "Connection: close\r\n" :
+            conn->http10 ? "Connection: keep-alive\r\n" : "",
         conn->header_extra);
     conn->http_code = code;
 }
@@ -489,7 +710,7 @@ static char *parse_field(const struct connection *conn, const char *field)
 static int parse_request(struct connection *conn)
 {
     size_t bound1, bound2, mid;
-    char *accept_enc;
+    char *accept_enc, *connection;
 
     /* parse method */
     for (bound1 = 0; bound1 < conn->request_length &&
@@ -512,6 +733,11 @@ static int parse_request(struct connection *conn)
         conn->request[bound2] != '\r'; bound2++)
             ;
 
+    /* note an HTTP/1.0 client, which can't take a chunked reply */
+    if (conn->request_length - bound2 >= 9 &&
+        memcmp(conn->request + bound2, " HTTP/1.0", 9) == 0)
+        conn->http10 = 1;
+
     /* find query string */
     for (mid=bound1; mid<bound2 && conn->request[mid] != '?'; mid++)
         ;
@@ -530,10 +756,173 @@ static int parse_request(struct connection *conn)
             conn->accept_gzip = 1;
         free(accept_enc);
     }
+
+    /* HTTP/1.1 connections persist unless the client says otherwise, and
+     * HTTP/1.0 ones only if it asks.
+     */
+    conn->keepalive = !conn->http10;
+    connection = parse_field(conn, "Connection: ");
+    if (connection != NULL) {
+        strntoupper(connection, strlen(connection));
+        if (strstr(connection, "CLOSE") != NULL)
+            conn->keepalive = 0;
+        else if (strstr(connection, "KEEP-ALIVE") != NULL)
+            conn->keepalive = 1;
+        free(connection);
+    }
+    return (1);
+}
+
+/* ---------------------------------------------------------------------------
+ * gzip.  Dynamic pages are generated for every request, so they're
+ * compressed at gzip_level, which is cheap by default, using one stream that
+ * is reset between pages rather than set up again.  Static pages never
+ * change, so each is compressed once, as hard as possible, and the result
+ * is served from then on.
+ */
+static int gzip_level = Z_BEST_SPEED;
+static z_stream gzip_zs;
+static int gzip_zs_ready = 0;
+
+void http_set_gzip_level(const int level)
+{
+    assert(level >= 0 && level <= Z_BEST_COMPRESSION);
+    gzip_level = level;
+}
+
+static int
+gzip_init(z_stream *zs, const int level)
+{
+    zs->zalloc = Z_NULL;
+    zs->zfree = Z_NULL;
+    zs->opaque = Z_NULL;
+
+    return (deflateInit2(zs,
+                         level,
+                         Z_DEFLATED,
+                         15+16, /* 15 = biggest window,
+                                   16 = add gzip header+trailer */
+                         8 /* default */,
+                         Z_DEFAULT_STRATEGY) == Z_OK);
+}
+
+/* The stream for dynamic pages, ready for a new one, or NULL if they
+ * aren't compressed.
+ */
+static z_stream *
+gzip_stream(void)
+{
+    if (gzip_level == 0)
+        return (NULL);
+    if (!gzip_zs_ready) {
+        if (!gzip_init(&gzip_zs, gzip_level))
+            return (NULL);
+        gzip_zs_ready = 1;
+    } else if (deflateReset(&gzip_zs) != Z_OK)
+        return (NULL);
+    return (&gzip_zs);
+}
+
+/* Compress len bytes of data, or return NULL if that fails. */
+static struct str *
+gzip_buf(z_stream *zs, const char *data, const size_t len)
+{
+    struct str *out = str_make();
+    unsigned char buf[65536];
+    int ret;
+
+    zs->next_in = (unsigned char *)data;
+    zs->avail_in = len;
+    do {
+        zs->next_out = buf;
+        zs->avail_out = sizeof(buf);
+        ret = deflate(zs, Z_FINISH);
+        if (ret != Z_OK && ret != Z_STREAM_END) {
+            verbosef("failed to compress %zu bytes", len);
+            str_free(out);
+            return (NULL);
+        }
+        str_appendn(out, (char *)buf, sizeof(buf) - zs->avail_out);
+    } while (ret != Z_STREAM_END);
+    return (out);
+}
+
+/* ---------------------------------------------------------------------------
+ * gzip a dynamic reply in place, if possible.  Returns 1 if it did.  Don't
+ * bother with a minimum length requirement, I've never seen a page fail to
+ * compress.
+ */
+static int
+gzip_reply(char **reply, size_t *len)
+{
+    z_stream *zs;
+    struct str *out;
+
+    if ((zs = gzip_stream()) == NULL)
+        return (0);
+    if ((out = gzip_buf(zs, *reply, *len)) == NULL)
+        return (0);
+    free(*reply);
+    str_extract(out, len, reply);
     return (1);
 }
 
-/* FIXME: maybe we need a smarter way of doing static pages: */
+/* ---------------------------------------------------------------------------
+ * Static pages, and their gzipped copies.  Both are made by the build, along
+ * with a strong ETag for each, so a browser that already has the page gets
+ * a 304 instead of it again.
+ */
+struct static_page {
+    const char *data, *etag;
+    size_t length;
+    const char *gzip_data, *gzip_etag; /* NULL for no point, like a PNG */
+    size_t gzip_length;
+    const char *mime_type;
+};
+
+/* Whether an If-None-Match list has the given ETag in it. */
+static int
+etag_matches(const char *list, const char *etag)
+{
+    const size_t len = strlen(etag);
+    const char *p;
+
+    if (strcmp(list, "*") == 0)
+        return (1);
+    /* A weak W/ prefix still matches, as it's only for a conditional GET. */
+    for (p = strstr(list, etag); p != NULL; p = strstr(p + 1, etag))
+        if (p[len] == '\0' || p[len] == ',' || p[len] == ' ')
+            return (1);
+    return (0);
+}
+
+static void
+static_reply(struct connection *conn, const struct static_page *page)
+{
+    char *if_none_match;
+
+    conn->mime_type = page->mime_type;
+    conn->reply_dont_free = 1;
+    if (page->gzip_data != NULL && conn->accept_gzip) {
+        conn->reply = (char *)page->gzip_data;
+        conn->reply_length = page->gzip_length;
+        conn->encoding = encoding_gzip;
+        conn->etag = page->gzip_etag;
+    } else {
+        conn->reply = (char *)page->data;
+        conn->reply_length = page->length;
+        conn->etag = page->etag;
+    }
+
+    if_none_match = parse_field(conn, "If-None-Match: ");
+    if (if_none_match != NULL && etag_matches(if_none_match, conn->etag)) {
+        /* Same headers as a 200, Content-Length included, but no body. */
+        conn->header_only = 1;
+        generate_header(conn, 304, "Not Modified");
+    } else
+        generate_header(conn, 200, "OK");
+    free(if_none_match);
+}
 
 /* ---------------------------------------------------------------------------
  * Web interface: static stylesheet.
@@ -542,11 +931,14 @@ static void
 static_style_css(struct connection *conn)
 {
 #include "stylecss.h"
-
-    conn->reply = (char*)style_css;
-    conn->reply_length = style_css_len;
-    conn->reply_dont_free = 1;
-    conn->mime_type = mime_type_css;
+#include "stylecssgz.h"
+    const struct static_page page = {
+        style_css, style_css_etag, style_css_len,
+        (const char *)style_css_gz, style_css_gz_etag, sizeof(style_css_gz),
+        mime_type_css
+    };
+
+    static_reply(conn, &page);
 }
 
 /* ---------------------------------------------------------------------------
@@ -556,11 +948,14 @@ static void
 static_graph_js(struct connection *conn)
 {
 #include "graphjs.h"
-
-    conn->reply = (char*)graph_js;
-    conn->reply_length = graph_js_len;
-    conn->reply_dont_free = 1;
-    conn->mime_type = mime_type_js;
+#include "graphjsgz.h"
+    const struct static_page page = {
+        graph_js, graph_js_etag, graph_js_len,
+        (const char *)graph_js_gz, graph_js_gz_etag, sizeof(graph_js_gz),
+        mime_type_js
+    };
+
+    static_reply(conn, &page);
 }
 
 /* ---------------------------------------------------------------------------
@@ -570,66 +965,491 @@ static void
 static_favicon(struct connection *conn)
 {
 #include "favicon.h"
+    const struct static_page page = {
+        (const char *)favicon_png, favicon_png_etag, sizeof(favicon_png),
+        NULL, NULL, 0,
+        mime_type_png
+    };
 
-    conn->reply = (char*)favicon_png;
-    conn->reply_length = sizeof(favicon_png);
-    conn->reply_dont_free = 1;
-    conn->mime_type = mime_type_png;
+    static_reply(conn, &page);
 }
 
 /* ---------------------------------------------------------------------------
- * gzip a reply, if requested and possible.  Don't bother with a minimum
- * length requirement, I've never seen a page fail to compress.
+ * The header and reply are ready: start sending them.
  */
-static void
-process_gzip(struct connection *conn)
+static void start_reply(struct connection *conn)
 {
-    char *buf;
-    size_t len;
-    z_stream zs;
+    if (conn->header_only)
+        conn->state = SEND_HEADER;
+    else
+        conn->state = SEND_HEADER_AND_REPLY;
+}
 
-    if (!conn->accept_gzip)
-        return;
+/* ---------------------------------------------------------------------------
+ * Generate the page, gzipped if asked for.  Returns 0 if there's no such
+ * page.
+ */
+static int render_page(const struct render *r, char **reply, size_t *len,
+    int *gzipped)
+{
+    struct str *buf;
+
+    switch (r->page)
+    {
+    case PAGE_FRONT:
+        buf = html_front_page();
+        break;
+
+    case PAGE_HOSTS:
+        /* FIXME here - make this saner */
+        buf = html_hosts(r->url, r->query);
+        break;
 
-    buf = xmalloc(conn->reply_length);
-    len = conn->reply_length;
+    case PAGE_HOSTS_JSON:
+        buf = json_hosts(r->query);
+        break;
 
-    zs.zalloc = Z_NULL;
-    zs.zfree = Z_NULL;
-    zs.opaque = Z_NULL;
+    case PAGE_GRAPHS_XML:
+        buf = xml_graphs(r->query);
+        break;
 
-    if (deflateInit2(&zs,
-                     Z_BEST_COMPRESSION,
-                     Z_DEFLATED,
-                     15+16, /* 15 = biggest window,
-                               16 = add gzip header+trailer */
-                     8 /* default */,
-                     Z_DEFAULT_STRATEGY) != Z_OK) {
-        free(buf);
+    case PAGE_METRICS:
+        buf = text_metrics(r->query);
+        break;
+
+    case PAGE_DELTA:
+        buf = sensor_delta(r->query);
+        break;
+
+    default: errx(1, "invalid page");
+    }
+    if (buf == NULL)
+        return (0);
+    str_extract(buf, len, reply);
+    *gzipped = r->gzip && gzip_reply(reply, len);
+    return (1);
+}
+
+/* ---------------------------------------------------------------------------
+ * Reply with a copy of a generated page, or 404 if there was none.
+ */
+static void reply_with_page(struct connection *conn, const int found,
+    const char *reply, const size_t len, const int gzipped)
+{
+    if (found) {
+        conn->reply = xmalloc(len);
+        memcpy(conn->reply, reply, len);
+        conn->reply_length = len;
+        conn->encoding = gzipped ? encoding_gzip : encoding_identity;
+        generate_header(conn, 200, "OK");
+    } else
+        default_reply(conn, 404, "Not Found",
+            "The page you requested could not be found.");
+}
+
+/* ---------------------------------------------------------------------------
+ * The page cache.
+ */
+static int same_page(const enum page page_a, const char *url_a,
+    const char *query_a, const int gzip_a, const enum page page_b,
+    const char *url_b, const char *query_b, const int gzip_b)
+{
+    if (page_a != page_b || gzip_a != gzip_b || strcmp(url_a, url_b) != 0)
+        return (0);
+    if (query_a == NULL || query_b == NULL)
+        return (query_a == query_b);
+    return (strcmp(query_a, query_b) == 0);
+}
+
+static void cache_clear(struct cache_entry *e)
+{
+    free(e->url);
+    free(e->query);
+    free(e->reply);
+    e->url = NULL;
+    e->query = NULL;
+    e->reply = NULL;
+}
+
+/* Returns the page if it's still current, or NULL. */
+static struct cache_entry *cache_find(const enum page page, const char *url,
+    const char *query, const int gzip)
+{
+    unsigned int i;
+
+    for (i = 0; i < CACHE_ENTRIES; i++) {
+        struct cache_entry *e = &cache[i];
+
+        if (e->url == NULL ||
+            !same_page(e->page, e->url, e->query, e->gzip,
+                       page, url, query, gzip))
+            continue;
+        if (e->generation != graph_generation()) {
+            cache_clear(e); /* stale */
+            return (NULL);
+        }
+        e->last_used = ++cache_clock;
+        return (e);
+    }
+    return (NULL);
+}
+
+/* Keep the page that r generated, taking over reply. */
+static void cache_store(const struct render *r, char *reply, const size_t len,
+    const int gzipped)
+{
+    struct cache_entry *e = NULL;
+    unsigned int i;
+
+    if (r->generation != graph_generation()) {
+        free(reply); /* already stale */
         return;
     }
+    /* Replace an unused or stale entry, or else the least recently used. */
+    for (i = 0; i < CACHE_ENTRIES; i++) {
+        struct cache_entry *c = &cache[i];
 
-    zs.avail_in = conn->reply_length;
-    zs.next_in = (unsigned char *)conn->reply;
+        if (c->url == NULL || c->generation != graph_generation()) {
+            e = c;
+            break;
+        }
+        if (e == NULL || c->last_used < e->last_used)
+            e = c;
+    }
+    cache_clear(e);
+    e->page = r->page;
+    e->url = xstrdup(r->url);
+    e->query = (r->query == NULL) ? NULL : xstrdup(r->query);
+    e->gzip = r->gzip;
+    e->gzipped = gzipped;
+    e->generation = r->generation;
+    e->last_used = ++cache_clock;
+    e->reply = reply;
+    e->reply_length = len;
+}
 
-    zs.avail_out = conn->reply_length;
-    zs.next_out = (unsigned char *)buf;
+/* ---------------------------------------------------------------------------
+ * Streaming a reply from the snapshot child, which has the socket to itself
+ * until it exits.  /metrics can be huge, so it's sent a piece at a time, as
+ * it's generated and compressed, in chunks.
+ */
+#define STREAM_CHUNK 65536
 
-    if (deflate(&zs, Z_FINISH) != Z_STREAM_END) {
-        deflateEnd(&zs);
+struct stream {
+    struct connection *conn;
+    z_stream *zs; /* NULL if not compressing */
+    unsigned char out[STREAM_CHUNK];
+};
+
+/* Send all of iov, waiting for the socket to drain.  Returns 0 on failure. */
+static int stream_send(struct connection *conn, struct iovec *iov, int iovcnt)
+{
+    while (iovcnt > 0) {
+        ssize_t sent = writev(conn->socket, iov, iovcnt);
+
+        if (sent == -1) {
+            struct pollfd pfd;
+            int ret;
+
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                verbosef("writev(%d) error: %s",
+                    conn->socket, strerror(errno));
+                return (0);
+            }
+            pfd.fd = conn->socket;
+            pfd.events = POLLOUT;
+            ret = poll(&pfd, 1, idletime * 1000);
+            if (ret == 0) {
+                verbosef("http socket timeout while streaming (fd %d)",
+                    conn->socket);
+                return (0);
+            }
+            if (ret == -1 && errno != EINTR)
+                return (0);
+            continue;
+        }
+        conn->total_sent += (unsigned int)sent;
+        while (iovcnt > 0 && (size_t)sent >= iov->iov_len) {
+            sent -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + sent;
+            iov->iov_len -= sent;
+        }
+    }
+    return (1);
+}
+
+/* Send a piece of the body, as a chunk unless the client is HTTP/1.0. */
+static int stream_chunk(struct connection *conn, const void *buf,
+    const size_t len)
+{
+    char size[24];
+    struct iovec iov[3];
+
+    if (len == 0)
+        return (1); /* that would be the last chunk */
+    iov[0].iov_base = size;
+    iov[0].iov_len = (size_t)snprintf(size, sizeof(size), "%zx\r\n", len);
+    iov[1].iov_base = (void *)buf;
+    iov[1].iov_len = len;
+    iov[2].iov_base = (void *)"\r\n";
+    iov[2].iov_len = 2;
+    if (conn->http10)
+        return (stream_send(conn, &iov[1], 1));
+    return (stream_send(conn, iov, 3));
+}
+
+/* Compress what's waiting, sending the output as it fills up. */
+static int stream_deflate(struct stream *st, const int flush)
+{
+    int ret;
+
+    do {
+        st->zs->next_out = st->out;
+        st->zs->avail_out = sizeof(st->out);
+        ret = deflate(st->zs, flush);
+        if (ret == Z_STREAM_ERROR)
+            return (0);
+        if (!stream_chunk(st->conn, st->out,
+                sizeof(st->out) - st->zs->avail_out))
+            return (0);
+    } while (st->zs->avail_out == 0 ||
+             (flush == Z_FINISH && ret != Z_STREAM_END));
+    return (1);
+}
+
+/* Takes each piece of the page from text_metrics_stream(). */
+static int stream_out(void *arg, const char *s, size_t len)
+{
+    struct stream *st = arg;
+
+    if (st->zs == NULL)
+        return (stream_chunk(st->conn, s, len));
+    st->zs->next_in = (unsigned char *)s;
+    st->zs->avail_in = len;
+    return (stream_deflate(st, Z_NO_FLUSH));
+}
+
+static int render_stream(struct connection *conn)
+{
+    struct stream *st = xmalloc(sizeof(*st));
+    struct iovec iov;
+    int ok;
+
+    st->conn = conn;
+    st->zs = conn->accept_gzip ? gzip_stream() : NULL;
+    conn->encoding = (st->zs != NULL) ? encoding_gzip : encoding_identity;
+    conn->streaming = 1;
+    generate_header(conn, 200, "OK");
+
+    iov.iov_base = conn->header;
+    iov.iov_len = conn->header_length;
+    ok = stream_send(conn, &iov, 1);
+    if (ok && !conn->header_only) {
+        ok = text_metrics_stream(conn->query, stream_out, st);
+        if (ok && st->zs != NULL)
+            ok = stream_deflate(st, Z_FINISH);
+        if (ok && !conn->http10) {
+            iov.iov_base = (void *)"0\r\n\r\n";
+            iov.iov_len = 5;
+            ok = stream_send(conn, &iov, 1);
+        }
+    }
+    free(st);
+    if (ok)
+        verbosef("http: streamed %u bytes", conn->total_sent);
+    return (ok);
+}
+
+/* ---------------------------------------------------------------------------
+ * Runs in the snapshot child: generate the page and send it back, or for
+ * /metrics, send it to the client directly.
+ */
+static int render_child(void *arg, const int fd)
+{
+    const struct render *r = arg;
+    struct rendered hdr;
+    struct str *dns = str_make();
+    char *dns_buf, *reply = NULL;
+    size_t reply_length = 0;
+
+    memset(&hdr, 0, sizeof(hdr));
+    dns_defer(dns);
+    if (r->page == PAGE_METRICS) {
+        /* Whether or not it worked, there's nothing for the parent to
+         * send.
+         */
+        render_stream(LIST_FIRST(&r->conns));
+        hdr.streamed = 1;
+    } else
+        hdr.found = render_page(r, &reply, &reply_length, &hdr.gzip);
+    hdr.reply_length = hdr.found ? reply_length : 0;
+    str_extract(dns, &hdr.dns_length, &dns_buf);
+    return (writen(fd, &hdr, sizeof(hdr)) &&
+            writen(fd, dns_buf, hdr.dns_length) &&
+            writen(fd, reply, hdr.reply_length));
+}
+
+static void render_next(void);
+
+static void render_free(struct render *r)
+{
+    assert(LIST_FIRST(&r->conns) == NULL);
+    LIST_REMOVE(r, entries);
+    free(r->url);
+    free(r->query);
+    free(r);
+}
+
+/* Take the next connection waiting for r, or NULL. */
+static struct connection *render_take(struct render *r)
+{
+    struct connection *conn = LIST_FIRST(&r->conns);
+
+    if (conn != NULL) {
+        LIST_REMOVE(conn, render_entries);
+        conn->render = NULL;
+    }
+    return (conn);
+}
+
+/* ---------------------------------------------------------------------------
+ * The page has been generated, or not found.  Reply to everyone who wanted
+ * it, keep it for whoever wants it next, and free r.
+ */
+static void render_finish(struct render *r, const int found, char *reply,
+    const size_t len, const int gzipped)
+{
+    struct connection *conn;
+
+    if (found)
+        histogram_add(&page_nsec[r->page], (uint64_t)timer_nsec(&r->start));
+    while ((conn = render_take(r)) != NULL) {
+        reply_with_page(conn, found, reply, len, gzipped);
+        start_reply(conn);
+        conn_touch(conn);
+        conn_update(conn);
+    }
+    if (found)
+        cache_store(r, reply, len, gzipped);
+    else
+        free(reply);
+    render_free(r);
+}
+
+/* ---------------------------------------------------------------------------
+ * The snapshot child is done: queue the lookups it wanted, and reply with
+ * its page.
+ */
+static void render_done(void *arg, char *buf, size_t len, int ok)
+{
+    struct render *r = arg;
+    struct connection *conn;
+    struct rendered hdr;
+
+    assert(render_running > 0);
+    render_running--;
+    if (ok && len >= sizeof(hdr))
+        memcpy(&hdr, buf, sizeof(hdr));
+    else
+        ok = 0;
+    if (ok && len != sizeof(hdr) + hdr.dns_length + hdr.reply_length)
+        ok = 0;
+
+    if (ok) {
+        size_t pos;
+
+        for (pos = 0; pos + sizeof(struct addr) <= hdr.dns_length;
+             pos += sizeof(struct addr)) {
+            struct addr a;
+
+            memcpy(&a, buf + sizeof(hdr) + pos, sizeof(a));
+            dns_queue(&a);
+        }
+    }
+    if (r->page == PAGE_METRICS) {
+        /* The child has been talking to the client itself, if it's still
+         * there.
+         */
         free(buf);
-        verbosef("failed to compress %zu bytes", len);
+        if ((conn = render_take(r)) != NULL) {
+            if (ok && hdr.streamed)
+                histogram_add(&page_nsec[r->page],
+                    (uint64_t)timer_nsec(&r->start));
+            conn->state = DONE;
+            conn_update(conn);
+        }
+        render_free(r);
+    } else if (!ok) {
+        free(buf);
+        while ((conn = render_take(r)) != NULL) {
+            default_reply(conn, 500, "Internal Server Error",
+                "The page couldn't be generated.");
+            start_reply(conn);
+            conn_touch(conn);
+            conn_update(conn);
+        }
+        render_free(r);
+    } else {
+        memmove(buf, buf + sizeof(hdr) + hdr.dns_length, hdr.reply_length);
+        render_finish(r, hdr.found, buf, hdr.reply_length, hdr.gzip);
+    }
+    render_next();
+}
+
+/* ---------------------------------------------------------------------------
+ * Start generating a page in a snapshot child, or if there can't be one,
+ * right here.
+ */
+static void render_start(struct render *r)
+{
+    char *reply = NULL;
+    size_t len = 0;
+    int found, gzipped = 0;
+
+    r->generation = graph_generation();
+    /* A /metrics child streams straight to its connection. */
+    if (snapshot_start(render_child, render_done, r,
+            (r->page == PAGE_METRICS) ? LIST_FIRST(&r->conns)->socket : -1)
+            == 0) {
+        r->started = 1;
+        render_running++;
         return;
     }
+    found = render_page(r, &reply, &len, &gzipped);
+    render_finish(r, found, reply, len, gzipped);
+}
 
-    if (conn->reply_dont_free)
-        conn->reply_dont_free = 0;
-    else
-        free(conn->reply);
-    conn->reply = buf;
-    conn->reply_length -= zs.avail_out;
-    conn->encoding = encoding_gzip;
-    deflateEnd(&zs);
+/* Start as many waiting pages as there's room for, oldest first. */
+static void render_next(void)
+{
+    while (render_running < RENDER_MAX) {
+        struct render *r, *oldest = NULL;
+
+        LIST_FOREACH(r, &renders, entries)
+            if (!r->started)
+                oldest = r;
+        if (oldest == NULL)
+            return;
+        render_start(oldest);
+    }
+}
+
+/* The connection is going away. */
+static void render_cancel(struct connection *conn)
+{
+    struct render *r = conn->render;
+
+    LIST_REMOVE(conn, render_entries);
+    conn->render = NULL;
+    /* Once started, render_done() will free it, and keep the page. */
+    if (!r->started && LIST_FIRST(&r->conns) == NULL)
+        render_free(r);
 }
 
 /* ---------------------------------------------------------------------------
@@ -638,6 +1458,11 @@ process_gzip(struct connection *conn)
 static void process_get(struct connection *conn)
 {
     char *safe_url;
+    struct timespec t;
+    struct render *r = NULL;
+    enum page page;
+
+    timer_start(&t);
 
     verbosef("http: %s \"%s\" %s", conn->method, conn->uri,
         (conn->query == NULL)?"":conn->query);
@@ -666,63 +1491,99 @@ static void process_get(struct connection *conn)
     }
 
     if (strcmp(safe_url, "/") == 0) {
-        struct str *buf = html_front_page();
-        str_extract(buf, &(conn->reply_length), &(conn->reply));
+        page = PAGE_FRONT;
         conn->mime_type = mime_type_html;
     }
     else if (str_starts_with(safe_url, "/hosts/")) {
-        /* FIXME here - make this saner */
-        struct str *buf = html_hosts(safe_url, conn->query);
-        if (buf == NULL) {
-            default_reply(conn, 404, "Not Found",
-                "The page you requested could not be found.");
-            free(safe_url);
-            return;
-        }
-        str_extract(buf, &(conn->reply_length), &(conn->reply));
+        page = PAGE_HOSTS;
         conn->mime_type = mime_type_html;
     }
+    else if (strcmp(safe_url, "/hosts.json") == 0) {
+        page = PAGE_HOSTS_JSON;
+        conn->mime_type = mime_type_json;
+    }
     else if (str_starts_with(safe_url, "/graphs.xml")) {
-        struct str *buf = xml_graphs();
-        str_extract(buf, &(conn->reply_length), &(conn->reply));
+        page = PAGE_GRAPHS_XML;
         conn->mime_type = mime_type_xml;
         /* hack around Opera caching the XML */
         conn->header_extra = "Pragma: no-cache\r\n";
     }
     else if (str_starts_with(safe_url, "/metrics")) {
-        struct str *buf = text_metrics();
-        str_extract(buf, &(conn->reply_length), &(conn->reply));
+        page = PAGE_METRICS;
         conn->mime_type = mime_type_text_prometheus;
     }
-    else if (strcmp(safe_url, "/style.css") == 0)
-        static_style_css(conn);
-    else if (strcmp(safe_url, "/graph.js") == 0)
-        static_graph_js(conn);
-    else if (strcmp(safe_url, "/favicon.ico") == 0) {
-        /* serves a PNG instead of an ICO, might cause problems for IE6 */
-        static_favicon(conn);
-    } else {
-        default_reply(conn, 404, "Not Found",
-            "The page you requested could not be found.");
+    else if (strcmp(safe_url, "/delta") == 0) {
+        page = PAGE_DELTA; /* for a federation aggregator, see sensor.c */
+        conn->mime_type = mime_type_octet_stream;
+    }
+    else {
+        if (strcmp(safe_url, "/style.css") == 0)
+            static_style_css(conn);
+        else if (strcmp(safe_url, "/graph.js") == 0)
+            static_graph_js(conn);
+        else if (strcmp(safe_url, "/favicon.ico") == 0)
+            /* serves a PNG instead of an ICO, might cause problems for IE6 */
+            static_favicon(conn);
+        else {
+            default_reply(conn, 404, "Not Found",
+                "The page you requested could not be found.");
+            free(safe_url);
+            return;
+        }
         free(safe_url);
+        assert(conn->mime_type != NULL);
+        histogram_add(&page_nsec[PAGE_STATIC], (uint64_t)timer_nsec(&t));
         return;
     }
-    free(safe_url);
 
-    process_gzip(conn);
-    assert(conn->mime_type != NULL);
-    generate_header(conn, 200, "OK");
+    /* A page that has to be generated, unless it already has been, or is
+     * being.  /metrics is streamed to each client separately.
+     */
+    if (page != PAGE_METRICS) {
+        struct cache_entry *e = cache_find(page, safe_url, conn->query,
+            conn->accept_gzip);
+
+        if (e != NULL) {
+            free(safe_url);
+            reply_with_page(conn, 1, e->reply, e->reply_length, e->gzipped);
+            return;
+        }
+        LIST_FOREACH(r, &renders, entries)
+            if (same_page(r->page, r->url, r->query, r->gzip,
+                          page, safe_url, conn->query, conn->accept_gzip) &&
+                (!r->started || r->generation == graph_generation()))
+                break;
+    }
+    if (r == NULL) {
+        r = xmalloc(sizeof(*r));
+        LIST_INIT(&r->conns);
+        r->page = page;
+        r->url = safe_url;
+        r->query = (conn->query == NULL) ? NULL : xstrdup(conn->query);
+        r->gzip = conn->accept_gzip;
+        r->started = 0;
+        r->generation = 0;
+        r->start = t;
+        LIST_INSERT_HEAD(&renders, r, entries);
+    } else
+        free(safe_url);
+    conn->state = RENDER;
+    conn->render = r;
+    LIST_INSERT_HEAD(&r->conns, conn, render_entries);
+    render_next();
 }
 
 
 
 /* ---------------------------------------------------------------------------
- * Process a request: build the header and reply, advance state.
+ * Process a request: build the header and reply, advance state.  If the
+ * page has to be generated first, it's left in RENDER until it has been.
  */
 static void process_request(struct connection *conn)
 {
     if (!parse_request(conn))
     {
+        conn->keepalive = 0;
         default_reply(conn, 400, "Bad Request",
             "You sent a request that the server couldn't understand.");
     }
@@ -732,25 +1593,26 @@ static void process_request(struct connection *conn)
     }
     else if (strcmp(conn->method, "HEAD") == 0)
     {
-        process_get(conn);
         conn->header_only = 1;
+        process_get(conn);
     }
     else
     {
+        conn->keepalive = 0;
         default_reply(conn, 501, "Not Implemented",
             "The method you specified (%s) is not implemented.",
             conn->method);
     }
 
     /* advance state */
-    if (conn->header_only)
-        conn->state = SEND_HEADER;
-    else
-        conn->state = SEND_HEADER_AND_REPLY;
+    if (conn->state == RECV_REQUEST)
+        start_reply(conn);
 }
 
 
 
+static void process_received(struct connection *conn);
+
 /* ---------------------------------------------------------------------------
  * Receiving request.
  */
@@ -768,7 +1630,7 @@ static void poll_recv_request(struct connection *conn)
         conn->state = DONE;
         return;
     }
-    conn->last_active_mono = now_mono();
+    conn_touch(conn);
 
     /* append to conn->request */
     conn->request = xrealloc(conn->request, conn->request_length+recvd+1);
@@ -776,25 +1638,67 @@ static void poll_recv_request(struct connection *conn)
     conn->request_length += recvd;
     conn->request[conn->request_length] = 0;
 
+    process_received(conn);
+}
+
+/* ---------------------------------------------------------------------------
+ * Process the first request in conn->request, if all of it is there.  What
+ * comes after it is the next request, which waits until this one has been
+ * answered.
+ */
+static void process_received(struct connection *conn)
+{
+    char *end, *next = NULL;
+    size_t length, next_length;
+
+    if (conn->request == NULL)
+        return;
+    end = strstr(conn->request, "\r\n\r\n");
+    length = (end == NULL) ? conn->request_length
+                           : (size_t)(end + 4 - conn->request);
+
     /* die if it's too long */
-    if (conn->request_length > MAX_REQUEST_LENGTH)
+    if (length > MAX_REQUEST_LENGTH)
     {
+        conn->keepalive = 0;
         default_reply(conn, 413, "Request Entity Too Large",
             "Your request was dropped because it was too long.");
         conn->state = SEND_HEADER;
         return;
     }
+    if (end == NULL)
+        return; /* wait for the rest */
 
-    /* process request if we have all of it */
-    if (conn->request_length > 4 &&
-        memcmp(conn->request+conn->request_length-4, "\r\n\r\n", 4) == 0)
-    {
-        process_request(conn);
+    next_length = conn->request_length - length;
+    if (next_length > 0) {
+        next = xmalloc(next_length + 1);
+        memcpy(next, conn->request + length, next_length + 1);
+    }
+    conn->request[length] = '\0';
+    conn->request_length = length;
 
-        /* request not needed anymore */
-        free(conn->request);
-        conn->request = NULL; /* important: don't free it again later */
+    process_request(conn);
+
+    /* request not needed anymore */
+    free(conn->request);
+    conn->request = next;
+    conn->request_length = next_length;
+}
+
+/* ---------------------------------------------------------------------------
+ * The reply has been sent: close, or get ready for the next request.
+ */
+static void reply_done(struct connection *conn)
+{
+    if (!conn->keepalive) {
+        conn->state = DONE;
+        return;
     }
+    request_free(conn);
+    request_init(conn);
+    conn->state = RECV_REQUEST;
+    conn_touch(conn);
+    process_received(conn);
 }
 
 
@@ -821,7 +1725,7 @@ static void poll_send_header_and_reply(struct connection *conn)
     iov[1].iov_len = conn->reply_length;
 
     sent = writev(conn->socket, iov, 2);
-    conn->last_active_mono = now_mono();
+    conn_touch(conn);
 
     /* handle any errors (-1) or closure (0) in send() */
     if (sent < 1) {
@@ -851,7 +1755,7 @@ static void poll_send_header_and_reply(struct connection *conn)
     }
     /* else */
     conn->reply_sent = conn->reply_length;
-    conn->state = DONE;
+    reply_done(conn);
 }
 
 /* ---------------------------------------------------------------------------
@@ -863,7 +1767,7 @@ static void poll_send_header(struct connection *conn)
 
     sent = send(conn->socket, conn->header + conn->header_sent,
         conn->header_length - conn->header_sent, 0);
-    conn->last_active_mono = now_mono();
+    conn_touch(conn);
     dverbosef("poll_send_header(%d) sent %d bytes", conn->socket, (int)sent);
 
     /* handle any errors (-1) or closure (0) in send() */
@@ -881,7 +1785,7 @@ static void poll_send_header(struct connection *conn)
     if (conn->header_sent == conn->header_length)
     {
         if (conn->header_only)
-            conn->state = DONE;
+            reply_done(conn);
         else
             conn->state = SEND_REPLY;
     }
@@ -899,7 +1803,7 @@ static void poll_send_reply(struct connection *conn)
     sent = send(conn->socket,
         conn->reply + conn->reply_sent,
         conn->reply_length - conn->reply_sent, 0);
-    conn->last_active_mono = now_mono();
+    conn_touch(conn);
     dverbosef("poll_send_reply(%d) sent %d: [%d-%d] of %d",
         conn->socket, (int)sent,
         (int)conn->reply_sent,
@@ -920,7 +1824,7 @@ static void poll_send_reply(struct connection *conn)
     conn->total_sent += (unsigned int)sent;
 
     /* check if we're done sending */
-    if (conn->reply_sent == conn->reply_length) conn->state = DONE;
+    if (conn->reply_sent == conn->reply_length) reply_done(conn);
 }
 
 
@@ -1054,6 +1958,7 @@ static void http_listen_one(struct addrinfo *ai,
         http_base_url);
 
     /* add to insocks */
+    snapshot_fd_add(sockin);
     insocks = xrealloc(insocks, sizeof(*insocks) * (insock_num + 1));
     insocks[insock_num++] = sockin;
 }
@@ -1061,6 +1966,8 @@ static void http_listen_one(struct addrinfo *ai,
 /* Initialize the http sockets and listen on them. */
 void http_listen(const unsigned short bindport)
 {
+    unsigned int i;
+
     /* If the user didn't specify any bind addresses, add a NULL.
      * This will become a wildcard.
      */
@@ -1085,6 +1992,12 @@ void http_listen(const unsigned short bindport)
     if (insocks == NULL)
         errx(1, "was not able to bind any ports for http interface");
 
+    /* Set up the deflate stream now, so snapshot children inherit it. */
+    gzip_stream();
+    for (i=0; i<insock_num; i++)
+        if (event_set(insocks[i], EVENT_READ, accept_event, &insocks[i]) == -1)
+            errx(1, "can't wait on http socket %d", insocks[i]);
+
     /* ignore SIGPIPE */
     if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
         err(1, "can't ignore SIGPIPE");
@@ -1093,114 +2006,120 @@ void http_listen(const unsigned short bindport)
 
 
 /* ---------------------------------------------------------------------------
- * Set recv/send fd_sets and calculate timeout length.
+ * How long until the next idle connection times out, in msec, or -1 for
+ * never.
  */
-void
-http_fd_set(fd_set *recv_set, fd_set *send_set, int *max_fd,
-    struct timeval *timeout, int *need_timeout)
+int http_timeout_msec(void)
 {
-    struct connection *conn, *next;
-    int minidle = idletime + 1;
-    unsigned int i;
-
-    #define MAX_FD_SET(sock, fdset) do { \
-        FD_SET(sock, fdset); *max_fd = MAX(*max_fd, sock); } while(0)
-
-    for (i=0; i<insock_num; i++)
-        MAX_FD_SET(insocks[i], recv_set);
-
-    LIST_FOREACH_SAFE(conn, &connlist, entries, next)
-    {
-        int idlefor = now_mono() - conn->last_active_mono;
-
-        /* Time out dead connections. */
-        if (idlefor >= idletime) {
-            char ipaddr[INET6_ADDRSTRLEN];
-            /* FIXME: this is too late on FreeBSD, socket is invalid */
-            int ret = getnameinfo((struct sockaddr *)&conn->client,
-                sizeof(conn->client), ipaddr, sizeof(ipaddr),
-                NULL, 0, NI_NUMERICHOST);
-            if (ret == 0)
-                verbosef("http socket timeout from %s (fd %d)",
-                        ipaddr, conn->socket);
-            else
-                warn("http socket timeout: getnameinfo error: %s",
-                    gai_strerror(ret));
-            conn->state = DONE;
-        }
-
-        /* Connections that need a timeout. */
-        if (conn->state != DONE)
-            minidle = MIN(minidle, (idletime - idlefor));
-
-        switch (conn->state)
-        {
-        case DONE:
-            /* clean out stale connection */
-            LIST_REMOVE(conn, entries);
-            free_connection(conn);
-            free(conn);
-            break;
-
-        case RECV_REQUEST:
-            MAX_FD_SET(conn->socket, recv_set);
-            break;
-
-        case SEND_HEADER_AND_REPLY:
-        case SEND_HEADER:
-        case SEND_REPLY:
-            MAX_FD_SET(conn->socket, send_set);
-            break;
-
-        default: errx(1, "invalid state");
-        }
-    }
-    #undef MAX_FD_SET
-
-    /* Only set timeout if cap hasn't already. */
-    if ((*need_timeout == 0) && (minidle <= idletime)) {
-        *need_timeout = 1;
-        timeout->tv_sec = minidle;
-        timeout->tv_usec = 0;
-    }
+    const time_t now = now_mono();
+    time_t t;
+
+    if (LIST_FIRST(&connlist) == NULL || !idle_started)
+        return -1;
+    for (t = idle_next; t < idle_next + IDLE_WHEEL; t++)
+        if (LIST_FIRST(IDLE_SLOT(t)) != NULL)
+            return (t <= now) ? 0 : (int)(t - now) * 1000;
+    return -1;
 }
 
 
 
 /* ---------------------------------------------------------------------------
- * poll connections that select() says need attention
+ * Event handlers for listening sockets and connections.
  */
-void http_poll(fd_set *recv_set, fd_set *send_set)
+static void accept_event(void *arg)
 {
-    struct connection *conn;
-    unsigned int i;
+    accept_connection(*(const int *)arg);
+}
 
-    for (i=0; i<insock_num; i++)
-        if (FD_ISSET(insocks[i], recv_set))
-            accept_connection(insocks[i]);
+static void conn_event(void *arg)
+{
+    struct connection *conn = arg;
 
-    LIST_FOREACH(conn, &connlist, entries)
     switch (conn->state)
     {
     case RECV_REQUEST:
-        if (FD_ISSET(conn->socket, recv_set)) poll_recv_request(conn);
+        poll_recv_request(conn);
         break;
 
     case SEND_HEADER_AND_REPLY:
-        if (FD_ISSET(conn->socket, send_set)) poll_send_header_and_reply(conn);
+        poll_send_header_and_reply(conn);
         break;
 
     case SEND_HEADER:
-        if (FD_ISSET(conn->socket, send_set)) poll_send_header(conn);
+        poll_send_header(conn);
         break;
 
     case SEND_REPLY:
-        if (FD_ISSET(conn->socket, send_set)) poll_send_reply(conn);
+        poll_send_reply(conn);
         break;
 
     case DONE: /* fallthrough */
     default: errx(1, "invalid state");
     }
+    conn_update(conn);
+}
+
+
+
+/* ---------------------------------------------------------------------------
+ * Time out idle connections, and free the ones that are done.  Call after
+ * event_dispatch().
+ */
+void http_poll(void)
+{
+    struct connection *conn, *next;
+    const time_t now = now_mono();
+
+    if (!idle_started || now - idle_next >= IDLE_WHEEL) {
+        if (!idle_started)
+            idle_next = now;
+        else
+            idle_next = now - IDLE_WHEEL + 1;
+        idle_started = 1;
+    }
+    for (; idle_next <= now; idle_next++)
+        LIST_FOREACH_SAFE(conn, IDLE_SLOT(idle_next), idle_entries, next)
+        {
+            char ipaddr[INET6_ADDRSTRLEN];
+            int ret;
+
+            if (conn->expires_mono > now)
+                continue;
+            ret = getnameinfo((struct sockaddr *)&conn->client,
+                sizeof(conn->client), ipaddr, sizeof(ipaddr),
+                NULL, 0, NI_NUMERICHOST);
+            if (ret == 0)
+                verbosef("http socket timeout from %s (fd %d)",
+                        ipaddr, conn->socket);
+            else
+                warn("http socket timeout: getnameinfo error: %s",
+                    gai_strerror(ret));
+            conn->state = DONE;
+            conn_update(conn);
+        }
+
+    while (LIST_FIRST(&donelist) != NULL) {
+        conn = LIST_FIRST(&donelist);
+        LIST_REMOVE(conn, entries);
+        free_connection(conn);
+        if (freelist_length < CONN_FREE_MAX) {
+            LIST_INSERT_HEAD(&freelist, conn, entries);
+            freelist_length++;
+        } else
+            free(conn);
+    }
+}
+
+void http_metrics(struct str *buf)
+{
+    int i;
+
+    metrics_header(buf, "darkstat_http_render_seconds", "histogram",
+        "Time taken to generate and compress each page.");
+    for (i = 0; i < NUM_PAGES; i++)
+        metrics_histogram(buf, "darkstat_http_render_seconds",
+            page_label[i], &page_nsec[i]);
 }
 
 void http_stop(void) {
@@ -1211,17 +2130,25 @@ void http_stop(void) {
     free(http_base_url);
 
     /* Close listening sockets. */
-    for (i=0; i<insock_num; i++)
+    for (i=0; i<insock_num; i++) {
+        event_set(insocks[i], 0, NULL, NULL);
+        snapshot_fd_remove(insocks[i]);
         close(insocks[i]);
+    }
     free(insocks);
     insocks = NULL;
 
     /* Close in-flight connections. */
     LIST_FOREACH_SAFE(conn, &connlist, entries, next) {
+        conn->state = DONE;
+        conn_update(conn);
+    }
+    http_poll();
+    while ((conn = LIST_FIRST(&freelist)) != NULL) {
         LIST_REMOVE(conn, entries);
-        free_connection(conn);
         free(conn);
     }
+    freelist_length = 0;
 }
 
 /* vim:set ts=4 sw=4 et tw=78: */
@@ -4,15 +4,14 @@
  * http.h: embedded webserver.
  */
 
-#include <sys/time.h>
-#include <sys/select.h>
-
 void http_init_base(const char *url);
 void http_add_bindaddr(const char *bindaddr);
+void http_set_gzip_level(const int level); /* 0 to not compress pages */
 void http_listen(const unsigned short bindport);
-void http_fd_set(fd_set *recv_set, fd_set *send_set, int *max_fd,
-   struct timeval *timeout, int *need_timeout);
-void http_poll(fd_set *read_set, fd_set *write_set);
+int http_timeout_msec(void);
+void http_poll(void); /* after event_dispatch() */
 void http_stop(void);
+struct str;
+void http_metrics(struct str *buf); /* for /metrics */
 
 /* vim:set ts=3 sw=3 tw=78 expandtab: */
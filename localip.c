@@ -9,9 +9,11 @@
 
 #include "addr.h"
 #include "bsd.h" /* for strlcpy */
+#include "cdefs.h"
 #include "config.h" /* for HAVE_IFADDRS_H */
 #include "conv.h"
 #include "err.h"
+#include "event.h"
 #include "localip.h"
 #include "now.h"
 
@@ -33,8 +35,95 @@
 # include <sys/ioctl.h>
 #endif
 
+#ifdef linux
+# include <linux/netlink.h>
+# include <linux/rtnetlink.h>
+#endif
+
+/* On Linux, a netlink socket tells us when any address changes, and
+ * localip_update() only looks at the interfaces again after that.  Elsewhere
+ * it looks once a second.
+ */
+static int watch_fd = -1;
+
+/* Bumped on every address change.  Capture threads read it without a lock:
+ * at worst they see a change one poll late.
+ */
+static volatile unsigned int watch_generation = 0;
+
+#ifdef linux
+static void localip_drain(void *arg);
+#endif
+
+void localip_watch_start(void) {
+#ifdef linux
+   struct sockaddr_nl sa;
+
+   watch_fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+   if (watch_fd == -1) {
+      verbosef("can't watch for address changes, socket(): %s",
+         strerror(errno));
+      return;
+   }
+   memset(&sa, 0, sizeof(sa));
+   sa.nl_family = AF_NETLINK;
+   sa.nl_groups = RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR;
+   if (bind(watch_fd, (struct sockaddr *)&sa, sizeof(sa)) == -1) {
+      verbosef("can't watch for address changes, bind(): %s",
+         strerror(errno));
+      close(watch_fd);
+      watch_fd = -1;
+      return;
+   }
+   fd_set_nonblock(watch_fd);
+   if (event_set(watch_fd, EVENT_READ, localip_drain, NULL) == -1) {
+      close(watch_fd);
+      watch_fd = -1;
+      return;
+   }
+   verbosef("watching for address changes");
+#endif
+}
+
+#ifdef linux
+/* Drain the netlink socket.  We don't need to know what changed, only that
+ * something did.
+ */
+static void localip_drain(void *arg _unused_) {
+   char buf[8192];
+   int changed = 0;
+
+   for (;;) {
+      ssize_t len = recv(watch_fd, buf, sizeof(buf), 0);
+
+      if (len > 0) {
+         changed = 1;
+         continue;
+      }
+      if (len == -1 && errno == EINTR)
+         continue;
+      if (len == -1 && errno == ENOBUFS) {
+         changed = 1; /* lost some, so assume the worst */
+         continue;
+      }
+      break;
+   }
+   if (changed)
+      watch_generation++;
+}
+#endif
+
+void localip_watch_stop(void) {
+   if (watch_fd != -1) {
+      event_set(watch_fd, 0, NULL, NULL);
+      close(watch_fd);
+   }
+   watch_fd = -1;
+}
+
 void localip_init(struct local_ips *ips) {
    ips->is_valid = 0;
+   ips->generation = ~0U;
    ips->last_update_mono = 0;
    ips->num_addrs = 0;
    ips->addrs = NULL;
@@ -79,7 +168,13 @@ void localip_update(const char *iface, struct local_ips *ips) {
       return;
    }
 
-   if (ips->last_update_mono == now_mono()) {
+   if (watch_fd != -1) {
+      const unsigned int generation = watch_generation;
+
+      if (ips->generation == generation)
+         return; /* nothing changed */
+      ips->generation = generation;
+   } else if (ips->last_update_mono == now_mono()) {
       /* Too soon, bail out. */
       return;
    }
@@ -13,6 +13,7 @@
 
 struct local_ips {
    int is_valid;
+   unsigned int generation; /* of address changes, when last updated */
    time_t last_update_mono;
    int num_addrs;
    struct addr *addrs;
@@ -21,6 +22,9 @@ struct local_ips {
 void localip_init(struct local_ips *ips);
 void localip_free(struct local_ips *ips);
 
+void localip_watch_start(void); /* after event_init() */
+void localip_watch_stop(void);
+
 void localip_update(const char *iface, struct local_ips *ips);
 int is_localip(const struct addr * const a,
                const struct local_ips * const ips);
@@ -0,0 +1,135 @@
+/* darkstat 3
+ * copyright (c) 2026 darkstat contributors.
+ *
+ * lpm.c: prefix tables for matching addresses against many networks
+ *
+ * You may use, modify and redistribute this file under the terms of the
+ * GNU General Public License version 2. (see COPYING.GPL)
+ */
+
+/* A multibit trie with a stride of one byte.  Each node is a table of 256
+ * entries, indexed by the next byte of the address, that says whether the
+ * address is inside a network, outside all of them, or that the next byte
+ * decides.  A prefix that doesn't end on a byte boundary is expanded into
+ * the run of entries it covers.
+ *
+ * A lookup is at most one load per byte of the address, four for IPv4 and
+ * sixteen for IPv6, however many networks there are.  We only need to know
+ * whether some network matched, not which, so a shorter prefix simply
+ * replaces whatever is under it.
+ */
+
+#include "conv.h"
+#include "lpm.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LPM_STRIDE 256
+
+/* Entry values.  Anything else is the index of the node for the next byte. */
+#define LPM_OUTSIDE 0
+#define LPM_INSIDE 1
+
+/* The roots are the first two nodes, so no child can have their index. */
+#define LPM_ROOT4 0
+#define LPM_ROOT6 1
+
+struct lpm {
+   uint32_t (*node)[LPM_STRIDE];
+   uint32_t num_nodes;
+};
+
+static uint32_t lpm_new_node(struct lpm *l) {
+   l->node = xrealloc(l->node, (l->num_nodes + 1) * sizeof(*l->node));
+   memset(l->node[l->num_nodes], 0, sizeof(*l->node));
+   return l->num_nodes++;
+}
+
+struct lpm *lpm_make(void) {
+   struct lpm *l = xmalloc(sizeof(*l));
+
+   l->node = NULL;
+   l->num_nodes = 0;
+   lpm_new_node(l); /* LPM_ROOT4 */
+   lpm_new_node(l); /* LPM_ROOT6 */
+   return l;
+}
+
+void lpm_free(struct lpm *l) {
+   free(l->node);
+   free(l);
+}
+
+static const uint8_t *lpm_bytes(const struct addr * const a,
+                                unsigned int *len, uint32_t *root) {
+   if (a->family == IPv4) {
+      *len = 4;
+      *root = LPM_ROOT4;
+      return (const uint8_t *)&(a->ip.v4);
+   }
+   assert(a->family == IPv6);
+   *len = 16;
+   *root = LPM_ROOT6;
+   return a->ip.v6.s6_addr;
+}
+
+void lpm_insert(struct lpm *l, const struct addr * const net,
+                const unsigned int pfxlen) {
+   const uint8_t *p;
+   unsigned int len, depth;
+   uint32_t node;
+
+   p = lpm_bytes(net, &len, &node);
+   assert(pfxlen <= len * 8);
+   if (pfxlen == 0) {
+      /* Everything matches. */
+      uint32_t i;
+
+      for (i = 0; i < LPM_STRIDE; i++)
+         l->node[node][i] = LPM_INSIDE;
+      return;
+   }
+   for (depth = 0; ; depth++) {
+      const unsigned int left = pfxlen - depth * 8;
+
+      if (left <= 8) {
+         /* The prefix ends in this byte: fill the entries it covers. */
+         const uint32_t span = 1U << (8 - left);
+         const uint32_t first = p[depth] & ~(span - 1);
+         uint32_t i;
+
+         for (i = first; i < first + span; i++)
+            l->node[node][i] = LPM_INSIDE;
+         return;
+      }
+      if (l->node[node][p[depth]] == LPM_INSIDE)
+         return; /* already covered by a shorter prefix */
+      if (l->node[node][p[depth]] == LPM_OUTSIDE) {
+         const uint32_t child = lpm_new_node(l);
+
+         l->node[node][p[depth]] = child;
+      }
+      node = l->node[node][p[depth]];
+   }
+}
+
+int lpm_match(const struct lpm *l, const struct addr * const a) {
+   const uint8_t *p;
+   unsigned int len, depth;
+   uint32_t node;
+
+   p = lpm_bytes(a, &len, &node);
+   for (depth = 0; depth < len; depth++) {
+      const uint32_t e = l->node[node][p[depth]];
+
+      if (e == LPM_OUTSIDE || e == LPM_INSIDE)
+         return (e == LPM_INSIDE);
+      node = e;
+   }
+   return 0; /* not reached: the last byte always ends in a leaf */
+}
+
+/* vim:set ts=3 sw=3 tw=78 expandtab: */
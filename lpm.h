@@ -0,0 +1,27 @@
+/* darkstat 3
+ * copyright (c) 2026 darkstat contributors.
+ *
+ * lpm.h: prefix tables for matching addresses against many networks
+ *
+ * You may use, modify and redistribute this file under the terms of the
+ * GNU General Public License version 2. (see COPYING.GPL)
+ */
+#ifndef __DARKSTAT_LPM_H
+#define __DARKSTAT_LPM_H
+
+#include "addr.h"
+
+struct lpm;
+
+struct lpm *lpm_make(void);
+void lpm_free(struct lpm *l);
+
+/* Add the network of the given prefix length. */
+void lpm_insert(struct lpm *l, const struct addr * const net,
+   const unsigned int pfxlen);
+
+/* Returns non-zero if the address is inside any of the networks. */
+int lpm_match(const struct lpm *l, const struct addr * const a);
+
+#endif /* __DARKSTAT_LPM_H */
+/* vim:set ts=3 sw=3 tw=78 expandtab: */
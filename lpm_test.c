@@ -0,0 +1,95 @@
+/* darkstat 3
+ * copyright (c) 2026 darkstat contributors.
+ *
+ * You may use, modify and redistribute this file under the terms of the
+ * GNU General Public License version 2. (see COPYING.GPL)
+ */
+
+#include "conv.h"
+#include "lpm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/* lpm.c only needs these from conv.c. */
+void *xmalloc(const size_t size) {
+  void *p = malloc(size);
+  if (p == NULL) abort();
+  return p;
+}
+
+void *xrealloc(void *original, const size_t size) {
+  void *p = realloc(original, size);
+  if (p == NULL) abort();
+  return p;
+}
+
+static int retcode = 0;
+
+static void add(struct lpm *l, const char *net, unsigned int pfxlen) {
+  struct addr a;
+
+  if (str_to_addr(net, &a) != 0) {
+    printf("FAIL: can't parse \"%s\"\n", net);
+    retcode = 1;
+    return;
+  }
+  lpm_insert(l, &a, pfxlen);
+}
+
+static void test(const struct lpm *l, const char *in, int expect) {
+  struct addr a;
+  int ret;
+
+  if (str_to_addr(in, &a) != 0) {
+    printf("FAIL: can't parse \"%s\"\n", in);
+    retcode = 1;
+    return;
+  }
+  ret = lpm_match(l, &a);
+  printf("%s: %s is %s\n", (ret == expect) ? "PASS" : "FAIL",
+      in, ret ? "inside" : "outside");
+  if (ret != expect)
+    retcode = 1;
+}
+
+int main() {
+  struct lpm *l = lpm_make();
+
+  test(l, "10.1.2.3", 0);
+  test(l, "::1", 0);
+
+  add(l, "10.0.0.0", 8);
+  add(l, "192.168.4.0", 22);
+  add(l, "172.16.5.7", 32);
+  add(l, "2001:db8:1::", 48);
+  add(l, "fe80::", 10);
+
+  test(l, "10.1.2.3", 1);
+  test(l, "11.0.0.1", 0);
+  test(l, "192.168.3.255", 0);
+  test(l, "192.168.4.0", 1);
+  test(l, "192.168.7.255", 1);
+  test(l, "192.168.8.0", 0);
+  test(l, "172.16.5.7", 1);
+  test(l, "172.16.5.6", 0);
+  test(l, "2001:db8:1:ffff::1", 1);
+  test(l, "2001:db8:2::1", 0);
+  test(l, "febf::1", 1);
+  test(l, "fec0::1", 0);
+
+  /* A shorter prefix covers a longer one added before it. */
+  add(l, "172.16.0.0", 12);
+  test(l, "172.31.255.255", 1);
+  test(l, "172.32.0.0", 0);
+
+  /* And everything matches a /0. */
+  add(l, "::", 0);
+  test(l, "2001:db8:2::1", 1);
+  test(l, "11.0.0.1", 0);
+
+  lpm_free(l);
+  return retcode;
+}
+
+/* vim:set ts=2 sts=2 sw=2 tw=80 et: */
@@ -0,0 +1,201 @@
+/* darkstat 3
+ * copyright (c) 2026 darkstat contributors.
+ *
+ * merge.c: darkstat-merge, which adds up several export files into one
+ *
+ * You may use, modify and redistribute this file under the terms of the
+ * GNU General Public License version 2. (see COPYING.GPL)
+ */
+
+/* Usage:
+ *  darkstat-merge [-j jobs] [-p parts] -o output input ...
+ *
+ * Hosts found in more than one input have their traffic, protocols and
+ * ports added up; their last seen time, MAC address and name are taken from
+ * whichever input saw them last.  The graphs are added up bar by bar, lined
+ * up by time.  The output can be imported by darkstat, or merged again.
+ *
+ * Hosts are split into parts by address, and each part is merged by a
+ * child process of its own, which reads through every input, keeping only
+ * the hosts in its part, and writes them to <output>.part<n>.  Up to jobs
+ * children run at once (by default, one per CPU), and each only ever holds
+ * its own part, so more parts means less memory.  Once they're all done,
+ * the parts are joined into the output.
+ */
+
+#include "cdefs.h"
+#include "conv.h"
+#include "db.h"
+#include "err.h"
+#include "graph_db.h"
+#include "hosts_db.h"
+#include "names.h"
+#include "now.h"
+#include "opt.h"
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static unsigned int num_parts, this_part;
+
+/* Which part a host belongs to: FNV-1a of its address. */
+static unsigned int
+part_of(const struct addr *const a)
+{
+   const unsigned char *p;
+   size_t len, i;
+   uint32_t h = 2166136261U;
+
+   if (a->family == IPv4) {
+      p = (const unsigned char *)&(a->ip.v4);
+      len = sizeof(a->ip.v4);
+   } else {
+      p = a->ip.v6.s6_addr;
+      len = sizeof(a->ip.v6.s6_addr);
+   }
+   for (i = 0; i < len; i++)
+      h = (h ^ p[i]) * 16777619U;
+   return h % num_parts;
+}
+
+static int
+keep_this_part(const struct addr *const a)
+{
+   return part_of(a) == this_part;
+}
+
+static int
+keep_none(const struct addr *const a _unused_)
+{
+   return 0;
+}
+
+/* Merge one part of the hosts in every input, in a child. */
+static pid_t
+start_part(const unsigned int part, char *const *inputs,
+   const unsigned int num_inputs, const char *part_fn)
+{
+   pid_t pid = fork();
+   unsigned int i;
+
+   if (pid == -1)
+      err(1, "fork");
+   if (pid != 0)
+      return pid;
+
+   this_part = part;
+   hosts_db_set_merge(keep_this_part);
+   for (i = 0; i < num_inputs; i++)
+      if (!db_merge(inputs[i], /*with_graphs=*/0))
+         _exit(1);
+   _exit(db_export_part(part_fn) ? 0 : 1);
+}
+
+/* Wait for a child.  Returns 0 if it failed. */
+static int
+wait_part(void)
+{
+   int status;
+
+   while (wait(&status) == -1)
+      if (errno != EINTR)
+         err(1, "wait");
+   return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static void
+usage(void)
+{
+   fprintf(stderr,
+      "usage: darkstat-merge [-j jobs] [-p parts] -o output input ...\n");
+   exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+   const char *output = NULL;
+   char **part_fns;
+   long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+   unsigned int jobs = (ncpu > 0) ? (unsigned int)ncpu : 1;
+   unsigned int num_inputs, started = 0, running = 0, i;
+   int c, ok = 1;
+
+   num_parts = 0;
+   while ((c = getopt(argc, argv, "j:o:p:")) != -1)
+      switch (c) {
+      case 'j': jobs = (unsigned int)atoi(optarg); break;
+      case 'o': output = optarg; break;
+      case 'p': num_parts = (unsigned int)atoi(optarg); break;
+      default: usage();
+      }
+   if (output == NULL || optind == argc || jobs == 0)
+      usage();
+   if (num_parts == 0)
+      num_parts = jobs;
+   argv += optind;
+   num_inputs = (unsigned int)(argc - optind);
+
+   part_fns = xcalloc(num_parts, sizeof(*part_fns));
+   for (i = 0; i < num_parts; i++) {
+      const size_t len = strlen(output) + sizeof(".part") + 10;
+
+      part_fns[i] = xmalloc(len);
+      snprintf(part_fns[i], len, "%s.part%u", output, i);
+   }
+
+   /* Unlike darkstat, throw nothing away. */
+   opt_hosts_max = UINT_MAX;
+   opt_hosts_keep = UINT_MAX / 2;
+   opt_ports_max = 65536 + 1;
+   opt_ports_keep = 65536;
+
+   now_init();
+   graph_init();
+   hosts_db_init(); /* stays empty here, for the children to fill */
+
+   while (started < num_parts && running < jobs) {
+      start_part(started, argv, num_inputs, part_fns[started]);
+      started++;
+      running++;
+   }
+
+   /* Meanwhile, add up the graphs here. */
+   hosts_db_set_merge(keep_none);
+   for (i = 0; i < num_inputs; i++)
+      if (!db_merge(argv[i], /*with_graphs=*/1))
+         ok = 0;
+
+   while (running > 0) {
+      if (!wait_part())
+         ok = 0;
+      running--;
+      if (ok && started < num_parts) {
+         start_part(started, argv, num_inputs, part_fns[started]);
+         started++;
+         running++;
+      }
+   }
+
+   if (ok && !db_export_parts(output, part_fns, num_parts))
+      ok = 0;
+   for (i = 0; i < num_parts; i++) {
+      unlink(part_fns[i]);
+      free(part_fns[i]);
+   }
+   free(part_fns);
+   hosts_db_free();
+   names_free();
+   graph_free();
+   if (!ok)
+      errx(1, "merge failed");
+   return 0;
+}
+
+/* vim:set ts=3 sw=3 tw=78 expandtab: */
@@ -0,0 +1,100 @@
+/* darkstat 3
+ * copyright (c) 2026 darkstat contributors.
+ *
+ * metrics.c: darkstat's own counters and histograms, for /metrics
+ *
+ * You may use, modify and redistribute this file under the terms of the
+ * GNU General Public License version 2. (see COPYING.GPL)
+ */
+
+#include "metrics.h"
+#include "str.h"
+
+#include <stdio.h> /* snprintf() */
+#include <string.h>
+
+/* Upper bounds of the buckets, and how they're written in the "le" label. */
+static const uint64_t nsec_bound[HISTOGRAM_BUCKETS] = {
+   10000, 100000, 1000000, 10000000, 100000000,
+   500000000, 1000000000, 5000000000ULL
+};
+static const char *const nsec_label[HISTOGRAM_BUCKETS] = {
+   "1e-05", "0.0001", "0.001", "0.01", "0.1", "0.5", "1", "5"
+};
+static const uint64_t count_bound[HISTOGRAM_BUCKETS] = {
+   1, 4, 16, 64, 256, 1024, 4096, 16384
+};
+static const char *const count_label[HISTOGRAM_BUCKETS] = {
+   "1", "4", "16", "64", "256", "1024", "4096", "16384"
+};
+
+void histogram_init(struct histogram *h, const enum histogram_unit unit) {
+   memset(h, 0, sizeof(*h));
+   h->unit = unit;
+}
+
+void histogram_add(struct histogram *h, const uint64_t v) {
+   const uint64_t *bound =
+      (h->unit == HISTOGRAM_NSEC) ? nsec_bound : count_bound;
+   unsigned int i;
+
+   for (i = 0; i < HISTOGRAM_BUCKETS && v > bound[i]; i++)
+      ;
+   h->bucket[i]++;
+   h->count++;
+   h->sum += v;
+}
+
+void histogram_merge(struct histogram *into, const struct histogram *h) {
+   unsigned int i;
+
+   for (i = 0; i <= HISTOGRAM_BUCKETS; i++)
+      into->bucket[i] += h->bucket[i];
+   into->count += h->count;
+   into->sum += h->sum;
+}
+
+void metrics_header(struct str *buf, const char *metric, const char *type,
+                    const char *help) {
+   str_appendf(buf, "# HELP %s %s\n", metric, help);
+   str_appendf(buf, "# TYPE %s %s\n", metric, type);
+}
+
+/* Append the name of one of a histogram's series, with its labels. */
+static void metrics_series(struct str *buf, const char *metric,
+                           const char *suffix, const char *labels) {
+   str_appendf(buf, "%s_%s", metric, suffix);
+   if (labels != NULL)
+      str_appendf(buf, "{%s}", labels);
+}
+
+void metrics_histogram(struct str *buf, const char *metric,
+                       const char *labels, const struct histogram *h) {
+   const char *const *label =
+      (h->unit == HISTOGRAM_NSEC) ? nsec_label : count_label;
+   const char *sep = (labels == NULL) ? "" : ",";
+   uint64_t cumulative = 0;
+   unsigned int i;
+
+   for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+      cumulative += h->bucket[i];
+      str_appendf(buf, "%s_bucket{%s%sle=\"%s\"} %qu\n",
+         metric, (labels == NULL) ? "" : labels, sep, label[i],
+         (qu)cumulative);
+   }
+   str_appendf(buf, "%s_bucket{%s%sle=\"+Inf\"} %qu\n",
+      metric, (labels == NULL) ? "" : labels, sep, (qu)h->count);
+
+   metrics_series(buf, metric, "sum", labels);
+   if (h->unit == HISTOGRAM_NSEC) {
+      char sum[32];
+
+      snprintf(sum, sizeof(sum), "%.9f", (double)h->sum / 1e9);
+      str_appendf(buf, " %s\n", sum);
+   } else
+      str_appendf(buf, " %qu\n", (qu)h->sum);
+   metrics_series(buf, metric, "count", labels);
+   str_appendf(buf, " %qu\n", (qu)h->count);
+}
+
+/* vim:set ts=3 sw=3 tw=78 expandtab: */
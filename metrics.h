@@ -0,0 +1,46 @@
+/* darkstat 3
+ * copyright (c) 2026 darkstat contributors.
+ *
+ * metrics.h: darkstat's own counters and histograms, for /metrics
+ *
+ * You may use, modify and redistribute this file under the terms of the
+ * GNU General Public License version 2. (see COPYING.GPL)
+ */
+#ifndef __DARKSTAT_METRICS_H
+#define __DARKSTAT_METRICS_H
+
+#include <stdint.h>
+
+struct str;
+
+/* What a histogram's observations are: durations in nanoseconds, shown in
+ * seconds, or plain counts.
+ */
+enum histogram_unit { HISTOGRAM_NSEC, HISTOGRAM_COUNT };
+
+#define HISTOGRAM_BUCKETS 8
+
+struct histogram {
+   enum histogram_unit unit;
+   uint64_t bucket[HISTOGRAM_BUCKETS + 1]; /* not cumulative, last is +Inf */
+   uint64_t count, sum;
+};
+
+#define HISTOGRAM_INIT(unit) { (unit), { 0 }, 0, 0 }
+
+void histogram_init(struct histogram *h, const enum histogram_unit unit);
+void histogram_add(struct histogram *h, const uint64_t v);
+void histogram_merge(struct histogram *into, const struct histogram *h);
+
+/* Append the HELP and TYPE lines for a metric. */
+void metrics_header(struct str *buf, const char *metric, const char *type,
+   const char *help);
+
+/* Append a histogram's series.  labels, if not NULL, goes inside the braces,
+ * e.g. "page=\"hosts\"".
+ */
+void metrics_histogram(struct str *buf, const char *metric,
+   const char *labels, const struct histogram *h);
+
+#endif /* __DARKSTAT_METRICS_H */
+/* vim:set ts=3 sw=3 tw=78 expandtab: */
@@ -0,0 +1,269 @@
+/* darkstat 3
+ * copyright (c) 2026 darkstat contributors.
+ *
+ * names.c: interned host names, with shared suffixes.
+ *
+ * You may use, modify and redistribute this file under the terms of the
+ * GNU General Public License version 2. (see COPYING.GPL)
+ */
+
+/* Hosts in the same network tend to have names that only differ in their
+ * first label, like ec2-1-2-3-4.compute-1.amazonaws.com.  So a name is kept
+ * as its first label and a handle to the rest of it, which is a name too,
+ * and every name is kept once, however many hosts or longer names use it.
+ *
+ * Names are entries in one array, found by (suffix, label) through a
+ * chained hash table, with their labels in one arena of bytes.  Each entry
+ * counts the hosts and longer names that refer to it, and is freed along
+ * with its label after the last one goes.  Freed labels leave holes in the
+ * arena, which is compacted once they're half of it.
+ *
+ * Only the main process changes names, and only from the main thread.
+ */
+
+#include "conv.h"
+#include "metrics.h"
+#include "names.h"
+#include "str.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct name_ent {
+   uint32_t suffix;     /* the rest of the name, after a dot, or NAME_NONE */
+   uint32_t refs;       /* 0 if the entry is free */
+   uint32_t next;       /* in the hash chain, or the free list */
+   uint32_t label;      /* offset into labels */
+   uint8_t label_len;
+};
+
+static struct name_ent *ents = NULL;
+static uint32_t ents_size = 0, ents_used = 0, ents_free = NAME_NONE;
+static uint32_t num_names = 0;
+
+static uint32_t *chains = NULL; /* heads, NAME_NONE for empty */
+static uint32_t chains_mask = 0;
+
+static char *labels = NULL;
+static size_t labels_size = 0, labels_len = 0, labels_dead = 0;
+
+static uint32_t hash_label(const uint32_t suffix, const char *s,
+   const size_t len) {
+   uint32_t h = 2166136261U ^ suffix;
+   size_t i;
+
+   for (i=0; i<len; i++)
+      h = (h ^ (uint8_t)s[i]) * 16777619U;
+   return h;
+}
+
+static uint32_t *chain_of(const uint32_t suffix, const char *s,
+   const size_t len) {
+   return &chains[hash_label(suffix, s, len) & chains_mask];
+}
+
+/* Double the hash table, when there are more names than chains. */
+static void grow_chains(void) {
+   const uint32_t size = chains_mask ? (chains_mask + 1) * 2 : 1024;
+   uint32_t i;
+
+   free(chains);
+   chains = xcalloc(size, sizeof(*chains));
+   chains_mask = size - 1;
+   for (i=1; i<ents_used; i++)
+      if (ents[i].refs != 0) {
+         uint32_t *c = chain_of(ents[i].suffix, labels + ents[i].label,
+            ents[i].label_len);
+
+         ents[i].next = *c;
+         *c = i;
+      }
+}
+
+/* Copy the live labels to the start of the arena, dropping the holes. */
+static void compact_labels(void) {
+   char *old = labels;
+   uint32_t i;
+
+   labels = xmalloc(labels_size);
+   labels_len = 0;
+   for (i=1; i<ents_used; i++)
+      if (ents[i].refs != 0) {
+         memcpy(labels + labels_len, old + ents[i].label,
+            ents[i].label_len);
+         ents[i].label = (uint32_t)labels_len;
+         labels_len += ents[i].label_len;
+      }
+   labels_dead = 0;
+   free(old);
+}
+
+static uint32_t add_label(const char *s, const size_t len) {
+   uint32_t ofs;
+
+   if (labels_len + len > labels_size) {
+      if (labels_dead > labels_len / 2)
+         compact_labels();
+      while (labels_len + len > labels_size)
+         labels_size = labels_size ? labels_size * 2 : 4096;
+      labels = xrealloc(labels, labels_size);
+   }
+   ofs = (uint32_t)labels_len;
+   memcpy(labels + labels_len, s, len);
+   labels_len += len;
+   return ofs;
+}
+
+/* The name of label s followed by suffix, taking over the caller's reference
+ * to suffix, and returning one to the name.
+ */
+static uint32_t get_ent(const uint32_t suffix, const char *s,
+   const size_t len) {
+   uint32_t *c, n;
+
+   if (chains == NULL || num_names > chains_mask)
+      grow_chains();
+   c = chain_of(suffix, s, len);
+   for (n = *c; n != NAME_NONE; n = ents[n].next)
+      if (ents[n].suffix == suffix && ents[n].label_len == len &&
+          memcmp(labels + ents[n].label, s, len) == 0) {
+         ents[n].refs++;
+         name_unref(suffix); /* n already holds one */
+         return n;
+      }
+
+   if (ents_free != NAME_NONE) {
+      n = ents_free;
+      ents_free = ents[n].next;
+   } else {
+      if (ents_used == ents_size) {
+         ents_size = ents_size ? ents_size * 2 : 1024;
+         ents = xrealloc(ents, ents_size * sizeof(*ents));
+         if (ents_used == 0)
+            ents_used = 1; /* entry 0 is NAME_NONE */
+      }
+      n = ents_used++;
+   }
+   ents[n].suffix = suffix;
+   ents[n].refs = 1;
+   ents[n].label = add_label(s, len);
+   ents[n].label_len = (uint8_t)len;
+   ents[n].next = *c;
+   *c = n;
+   num_names++;
+   return n;
+}
+
+uint32_t name_intern(const char *s) {
+   size_t len = strlen(s), end;
+   uint32_t n = NAME_NONE;
+
+   if (len > NAME_BUF_LEN - 1)
+      len = NAME_BUF_LEN - 1;
+   /* From the last label back to the first. */
+   end = len;
+   for (;;) {
+      size_t start = end;
+
+      while (start > 0 && s[start-1] != '.')
+         start--;
+      n = get_ent(n, s + start, end - start);
+      if (start == 0)
+         return n;
+      end = start - 1; /* before the dot */
+   }
+}
+
+void name_ref(const uint32_t n) {
+   if (n != NAME_NONE)
+      ents[n].refs++;
+}
+
+void name_unref(uint32_t n) {
+   while (n != NAME_NONE) {
+      struct name_ent *e = &ents[n];
+      uint32_t *c;
+      const uint32_t suffix = e->suffix;
+
+      assert(e->refs > 0);
+      if (--e->refs > 0)
+         return;
+      for (c = chain_of(e->suffix, labels + e->label, e->label_len);
+           *c != n; c = &ents[*c].next)
+         assert(*c != NAME_NONE);
+      *c = e->next;
+      labels_dead += e->label_len;
+      e->next = ents_free;
+      ents_free = n;
+      num_names--;
+      n = suffix; /* which loses the reference this name held */
+   }
+}
+
+const char *name_str(const uint32_t n, char buf[NAME_BUF_LEN]) {
+   size_t len = 0;
+   uint32_t i;
+
+   if (n == NAME_NONE)
+      return NULL;
+   for (i = n; i != NAME_NONE; i = ents[i].suffix) {
+      if (i != n)
+         buf[len++] = '.';
+      memcpy(buf + len, labels + ents[i].label, ents[i].label_len);
+      len += ents[i].label_len;
+   }
+   assert(len < NAME_BUF_LEN); /* name_intern() made sure */
+   buf[len] = '\0';
+   return buf;
+}
+
+size_t name_len(const uint32_t n) {
+   size_t len = 0;
+   uint32_t i;
+
+   for (i = n; i != NAME_NONE; i = ents[i].suffix)
+      len += ents[i].label_len + (i != n);
+   return len;
+}
+
+/* An entry and its label, plus its share of the chain heads. */
+#define ENT_BYTES(e) \
+   (sizeof(struct name_ent) + sizeof(uint32_t) + (e)->label_len)
+
+size_t name_bytes(const uint32_t n) {
+   size_t bytes = 0;
+   uint32_t i;
+
+   for (i = n; i != NAME_NONE && ents[i].refs == 1; i = ents[i].suffix)
+      bytes += ENT_BYTES(&ents[i]);
+   return bytes;
+}
+
+size_t names_bytes(void) {
+   return num_names * (sizeof(struct name_ent) + sizeof(uint32_t)) +
+      labels_len - labels_dead;
+}
+
+void names_free(void) {
+   free(ents);
+   free(chains);
+   free(labels);
+   ents = NULL;
+   chains = NULL;
+   labels = NULL;
+   ents_size = ents_used = num_names = chains_mask = 0;
+   ents_free = NAME_NONE;
+   labels_size = labels_len = labels_dead = 0;
+}
+
+void names_metrics(struct str *buf) {
+   metrics_header(buf, "darkstat_names", "gauge",
+      "Host names and name suffixes kept, each once.");
+   str_appendf(buf, "darkstat_names %u\n", num_names);
+   metrics_header(buf, "darkstat_names_bytes", "gauge",
+      "Bytes of labels in the host names arena, including freed ones.");
+   str_appendf(buf, "darkstat_names_bytes %qu\n", (qu)labels_len);
+}
+
+/* vim:set ts=3 sw=3 tw=78 expandtab: */
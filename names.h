@@ -0,0 +1,43 @@
+/* darkstat 3
+ * copyright (c) 2026 darkstat contributors.
+ *
+ * names.h: interned host names, with shared suffixes.
+ *
+ * You may use, modify and redistribute this file under the terms of the
+ * GNU General Public License version 2. (see COPYING.GPL)
+ */
+#ifndef __DARKSTAT_NAMES_H
+#define __DARKSTAT_NAMES_H
+
+#include <stddef.h> /* for size_t */
+#include <stdint.h>
+
+/* A name is a 32-bit handle, and 0 is no name. */
+#define NAME_NONE 0
+#define NAME_BUF_LEN 256 /* longest name, plus the NUL */
+
+/* Returns a handle to s, holding one reference to it.  s is cut short if
+ * it's longer than NAME_BUF_LEN-1.
+ */
+uint32_t name_intern(const char *s);
+
+void name_ref(const uint32_t n);
+void name_unref(const uint32_t n); /* and frees it after the last one */
+
+/* Spells out n into buf, and returns buf, or NULL for NAME_NONE. */
+const char *name_str(const uint32_t n, char buf[NAME_BUF_LEN]);
+size_t name_len(const uint32_t n);
+
+/* Memory that letting go of one reference to n would free: the part of it
+ * that nothing else refers to.
+ */
+size_t name_bytes(const uint32_t n);
+size_t names_bytes(void); /* by all live names */
+
+void names_free(void);
+
+struct str;
+void names_metrics(struct str *buf); /* for /metrics */
+
+#endif /* __DARKSTAT_NAMES_H */
+/* vim:set ts=3 sw=3 tw=78 expandtab: */
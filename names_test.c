@@ -0,0 +1,148 @@
+/* darkstat 3
+ * copyright (c) 2026 darkstat contributors.
+ *
+ * You may use, modify and redistribute this file under the terms of the
+ * GNU General Public License version 2. (see COPYING.GPL)
+ */
+
+#include "conv.h"
+#include "metrics.h"
+#include "names.h"
+#include "str.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* names.c only needs these from conv.c. */
+void *xmalloc(const size_t size) {
+  void *p = malloc(size);
+  if (p == NULL) abort();
+  return p;
+}
+
+void *xcalloc(const size_t num, const size_t size) {
+  void *p = calloc(num, size);
+  if (p == NULL) abort();
+  return p;
+}
+
+void *xrealloc(void *original, const size_t size) {
+  void *p = realloc(original, size);
+  if (p == NULL) abort();
+  return p;
+}
+
+/* And these for names_metrics(), which isn't tested. */
+void metrics_header(struct str *buf, const char *metric, const char *type,
+    const char *help) {
+  (void)buf; (void)metric; (void)type; (void)help;
+  abort();
+}
+
+void str_appendf(struct str *s, const char *format, ...) {
+  (void)s; (void)format;
+  abort();
+}
+
+static int retcode = 0;
+
+static void check(const int ok, const char *what) {
+  printf("%s: %s\n", ok ? "PASS" : "FAIL", what);
+  if (!ok)
+    retcode = 1;
+}
+
+/* Interns s and checks that it reads back the same. */
+static uint32_t test(const char *s) {
+  char buf[NAME_BUF_LEN];
+  const uint32_t n = name_intern(s);
+  const char *got = name_str(n, buf);
+  const int ok = (strcmp(got, s) == 0) && (name_len(n) == strlen(s));
+
+  printf("%s: \"%s\" reads back as \"%s\"\n", ok ? "PASS" : "FAIL", s, got);
+  if (!ok)
+    retcode = 1;
+  return n;
+}
+
+/* Lots of names, freeing and reusing them, to grow the table and compact
+ * the labels.
+ */
+static void test_many(void) {
+  static uint32_t n[20000];
+  char s[64], buf[NAME_BUF_LEN];
+  unsigned int i, round, bad = 0;
+
+  for (round = 0; round < 3; round++) {
+    for (i = 0; i < 20000; i++) {
+      snprintf(s, sizeof(s), "host-%u-%u.rack%u.example.net",
+          round, i, i % 50);
+      n[i] = name_intern(s);
+    }
+    for (i = 0; i < 20000; i++) {
+      snprintf(s, sizeof(s), "host-%u-%u.rack%u.example.net",
+          round, i, i % 50);
+      if (strcmp(name_str(n[i], buf), s) != 0)
+        bad++;
+      name_unref(n[i]);
+    }
+  }
+  check(bad == 0, "many names read back");
+}
+
+int main() {
+  char buf[NAME_BUF_LEN], longname[400];
+  uint32_t a, b, c, d, e;
+
+  check(name_str(NAME_NONE, buf) == NULL, "no name is NULL");
+  check(name_len(NAME_NONE) == 0, "no name is empty");
+
+  a = test("ec2-1-2-3-4.compute-1.amazonaws.com");
+  b = test("ec2-5-6-7-8.compute-1.amazonaws.com");
+  c = test("ec2-1-2-3-4.compute-1.amazonaws.com");
+  check(a == c, "the same name is the same handle");
+  check(a != b, "different names are different handles");
+  test("localhost");
+  test("(none)");
+  test("trailing.dot.");
+  test(".leading.dot");
+  test("two..dots");
+  test("");
+
+  /* Dropping one reference keeps the name, dropping the last frees it. */
+  name_unref(c);
+  check(strcmp(name_str(a, buf), "ec2-1-2-3-4.compute-1.amazonaws.com") == 0,
+      "still there after one unref");
+  name_unref(a);
+  d = test("ec2-9-9-9-9.compute-1.amazonaws.com");
+  check(d == a, "a freed entry is reused");
+  check(strcmp(name_str(b, buf), "ec2-5-6-7-8.compute-1.amazonaws.com") == 0,
+      "the shared suffix outlives a name that used it");
+  name_ref(b);
+  name_unref(b);
+  check(strcmp(name_str(b, buf), "ec2-5-6-7-8.compute-1.amazonaws.com") == 0,
+      "ref and unref leave it alone");
+
+  /* Only the first label of d is its own, the rest is shared with b. */
+  name_ref(b);
+  check(name_bytes(b) == 0, "a name with two references has nothing to free");
+  name_unref(b);
+  {
+    const size_t total = names_bytes(), own = name_bytes(d);
+
+    check(own > 0 && own < total, "a name's own bytes are part of the total");
+    name_unref(d);
+    check(names_bytes() == total - own, "and are what unref frees");
+  }
+
+  memset(longname, 'x', sizeof(longname) - 1);
+  longname[sizeof(longname) - 1] = '\0';
+  e = name_intern(longname);
+  check(name_len(e) == NAME_BUF_LEN - 1, "long names are cut short");
+
+  test_many();
+  names_free();
+  return retcode;
+}
+/* vim:set ts=2 sts=2 sw=2 tw=80 et: */
@@ -7,138 +7,169 @@
  * GNU General Public License version 2. (see COPYING.GPL)
  */
 
+/* Names are looked up for every row of a table of ports or protocols, and
+ * never change after ncache_init(), so each kind is a flat array indexed by
+ * number, of offsets into one blob of names.  Offset 0 is the empty name.
+ * Nothing is written after startup, so any thread can look names up.
+ */
+
 #include "conv.h"
 #include "err.h"
 #include "ncache.h"
-#include "tree.h"
-#include "bsd.h" /* for strlcpy */
 
 #include <netinet/in.h> /* ntohs */
 #include <netdb.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
+#define NUM_PROTOS 256
+#define NUM_PORTS 65536
+
+static uint32_t *proto_ofs = NULL, *servtcp_ofs = NULL, *servudp_ofs = NULL;
+static char *blob = NULL;
+static size_t blob_len = 0, blob_size = 0;
+
+/* While loading: names in the order they were read, to be sorted by number.
+ * A number with more than one name gets them all, separated by spaces.
+ */
 struct name_rec {
-   RB_ENTRY(name_rec) ptree;
    int num;
+   unsigned int seq;
    char *name;
 };
 
-static int
-rec_cmp(struct name_rec *a, struct name_rec *b)
+struct name_list {
+   struct name_rec *recs;
+   unsigned int len, size;
+};
+
+static void
+add_rec(struct name_list *l, const int num, const char *name)
 {
-   if (a->num < b->num) return (-1); else
-   if (a->num > b->num) return (+1); else
-   return (0);
+   if (l->len == l->size) {
+      l->size = l->size ? l->size * 2 : 256;
+      l->recs = xrealloc(l->recs, l->size * sizeof(*l->recs));
+   }
+   l->recs[l->len].num = num;
+   l->recs[l->len].seq = l->len;
+   l->recs[l->len].name = xstrdup(name);
+   l->len++;
 }
 
-RB_HEAD(nc_tree, name_rec);
-RB_GENERATE_STATIC(nc_tree, name_rec, ptree, rec_cmp)
+static int
+rec_cmp(const void *va, const void *vb)
+{
+   const struct name_rec *a = va, *b = vb;
 
-static struct nc_tree
-   t_proto   = RB_INITIALIZER(&name_rec),
-   t_servtcp = RB_INITIALIZER(&name_rec),
-   t_servudp = RB_INITIALIZER(&name_rec);
+   if (a->num != b->num)
+      return (a->num < b->num) ? -1 : 1;
+   return (a->seq < b->seq) ? -1 : (a->seq > b->seq);
+}
 
 static void
-add_rec(struct nc_tree *tree, const int num, const char *name)
+blob_append(const char *s, const size_t len)
 {
-   struct name_rec *e, *r = xmalloc(sizeof(*r));
-
-   r->num = num;
-   e = RB_INSERT(nc_tree, tree, r);
-
-   if (e != NULL) {
-      size_t newlen;
-
-      /* record exists: append service name, free record */
-      newlen = strlen(e->name) + strlen(name) + 2;
-      e->name = xrealloc(e->name, newlen);
-      strlcat(e->name, " ", newlen);
-      strlcat(e->name, name, newlen);
-      free(r);
+   if (blob_len + len > blob_size) {
+      while (blob_len + len > blob_size)
+         blob_size = blob_size ? blob_size * 2 : 4096;
+      blob = xrealloc(blob, blob_size);
    }
-   else {
-      /* record added: fill out name field */
-      r->name = xstrdup(name);
+   memcpy(blob + blob_len, s, len);
+   blob_len += len;
+}
+
+/* Write l's names into the blob and return the array of their offsets. */
+static uint32_t *
+build(struct name_list *l, const unsigned int size)
+{
+   uint32_t *ofs = xcalloc(size, sizeof(*ofs));
+   unsigned int i;
+
+   qsort(l->recs, l->len, sizeof(*l->recs), rec_cmp);
+   for (i=0; i<l->len; i++) {
+      const struct name_rec *r = &(l->recs[i]);
+
+      if (i > 0 && r->num == l->recs[i-1].num) {
+         blob[blob_len-1] = ' '; /* instead of the last name's '\0' */
+      } else
+         ofs[r->num] = (uint32_t)blob_len;
+      blob_append(r->name, strlen(r->name) + 1);
+      free(r->name);
    }
+   free(l->recs);
+   return ofs;
 }
 
 void
 ncache_init(void)
 {
+   struct name_list protos = { NULL, 0, 0 }, tcp = { NULL, 0, 0 },
+                    udp = { NULL, 0, 0 };
    struct protoent *pe;
    struct servent *se;
-   int count, ctcp, cudp;
+   int count;
+
+   blob_append("", 1);
 
    count = 0;
    setprotoent(0);
    while ((pe = getprotoent()) != NULL) {
-      add_rec(&t_proto, pe->p_proto, pe->p_name);
+      if (pe->p_proto >= 0 && pe->p_proto < NUM_PROTOS)
+         add_rec(&protos, pe->p_proto, pe->p_name);
       count++;
    }
    endprotoent();
    verbosef("loaded %d protos", count);
 
-   count = ctcp = cudp = 0;
+   count = 0;
    setservent(0);
    while ((se = getservent()) != NULL) {
-      if (strcmp(se->s_proto, "tcp") == 0) {
-         add_rec(&t_servtcp, ntohs(se->s_port), se->s_name);
-         ctcp++;
-      }
-      else if (strcmp(se->s_proto, "udp") == 0) {
-         add_rec(&t_servudp, ntohs(se->s_port), se->s_name);
-         cudp++;
-      }
+      if (strcmp(se->s_proto, "tcp") == 0)
+         add_rec(&tcp, ntohs(se->s_port), se->s_name);
+      else if (strcmp(se->s_proto, "udp") == 0)
+         add_rec(&udp, ntohs(se->s_port), se->s_name);
       count++;
    }
    endservent();
-   verbosef("loaded %d tcp and %d udp servs, from total %d",
-      ctcp, cudp, count);
-}
-
-static void
-tree_free(struct nc_tree *tree)
-{
-   struct name_rec *curr, *next;
+   verbosef("loaded %u tcp and %u udp servs, from total %d",
+      tcp.len, udp.len, count);
 
-   for (curr = RB_MIN(nc_tree, tree); curr != NULL; curr = next) {
-      next = RB_NEXT(nc_tree, tree, curr);
-      RB_REMOVE(nc_tree, tree, curr);
-      free(curr->name);
-      free(curr);
-   }
+   proto_ofs = build(&protos, NUM_PROTOS);
+   servtcp_ofs = build(&tcp, NUM_PORTS);
+   servudp_ofs = build(&udp, NUM_PORTS);
+   verbosef("names of protos and servs take %u bytes", (unsigned int)blob_len);
 }
 
 void
 ncache_free(void)
 {
-   tree_free(&t_proto);
-   tree_free(&t_servtcp);
-   tree_free(&t_servudp);
+   free(proto_ofs);
+   free(servtcp_ofs);
+   free(servudp_ofs);
+   free(blob);
+   proto_ofs = servtcp_ofs = servudp_ofs = NULL;
+   blob = NULL;
+   blob_len = blob_size = 0;
 }
 
-#define FIND(tree,n) { \
-   struct name_rec r, *f; \
-   r.num = n; \
-   f = RB_FIND(nc_tree, &tree, &r); \
-   if (f == NULL) \
+/* Before ncache_init(), everything is nameless. */
+#define FIND(ofs, n, size) { \
+   if (ofs == NULL || n < 0 || n >= size) \
       return (""); \
-   else \
-      return (f->name); \
+   return (blob + ofs[n]); \
 }
 
 const char *
 getproto(const int proto)
-FIND(t_proto, proto)
+FIND(proto_ofs, proto, NUM_PROTOS)
 
 const char *
 getservtcp(const int port)
-FIND(t_servtcp, port)
+FIND(servtcp_ofs, port, NUM_PORTS)
 
 const char *
 getservudp(const int port)
-FIND(t_servudp, port)
+FIND(servudp_ofs, port, NUM_PORTS)
 
 /* vim:set ts=3 sw=3 tw=78 expandtab: */
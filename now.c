@@ -73,6 +73,18 @@ time_t now_mono(void) {
    return clock_mono.tv_sec;
 }
 
+int64_t now_mono_msec(void) {
+   struct timespec t;
+
+   clock_gettime(CLOCK_MONOTONIC, &t);
+   return (int64_t)t.tv_sec * 1000 + t.tv_nsec / 1000000;
+}
+
+int now_msec_to_real_second(void) {
+   assert(now_initialized);
+   return 1000 - (int)(clock_real.tv_nsec / 1000000);
+}
+
 static int before(const struct timespec *a, const struct timespec *b) {
    if (a->tv_sec < b->tv_sec)
       return 1;
@@ -140,6 +152,15 @@ static int64_t ts_diff(const struct timespec * const a,
           a->tv_nsec - b->tv_nsec;
 }
 
+int64_t timer_nsec(const struct timespec * const t0) {
+   struct timespec t1;
+
+   clock_gettime(CLOCK_MONOTONIC, &t1);
+   if (before(&t1, t0))
+      return 0;
+   return ts_diff(&t1, t0);
+}
+
 void timer_stop(const struct timespec * const t0,
                 const int64_t nsec,
                 const char *warning) {
@@ -23,6 +23,12 @@ void now_update(void); /* once per event loop (in darkstat.c) */
 time_t now_real(void);
 time_t now_mono(void);
 
+/* The monotonic clock in msec, read afresh rather than cached. */
+int64_t now_mono_msec(void);
+
+/* Msec from the cached time until the next real second starts, at least 1. */
+int now_msec_to_real_second(void);
+
 /* Monotonic times can be negative (a time from before the machine booted) so
  * treat them as signed. */
 time_t mono_to_real(const int64_t t);
@@ -35,4 +41,7 @@ void timer_stop(const struct timespec * const t,
                 const int64_t nsec,
                 const char *warning);
 
+/* Nanoseconds since timer_start(). */
+int64_t timer_nsec(const struct timespec * const t0);
+
 /* vim:set ts=3 sw=3 tw=80 et: */
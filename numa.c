@@ -0,0 +1,121 @@
+/* darkstat 3
+ * copyright (c) 2026 darkstat contributors.
+ *
+ * numa.c: keep darkstat on the NUMA node of its capture interface.
+ *
+ * You may use, modify and redistribute this file under the terms of the
+ * GNU General Public License version 2. (see COPYING.GPL)
+ */
+
+/* On a machine with more than one socket, the NIC hangs off one of them,
+ * and its packets land in that socket's memory.  With --numa, the capture
+ * threads and the main thread, which accounts and owns the hosts table, all
+ * run on that socket's CPUs and allocate from its memory, instead of
+ * wherever the scheduler and first touch happen to put them.
+ *
+ * This is done by hand, from /sys and two system calls, rather than
+ * depending on libnuma for so little.
+ */
+
+#include "cdefs.h"
+#include "err.h"
+#include "numa.h"
+
+#ifdef linux
+# include <linux/mempolicy.h> /* for MPOL_PREFERRED */
+# include <sys/syscall.h>
+# include <stdio.h>
+# include <stdlib.h>
+# include <string.h>
+# include <unistd.h>
+
+#define MAX_NODES 1024
+#define MAX_CPUS 4096
+#define MASK_BITS (8 * sizeof(unsigned long))
+
+/* Read the first line of a file in /sys, or return 0. */
+static int read_sys(const char *path, char *buf, const size_t len) {
+   FILE *f = fopen(path, "r");
+   int ok;
+
+   if (f == NULL)
+      return 0;
+   ok = (fgets(buf, (int)len, f) != NULL);
+   fclose(f);
+   if (ok)
+      buf[strcspn(buf, "\n")] = '\0';
+   return ok;
+}
+
+/* Parse a list of CPUs like "0-7,16-23" into mask, returning how many. */
+static int parse_cpulist(const char *s,
+   unsigned long mask[MAX_CPUS / MASK_BITS]) {
+   int n = 0;
+
+   memset(mask, 0, MAX_CPUS / 8);
+   while (*s != '\0') {
+      char *end;
+      long lo = strtol(s, &end, 10), hi = lo, cpu;
+
+      if (end == s)
+         return 0;
+      if (*end == '-') {
+         s = end + 1;
+         hi = strtol(s, &end, 10);
+         if (end == s || hi < lo)
+            return 0;
+      }
+      for (cpu = lo; cpu <= hi && cpu < MAX_CPUS; cpu++) {
+         mask[cpu / MASK_BITS] |= 1UL << (cpu % MASK_BITS);
+         n++;
+      }
+      s = end;
+      if (*s == ',')
+         s++;
+      else if (*s != '\0')
+         return 0;
+   }
+   return n;
+}
+
+void numa_bind_iface(const char *ifname) {
+   char path[256], buf[1024];
+   unsigned long cpus[MAX_CPUS / MASK_BITS], nodes[MAX_NODES / MASK_BITS];
+   int node, ncpus;
+
+   snprintf(path, sizeof(path), "/sys/class/net/%s/device/numa_node",
+      ifname);
+   if (!read_sys(path, buf, sizeof(buf)) ||
+       (node = atoi(buf)) < 0 || node >= MAX_NODES) {
+      verbosef("--numa: interface '%s' isn't on a NUMA node", ifname);
+      return;
+   }
+
+   snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+      node);
+   if (!read_sys(path, buf, sizeof(buf)) ||
+       (ncpus = parse_cpulist(buf, cpus)) == 0) {
+      warnx("--numa: can't read the CPUs of node %d", node);
+      return;
+   }
+   if (syscall(SYS_sched_setaffinity, 0, sizeof(cpus), cpus) == -1)
+      warn("--numa: sched_setaffinity(node %d)", node);
+
+   memset(nodes, 0, sizeof(nodes));
+   nodes[node / MASK_BITS] |= 1UL << (node % MASK_BITS);
+   if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, nodes,
+               (unsigned long)MAX_NODES + 1) == -1)
+      warn("--numa: set_mempolicy(node %d)", node);
+   verbosef("--numa: running on the %d CPUs of node %d, near '%s'",
+      ncpus, node, ifname);
+}
+
+#else /* !linux */
+
+void numa_bind_iface(const char *ifname _unused_) {
+   errx(1, "--numa is only supported on Linux");
+}
+
+#endif
+
+/* vim:set ts=3 sw=3 tw=78 expandtab: */
@@ -0,0 +1,20 @@
+/* darkstat 3
+ * copyright (c) 2026 darkstat contributors.
+ *
+ * numa.h: keep darkstat on the NUMA node of its capture interface.
+ *
+ * You may use, modify and redistribute this file under the terms of the
+ * GNU General Public License version 2. (see COPYING.GPL)
+ */
+#ifndef __DARKSTAT_NUMA_H
+#define __DARKSTAT_NUMA_H
+
+/* Run the calling thread, and every thread it starts after, on the CPUs of
+ * the interface's node, and prefer that node's memory for what they
+ * allocate.  Does nothing if the interface isn't on a node.  Must be called
+ * before chroot(), as it reads /sys.
+ */
+void numa_bind_iface(const char *ifname);
+
+#endif /* __DARKSTAT_NUMA_H */
+/* vim:set ts=3 sw=3 tw=78 expandtab: */
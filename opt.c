@@ -0,0 +1,55 @@
+/* darkstat 3
+ * copyright (c) 2026 darkstat contributors.
+ *
+ * opt.c: global options, with their defaults.  darkstat.c sets them from
+ * the command line, darkstat-merge and decode_bench use them as they are.
+ *
+ * You may use, modify and redistribute this file under the terms of the
+ * GNU General Public License version 2. (see COPYING.GPL)
+ */
+
+#include "opt.h"
+
+/* Capture options. */
+int opt_want_pppoe = 0;
+int opt_want_macs = 1;
+int opt_want_hexdump = 0;
+int opt_want_snaplen = -1;
+int opt_wait_secs = -1;
+int opt_capture_threads = 0;
+unsigned int opt_ring_size = 0;
+unsigned int opt_fanout = 1;
+int opt_fanout_cpu = 0;
+unsigned int opt_xdp_queues = 0;
+unsigned int opt_queue_size = 0;
+int opt_want_numa = 0;
+int opt_want_huge_pages = 0;
+unsigned int opt_pf_cache_max = 1 << 18;
+unsigned int opt_pf_interval = 1000;
+
+/* DNS options. */
+unsigned int opt_dns_workers = 8;
+unsigned int opt_dns_timeout = 0;
+unsigned int opt_dns_cache = 4096;
+
+/* Error/logging options. */
+int opt_want_verbose = 0;
+int opt_want_syslog = 0;
+
+/* Accounting options. */
+unsigned int opt_highest_port = 65535;
+int opt_want_local_only = 0;
+
+/* Hosts table reduction. */
+unsigned int opt_hosts_max = 1000;
+unsigned int opt_hosts_keep = 500;
+unsigned int opt_memory_limit = 0;
+unsigned int opt_admit_bytes = 0;
+unsigned int opt_ports_max = 60;
+unsigned int opt_ports_keep = 30;
+
+/* Hosts output options. */
+int opt_want_lastseen = 1;
+int opt_want_peers = 1;
+
+/* vim:set ts=3 sw=3 tw=78 expandtab: */
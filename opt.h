@@ -10,6 +10,21 @@ extern int opt_want_macs;
 extern int opt_want_hexdump;
 extern int opt_want_snaplen;
 extern int opt_wait_secs;
+extern int opt_capture_threads;
+extern unsigned int opt_ring_size;
+extern unsigned int opt_fanout;
+extern int opt_fanout_cpu;
+extern unsigned int opt_xdp_queues;
+extern unsigned int opt_queue_size;
+extern int opt_want_numa;       /* see numa.c */
+extern int opt_want_huge_pages; /* see slab.c */
+extern unsigned int opt_pf_cache_max; /* pf states to keep track of */
+extern unsigned int opt_pf_interval; /* longest between reads, in msec */
+
+/* DNS options. */
+extern unsigned int opt_dns_workers;
+extern unsigned int opt_dns_timeout; /* secs, or 0 for the resolver's own */
+extern unsigned int opt_dns_cache;   /* names to remember, or 0 for none */
 
 /* Error/logging options. */
 extern int opt_want_verbose;
@@ -24,11 +39,14 @@ extern int opt_want_local_only;
  */
 extern unsigned int opt_hosts_max;
 extern unsigned int opt_hosts_keep;
+extern unsigned int opt_memory_limit; /* MB, or 0, see hosts_db_reduce() */
+extern unsigned int opt_admit_bytes; /* see admit.c */
 extern unsigned int opt_ports_max;
 extern unsigned int opt_ports_keep;
 
 /* Hosts output options. */
 extern int opt_want_lastseen;
+extern int opt_want_peers; /* count distinct peers, see host_add_peer() */
 
 /* Initialized in cap.c, added to <title> */
 extern char *title_interfaces;
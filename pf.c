@@ -18,6 +18,7 @@
 #include "err.h"
 #include "hosts_db.h"
 #include "localip.h"
+#include "metrics.h"
 #include "now.h"
 #include "opt.h"
 #include "queue.h"
@@ -30,11 +31,20 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
 
 #define MIN_NUM_STATES 1024
-#define NUM_STATE_INC  1024
 
-#define DEFAULT_CACHE_SIZE 10000
+/* The whole state table is copied out on every read, so how often that
+ * happens follows how long it takes: reading keeps to about 1/20th of the
+ * time, but no less often than every opt_pf_interval msec.
+ */
+#define PF_INTERVAL_MIN 100 /* msec */
+#define PF_READ_SHARE   20
+
+static int64_t next_read = 0;
+static int read_interval = PF_INTERVAL_MIN;
+static uint64_t reads = 0;
 
 struct pfsync_state *state_buf = NULL;
 size_t state_buf_len = 0;
@@ -57,7 +67,7 @@ void pfsync_start(void) {
       errx(1, "pfsync_start");
    }
 
-   if (cache_init(1<<16)) {
+   if (cache_init((int)opt_pf_cache_max)) {
       errx(1, "pfsync_start: cache_init");
    }
 
@@ -65,15 +75,43 @@ void pfsync_start(void) {
    localip_init(&local_ips);
 }
 
-void pfsync_fd_set(fd_set *read_set, int *max_fd,
-   struct timeval *timeout, int *need_timeout) {
-   assert(*need_timeout == 0); /* we're first to get a shot at the fd_set */
+void pfsync_metrics(struct str *buf) {
+   if (pf_dev == -1)
+      return;
+   metrics_header(buf, "darkstat_pf_states", "gauge",
+      "pf states in the cache, to tell how much each has grown.");
+   str_appendf(buf, "darkstat_pf_states %d\n", cache_size);
+   metrics_header(buf, "darkstat_pf_state_lookups_total", "counter",
+      "pf states looked up in the cache.");
+   str_appendf(buf, "darkstat_pf_state_lookups_total %qu\n",
+      (qu)cache_stats.lookups);
+   metrics_header(buf, "darkstat_pf_state_misses_total", "counter",
+      "pf states that weren't in the cache yet.");
+   str_appendf(buf, "darkstat_pf_state_misses_total %qu\n",
+      (qu)cache_stats.misses);
+   metrics_header(buf, "darkstat_pf_state_cache_full_total", "counter",
+      "New pf states that didn't fit in the cache, so went uncounted.");
+   str_appendf(buf, "darkstat_pf_state_cache_full_total %qu\n",
+      (qu)cache_stats.full);
+   metrics_header(buf, "darkstat_pf_state_expired_total", "counter",
+      "pf states dropped from the cache after leaving the state table.");
+   str_appendf(buf, "darkstat_pf_state_expired_total %qu\n",
+      (qu)cache_stats.expired);
+   metrics_header(buf, "darkstat_pf_reads_total", "counter",
+      "Times the pf state table was read.");
+   str_appendf(buf, "darkstat_pf_reads_total %qu\n", (qu)reads);
+   metrics_header(buf, "darkstat_pf_read_interval_msec", "gauge",
+      "How often the pf state table is read, as it is now.");
+   str_appendf(buf, "darkstat_pf_read_interval_msec %d\n", read_interval);
+}
+
+int pfsync_timeout_msec(void) {
+   int64_t left = next_read - now_mono_msec();
 
-   *need_timeout = 1;
-   timeout->tv_sec = 0;
-   timeout->tv_usec = 1000;
+   return (left > 0) ? (int)left : 0;
 }
 
+/* Room for ns states, and an eighth more for the table to grow into. */
 void
 alloc_buf(size_t ns)
 {
@@ -82,10 +120,9 @@ alloc_buf(size_t ns)
 	if (ns < MIN_NUM_STATES)
 		ns = MIN_NUM_STATES;
 
-	len = ns;
+	len = ns + ns / 8;
 
-	if (len >= state_buf_len) {
-		len += NUM_STATE_INC;
+	if (len > state_buf_len) {
 		state_buf = reallocarray(state_buf, len,
 		    sizeof(struct pfsync_state));
 		if (state_buf == NULL)
@@ -94,95 +131,93 @@ alloc_buf(size_t ns)
 	}
 }
 
-int state_simple_idx(struct pfsync_state *s, int idx) {
-  struct pfsync_state_key *sk, *nk;
-
-  sk = &s->key[PF_SK_STACK];
-  nk = &s->key[PF_SK_WIRE];
-
-  if (sk->af != nk->af || PF_ANEQ(&sk->addr[idx], &nk->addr[idx], sk->af) ||
-      sk->port[idx] != nk->port[idx] || sk->rdomain != nk->rdomain) {
-    return 0;
-  }
-  return 1;
-}
-
-void pfsync_handle_state(struct pfsync_state * s, struct sc_ent * ent) {
-   int afto, dir;
-
+/* pfvar.h #defines these, which clash with struct addr's members. */
 #undef v4
+#undef v6
 
-   // FIXME: support ipv6
-   if (s->key[0].af != AF_INET || s->key[1].af != AF_INET) {
-      return;
-   }
-   if (!state_simple_idx(s, 0) || !state_simple_idx(s, 1)) {
-      return;
-   }
-
-   u_int64_t bytes_delta[2];
-   u_int64_t packets_delta[2];
-   if (ent != NULL) {
-      bytes_delta[0] = ent->bytes_delta[0];
-      bytes_delta[1] = ent->bytes_delta[1];
-      packets_delta[0] = ent->packets_delta[0];
-      packets_delta[1] = ent->packets_delta[1];
+static void pf_to_addr(struct addr *a, const struct pf_addr *pa,
+   const sa_family_t af) {
+   if (af == AF_INET6) {
+      a->family = IPv6;
+      memcpy(&a->ip.v6, &pa->pfa.v6, sizeof(a->ip.v6));
    } else {
-      bytes_delta[0] = COUNTER(s->bytes[0]);
-      bytes_delta[1] = COUNTER(s->bytes[1]);
-      packets_delta[0] = COUNTER(s->packets[0]);
-      packets_delta[1] = COUNTER(s->packets[1]);
+      a->family = IPv4;
+      a->ip.v4 = pa->pfa.v4.s_addr;
    }
+}
 
-   afto = s->key[PF_SK_STACK].af == s->key[PF_SK_WIRE].af ? 0 : 1;
-   dir = afto ? PF_OUT : s->direction;
-
-   struct pktsummary sm;
-   memset(&sm, 0, sizeof(sm));
-
-   sm.src.family = IPv4;
-   sm.dst.family = IPv4;
-   sm.proto = s->proto;
-
-   sm.len = (dir == PF_OUT) ? bytes_delta[0] : bytes_delta[1];
-   sm.packets = (dir == PF_OUT) ? packets_delta[0] : packets_delta[1];
-
-   if (sm.len > 0) {
-      struct pfsync_state_key *ks = &s->key[afto ? PF_SK_STACK : PF_SK_WIRE];
-      sm.src.ip.v4 = ks->addr[1].pfa.v4.s_addr;
-      sm.src_port = ntohs(ks->port[1]);
+/* One end of a state, as the host there really is. */
+struct pf_end {
+   struct addr addr;
+   uint16_t port;
+};
 
-      sm.dst.ip.v4 = ks->addr[0].pfa.v4.s_addr;
-      sm.dst_port = ntohs(ks->port[0]);
+static void pf_end_of(struct pf_end *e, const struct pfsync_state_key *k,
+   const int idx, const int ports) {
+   pf_to_addr(&e->addr, &k->addr[idx], k->af);
+   e->port = ports ? ntohs(k->port[idx]) : 0;
+}
 
-      acct_for(&sm, &local_ips);
-   }
+static void pf_acct(const struct pf_end *from, const struct pf_end *to,
+   const uint8_t proto, const u_int64_t bytes, const u_int64_t packets) {
+   struct pktsummary sm;
 
-   sm.len = (dir == PF_OUT) ? bytes_delta[1] : bytes_delta[0];
-   sm.packets = (dir == PF_OUT) ? packets_delta[1] : packets_delta[0];
-   if (sm.len > 0) {
-      struct pfsync_state_key *ks = &s->key[PF_SK_STACK];
-      sm.src.ip.v4 = ks->addr[0].pfa.v4.s_addr;
-      sm.src_port = ntohs(ks->port[0]);
+   if (bytes == 0)
+      return;
+   memset(&sm, 0, sizeof(sm));
+   sm.src = from->addr;
+   sm.src_port = from->port;
+   sm.dst = to->addr;
+   sm.dst_port = to->port;
+   sm.proto = proto;
+   sm.len = bytes;
+   sm.packets = packets;
+   acct_for(&sm, &local_ips);
+}
 
-      sm.dst.ip.v4 = ks->addr[1].pfa.v4.s_addr;
-      sm.dst_port = ntohs(ks->port[1]);
+/* A state has two keys: the wire key, as its packets look on the
+ * interface, and the stack key, as they look to the rest of the stack,
+ * which differ when nat-to, rdr-to, binat-to or af-to translated them.
+ * In both, addr[0] is the end on the far side of the interface and
+ * addr[1] the end on this side, except that af-to swaps them in the stack
+ * key.  So the hosts that really talked are the far end of the wire key
+ * and the near end of the stack key.
+ *
+ * bytes[0] and packets[0] went in the direction of the state, from the end
+ * that started it, and [1] came back.  af-to states are made inbound.
+ */
+void pfsync_handle_state(struct pfsync_state *s, struct sc_ent *ent) {
+   const struct pfsync_state_key *wire = &s->key[PF_SK_WIRE],
+      *stack = &s->key[PF_SK_STACK];
+   const int afto = (wire->af != stack->af);
+   const int ports = (s->proto == IPPROTO_TCP || s->proto == IPPROTO_UDP);
+   struct pf_end far, near;
+   const struct pf_end *from, *to;
+
+   if ((wire->af != AF_INET && wire->af != AF_INET6) ||
+       (stack->af != AF_INET && stack->af != AF_INET6))
+      return;
 
-      acct_for(&sm, &local_ips);
+   pf_end_of(&far, wire, 0, ports);
+   pf_end_of(&near, stack, afto ? 0 : 1, ports);
+   if (afto || s->direction == PF_IN) {
+      from = &far;
+      to = &near;
+   } else {
+      from = &near;
+      to = &far;
    }
+   pf_acct(from, to, s->proto, ent->bytes_delta[0], ent->packets_delta[0]);
+   pf_acct(to, from, s->proto, ent->bytes_delta[1], ent->packets_delta[1]);
 }
 
-int pfsync_poll(void) {
-   int n;
+/* Copy the state table into state_buf.  This takes one ioctl, unless the
+ * table has outgrown the buffer, when it's sized and read again.
+ */
+static void read_states(void) {
 	struct pfioc_states ps;
 
-   ps.ps_len = 0;
-   ps.ps_states = NULL;
-
-   if (ioctl(pf_dev, DIOCGETSTATES, &ps) == -1) {
-      errx(1, "DIOCGETSTATES");
-   }
-
+	alloc_buf(0);
 	for (;;) {
 		size_t sbytes = state_buf_len * sizeof(struct pfsync_state);
 
@@ -194,12 +229,26 @@ int pfsync_poll(void) {
 		}
 		num_states = ps.ps_len / sizeof(struct pfsync_state);
 
+		/* If it filled the buffer, there may have been more. */
 		if (ps.ps_len < sbytes)
 			break;
 
-		alloc_buf(num_states);
+		ps.ps_len = 0; /* asks for the size of the table */
+		if (ioctl(pf_dev, DIOCGETSTATES, &ps) == -1) {
+			errx(1, "DIOCGETSTATES");
+		}
+		alloc_buf(ps.ps_len / sizeof(struct pfsync_state));
 	}
+}
+
+int pfsync_poll(void) {
+   size_t n;
+   int64_t start = now_mono_msec(), took;
 
+   if (start < next_read)
+      return 1;
+
+   read_states();
    for (n = 0; n < num_states; n++) {
       struct sc_ent *ent = cache_state(state_buf + n);
       if (ent != NULL) {
@@ -207,6 +256,12 @@ int pfsync_poll(void) {
       }
    }
    cache_endupdate();
+   reads++;
+
+   took = now_mono_msec() - start;
+   read_interval = (int)MAX(took * PF_READ_SHARE, PF_INTERVAL_MIN);
+   read_interval = MIN(read_interval, (int)opt_pf_interval);
+   next_read = start + read_interval;
 
    return 1;
 }
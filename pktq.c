@@ -0,0 +1,139 @@
+/* darkstat 3
+ * copyright (c) 2026 darkstat contributors.
+ *
+ * pktq.c: lock-free queue of packet summaries, from one thread to another.
+ *
+ * You may use, modify and redistribute this file under the terms of the
+ * GNU General Public License version 2. (see COPYING.GPL)
+ */
+
+/* A ring with one writer and one reader, which own head and tail
+ * respectively.  Each keeps its own copy of the other's index, and only
+ * reads the real one when its copy says the ring is full (or empty), so the
+ * two threads mostly stay out of each other's cache lines.  The indexes
+ * count up forever, and are masked to find a slot.  Each thread publishes
+ * its index with a release store, after it's done with the slots, and the
+ * other reads it with an acquire load, before it touches them.
+ */
+
+#include "decode.h"
+#include "err.h"
+#include "pktq.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PKTQ_LINE 64 /* bytes in a cache line, or more */
+
+struct pktq {
+   /* The producer's. */
+   uint32_t head;
+   uint32_t tail_seen;
+   char pad1[PKTQ_LINE - 2 * sizeof(uint32_t)];
+
+   /* The consumer's. */
+   uint32_t tail;
+   uint32_t head_seen;
+   char pad2[PKTQ_LINE - 2 * sizeof(uint32_t)];
+
+   /* Neither changes these. */
+   uint32_t mask;
+   struct pktsummary *recs;
+};
+
+struct pktq *pktq_make(const size_t size) {
+   struct pktq *q;
+   void *mem;
+   uint32_t n = 1;
+
+   while (n < size && n < (UINT32_C(1) << 30))
+      n *= 2;
+   if (posix_memalign(&mem, PKTQ_LINE, sizeof(*q)) != 0)
+      errx(1, "posix_memalign(%d) failed", PKTQ_LINE);
+   q = mem;
+   memset(q, 0, sizeof(*q));
+   q->mask = n - 1;
+   q->recs = malloc((size_t)n * sizeof(*q->recs));
+   if (q->recs == NULL)
+      errx(1, "can't allocate a queue of %u packets", n);
+   return q;
+}
+
+void pktq_free(struct pktq *q) {
+   free(q->recs);
+   free(q);
+}
+
+/* Copy n summaries into the ring from slot i on, wrapping around. */
+static void pktq_copy_in(struct pktq *q, const uint32_t i,
+   const struct pktsummary *sms, const size_t n) {
+   const size_t at = i & q->mask, first = q->mask + 1 - at;
+
+   if (n <= first)
+      memcpy(q->recs + at, sms, n * sizeof(*sms));
+   else {
+      memcpy(q->recs + at, sms, first * sizeof(*sms));
+      memcpy(q->recs, sms + first, (n - first) * sizeof(*sms));
+   }
+}
+
+static void pktq_copy_out(const struct pktq *q, const uint32_t i,
+   struct pktsummary *sms, const size_t n) {
+   const size_t at = i & q->mask, first = q->mask + 1 - at;
+
+   if (n <= first)
+      memcpy(sms, q->recs + at, n * sizeof(*sms));
+   else {
+      memcpy(sms, q->recs + at, first * sizeof(*sms));
+      memcpy(sms + first, q->recs, (n - first) * sizeof(*sms));
+   }
+}
+
+size_t pktq_put(struct pktq *q, const struct pktsummary *sms,
+   const size_t n) {
+   const uint32_t head = q->head; /* only we write it */
+   size_t room = q->mask + 1 - (uint32_t)(head - q->tail_seen);
+
+   if (room < n) {
+      q->tail_seen = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+      room = q->mask + 1 - (uint32_t)(head - q->tail_seen);
+   }
+   if (room > n)
+      room = n;
+   if (room == 0)
+      return 0;
+   pktq_copy_in(q, head, sms, room);
+   __atomic_store_n(&q->head, head + (uint32_t)room, __ATOMIC_RELEASE);
+   return room;
+}
+
+size_t pktq_get(struct pktq *q, struct pktsummary *sms, const size_t n) {
+   const uint32_t tail = q->tail; /* only we write it */
+   size_t avail = (uint32_t)(q->head_seen - tail);
+
+   if (avail < n) {
+      q->head_seen = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+      avail = (uint32_t)(q->head_seen - tail);
+   }
+   if (avail > n)
+      avail = n;
+   if (avail == 0)
+      return 0;
+   pktq_copy_out(q, tail, sms, avail);
+   __atomic_store_n(&q->tail, tail + (uint32_t)avail, __ATOMIC_RELEASE);
+   return avail;
+}
+
+size_t pktq_len(const struct pktq *q) {
+   /* Tail first: head only moves up, so it can't be read as behind it. */
+   const uint32_t tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+
+   return (uint32_t)(__atomic_load_n(&q->head, __ATOMIC_ACQUIRE) - tail);
+}
+
+size_t pktq_size(const struct pktq *q) {
+   return (size_t)q->mask + 1;
+}
+
+/* vim:set ts=3 sw=3 tw=78 expandtab: */
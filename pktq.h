@@ -0,0 +1,35 @@
+/* darkstat 3
+ * copyright (c) 2026 darkstat contributors.
+ *
+ * pktq.h: lock-free queue of packet summaries, from one thread to another.
+ *
+ * You may use, modify and redistribute this file under the terms of the
+ * GNU General Public License version 2. (see COPYING.GPL)
+ */
+#ifndef __DARKSTAT_PKTQ_H
+#define __DARKSTAT_PKTQ_H
+
+#include <stddef.h> /* for size_t */
+
+struct pktq;
+struct pktsummary;
+
+/* Holds size summaries, which is rounded up to a power of two. */
+struct pktq *pktq_make(const size_t size);
+void pktq_free(struct pktq *q);
+
+/* Only the producing thread calls pktq_put(), and only the consuming thread
+ * calls pktq_get().  Neither ever waits: they return how many summaries
+ * they could copy in or out, which can be fewer than n.
+ */
+size_t pktq_put(struct pktq *q, const struct pktsummary *sms, const size_t n);
+size_t pktq_get(struct pktq *q, struct pktsummary *sms, const size_t n);
+
+/* How many summaries are waiting, from either thread, or any other.  It
+ * can be out of date by the time it returns.
+ */
+size_t pktq_len(const struct pktq *q);
+size_t pktq_size(const struct pktq *q);
+
+#endif /* __DARKSTAT_PKTQ_H */
+/* vim:set ts=3 sw=3 tw=78 expandtab: */
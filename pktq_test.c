@@ -0,0 +1,109 @@
+/* darkstat 3
+ * copyright (c) 2026 darkstat contributors.
+ *
+ * You may use, modify and redistribute this file under the terms of the
+ * GNU General Public License version 2. (see COPYING.GPL)
+ */
+
+#include "decode.h"
+#include "err.h"
+#include "pktq.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* pktq.c only needs this from err.c. */
+void errx(const int code, const char *format, ...) {
+  (void)format;
+  exit(code);
+}
+
+static int retcode = 0;
+
+static void check(const int ok, const char *what) {
+  printf("%s: %s\n", ok ? "PASS" : "FAIL", what);
+  if (!ok)
+    retcode = 1;
+}
+
+#define TOTAL 200000
+
+/* Puts summaries numbered 0 to TOTAL-1, in batches of varying sizes. */
+static void *producer(void *arg) {
+  struct pktq *q = arg;
+  struct pktsummary batch[37];
+  uint64_t next = 0;
+
+  memset(batch, 0, sizeof(batch));
+  while (next < TOTAL) {
+    size_t n = 1 + (size_t)(next % 37), done = 0, i;
+
+    if (n > TOTAL - next)
+      n = (size_t)(TOTAL - next);
+    for (i = 0; i < n; i++)
+      batch[i].packets = next + i;
+    while (done < n) {
+      const size_t put = pktq_put(q, batch + done, n - done);
+
+      if (put == 0)
+        sched_yield(); /* there might only be one CPU */
+      done += put;
+    }
+    next += n;
+  }
+  return NULL;
+}
+
+static void test_threads(void) {
+  struct pktq *q = pktq_make(100); /* rounded up to 128 */
+  struct pktsummary got[50];
+  pthread_t thread;
+  uint64_t next = 0, bad = 0;
+
+  check(pktq_size(q) == 128, "size is rounded up to a power of two");
+  if (pthread_create(&thread, NULL, producer, q) != 0) {
+    check(0, "pthread_create");
+    return;
+  }
+  while (next < TOTAL) {
+    const size_t n = pktq_get(q, got, 1 + (size_t)(next % 50));
+    size_t i;
+
+    if (n == 0)
+      sched_yield();
+
+    for (i = 0; i < n; i++)
+      if (got[i].packets != next++)
+        bad++;
+  }
+  pthread_join(thread, NULL);
+  check(bad == 0, "lots of summaries come out in order");
+  check(pktq_len(q) == 0, "and the queue is empty after");
+  pktq_free(q);
+}
+
+int main() {
+  struct pktq *q = pktq_make(8);
+  struct pktsummary in[10], out[10];
+  size_t i;
+
+  memset(in, 0, sizeof(in));
+  for (i = 0; i < 10; i++)
+    in[i].packets = i;
+  check(pktq_get(q, out, 10) == 0, "nothing comes out of an empty queue");
+  check(pktq_put(q, in, 10) == 8, "only as many go in as fit");
+  check(pktq_len(q) == 8, "and they're all waiting");
+  check(pktq_put(q, in, 1) == 0, "none go into a full one");
+  check(pktq_get(q, out, 5) == 5 && out[4].packets == 4, "some come out");
+  check(pktq_put(q, in + 8, 2) == 2, "more go in, wrapping around");
+  check(pktq_get(q, out, 10) == 5 && out[0].packets == 5 &&
+        out[4].packets == 9, "the rest come out, in order");
+  pktq_free(q);
+
+  test_threads();
+  return retcode;
+}
+/* vim:set ts=2 sts=2 sw=2 tw=80 et: */
@@ -60,6 +60,7 @@ favicon.h \
 graph_db.c \
 graph_db.h \
 graphjs.h \
+graphjsgz.h \
 hosts_db.c \
 hosts_db.h \
 hosts_sort.c \
@@ -74,6 +75,7 @@ ncache.c \
 ncache.h \
 now.c \
 now.h \
+opt.c \
 opt.h \
 pidfile.c \
 pidfile.h \
@@ -82,6 +84,7 @@ static \
 str.c \
 str.h \
 stylecss.h \
+stylecssgz.h \
 tree.h \
 "
 # end packing list
@@ -98,7 +101,7 @@ run() {
 PKG=$NAME-$VERSION
 say releasing $PKG
 run make depend
-run make graphjs.h stylecss.h
+run make graphjs.h graphjsgz.h stylecss.h stylecssgz.h
 run autoconf
 run autoheader
 run ./config.status
@@ -0,0 +1,295 @@
+/* darkstat 3
+ * copyright (c) 2026 darkstat contributors.
+ *
+ * sensor.c: federation, pulling what other darkstats have counted
+ *
+ * You may use, modify and redistribute this file under the terms of the
+ * GNU General Public License version 2. (see COPYING.GPL)
+ */
+
+/* An aggregator is a darkstat given one or more --sensor, which are other
+ * darkstats.  Every interval, it asks each of them for /delta?since=<gen>:
+ * the hosts they've counted since generation gen of theirs (the one they
+ * sent last time), as host records of the version hosts_db_export_host()
+ * writes, ver5 (see export-format.txt).  Sensors from before PEERS DATA
+ * send ver4, which reads the same way without the peers.
+ *
+ * The records hold each sensor's totals, not what's new, so a pull that
+ * fails or repeats does no harm: the aggregator keeps a mirror of the last
+ * totals it saw from each sensor, and adds only how much they've grown to
+ * its own hosts_db.  The bytes in a sensor's graphs are handled the same
+ * way, and go in the aggregator's current bar.
+ *
+ * Each pull runs in a snapshot child, so a slow sensor doesn't hold up the
+ * main loop, and the delta is folded in once the child has it all.
+ */
+
+#include "conv.h"
+#include "db.h"
+#include "err.h"
+#include "graph_db.h"
+#include "hosts_db.h"
+#include "now.h"
+#include "queue.h"
+#include "sensor.h"
+#include "snapshot.h"
+#include "str.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SENSOR_PORT "667"  /* darkstat's default */
+#define SENSOR_TIMEOUT 60  /* seconds, for a whole pull */
+
+struct sensor {
+   STAILQ_ENTRY(sensor) entries;
+   char *name;                      /* as given */
+   char *host, *port;
+   struct sockaddr_storage addr;
+   socklen_t addrlen;
+   int running;                     /* a pull is under way */
+   time_t next_pull;                /* now_mono() */
+   unsigned int since;              /* its generation, as of the last pull */
+   uint64_t graph_in, graph_out;    /* its graph totals, as of then */
+   struct hashtable *mirror;        /* its hosts' totals, as of then */
+};
+
+static STAILQ_HEAD(sensors_head, sensor) sensors =
+   STAILQ_HEAD_INITIALIZER(sensors);
+static unsigned int pull_interval;
+
+/* ---------------------------------------------------------------------------
+ * Sensor side.
+ */
+struct str *
+sensor_delta(const char *query)
+{
+   char *qs_since = qs_get(query, "since"), *ep;
+   unsigned long since = 0;
+
+   if (qs_since != NULL) {
+      since = strtoul(qs_since, &ep, 10);
+      if ((qs_since[0] == '\0') || (*ep != '\0'))
+         since = 0; /* everything */
+   }
+   free(qs_since);
+   return db_delta((unsigned int)since);
+}
+
+/* ---------------------------------------------------------------------------
+ * Aggregator side.
+ */
+
+/* Split host[:port] or [v6addr][:port]. */
+void
+sensor_add(const char *spec)
+{
+   struct sensor *s = xcalloc(1, sizeof(*s));
+   const char *colon;
+
+   s->name = xstrdup(spec);
+   if (spec[0] == '[') {
+      const char *end = strchr(spec, ']');
+
+      if ((end == NULL) || ((end[1] != '\0') && (end[1] != ':')))
+         errx(1, "invalid sensor \"%s\"", spec);
+      s->host = split_string(spec, 1, (size_t)(end - spec));
+      colon = (end[1] == ':') ? end + 1 : NULL;
+   } else {
+      colon = strchr(spec, ':');
+      if ((colon != NULL) && (strchr(colon + 1, ':') != NULL))
+         colon = NULL; /* a bare IPv6 address */
+      s->host = (colon == NULL) ? xstrdup(spec) :
+         split_string(spec, 0, (size_t)(colon - spec));
+   }
+   s->port = xstrdup(((colon == NULL) || (colon[1] == '\0')) ?
+      SENSOR_PORT : colon + 1);
+   STAILQ_INSERT_TAIL(&sensors, s, entries);
+}
+
+void
+sensor_init(const unsigned int interval)
+{
+   struct sensor *s;
+
+   pull_interval = interval;
+   STAILQ_FOREACH(s, &sensors, entries) {
+      struct addrinfo hints, *ai;
+      int ret;
+
+      memset(&hints, 0, sizeof(hints));
+      hints.ai_family = AF_UNSPEC;
+      hints.ai_socktype = SOCK_STREAM;
+      if ((ret = getaddrinfo(s->host, s->port, &hints, &ai)) != 0)
+         errx(1, "can't look up sensor \"%s\": %s", s->name,
+            gai_strerror(ret));
+      assert(ai->ai_addrlen <= sizeof(s->addr));
+      memcpy(&(s->addr), ai->ai_addr, ai->ai_addrlen);
+      s->addrlen = ai->ai_addrlen;
+      freeaddrinfo(ai);
+      s->next_pull = 0; /* straight away */
+      verbosef("pulling from sensor %s every %u secs", s->name, interval);
+   }
+}
+
+/* Find the body of an HTTP reply, if it's a 200. */
+static const char *
+reply_body(const char *reply, const size_t len)
+{
+   size_t i;
+
+   if ((len < 12) || (memcmp(reply, "HTTP/1.", 7) != 0) ||
+       (memcmp(reply + 8, " 200", 4) != 0))
+      return NULL;
+   for (i = 12; i + 4 <= len; i++)
+      if (memcmp(reply + i, "\r\n\r\n", 4) == 0)
+         return reply + i + 4;
+   return NULL;
+}
+
+/* Runs in the snapshot child: fetch the delta, and send back its body. */
+static int
+sensor_pull(void *arg, const int fd)
+{
+   const struct sensor *s = arg;
+   struct str *req = str_make(), *reply = str_make();
+   char buf[65536], *r;
+   const char *body;
+   size_t len;
+   ssize_t got;
+   int sock;
+
+   alarm(SENSOR_TIMEOUT); /* if the sensor stops answering, give up */
+   if ((sock = socket(s->addr.ss_family, SOCK_STREAM, 0)) == -1) {
+      warn("sensor %s: socket", s->name);
+      return 0;
+   }
+   if (connect(sock, (const struct sockaddr *)&(s->addr),
+               s->addrlen) == -1) {
+      warn("sensor %s: connect", s->name);
+      return 0;
+   }
+   /* HTTP/1.0, so the sensor closes the connection when it's done. */
+   str_appendf(req, "GET /delta?since=%u HTTP/1.0\r\nHost: %s\r\n\r\n",
+      s->since, s->host);
+   str_extract(req, &len, &r);
+   if (!writen(sock, r, len))
+      return 0;
+   free(r);
+   for (;;) {
+      got = read(sock, buf, sizeof(buf));
+      if (got == -1 && errno == EINTR)
+         continue;
+      if (got == -1) {
+         warn("sensor %s: read", s->name);
+         return 0;
+      }
+      if (got == 0)
+         break;
+      str_appendn(reply, buf, (size_t)got);
+   }
+   close(sock);
+   str_extract(reply, &len, &r);
+   if ((body = reply_body(r, len)) == NULL) {
+      warnx("sensor %s: bad reply", s->name);
+      return 0;
+   }
+   return writen(fd, body, len - (size_t)(body - r));
+}
+
+/* How much now is past *last, which becomes now. */
+static uint64_t
+grown(uint64_t *last, const uint64_t now)
+{
+   const uint64_t d = (now >= *last) ? now - *last : now;
+
+   *last = now;
+   return d;
+}
+
+/* The pull is done: fold in whatever it got. */
+static void
+sensor_pulled(void *arg, char *buf, size_t len, int ok)
+{
+   struct sensor *s = arg;
+   struct db_delta d;
+
+   s->running = 0;
+   if (!ok) {
+      verbosef("sensor %s: pull failed", s->name);
+      free(buf);
+      return;
+   }
+   ok = db_delta_read(buf, len, &d);
+   free(buf);
+   if (!ok) {
+      warnx("sensor %s: bad delta", s->name);
+      return;
+   }
+   if (s->mirror == NULL)
+      s->mirror = hosts_shard_make();
+   hosts_db_fold_sensor(d.hosts, s->mirror);
+   graph_acct(grown(&(s->graph_in), d.graph_in), 0, GRAPH_IN);
+   graph_acct(grown(&(s->graph_out), d.graph_out), 0, GRAPH_OUT);
+   s->since = d.generation;
+}
+
+int
+sensor_timeout_msec(void)
+{
+   const struct sensor *s;
+   const time_t now = now_mono();
+   int timeout = -1;
+
+   STAILQ_FOREACH(s, &sensors, entries) {
+      int until;
+
+      if (s->running)
+         continue; /* its child will wake us up */
+      until = (s->next_pull <= now) ? 0 : (int)(s->next_pull - now) * 1000;
+      if ((timeout == -1) || (until < timeout))
+         timeout = until;
+   }
+   return timeout;
+}
+
+/* Start the pulls that are due. */
+void
+sensor_poll(void)
+{
+   struct sensor *s;
+   const time_t now = now_mono();
+
+   STAILQ_FOREACH(s, &sensors, entries)
+      if (!s->running && (now >= s->next_pull)) {
+         s->next_pull = now + pull_interval;
+         if (snapshot_start(sensor_pull, sensor_pulled, s, -1) == 0)
+            s->running = 1;
+         else
+            warnx("sensor %s: can't start a pull", s->name);
+      }
+}
+
+void
+sensor_free(void)
+{
+   struct sensor *s;
+
+   while ((s = STAILQ_FIRST(&sensors)) != NULL) {
+      STAILQ_REMOVE_HEAD(&sensors, entries);
+      if (s->mirror != NULL)
+         hosts_shard_free(s->mirror);
+      free(s->name);
+      free(s->host);
+      free(s->port);
+      free(s);
+   }
+}
+
+/* vim:set ts=3 sw=3 tw=78 expandtab: */
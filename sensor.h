@@ -0,0 +1,27 @@
+/* darkstat 3
+ * copyright (c) 2026 darkstat contributors.
+ *
+ * sensor.h: federation, pulling what other darkstats have counted
+ *
+ * You may use, modify and redistribute this file under the terms of the
+ * GNU General Public License version 2. (see COPYING.GPL)
+ */
+#ifndef __DARKSTAT_SENSOR_H
+#define __DARKSTAT_SENSOR_H
+
+struct str;
+
+/* Sensor side: the /delta page. */
+struct str *sensor_delta(const char *query);
+
+/* Aggregator side.  sensor_add() takes host[:port], and sensor_init()
+ * looks them all up, so it has to come before privdrop().
+ */
+void sensor_add(const char *spec);
+void sensor_init(const unsigned int interval);
+int sensor_timeout_msec(void); /* -1 if there are no sensors */
+void sensor_poll(void);
+void sensor_free(void);
+
+#endif /* __DARKSTAT_SENSOR_H */
+/* vim:set ts=3 sw=3 tw=78 expandtab: */
@@ -0,0 +1,207 @@
+/* darkstat 3
+ * copyright (c) 2026 darkstat contributors.
+ *
+ * slab.c: pools of small fixed-size objects.
+ *
+ * You may use, modify and redistribute this file under the terms of the
+ * GNU General Public License version 2. (see COPYING.GPL)
+ */
+
+/* Hosts, ports and protocols are tiny records, allocated and freed by the
+ * million when we're being scanned.  Instead of going through malloc() for
+ * each one, a slab hands them out from big chunks, one chunk per size class,
+ * and keeps a free list per class for reuse.
+ *
+ * Chunks are aligned to their size, so the chunk header, and with it the
+ * owning slab and the size class, can be found from any object pointer.
+ * A slab must only be used by one thread at a time.
+ *
+ * With --huge-pages, chunks are cut from 2MB regions, aligned to 2MB, which
+ * the kernel is asked to back with transparent huge pages.  A big hosts
+ * table then takes one TLB entry per 2MB instead of one per 4KB.
+ */
+
+#include "conv.h"
+#include "err.h"
+#include "opt.h"
+#include "slab.h"
+
+#include <sys/mman.h>
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SLAB_CHUNK_SIZE (64 * 1024)
+#define SLAB_ALIGN 8
+#define SLAB_MAX_SIZE 256
+#define SLAB_CLASSES (SLAB_MAX_SIZE / SLAB_ALIGN)
+#define SLAB_HUGE_SIZE (2 * 1024 * 1024)
+
+struct slab_chunk {
+   struct slab *slab;
+   struct slab_chunk *next;
+   unsigned int class;  /* each chunk holds objects of a single size */
+};
+
+/* Objects on a free list are overlaid with this. */
+struct slab_free {
+   struct slab_free *next;
+};
+
+struct slab {
+   struct slab_chunk *chunks;
+   size_t used;  /* bytes of live objects, plus slab_charge()s */
+   /* With --huge-pages, chunks are freed with their regions. */
+   void **regions;
+   unsigned int num_regions;
+   uint8_t *region_next, *region_end;
+   struct {
+      struct slab_free *free;
+      uint8_t *next, *end;  /* not yet handed out in the newest chunk */
+   } class[SLAB_CLASSES];
+};
+
+/* Chunk headers are padded so objects stay aligned. */
+#define SLAB_HDR_SIZE \
+   ((sizeof(struct slab_chunk) + SLAB_ALIGN - 1) & ~(size_t)(SLAB_ALIGN - 1))
+
+struct slab *slab_make(void) {
+   struct slab *slab = xmalloc(sizeof(*slab));
+
+   memset(slab, 0, sizeof(*slab));
+   return slab;
+}
+
+void slab_destroy(struct slab *slab) {
+   unsigned int i;
+
+   if (slab->regions != NULL) {
+      for (i = 0; i < slab->num_regions; i++)
+         free(slab->regions[i]);
+      free(slab->regions);
+   } else
+      while (slab->chunks != NULL) {
+         struct slab_chunk *next = slab->chunks->next;
+         free(slab->chunks);
+         slab->chunks = next;
+      }
+   free(slab);
+}
+
+void slab_advise(void *p, const size_t len) {
+#ifdef MADV_HUGEPAGE
+   /* Only whole huge pages inside [p, p+len) can be backed by one. */
+   const uintptr_t start =
+      ((uintptr_t)p + SLAB_HUGE_SIZE - 1) & ~(uintptr_t)(SLAB_HUGE_SIZE - 1);
+   const uintptr_t end =
+      ((uintptr_t)p + len) & ~(uintptr_t)(SLAB_HUGE_SIZE - 1);
+
+   if (opt_want_huge_pages && (end > start) &&
+       (madvise((void *)start, end - start, MADV_HUGEPAGE) == -1))
+      verbosef("madvise(MADV_HUGEPAGE) failed: %s", strerror(errno));
+#else
+   (void)p;
+   (void)len;
+#endif
+}
+
+/* A chunk from the current region, or a new region. */
+static void *slab_region_chunk(struct slab *slab) {
+   void *mem;
+
+   if (slab->region_next == slab->region_end) {
+      if (posix_memalign(&mem, SLAB_HUGE_SIZE, SLAB_HUGE_SIZE) != 0)
+         errx(1, "posix_memalign(%d) failed", SLAB_HUGE_SIZE);
+      slab_advise(mem, SLAB_HUGE_SIZE);
+      slab->regions = xrealloc(slab->regions,
+         (slab->num_regions + 1) * sizeof(*slab->regions));
+      slab->regions[slab->num_regions++] = mem;
+      slab->region_next = mem;
+      slab->region_end = slab->region_next + SLAB_HUGE_SIZE;
+   }
+   mem = slab->region_next;
+   slab->region_next += SLAB_CHUNK_SIZE;
+   return mem;
+}
+
+static void slab_grow(struct slab *slab, const unsigned int c) {
+   struct slab_chunk *chunk;
+   void *mem;
+
+   if (opt_want_huge_pages)
+      mem = slab_region_chunk(slab);
+   else if (posix_memalign(&mem, SLAB_CHUNK_SIZE, SLAB_CHUNK_SIZE) != 0)
+      errx(1, "posix_memalign(%d) failed", SLAB_CHUNK_SIZE);
+   chunk = mem;
+   chunk->slab = slab;
+   chunk->next = slab->chunks;
+   chunk->class = c;
+   slab->chunks = chunk;
+   slab->class[c].next = (uint8_t *)chunk + SLAB_HDR_SIZE;
+   slab->class[c].end = (uint8_t *)chunk + SLAB_CHUNK_SIZE;
+}
+
+void *slab_alloc(struct slab *slab, const size_t size) {
+   const unsigned int c = (unsigned int)((size - 1) / SLAB_ALIGN);
+   const size_t rounded = (size_t)(c + 1) * SLAB_ALIGN;
+   void *p;
+
+   assert(size > 0);
+   assert(size <= SLAB_MAX_SIZE);
+   if (slab->class[c].free != NULL) {
+      struct slab_free *f = slab->class[c].free;
+      slab->class[c].free = f->next;
+      p = f;
+   } else {
+      if ((size_t)(slab->class[c].end - slab->class[c].next) < rounded)
+         slab_grow(slab, c);
+      p = slab->class[c].next;
+      slab->class[c].next += rounded;
+   }
+   slab->used += rounded;
+   memset(p, 0, size);
+   return p;
+}
+
+static struct slab_chunk *slab_chunk_of(const void *p) {
+   return (struct slab_chunk *)
+      ((uintptr_t)p & ~(uintptr_t)(SLAB_CHUNK_SIZE - 1));
+}
+
+struct slab *slab_owner(const void *p) {
+   return slab_chunk_of(p)->slab;
+}
+
+void slab_release(void *p) {
+   const struct slab_chunk *chunk;
+   struct slab_free *f = p;
+
+   if (p == NULL)
+      return;
+   chunk = slab_chunk_of(p);
+   f->next = chunk->slab->class[chunk->class].free;
+   chunk->slab->class[chunk->class].free = f;
+   chunk->slab->used -= (size_t)(chunk->class + 1) * SLAB_ALIGN;
+}
+
+size_t slab_size(const void *p) {
+   return (size_t)(slab_chunk_of(p)->class + 1) * SLAB_ALIGN;
+}
+
+void slab_charge(struct slab *slab, const size_t bytes) {
+   slab->used += bytes;
+}
+
+void slab_uncharge(struct slab *slab, const size_t bytes) {
+   assert(slab->used >= bytes);
+   slab->used -= bytes;
+}
+
+size_t slab_used(const struct slab *slab) {
+   return slab->used;
+}
+
+/* vim:set ts=3 sw=3 tw=78 expandtab: */
+
@@ -0,0 +1,49 @@
+/* darkstat 3
+ * copyright (c) 2026 darkstat contributors.
+ *
+ * slab.h: pools of small fixed-size objects.
+ *
+ * You may use, modify and redistribute this file under the terms of the
+ * GNU General Public License version 2. (see COPYING.GPL)
+ */
+#ifndef __DARKSTAT_SLAB_H
+#define __DARKSTAT_SLAB_H
+
+#include <stddef.h> /* for size_t */
+
+struct slab;
+
+struct slab *slab_make(void);
+void slab_destroy(struct slab *slab); /* frees every object at once */
+
+/* Returns zeroed memory of the given size from the pool. */
+void *slab_alloc(struct slab *slab, const size_t size);
+
+/* Returns an object to the pool it came from. */
+void slab_release(void *p);
+
+/* The pool that an object came from. */
+struct slab *slab_owner(const void *p);
+
+/* How much memory an object takes up in its pool, which is its size
+ * rounded up.
+ */
+size_t slab_size(const void *p);
+
+/* Bytes of objects handed out and not yet released.  Memory allocated
+ * elsewhere for the pool's users can be counted in too, with slab_charge(),
+ * and taken out again with slab_uncharge() when it's freed.  Chunks aren't
+ * given back, so this is what's in use, not what the process holds.
+ */
+void slab_charge(struct slab *slab, const size_t bytes);
+void slab_uncharge(struct slab *slab, const size_t bytes);
+size_t slab_used(const struct slab *slab);
+
+/* With --huge-pages, ask for a big array to be backed by huge pages, as
+ * far as it covers whole ones.  Users of a pool call this on the arrays
+ * that go with it, like hash tables.
+ */
+void slab_advise(void *p, const size_t len);
+
+#endif /* __DARKSTAT_SLAB_H */
+/* vim:set ts=3 sw=3 tw=78 expandtab: */
@@ -0,0 +1,186 @@
+/* darkstat 3
+ * copyright (c) 2026 darkstat contributors.
+ *
+ * snapshot.c: doing work on a copy-on-write snapshot in a child process
+ *
+ * You may use, modify and redistribute this file under the terms of the
+ * GNU General Public License version 2. (see COPYING.GPL)
+ */
+
+/* fork() gives the child a consistent copy of hosts_db and the graphs, as
+ * of the moment between two passes of the main loop, without copying
+ * anything up front: pages are shared until the parent writes to them.  So
+ * the child can take as long as it likes over them, while the parent goes
+ * on capturing.  What the child writes to its pipe is collected by the event
+ * loop and handed back when it exits.
+ */
+
+#include "cdefs.h"
+#include "conv.h"
+#include "err.h"
+#include "event.h"
+#include "queue.h"
+#include "snapshot.h"
+#include "str.h"
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+struct snapshot {
+   LIST_ENTRY(snapshot) entries;
+   pid_t pid;
+   int fd; /* reading end of the child's pipe */
+   struct str *buf;
+   snapshot_done_fn *done;
+   void *arg;
+};
+
+static LIST_HEAD(snapshot_list_head, snapshot) snapshots =
+   LIST_HEAD_INITIALIZER(snapshot_list_head);
+
+/* Which fds children close, indexed by fd.  A child that kept a client's
+ * socket open would keep its connection from ending when the parent closes
+ * it, for as long as the child runs.
+ */
+static unsigned char *child_closes = NULL;
+static int child_closes_len = 0;
+
+void snapshot_fd_add(const int fd) {
+   if (fd >= child_closes_len) {
+      const int len = MAX(fd + 1, child_closes_len * 2);
+
+      child_closes = xrealloc(child_closes, (size_t)len);
+      memset(child_closes + child_closes_len, 0,
+         (size_t)(len - child_closes_len));
+      child_closes_len = len;
+   }
+   child_closes[fd] = 1;
+}
+
+void snapshot_fd_remove(const int fd) {
+   if (fd >= 0 && fd < child_closes_len)
+      child_closes[fd] = 0;
+}
+
+/* In the child, close everything it has no business with: the fds that
+ * were added, and the pipes of the other children.
+ */
+static void snapshot_close_fds(const int keep_fd) {
+   const struct snapshot *s;
+   int fd;
+
+   for (fd = 0; fd < child_closes_len; fd++)
+      if (child_closes[fd] && fd != keep_fd)
+         close(fd);
+   LIST_FOREACH(s, &snapshots, entries)
+      close(s->fd);
+}
+
+/* Reap the child and hand over what it wrote. */
+static void snapshot_finish(struct snapshot *s, const int killed) {
+   char *buf;
+   size_t len;
+   int status, ok;
+
+   LIST_REMOVE(s, entries);
+   event_set(s->fd, 0, NULL, NULL);
+   close(s->fd);
+   if (killed)
+      kill(s->pid, SIGTERM);
+   while (waitpid(s->pid, &status, 0) == -1)
+      if (errno != EINTR)
+         err(1, "waitpid");
+   ok = !killed && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+   if (!killed && !ok)
+      verbosef("snapshot child %d failed", (int)s->pid);
+   str_extract(s->buf, &len, &buf);
+   s->done(s->arg, buf, len, ok);
+   free(s);
+}
+
+/* Up to this many reads per event, so a big result doesn't hold up the loop
+ * while the child is still writing it.
+ */
+#define SNAPSHOT_READS 16
+
+static void snapshot_event(void *arg) {
+   struct snapshot *s = arg;
+   char buf[65536];
+   ssize_t got;
+   int i;
+
+   for (i = 0; i < SNAPSHOT_READS; i++) {
+      got = read(s->fd, buf, sizeof(buf));
+      if (got > 0)
+         str_appendn(s->buf, buf, (size_t)got);
+      else if (got == -1 && (errno == EAGAIN || errno == EINTR))
+         return;
+      else {
+         /* End of file, or the child is gone. */
+         snapshot_finish(s, 0);
+         return;
+      }
+   }
+}
+
+int snapshot_start(snapshot_fn *fn, snapshot_done_fn *done, void *arg,
+   const int keep_fd) {
+   struct snapshot *s;
+   int p[2];
+   pid_t pid;
+
+   if (pipe(p) == -1) {
+      warn("snapshot: pipe");
+      return -1;
+   }
+   pid = fork();
+   if (pid == -1) {
+      warn("snapshot: fork");
+      close(p[0]);
+      close(p[1]);
+      return -1;
+   }
+   if (pid == 0) {
+      /* We are the child: do the work and leave, without any of the
+       * parent's cleanup.
+       */
+      close(p[0]);
+      snapshot_close_fds(keep_fd);
+      signal(SIGTERM, SIG_DFL);
+      signal(SIGINT, SIG_DFL);
+      _exit(fn(arg, p[1]) ? 0 : 1);
+   }
+   close(p[1]);
+   fd_set_nonblock(p[0]);
+
+   s = xmalloc(sizeof(*s));
+   s->pid = pid;
+   s->fd = p[0];
+   s->buf = str_make();
+   s->done = done;
+   s->arg = arg;
+   if (event_set(s->fd, EVENT_READ, snapshot_event, s) == -1) {
+      /* Can't wait for it, so don't use it. */
+      close(s->fd);
+      kill(pid, SIGTERM);
+      while (waitpid(pid, NULL, 0) == -1 && errno == EINTR)
+         ;
+      str_free(s->buf);
+      free(s);
+      return -1;
+   }
+   LIST_INSERT_HEAD(&snapshots, s, entries);
+   return 0;
+}
+
+void snapshot_stop(void) {
+   while (LIST_FIRST(&snapshots) != NULL)
+      snapshot_finish(LIST_FIRST(&snapshots), 1);
+}
+
+/* vim:set ts=3 sw=3 tw=78 expandtab: */
@@ -0,0 +1,43 @@
+/* darkstat 3
+ * copyright (c) 2026 darkstat contributors.
+ *
+ * snapshot.h: doing work on a copy-on-write snapshot in a child process
+ *
+ * You may use, modify and redistribute this file under the terms of the
+ * GNU General Public License version 2. (see COPYING.GPL)
+ */
+#ifndef __DARKSTAT_SNAPSHOT_H
+#define __DARKSTAT_SNAPSHOT_H
+
+#include <stddef.h>
+
+/* Runs in the child: write the result to fd.  Returns 0 on failure. */
+typedef int (snapshot_fn)(void *arg, const int fd);
+
+/* Runs in the parent once the child has exited, with everything it wrote,
+ * which the callee must free.  ok is zero if the child failed, or was
+ * killed by snapshot_stop().
+ */
+typedef void (snapshot_done_fn)(void *arg, char *buf, size_t len, int ok);
+
+/* Fork, and call fn() in the child on a snapshot of the whole process, as
+ * it is right now.  done() is called from event_dispatch().  The child
+ * closes every fd given to snapshot_fd_add() except keep_fd, which can be
+ * -1.  Returns -1 if the child couldn't be started, for the caller to do the
+ * work itself.
+ */
+int snapshot_start(snapshot_fn *fn, snapshot_done_fn *done, void *arg,
+   const int keep_fd);
+
+/* Have children close fd, or no longer.  Sockets whose peers wait for them
+ * to be closed, like HTTP connections, must be added, and removed before
+ * they're closed.
+ */
+void snapshot_fd_add(const int fd);
+void snapshot_fd_remove(const int fd);
+
+/* Kill and reap any children still running. */
+void snapshot_stop(void);
+
+#endif /* __DARKSTAT_SNAPSHOT_H */
+/* vim:set ts=3 sw=3 tw=78 expandtab: */
@@ -1,4 +1,6 @@
-/* Converts a textfile to a const char array with characters escaped. */
+/* Converts a textfile to a const char array with characters escaped, and
+ * an ETag of its contents.
+ */
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -6,6 +8,7 @@ int
 main(int argc, char **argv)
 {
 	int c, eol;
+	unsigned long long hash = 14695981039346656037ULL; /* FNV-1a */
 	if (argc != 2) {
 		fprintf(stderr, "usage: %s name <infile >outfile.h\n",
 			argv[0]);
@@ -15,6 +18,7 @@ main(int argc, char **argv)
 	       "static const char %s[] =", argv[1]);
 	eol = 1;
 	while ((c = getchar()) != EOF) {
+		hash = (hash ^ (unsigned char)c) * 1099511628211ULL;
 		if (eol) {
 			printf("\n\"");
 			eol = 0;
@@ -27,7 +31,8 @@ main(int argc, char **argv)
 		}
 	}
 	printf(";\n"
-	       "static const size_t %s_len = sizeof(%s) - 1;\n",
-	       argv[1], argv[1]);
+	       "static const size_t %s_len = sizeof(%s) - 1;\n"
+	       "static const char %s_etag[] = \"\\\"%016llx\\\"\";\n",
+	       argv[1], argv[1], argv[1], hash);
 	return (0);
 }
@@ -150,12 +150,14 @@ function poll() {
   for (var i=0; i<graphs.length; i++)
   {
    g = xh.responseXML.getElementsByTagName(graphs[i].name);
+   if (g.length == 0) continue; // a host's graphs can go away
    buildGraph(graphs[i].graph, graphs[i].title, graphs[i].bar_secs,
     g[0].getElementsByTagName("e"));
   }
   document.getElementById("graph_reload").innerHTML = "reload graphs";
   killChildren(graphs.msg);
   head = xh.responseXML.childNodes[0];
+  if (document.getElementById("rf") == null) return; // not the front page
   for (var n in {"tb":0, "tp":0, "pc":0, "pd":0})
    document.getElementById(n).innerHTML = thousands(head.getAttribute(n));
   document.getElementById("rf").innerHTML = head.getAttribute("rf");
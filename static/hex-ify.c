@@ -1,4 +1,6 @@
-/* Convert a binary file to a const char array of hex. */
+/* Convert a binary file to a const char array of hex, and an ETag of its
+ * contents.
+ */
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -6,6 +8,7 @@ int
 main(int argc, char **argv)
 {
   int c;
+  unsigned long long hash = 14695981039346656037ULL; /* FNV-1a */
   if (argc != 2) {
     fprintf(stderr, "usage: %s name <infile >outfile.h\n",
       argv[0]);
@@ -17,6 +20,7 @@ main(int argc, char **argv)
   int first = 1;
   int bytes = 0;
   while ((c = getchar()) != EOF) {
+    hash = (hash ^ (unsigned char)c) * 1099511628211ULL;
     if (start_of_line) {
       printf("  ");
       start_of_line = 0;
@@ -35,6 +39,8 @@ main(int argc, char **argv)
       bytes = 0;
     }
   }
-  printf("\n};\n");
+  printf("\n};\n"
+         "static const char %s_etag[] = \"\\\"%016llx\\\"\";\n",
+         argv[1], hash);
   return (0);
 }
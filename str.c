@@ -96,119 +96,80 @@ str_append(struct str *buf, const char *s)
  */
 #define COMMA ','
 
-/* 2^32 = 4,294,967,296 (10 digits, 13 chars) */
-#define I32_MAXLEN 13
-
 /* 2^64 = 18,446,744,073,709,551,616 (20 digits, 26 chars) */
 #define I64_MAXLEN 26
 
-static void
-str_append_u32(struct str *s, const uint32_t i, const int mod_sep)
+/* "00" to "99", so digits come out two at a time. */
+static const char digit_pairs[201] =
+   "00010203040506070809101112131415161718192021222324252627282930313233"
+   "34353637383940414243444546474849505152535455565758596061626364656667"
+   "6869707172737475767778798081828384858687888990919293949596979899";
+
+/*
+ * Write i in decimal, ending just before end, and return where it starts.
+ * Stick to 32-bit math when we can as it's faster on 32-bit platforms.
+ */
+static char *
+format_u64(char *end, uint64_t i)
 {
-   char out[I32_MAXLEN];
-   int pos;
-   unsigned int len;
-   uint32_t rem, next;
+   uint32_t i32;
 
-   if (i == 0) {
-      str_append(s, "0");
-      return;
-   }
+   while (i > UINT32_MAX) {
+      const uint32_t r = (uint32_t)(i % 100);
 
-   pos = sizeof(out)-1;
-   len = 0;
-   rem = i;
-
-   while (rem > 0) {
-      assert(pos >= 0);
-      next = rem / 10;
-      rem = rem - next * 10;
-      assert(rem < 10);
-      out[pos] = '0' + rem;
-      pos--;
-      len++;
-      rem = next;
-      if (mod_sep && (rem > 0) && (len > 0) && (len % 3 == 0)) {
-         out[pos] = COMMA;
-         pos--;
-      }
+      i /= 100;
+      end -= 2;
+      memcpy(end, digit_pairs + 2*r, 2);
    }
-   str_appendn(s, out+pos+1, sizeof(out)-1-pos);
-}
+   i32 = (uint32_t)i;
+   while (i32 >= 100) {
+      const uint32_t r = i32 % 100;
 
-static void
-str_append_i32(struct str *s, int32_t i, const int mod_sep)
-{
-   if (i < 0) {
-      str_append(s, "-");
-      i = -i;
+      i32 /= 100;
+      end -= 2;
+      memcpy(end, digit_pairs + 2*r, 2);
    }
-   str_append_u32(s, (uint32_t)i, mod_sep);
+   if (i32 >= 10) {
+      end -= 2;
+      memcpy(end, digit_pairs + 2*i32, 2);
+   } else
+      *--end = (char)('0' + i32);
+   return end;
 }
 
-static void
+void
 str_append_u64(struct str *s, const uint64_t i, const int mod_sep)
 {
-   char out[I64_MAXLEN];
-   int pos;
-   unsigned int len;
-   uint64_t rem, next;
-   uint32_t rem32, next32;
-
-   if (i == 0) {
-      str_append(s, "0");
-      return;
-   }
+   char digits[I64_MAXLEN], out[I64_MAXLEN];
+   const char *d = format_u64(digits + sizeof(digits), i);
+   size_t len = (size_t)(digits + sizeof(digits) - d), group, pos;
 
-   pos = sizeof(out)-1;
-   len = 0;
-   rem = i;
-
-   while (rem >= 4294967295U) {
-      assert(pos >= 0);
-      next = rem / 10;
-      rem = rem - next * 10;
-      assert(rem < 10);
-      out[pos] = '0' + rem;
-      pos--;
-      len++;
-      rem = next;
-      if (mod_sep && (rem > 0) && (len > 0) && (len % 3 == 0)) {
-         out[pos] = COMMA;
-         pos--;
-      }
+   if (!mod_sep || len <= 3) {
+      str_appendn(s, d, len);
+      return;
    }
-
-   /*
-    * Stick to 32-bit math when we can as it's faster on 32-bit platforms.
-    * FIXME: a tunable way to switch this off?
-    */
-   rem32 = (uint32_t)rem;
-   while (rem32 > 0) {
-      assert(pos >= 0);
-      next32 = rem32 / 10;
-      rem32 = rem32 - next32 * 10;
-      assert(rem32 < 10);
-      out[pos] = '0' + rem32;
-      pos--;
-      len++;
-      rem32 = next32;
-      if (mod_sep && (rem32 > 0) && (len > 0) && (len % 3 == 0)) {
-         out[pos] = COMMA;
-         pos--;
-      }
+   /* The first group has 1 to 3 digits, the rest have 3. */
+   group = len % 3;
+   if (group == 0)
+      group = 3;
+   memcpy(out, d, group);
+   pos = group;
+   for (d += group, len -= group; len > 0; d += 3, len -= 3) {
+      out[pos++] = COMMA;
+      memcpy(out + pos, d, 3);
+      pos += 3;
    }
-   str_appendn(s, out+pos+1, sizeof(out)-1-pos);
+   str_appendn(s, out, pos);
 }
 
 static void
-str_append_i64(struct str *s, int64_t i, const int mod_sep)
+str_append_i64(struct str *s, const int64_t i, const int mod_sep)
 {
    if (i < 0) {
       str_append(s, "-");
-      i = -i;
-   }
-   str_append_u64(s, (uint64_t)i, mod_sep);
+      str_append_u64(s, -(uint64_t)i, mod_sep);
+   } else
+      str_append_u64(s, (uint64_t)i, mod_sep);
 }
 
 static void
@@ -228,61 +189,58 @@ str_append_hex8(struct str *s, const uint8_t b)
  * %x is equivalent to %02x and expects a uint8_t
  */
 void str_vappendf(struct str *s, const char *format, va_list va) {
-   size_t pos, len;
-   len = strlen(format);
+   size_t pos = 0;
 
-   for (pos=0; pos<len; pos++) {
-      size_t span_start = pos, span_len = 0;
+   while (format[pos] != '\0') {
+      size_t span_start = pos;
+      int mod_quad = 0, mod_sep = 0;
+      char *arg_str;
 
-      while ((format[pos] != '\0') && (format[pos] != '%')) {
-         span_len++;
+      while ((format[pos] != '\0') && (format[pos] != '%'))
          pos++;
-      }
-      if (span_len > 0)
-         str_appendn(s, format+span_start, span_len);
-
-      if (format[pos] == '%') {
-         int mod_quad = 0, mod_sep = 0;
-         char *arg_str;
+      if (pos > span_start)
+         str_appendn(s, format+span_start, pos-span_start);
+      if (format[pos] == '\0')
+         break;
 FORMAT:
-         pos++;
-         switch (format[pos]) {
-         case '%':
-            str_append(s, "%");
-            break;
-         case 'q':
-            mod_quad = 1;
-            goto FORMAT;
-         case '\'':
-            mod_sep = 1;
-            goto FORMAT;
-         case 's':
-            arg_str = va_arg(va, char*);
-            str_append(s, arg_str);
-            /* str_append can be a macro!  passing it va_arg can result in
-             * va_arg being called twice
-             */
-            break;
-         case 'd':
-            if (mod_quad)
-               str_append_i64(s, va_arg(va, int64_t), mod_sep);
-            else
-               str_append_i32(s, (int32_t)va_arg(va, int), mod_sep);
-            break;
-         case 'u':
-            if (mod_quad)
-               str_append_u64(s, va_arg(va, uint64_t), mod_sep);
-            else
-               str_append_u32(s, (uint32_t)va_arg(va, unsigned int), mod_sep);
-            break;
-         case 'x':
-            str_append_hex8(s, (uint8_t)va_arg(va, int));
-            break;
-         default:
-            errx(1, "format string is \"%s\", unknown format '%c' at %u",
-               format, format[pos], (unsigned int)pos);
-         }
+      pos++;
+      switch (format[pos]) {
+      case '%':
+         str_append(s, "%");
+         break;
+      case 'q':
+         mod_quad = 1;
+         goto FORMAT;
+      case '\'':
+         mod_sep = 1;
+         goto FORMAT;
+      case 's':
+         arg_str = va_arg(va, char*);
+         str_append(s, arg_str);
+         /* str_append can be a macro!  passing it va_arg can result in
+          * va_arg being called twice
+          */
+         break;
+      case 'd':
+         if (mod_quad)
+            str_append_i64(s, va_arg(va, int64_t), mod_sep);
+         else
+            str_append_i64(s, (int32_t)va_arg(va, int), mod_sep);
+         break;
+      case 'u':
+         if (mod_quad)
+            str_append_u64(s, va_arg(va, uint64_t), mod_sep);
+         else
+            str_append_u64(s, (uint32_t)va_arg(va, unsigned int), mod_sep);
+         break;
+      case 'x':
+         str_append_hex8(s, (uint8_t)va_arg(va, int));
+         break;
+      default:
+         errx(1, "format string is \"%s\", unknown format '%c' at %u",
+            format, format[pos], (unsigned int)pos);
       }
+      pos++;
    }
 }
 
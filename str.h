@@ -61,6 +61,11 @@ void str_vappendf(struct str *s, const char *format, va_list va)
    _printflike_(2, 0);
 void str_appendf(struct str *s, const char *format, ...) _printflike_(2, 3);
 
+/* Same as appendf("%qu") or, with mod_sep, appendf("%'qu"), without the
+ * format string.  For rows that are written a million times over.
+ */
+void str_append_u64(struct str *s, const uint64_t i, const int mod_sep);
+
 struct str *length_of_time(const time_t t);
 ssize_t str_write(const struct str * const buf, const int fd);
 size_t str_len(const struct str * const buf);
@@ -11,7 +11,8 @@ check_deps() {
   # dependencies, and be able to be included multiple times.
   src=_test_hdr.c
   obj=_test_hdr.o
-  files=`ls *.h | fgrep -v -e graphjs.h -e stylecss.h -e favicon.h`
+  files=`ls *.h | fgrep -v -e graphjs.h -e graphjsgz.h -e stylecss.h \
+    -e stylecssgz.h -e favicon.h`
 
   for f in $files; do
     echo " * $f"
@@ -79,7 +80,8 @@ check_defines config.h "$defines" "$files"
 
 defines=`sed -e 's/# \+/#/;' < cdefs.h | grep '#define' | cut -d' ' -f2 |
   sed -e 's/(.\+/\\\\(/' | tr '\n' '|' | sed -e 's/|$//'`
-files=`ls *.[ch] | fgrep -v -e cdefs.h -e graphjs.h -e stylecss.h`
+files=`ls *.[ch] | fgrep -v -e cdefs.h -e graphjs.h -e graphjsgz.h \
+  -e stylecss.h -e stylecssgz.h`
 check_defines cdefs.h "$defines" "$files"
 
 exit $problem
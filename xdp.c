@@ -0,0 +1,465 @@
+/* darkstat 3
+ * copyright (c) 2026 darkstat contributors.
+ *
+ * xdp.c: capture with AF_XDP sockets on Linux
+ *
+ * You may use, modify and redistribute this file under the terms of the
+ * GNU General Public License version 2. (see COPYING.GPL)
+ */
+
+/* A small XDP program, written out by hand so we don't need a BPF compiler
+ * or libbpf, runs in the driver on every packet.  IP packets are truncated
+ * to the snaplen, their length on the wire is written into the metadata in
+ * front of them, and they are redirected to the AF_XDP socket bound to the
+ * queue they arrived on.  Everything else passes through to the network
+ * stack as usual.
+ *
+ * XDP can't copy a packet, so the IP traffic we take never reaches the
+ * network stack.  This is meant for an interface that only receives a
+ * mirror of the traffic, from a tap or a switch's monitor port.
+ *
+ * Each socket has its own UMEM: frames that the kernel fills and hands to us
+ * on the RX ring, and that we give back on the fill ring once we've
+ * accounted for them.
+ */
+
+#include "config.h" /* for HAVE_AF_XDP */
+
+#ifdef HAVE_AF_XDP
+
+#include "bsd.h" /* for strlcpy */
+#include "conv.h"
+#include "err.h"
+#include "opt.h"
+#include "queue.h"
+#include "xdp.h"
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <arpa/inet.h> /* for htons */
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+#include <linux/if_packet.h>
+#include <linux/if_xdp.h>
+#include <net/ethernet.h>
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <assert.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifndef SOL_XDP
+# define SOL_XDP 283
+#endif
+#ifndef ETHERTYPE_PPPOE
+# define ETHERTYPE_PPPOE 0x8864
+#endif
+
+#define XDP_FRAME_SIZE 2048
+#define XDP_NUM_FRAMES 4096
+#define XDP_RX_SIZE 2048
+#define XDP_FILL_SIZE XDP_NUM_FRAMES /* so there's always room to give back */
+#define XDP_COMP_SIZE 64 /* required, but unused since we don't transmit */
+
+/* The program and map shared by every queue of an interface. */
+struct xdp_prog {
+   LIST_ENTRY(xdp_prog) entries;
+   unsigned int ifindex, refs;
+   int map_fd, prog_fd, link_fd;
+   int promisc_fd; /* holds the interface in promiscuous mode, or -1 */
+};
+
+static LIST_HEAD(xdp_progs_head, xdp_prog) xdp_progs =
+   LIST_HEAD_INITIALIZER(xdp_progs);
+
+struct xdp_ring {
+   uint32_t *producer, *consumer, *flags;
+   void *desc;
+   uint32_t mask;
+   void *map;
+   size_t map_len;
+};
+
+struct xdp_queue {
+   int fd;
+   struct xdp_prog *prog;
+   uint8_t *umem;
+   struct xdp_ring rx, fill, comp;
+   unsigned int recv;
+};
+
+static int sys_bpf(const int cmd, union bpf_attr *attr) {
+   return (int)syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+/* ---------------------------------------------------------------------------
+ * The program.
+ */
+#define INSN(c, d, s, o, i) \
+   { .code = (c), .dst_reg = (d), .src_reg = (s), .off = (o), .imm = (i) }
+#define MOV_REG(d, s)      INSN(BPF_ALU64 | BPF_MOV | BPF_X, d, s, 0, 0)
+#define MOV_IMM(d, i)      INSN(BPF_ALU64 | BPF_MOV | BPF_K, d, 0, 0, i)
+#define ADD_IMM(d, i)      INSN(BPF_ALU64 | BPF_ADD | BPF_K, d, 0, 0, i)
+#define SUB_REG(d, s)      INSN(BPF_ALU64 | BPF_SUB | BPF_X, d, s, 0, 0)
+#define LDX(sz, d, s, o)   INSN(BPF_LDX | (sz) | BPF_MEM, d, s, o, 0)
+#define STX(sz, d, s, o)   INSN(BPF_STX | (sz) | BPF_MEM, d, s, o, 0)
+#define JREG(op, d, s, o)  INSN(BPF_JMP | (op) | BPF_X, d, s, o, 0)
+#define JIMM(op, d, i, o)  INSN(BPF_JMP | (op) | BPF_K, d, 0, o, i)
+#define JA(o)              INSN(BPF_JMP | BPF_JA, 0, 0, o, 0)
+#define CALL(f)            INSN(BPF_JMP | BPF_CALL, 0, 0, 0, f)
+#define EXIT()             INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0)
+#define LD_MAP_FD(d, fd) \
+   INSN(BPF_LD | BPF_DW | BPF_IMM, d, BPF_PSEUDO_MAP_FD, 0, fd), \
+   INSN(0, 0, 0, 0, 0)
+
+#define XDP_MD(field) ((int16_t)offsetof(struct xdp_md, field))
+
+static int xdp_load(const int map_fd, const int snaplen) {
+   /* Ethertypes are loaded as they are in memory, so compare them likewise.
+    * Without --pppoe, the third test repeats the first.
+    */
+   const int ip = htons(ETHERTYPE_IP), ip6 = htons(ETHERTYPE_IPV6),
+      other = htons(opt_want_pppoe ? ETHERTYPE_PPPOE : ETHERTYPE_IP);
+   struct bpf_insn insns[] = {
+      /*  0 */ MOV_REG(6, 1),                       /* r6 = ctx */
+      /*  1 */ LDX(BPF_W, 2, 6, XDP_MD(data)),
+      /*  2 */ LDX(BPF_W, 3, 6, XDP_MD(data_end)),
+      /*  3 */ MOV_REG(4, 2),
+      /*  4 */ ADD_IMM(4, ETHER_HDR_LEN),
+      /*  5 */ JREG(BPF_JGT, 4, 3, 28),             /* runt: pass */
+      /*  6 */ LDX(BPF_H, 4, 2, 12),                /* ethertype */
+      /*  7 */ JIMM(BPF_JEQ, 4, ip, 3),
+      /*  8 */ JIMM(BPF_JEQ, 4, ip6, 2),
+      /*  9 */ JIMM(BPF_JEQ, 4, other, 1),
+      /* 10 */ JA(23),                              /* not IP: pass */
+      /* 11 */ MOV_REG(7, 3),                       /* r7 = length */
+      /* 12 */ SUB_REG(7, 2),
+      /* 13 */ MOV_REG(1, 6),
+      /* 14 */ MOV_IMM(2, -4),
+      /* 15 */ CALL(BPF_FUNC_xdp_adjust_meta),
+      /* 16 */ JIMM(BPF_JNE, 0, 0, 17),             /* no metadata: pass */
+      /* 17 */ LDX(BPF_W, 2, 6, XDP_MD(data_meta)),
+      /* 18 */ LDX(BPF_W, 3, 6, XDP_MD(data)),
+      /* 19 */ MOV_REG(4, 2),
+      /* 20 */ ADD_IMM(4, 4),
+      /* 21 */ JREG(BPF_JGT, 4, 3, 12),
+      /* 22 */ STX(BPF_W, 2, 7, 0),                 /* meta = length */
+      /* 23 */ JIMM(BPF_JLE, 7, snaplen, 4),
+      /* 24 */ MOV_REG(1, 6),
+      /* 25 */ MOV_IMM(2, snaplen),
+      /* 26 */ SUB_REG(2, 7),
+      /* 27 */ CALL(BPF_FUNC_xdp_adjust_tail),      /* truncate */
+      /* 28 */ LDX(BPF_W, 2, 6, XDP_MD(rx_queue_index)),
+      /* 29 */ LD_MAP_FD(1, map_fd),
+      /* 31 */ MOV_IMM(3, XDP_PASS),                /* if no socket */
+      /* 32 */ CALL(BPF_FUNC_redirect_map),
+      /* 33 */ EXIT(),
+      /* 34 */ MOV_IMM(0, XDP_PASS),
+      /* 35 */ EXIT(),
+   };
+   static char log[65536];
+   union bpf_attr attr;
+   int fd;
+
+   memset(&attr, 0, sizeof(attr));
+   attr.prog_type = BPF_PROG_TYPE_XDP;
+   attr.expected_attach_type = BPF_XDP;
+   attr.insns = (uint64_t)(uintptr_t)insns;
+   attr.insn_cnt = sizeof(insns) / sizeof(*insns);
+   attr.license = (uint64_t)(uintptr_t)"GPL";
+   if ((fd = sys_bpf(BPF_PROG_LOAD, &attr)) >= 0)
+      return fd;
+
+   /* Load it again to find out why. */
+   attr.log_buf = (uint64_t)(uintptr_t)log;
+   attr.log_size = sizeof(log);
+   attr.log_level = 1;
+   log[0] = '\0';
+   if ((fd = sys_bpf(BPF_PROG_LOAD, &attr)) >= 0)
+      return fd;
+   err(1, "loading XDP program: %s", log);
+}
+
+/* Find or create the program for the interface, and attach it. */
+static struct xdp_prog *xdp_prog_get(const char *ifname,
+                                     const unsigned int ifindex,
+                                     const unsigned int nqueues,
+                                     const int snaplen,
+                                     const int promisc) {
+   struct xdp_prog *p;
+   struct rlimit rl = { RLIM_INFINITY, RLIM_INFINITY };
+   union bpf_attr attr;
+
+   LIST_FOREACH(p, &xdp_progs, entries)
+      if (p->ifindex == ifindex) {
+         p->refs++;
+         return p;
+      }
+
+   /* Kernels before 5.11 charge maps and programs to RLIMIT_MEMLOCK. */
+   (void)setrlimit(RLIMIT_MEMLOCK, &rl);
+
+   p = xmalloc(sizeof(*p));
+   p->ifindex = ifindex;
+   p->refs = 1;
+
+   memset(&attr, 0, sizeof(attr));
+   attr.map_type = BPF_MAP_TYPE_XSKMAP;
+   attr.key_size = sizeof(uint32_t);
+   attr.value_size = sizeof(uint32_t);
+   attr.max_entries = nqueues;
+   if ((p->map_fd = sys_bpf(BPF_MAP_CREATE, &attr)) == -1)
+      err(1, "creating XSKMAP");
+   p->prog_fd = xdp_load(p->map_fd, snaplen);
+
+   /* Prefer the driver's own XDP support, else the generic one.  The link
+    * detaches the program when we close it, or when we exit.
+    */
+   memset(&attr, 0, sizeof(attr));
+   attr.link_create.prog_fd = (uint32_t)p->prog_fd;
+   attr.link_create.target_ifindex = ifindex;
+   attr.link_create.attach_type = BPF_XDP;
+   attr.link_create.flags = XDP_FLAGS_DRV_MODE;
+   if ((p->link_fd = sys_bpf(BPF_LINK_CREATE, &attr)) >= 0)
+      verbosef("attached XDP program to '%s' in driver mode", ifname);
+   else {
+      attr.link_create.flags = XDP_FLAGS_SKB_MODE;
+      if ((p->link_fd = sys_bpf(BPF_LINK_CREATE, &attr)) == -1)
+         err(1, "attaching XDP program to '%s'%s", ifname,
+            (errno == EBUSY) ? ", it already has one" : "");
+      verbosef("attached XDP program to '%s' in generic mode", ifname);
+   }
+
+   /* AF_XDP has no promiscuous mode of its own, so hold a packet socket
+    * that asks for it.  It doesn't receive anything, and the kernel drops
+    * the membership when it's closed.
+    */
+   p->promisc_fd = -1;
+   if (promisc) {
+      struct packet_mreq mr;
+
+      if ((p->promisc_fd = socket(AF_PACKET, SOCK_RAW, 0)) == -1)
+         err(1, "socket(AF_PACKET)");
+      memset(&mr, 0, sizeof(mr));
+      mr.mr_ifindex = (int)ifindex;
+      mr.mr_type = PACKET_MR_PROMISC;
+      if (setsockopt(p->promisc_fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP,
+                     &mr, sizeof(mr)) == -1)
+         err(1, "setsockopt(PACKET_ADD_MEMBERSHIP)");
+      verbosef("capturing in promiscuous mode");
+   } else
+      verbosef("capturing in non-promiscuous mode");
+   LIST_INSERT_HEAD(&xdp_progs, p, entries);
+   return p;
+}
+
+static void xdp_prog_put(struct xdp_prog *p) {
+   assert(p->refs > 0);
+   if (--p->refs > 0)
+      return;
+   LIST_REMOVE(p, entries);
+   if (p->promisc_fd != -1)
+      close(p->promisc_fd);
+   close(p->link_fd);
+   close(p->prog_fd);
+   close(p->map_fd);
+   free(p);
+}
+
+/* ---------------------------------------------------------------------------
+ * The sockets.
+ */
+static void xdp_ring_map(struct xdp_ring *r, const int fd,
+                         const struct xdp_ring_offset *off,
+                         const uint32_t size, const size_t desc_size,
+                         const off_t pgoff, const char *name) {
+   r->map_len = off->desc + size * desc_size;
+   r->map = mmap(NULL, r->map_len, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, fd, pgoff);
+   if (r->map == MAP_FAILED)
+      err(1, "mmap(AF_XDP %s ring)", name);
+   r->producer = (uint32_t *)((uint8_t *)r->map + off->producer);
+   r->consumer = (uint32_t *)((uint8_t *)r->map + off->consumer);
+   r->flags = (uint32_t *)((uint8_t *)r->map + off->flags);
+   r->desc = (uint8_t *)r->map + off->desc;
+   r->mask = size - 1;
+}
+
+static void xdp_setsockopt(const int fd, const int opt, const void *val,
+                           const socklen_t len, const char *name) {
+   if (setsockopt(fd, SOL_XDP, opt, val, len) == -1)
+      err(1, "setsockopt(%s)", name);
+}
+
+static unsigned int xdp_ifindex(const char *ifname) {
+   struct ifreq ifr;
+   unsigned int ifindex;
+   int fd;
+
+   if ((ifindex = if_nametoindex(ifname)) == 0)
+      err(1, "if_nametoindex('%s')", ifname);
+   if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) == -1)
+      err(1, "socket(AF_INET)");
+   memset(&ifr, 0, sizeof(ifr));
+   strlcpy(ifr.ifr_name, ifname, sizeof(ifr.ifr_name));
+   if (ioctl(fd, SIOCGIFHWADDR, &ifr) == -1)
+      err(1, "ioctl(SIOCGIFHWADDR, '%s')", ifname);
+   close(fd);
+   if (ifr.ifr_hwaddr.sa_family != ARPHRD_ETHER)
+      errx(1, "--xdp-queues only works on Ethernet interfaces, "
+         "and '%s' isn't one", ifname);
+   return ifindex;
+}
+
+struct xdp_queue *xdp_open(const char *ifname, const unsigned int queue,
+                           const unsigned int nqueues, const int snaplen,
+                           const int promisc) {
+   struct xdp_queue *q = xmalloc(sizeof(*q));
+   struct xdp_umem_reg reg;
+   struct xdp_mmap_offsets off;
+   struct sockaddr_xdp sxdp;
+   socklen_t optlen;
+   size_t umem_len = (size_t)XDP_NUM_FRAMES * XDP_FRAME_SIZE;
+   uint32_t size, i;
+   unsigned int ifindex;
+   uint32_t key;
+   union bpf_attr attr;
+
+   assert(queue < nqueues);
+   ifindex = xdp_ifindex(ifname);
+   if ((q->fd = socket(AF_XDP, SOCK_RAW, 0)) == -1)
+      err(1, "socket(AF_XDP)");
+
+   q->umem = mmap(NULL, umem_len, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+   if (q->umem == MAP_FAILED)
+      err(1, "mmap(%zu bytes of UMEM)", umem_len);
+   memset(&reg, 0, sizeof(reg));
+   reg.addr = (uint64_t)(uintptr_t)q->umem;
+   reg.len = umem_len;
+   reg.chunk_size = XDP_FRAME_SIZE;
+   xdp_setsockopt(q->fd, XDP_UMEM_REG, &reg, sizeof(reg), "XDP_UMEM_REG");
+
+   size = XDP_FILL_SIZE;
+   xdp_setsockopt(q->fd, XDP_UMEM_FILL_RING, &size, sizeof(size),
+      "XDP_UMEM_FILL_RING");
+   size = XDP_COMP_SIZE;
+   xdp_setsockopt(q->fd, XDP_UMEM_COMPLETION_RING, &size, sizeof(size),
+      "XDP_UMEM_COMPLETION_RING");
+   size = XDP_RX_SIZE;
+   xdp_setsockopt(q->fd, XDP_RX_RING, &size, sizeof(size), "XDP_RX_RING");
+
+   optlen = sizeof(off);
+   if (getsockopt(q->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen) == -1)
+      err(1, "getsockopt(XDP_MMAP_OFFSETS)");
+   xdp_ring_map(&q->rx, q->fd, &off.rx, XDP_RX_SIZE,
+      sizeof(struct xdp_desc), XDP_PGOFF_RX_RING, "RX");
+   xdp_ring_map(&q->fill, q->fd, &off.fr, XDP_FILL_SIZE,
+      sizeof(uint64_t), (off_t)XDP_UMEM_PGOFF_FILL_RING, "fill");
+   xdp_ring_map(&q->comp, q->fd, &off.cr, XDP_COMP_SIZE,
+      sizeof(uint64_t), (off_t)XDP_UMEM_PGOFF_COMPLETION_RING, "completion");
+
+   /* Give the kernel every frame to fill. */
+   for (i = 0; i < XDP_NUM_FRAMES; i++)
+      ((uint64_t *)q->fill.desc)[i] = (uint64_t)i * XDP_FRAME_SIZE;
+   __sync_synchronize();
+   *q->fill.producer = XDP_NUM_FRAMES;
+
+   memset(&sxdp, 0, sizeof(sxdp));
+   sxdp.sxdp_family = AF_XDP;
+   sxdp.sxdp_ifindex = ifindex;
+   sxdp.sxdp_queue_id = queue;
+   sxdp.sxdp_flags = XDP_ZEROCOPY | XDP_USE_NEED_WAKEUP;
+   if (bind(q->fd, (struct sockaddr *)&sxdp, sizeof(sxdp)) == 0)
+      verbosef("capturing on queue %u of interface '%s' with AF_XDP, "
+         "zero-copy", queue, ifname);
+   else {
+      sxdp.sxdp_flags = XDP_COPY | XDP_USE_NEED_WAKEUP;
+      if (bind(q->fd, (struct sockaddr *)&sxdp, sizeof(sxdp)) == -1)
+         err(1, "bind(AF_XDP, '%s', queue %u)", ifname, queue);
+      verbosef("capturing on queue %u of interface '%s' with AF_XDP",
+         queue, ifname);
+   }
+
+   q->prog = xdp_prog_get(ifname, ifindex, nqueues, snaplen, promisc);
+   key = queue;
+   memset(&attr, 0, sizeof(attr));
+   attr.map_fd = (uint32_t)q->prog->map_fd;
+   attr.key = (uint64_t)(uintptr_t)&key;
+   attr.value = (uint64_t)(uintptr_t)&q->fd;
+   if (sys_bpf(BPF_MAP_UPDATE_ELEM, &attr) == -1)
+      err(1, "adding queue %u of '%s' to XSKMAP", queue, ifname);
+   q->recv = 0;
+   return q;
+}
+
+int xdp_fd(const struct xdp_queue *q) {
+   return q->fd;
+}
+
+int xdp_dispatch(struct xdp_queue *q, xdp_handler fn, void *user) {
+   const struct xdp_desc *desc = q->rx.desc;
+   uint64_t *fill = q->fill.desc;
+   uint32_t prod, cons, fprod;
+   struct timeval ts;
+   int count = 0;
+
+   prod = *q->rx.producer;
+   cons = *q->rx.consumer;
+   if (prod != cons) {
+      __sync_synchronize();
+      gettimeofday(&ts, NULL);
+      fprod = *q->fill.producer;
+      for (; cons != prod; cons++, fprod++) {
+         const struct xdp_desc *d = &desc[cons & q->rx.mask];
+         const uint8_t *pkt = q->umem + d->addr;
+         uint32_t len;
+
+         memcpy(&len, pkt - sizeof(len), sizeof(len)); /* metadata */
+         fn(user, &ts, pkt, d->len, len);
+         fill[fprod & q->fill.mask] =
+            d->addr & ~(uint64_t)(XDP_FRAME_SIZE - 1);
+         count++;
+      }
+      __sync_synchronize();
+      *q->rx.consumer = cons;
+      *q->fill.producer = fprod;
+      q->recv += (unsigned int)count;
+   }
+   if (*q->fill.flags & XDP_RING_NEED_WAKEUP)
+      (void)recvfrom(q->fd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+   return count;
+}
+
+int xdp_stats(const struct xdp_queue *q, unsigned int *recv,
+              unsigned int *drop) {
+   struct xdp_statistics st;
+   socklen_t len = sizeof(st);
+
+   memset(&st, 0, sizeof(st));
+   if (getsockopt(q->fd, SOL_XDP, XDP_STATISTICS, &st, &len) == -1)
+      return -1;
+   *drop = (unsigned int)(st.rx_dropped + st.rx_ring_full +
+      st.rx_fill_ring_empty_descs);
+   *recv = q->recv + *drop;
+   return 0;
+}
+
+void xdp_close(struct xdp_queue *q) {
+   munmap(q->rx.map, q->rx.map_len);
+   munmap(q->fill.map, q->fill.map_len);
+   munmap(q->comp.map, q->comp.map_len);
+   close(q->fd);
+   munmap(q->umem, (size_t)XDP_NUM_FRAMES * XDP_FRAME_SIZE);
+   xdp_prog_put(q->prog);
+   free(q);
+}
+
+#endif /* HAVE_AF_XDP */
+/* vim:set ts=3 sw=3 tw=78 expandtab: */
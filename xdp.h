@@ -0,0 +1,45 @@
+/* darkstat 3
+ * copyright (c) 2026 darkstat contributors.
+ *
+ * xdp.h: capture with AF_XDP sockets on Linux
+ *
+ * You may use, modify and redistribute this file under the terms of the
+ * GNU General Public License version 2. (see COPYING.GPL)
+ */
+#ifndef __DARKSTAT_XDP_H
+#define __DARKSTAT_XDP_H
+
+#include <stdint.h>
+#include <sys/time.h>
+
+struct xdp_queue;
+
+/* Called for each packet: its first caplen bytes, and its length on the
+ * wire.
+ */
+typedef void (*xdp_handler)(void *user, const struct timeval *ts,
+   const uint8_t *pkt, uint32_t caplen, uint32_t len);
+
+/* Open receive queue number queue of the Ethernet interface, and start
+ * taking its IP traffic, truncated to snaplen.  The first queue opened on
+ * an interface attaches the XDP program, with room for nqueues queues, and
+ * if promisc is set, puts the interface in promiscuous mode.
+ */
+struct xdp_queue *xdp_open(const char *ifname, const unsigned int queue,
+   const unsigned int nqueues, const int snaplen, const int promisc);
+
+/* The socket, which is readable when packets are waiting. */
+int xdp_fd(const struct xdp_queue *q);
+
+/* Hand over every packet waiting on the queue.  Returns how many. */
+int xdp_dispatch(struct xdp_queue *q, xdp_handler fn, void *user);
+
+/* Packets received and dropped by the kernel since xdp_open(). */
+int xdp_stats(const struct xdp_queue *q, unsigned int *recv,
+   unsigned int *drop);
+
+/* Close the queue.  Closing the last one detaches the program. */
+void xdp_close(struct xdp_queue *q);
+
+#endif /* __DARKSTAT_XDP_H */
+/* vim:set ts=3 sw=3 tw=78 expandtab: */